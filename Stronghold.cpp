@@ -1,1923 +1,11005 @@
 #include "Stronghold.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#ifdef _WIN32
 #include <windows.h> // For Sleep()
+#include <io.h> // For _commit()
+#else
+#include <unistd.h> // For sleep()
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <csignal>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#endif
 using namespace std;
 
 // Cross-platform sleep function
 void crossPlatformSleep(int seconds) {
+#ifdef _WIN32
   Sleep(seconds * 1000); // Sleep takes milliseconds
+#else
+  sleep(seconds);
+#endif
+}
+
+// Heap bytes behind a string; short ones live inside the string object itself
+static size_t stringHeapBytes(const string& text) {
+    static const size_t inlineCapacity = string().capacity();
+    return text.capacity() > inlineCapacity ? text.capacity() + 1 : 0;
+}
+
+// Windows consoles only interpret escape sequences once asked to
+static void enableAnsiTerminal() {
+#ifdef _WIN32
+    static bool enabled = false;
+    if (!enabled) {
+        HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode = 0;
+        if (GetConsoleMode(console, &mode)) {
+            SetConsoleMode(console, mode | 0x0004); // ENABLE_VIRTUAL_TERMINAL_PROCESSING
+        }
+        enabled = true;
+    }
+#endif
 }
 
-// ------------------------
-// Resource implementations
-// ------------------------
+// --------------------------
+// StringTable implementation
+// --------------------------
 
-Resource::Resource(const string& name, int amount, double value)
-    : name(name), amount(amount), value(value) {
+StringTable::StringTable() {
+    for (int i = 0; i < MAX_CHUNKS; i++) {
+        chunks[i].store(nullptr, memory_order_relaxed);
+    }
+    indexes.push_back(makeIndex(INITIAL_SLOTS));
+    index.store(indexes.back().get(), memory_order_relaxed);
 }
 
-Resource::~Resource() {}
-
-string Resource::getName() const {
-    return name;
+StringTable& StringTable::instance() {
+    // Never destroyed, so names stay readable from threads still running at exit
+    static StringTable* table = new StringTable();
+    return *table;
 }
 
-int Resource::getAmount() const {
-    return amount;
+unique_ptr<StringTable::Index> StringTable::makeIndex(size_t slotCount) {
+    unique_ptr<Index> created(new Index());
+    created->mask = slotCount - 1;
+    created->slots.reset(new atomic<Handle>[slotCount]);
+    for (size_t i = 0; i < slotCount; i++) {
+        created->slots[i].store(NO_HANDLE, memory_order_relaxed);
+    }
+    return created;
 }
 
-double Resource::getValue() const {
-    return value;
+StringTable::Handle StringTable::probe(const Index& index, const string& text, size_t& slot) {
+    // Ends at the name's handle, or at the empty slot where it would go
+    slot = hash<string>()(text) & index.mask;
+    for (;;) {
+        Handle handle = index.slots[slot].load(memory_order_acquire);
+        if (handle == NO_HANDLE || lookup(handle) == text) {
+            return handle;
+        }
+        slot = (slot + 1) & index.mask;
+    }
 }
 
-void Resource::setAmount(int newAmount) {
-    amount = newAmount < 0 ? 0 : newAmount;
+StringTable::Index* StringTable::growIndex() {
+    // Called with the lock held; readers move over when the new index is published
+    const Index& current = *index.load(memory_order_relaxed);
+    unique_ptr<Index> grown = makeIndex((current.mask + 1) * 2);
+    for (size_t i = 0; i <= current.mask; i++) {
+        Handle handle = current.slots[i].load(memory_order_relaxed);
+        if (handle != NO_HANDLE) {
+            size_t slot = hash<string>()(names[handle]) & grown->mask;
+            while (grown->slots[slot].load(memory_order_relaxed) != NO_HANDLE) {
+                slot = (slot + 1) & grown->mask;
+            }
+            grown->slots[slot].store(handle, memory_order_relaxed);
+        }
+    }
+    indexes.push_back(move(grown));
+    index.store(indexes.back().get(), memory_order_release);
+    return indexes.back().get();
 }
 
-void Resource::changeAmount(int delta) {
-    amount += delta;
-    if (amount < 0) amount = 0;
-}
+StringTable::Handle StringTable::intern(const string& text) {
+    // Names already in the table need no lock
+    Handle handle = find(text);
+    if (handle != NO_HANDLE) {
+        return handle;
+    }
 
-void Resource::setValue(double newValue) {
-    value = newValue > 0 ? newValue : 0; // Ensure value is non-negative
+    StringTable& table = instance();
+    lock_guard<std::mutex> lock(table.mutex);
+    Index* current = table.index.load(memory_order_relaxed);
+    size_t slot;
+    handle = probe(*current, text, slot);
+    if (handle != NO_HANDLE) {
+        return handle;
+    }
+
+    handle = static_cast<Handle>(table.names.size());
+    if (handle >= static_cast<Handle>(MAX_CHUNKS) * CHUNK_SIZE) {
+        Logger::error("Error: The string table is full!");
+        return NO_HANDLE;
+    }
+    if ((table.names.size() + 1) * 2 > current->mask + 1) {
+        current = table.growIndex();
+        probe(*current, text, slot);
+    }
+    const string** chunk = table.chunks[handle >> CHUNK_BITS].load(memory_order_relaxed);
+    if (!chunk) {
+        chunk = new const string*[CHUNK_SIZE];
+    }
+    table.names.push_back(text);
+    chunk[handle & (CHUNK_SIZE - 1)] = &table.names.back();
+    // Publishes the slot too, for threads that learn the handle without taking the lock
+    table.chunks[handle >> CHUNK_BITS].store(chunk, memory_order_release);
+    // After the chunk, so a reader that finds the handle can read the name
+    current->slots[slot].store(handle, memory_order_release);
+    return handle;
 }
 
+StringTable::Handle StringTable::find(const string& text) {
+    size_t slot;
+    return probe(*instance().index.load(memory_order_acquire), text, slot);
+}
 
-double Resource::getTotalValue() const {
-    return amount * value;
+const string& StringTable::lookup(Handle handle) {
+    static const string empty;
+    if (handle == NO_HANDLE) {
+        return empty;
+    }
+    const string* const* chunk = instance().chunks[handle >> CHUNK_BITS].load(memory_order_acquire);
+    return chunk ? *chunk[handle & (CHUNK_SIZE - 1)] : empty;
 }
 
-void Resource::applyEffects(Kingdom& kingdom) {
-    // Base implementation does nothing
+size_t StringTable::getCount() {
+    StringTable& table = instance();
+    lock_guard<std::mutex> lock(table.mutex);
+    return table.names.size();
 }
 
-// Food implementation
-Food::Food(int amount, double value)
-    : Resource("Food", amount, value) {
+size_t StringTable::memoryUsage() {
+    StringTable& table = instance();
+    lock_guard<std::mutex> lock(table.mutex);
+    // Replaced indexes count too, since they are never freed
+    size_t bytes = sizeof(StringTable) + table.names.size() * sizeof(string);
+    for (size_t i = 0; i < table.names.size(); i++) {
+        bytes += stringHeapBytes(table.names[i]);
+    }
+    for (size_t i = 0; i < table.indexes.size(); i++) {
+        bytes += sizeof(Index) + (table.indexes[i]->mask + 1) * sizeof(atomic<Handle>);
+    }
+    size_t chunkCount = (table.names.size() + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    return bytes + chunkCount * CHUNK_SIZE * sizeof(const string*);
 }
 
-void Food::applyEffects(Kingdom& kingdom) {
-    // Food directly affects population happiness
-    double happinessModifier = 0;
-    int totalPopulation = kingdom.getPopulation()->getTotal();
+// ---------------------
+// Logger implementation
+// ---------------------
 
-    if (totalPopulation > 0) {
-        double foodPerPerson = static_cast<double>(amount) / totalPopulation;
-        if (foodPerPerson > 1.5) {
-            happinessModifier = 0.1; // Plenty of food
-        }
-        else if (foodPerPerson > 1.0) {
-            happinessModifier = 0.05; // Adequate food
-        }
-        else if (foodPerPerson < 0.5) {
-            happinessModifier = -0.2; // Shortage
-        }
-        else if (foodPerPerson < 0.25) {
-            happinessModifier = -0.4; // Severe shortage
-        }
-    }
+atomic<int> Logger::activeLevel(Logger::LEVEL_INFO);
 
-    double currentHappiness = kingdom.getPopulation()->getHappiness();
-    kingdom.getPopulation()->setHappiness(currentHappiness + happinessModifier);
+// Kingdom whose code is running on this thread
+static thread_local StringTable::Handle currentKingdomTag = StringTable::NO_HANDLE;
+
+Logger::Logger()
+    : output(&cout), decorated(false), stopping(false), flushRequested(false), startedPasses(0),
+    completedPasses(0), startTime(chrono::steady_clock::now()) {
 }
 
-// Gold implementation
-Gold::Gold(int amount, double value)
-    : Resource("Gold", amount, value) {
+Logger::~Logger() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) {
+        writer.join();
+    }
 }
 
-void Gold::applyEffects(Kingdom& kingdom) {
-    // Gold is handled by the Economy class
+Logger& Logger::instance() {
+    static Logger logger;
+    return logger;
 }
 
-// Wood implementation
-Wood::Wood(int amount, double value)
-    : Resource("Wood", amount, value) {
+Logger::KingdomScope::KingdomScope(StringTable::Handle kingdomName) : previousTag(currentKingdomTag) {
+    currentKingdomTag = kingdomName;
 }
 
-void Wood::applyEffects(Kingdom& kingdom) {
-    // Wood effects might include building capacity, etc.
+Logger::KingdomScope::~KingdomScope() {
+    currentKingdomTag = previousTag;
 }
 
-// Stone implementation
-Stone::Stone(int amount, double value)
-    : Resource("Stone", amount, value) {
+void Logger::setLevel(Level level) {
+    activeLevel.store(level, memory_order_relaxed);
 }
 
-void Stone::applyEffects(Kingdom& kingdom) {
-    // Stone effects might include building capacity, etc.
+Logger::Level Logger::getLevel() {
+    return static_cast<Level>(activeLevel.load(memory_order_relaxed));
 }
 
-// Iron implementation
-Iron::Iron(int amount, double value)
-    : Resource("Iron", amount, value) {
+void Logger::setDecorated(bool decorated) {
+    Logger& logger = instance();
+    lock_guard<std::mutex> lock(logger.mutex);
+    logger.decorated = decorated;
 }
 
-void Iron::applyEffects(Kingdom& kingdom) {
-    // Iron affects army equipment quality
-    if (amount > 100) {
-        int currentLevel = kingdom.getArmy()->getTrainingLevel();
-        kingdom.getArmy()->setTrainingLevel(currentLevel + 1);
+void Logger::setOutput(ostream* output) {
+    flush();
+    Logger& logger = instance();
+    lock_guard<std::mutex> lock(logger.mutex);
+    logger.output = output;
+}
+
+void Logger::flush() {
+    Logger& logger = instance();
+    unique_lock<std::mutex> lock(logger.mutex);
+    if (!logger.writer.joinable()) {
+        return;
+    }
+    // The next pass to start is guaranteed to see everything committed so far
+    uint64_t target = logger.startedPasses + 1;
+    logger.flushRequested = true;
+    logger.wake.notify_one();
+    logger.drained.wait(lock, [&logger, target]() { return logger.completedPasses >= target; });
+}
+
+Logger::ThreadBuffer& Logger::threadBuffer() {
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer) {
+        unique_ptr<ThreadBuffer> created(new ThreadBuffer());
+        lock_guard<std::mutex> lock(mutex);
+        buffer = created.get();
+        buffers.push_back(move(created));
+        if (!writer.joinable()) {
+            writer = thread(&Logger::writerLoop, this);
+        }
     }
+    return *buffer;
 }
 
-// ---------------------
-// Leader implementations
-// ---------------------
+Logger::Record& Logger::beginRecord(Level level, const char* format) {
+    Logger& logger = instance();
+    ThreadBuffer& buffer = logger.threadBuffer();
+    uint32_t head = buffer.head.load(memory_order_relaxed);
+    // A full ring waits for the writer rather than dropping messages
+    while (head - buffer.tail.load(memory_order_acquire) >= RING_SIZE) {
+        logger.wake.notify_one();
+        this_thread::yield();
+    }
 
-Leader::Leader(const string& name, int charisma, int intelligence, int strength)
-    : name(name), charisma(charisma), intelligence(intelligence), strength(strength) {
+    Record& record = buffer.records[head % RING_SIZE];
+    record.format = format;
+    record.time = chrono::steady_clock::now();
+    record.kingdomTag = currentKingdomTag;
+    record.level = static_cast<uint8_t>(level);
+    record.argumentCount = 0;
+    record.textUsed = 0;
+    return record;
+}
+
+void Logger::commitRecord() {
+    Logger& logger = instance();
+    ThreadBuffer& buffer = logger.threadBuffer();
+    uint32_t head = buffer.head.load(memory_order_relaxed) + 1;
+    buffer.head.store(head, memory_order_release);
+    if (head - buffer.tail.load(memory_order_relaxed) >= RING_SIZE / 2) {
+        logger.wake.notify_one();
+    }
 }
 
-Leader::~Leader() {}
-
-string Leader::getName() const {
-    return name;
+Logger::Argument* Logger::nextArgument(Record& record, ArgumentType type) {
+    if (record.argumentCount >= MAX_ARGUMENTS) {
+        return nullptr;
+    }
+    Argument* argument = &record.arguments[record.argumentCount++];
+    argument->type = type;
+    return argument;
 }
 
-int Leader::getCharisma() const {
-    return charisma;
+void Logger::addText(Record& record, const char* text, size_t length) {
+    Argument* argument = nextArgument(record, ARGUMENT_TEXT);
+    if (!argument) {
+        return;
+    }
+    // Long strings are truncated to what is left of the inline text area
+    length = min(length, static_cast<size_t>(TEXT_CAPACITY - record.textUsed));
+    memcpy(record.text + record.textUsed, text, length);
+    argument->textOffset = record.textUsed;
+    argument->textLength = static_cast<uint16_t>(length);
+    record.textUsed = static_cast<uint16_t>(record.textUsed + length);
 }
 
-int Leader::getIntelligence() const {
-    return intelligence;
+void Logger::addArgument(Record& record, int value) {
+    addArgument(record, static_cast<long long>(value));
 }
 
-int Leader::getStrength() const {
-    return strength;
+void Logger::addArgument(Record& record, long value) {
+    addArgument(record, static_cast<long long>(value));
 }
 
-void Leader::setName(const string& newName) {
-    name = newName;
+void Logger::addArgument(Record& record, long long value) {
+    Argument* argument = nextArgument(record, ARGUMENT_INTEGER);
+    if (argument) {
+        argument->integer = value;
+    }
 }
 
-void Leader::applyEffects(Kingdom& kingdom) {
-    // Base implementation does nothing
+void Logger::addArgument(Record& record, unsigned int value) {
+    addArgument(record, static_cast<unsigned long long>(value));
 }
 
-// King implementation
-King::King(const string& name, int charisma, int intelligence, int strength, int royalBloodline)
-    : Leader(name, charisma, intelligence, strength), royalBloodline(royalBloodline), yearsInPower(0) {
+void Logger::addArgument(Record& record, unsigned long value) {
+    addArgument(record, static_cast<unsigned long long>(value));
 }
 
-King::~King() {}
+void Logger::addArgument(Record& record, unsigned long long value) {
+    Argument* argument = nextArgument(record, ARGUMENT_UNSIGNED);
+    if (argument) {
+        argument->unsignedInteger = value;
+    }
+}
 
-int King::getRoyalBloodline() const {
-    return royalBloodline;
+void Logger::addArgument(Record& record, double value) {
+    Argument* argument = nextArgument(record, ARGUMENT_REAL);
+    if (argument) {
+        argument->real = value;
+    }
 }
 
-int King::getYearsInPower() const {
-    return yearsInPower;
+void Logger::addArgument(Record& record, bool value) {
+    Argument* argument = nextArgument(record, ARGUMENT_BOOL);
+    if (argument) {
+        argument->integer = value ? 1 : 0;
+    }
 }
 
-void King::incrementYearsInPower() {
-    yearsInPower++;
+void Logger::addArgument(Record& record, char value) {
+    Argument* argument = nextArgument(record, ARGUMENT_CHAR);
+    if (argument) {
+        argument->integer = value;
+    }
 }
 
-void King::specialAction(Kingdom& kingdom) {
-    // King's royal decree: temporarily boost economy or population
-    cout << "\nKing " << name << " issues a Royal Decree!" << endl;
+void Logger::addArgument(Record& record, const char* value) {
+    addText(record, value, strlen(value));
+}
 
-    int choice = rand() % 3;
-    switch (choice) {
-    case 0: // Economic stimulus
-        cout << "The decree stimulates the economy, increasing treasury by 10%." << endl;
-        kingdom.getEconomy()->setTreasuryGold(
-            static_cast<int>(kingdom.getEconomy()->getTreasuryGold() * 1.1)
-        );
-        break;
-    case 1: // Population happiness
-        cout << "The decree grants minor tax relief, improving happiness." << endl;
-        kingdom.getPopulation()->setHappiness(
-            kingdom.getPopulation()->getHappiness() + 0.1
-        );
-        break;
-    case 2: // Military morale
-        cout << "The decree honors the military, boosting army morale." << endl;
-        kingdom.getArmy()->setMorale(
-            kingdom.getArmy()->getMorale() + 0.15
-        );
-        break;
-    }
+void Logger::addArgument(Record& record, const string& value) {
+    addText(record, value.data(), value.size());
 }
 
-void King::applyEffects(Kingdom& kingdom) {
-    // King's passive effects based on stats
+void Logger::writerLoop() {
+    vector<ThreadBuffer*> current;
+    string batch;
 
-    // Charisma affects diplomatic relations
-    double diplomacyBonus = charisma * 0.01;
-    // Implement diplomacy effects when needed
+    unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        startedPasses++;
+        bool stop = stopping;
+        bool decorate = decorated;
+        ostream* out = output;
+        current.clear();
+        for (size_t i = 0; i < buffers.size(); i++) {
+            current.push_back(buffers[i].get());
+        }
+        lock.unlock();
+
+        // All formatting happens here, off the simulation threads
+        for (size_t i = 0; i < current.size(); i++) {
+            ThreadBuffer& buffer = *current[i];
+            uint32_t tail = buffer.tail.load(memory_order_relaxed);
+            uint32_t head = buffer.head.load(memory_order_acquire);
+            for (; tail != head; tail++) {
+                formatRecord(buffer.records[tail % RING_SIZE], decorate, batch);
+            }
+            buffer.tail.store(tail, memory_order_release);
+        }
+        if (!batch.empty()) {
+            out->write(batch.data(), batch.size());
+            out->flush();
+            batch.clear();
+        }
 
-    // Intelligence affects economy
-    double economyBonus = intelligence * 0.01;
-    kingdom.getEconomy()->setInflation(
-        max(0.01, kingdom.getEconomy()->getInflation() - economyBonus)
-    );
+        lock.lock();
+        completedPasses++;
+        drained.notify_all();
+        if (stop) {
+            break;
+        }
+        if (!flushRequested && !stopping) {
+            wake.wait_for(lock, chrono::milliseconds(5));
+        }
+        flushRequested = false;
+    }
+}
 
-    // Strength affects army
-    double armyBonus = strength * 0.01;
-    kingdom.getArmy()->setMorale(
-        min(1.0, kingdom.getArmy()->getMorale() + armyBonus)
-    );
+void Logger::formatRecord(const Record& record, bool decorate, string& batch) const {
+    static const char* levelNames[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+    const char* format = record.format;
+    if (decorate) {
+        // Blank lines that open a message stay ahead of the prefix
+        while (*format == '\n') {
+            batch += '\n';
+            format++;
+        }
+        char prefix[48];
+        double seconds = chrono::duration<double>(record.time - startTime).count();
+        snprintf(prefix, sizeof(prefix), "[%11.6f] %-5s ", seconds, levelNames[record.level]);
+        batch += prefix;
+        if (record.kingdomTag != StringTable::NO_HANDLE) {
+            batch += '[';
+            batch += StringTable::lookup(record.kingdomTag);
+            batch += "] ";
+        }
+    }
 
-    // Royal bloodline affects population loyalty
-    double loyaltyBonus = royalBloodline * 0.02;
-    kingdom.getPopulation()->setHappiness(
-        min(1.0, kingdom.getPopulation()->getHappiness() + loyaltyBonus)
-    );
+    char number[32];
+    int next = 0;
+    for (const char* c = format; *c; c++) {
+        if (c[0] != '{' || c[1] != '}' || next >= record.argumentCount) {
+            batch += *c;
+            continue;
+        }
+        // Same output as streaming the value to cout
+        const Argument& argument = record.arguments[next++];
+        switch (argument.type) {
+        case ARGUMENT_INTEGER:
+        case ARGUMENT_BOOL:
+            snprintf(number, sizeof(number), "%lld", argument.integer);
+            batch += number;
+            break;
+        case ARGUMENT_UNSIGNED:
+            snprintf(number, sizeof(number), "%llu", argument.unsignedInteger);
+            batch += number;
+            break;
+        case ARGUMENT_REAL:
+            snprintf(number, sizeof(number), "%g", argument.real);
+            batch += number;
+            break;
+        case ARGUMENT_CHAR:
+            batch += static_cast<char>(argument.integer);
+            break;
+        case ARGUMENT_TEXT:
+            batch.append(record.text + argument.textOffset, argument.textLength);
+            break;
+        }
+        c++;
+    }
+    batch += '\n';
 }
 
-// Commander implementation
-Commander::Commander(const string& name, int charisma, int intelligence, int strength, int tacticalSkill)
-    : Leader(name, charisma, intelligence, strength), tacticalSkill(tacticalSkill), loyalty(50 + rand() % 51) {
+// Writes a file so that a crash leaves either the old or the new contents:
+// write a temporary file, force it to disk, then rename it over the target
+static bool writeFileDurably(const string& filename, const string& contents) {
+    string temporary = filename + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = fwrite(contents.data(), 1, contents.size(), file) == contents.size() && fflush(file) == 0;
+#ifdef _WIN32
+    written = written && _commit(_fileno(file)) == 0;
+#else
+    written = written && fsync(fileno(file)) == 0;
+#endif
+    written = fclose(file) == 0 && written;
+    if (!written) {
+        remove(temporary.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    return MoveFileExA(temporary.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(temporary.c_str(), filename.c_str()) == 0;
+#endif
 }
 
-Commander::~Commander() {}
+// -------------------------
+// CounterRng implementation
+// -------------------------
 
-int Commander::getTacticalSkill() const {
-    return tacticalSkill;
+// Philox4x32 multipliers and Weyl key increments (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3")
+static const uint32_t PHILOX_M0 = 0xD2511F53u;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57u;
+static const uint32_t PHILOX_W0 = 0x9E3779B9u;
+static const uint32_t PHILOX_W1 = 0xBB67AE85u;
+static const int PHILOX_ROUNDS = 10;
+static const double WORD_SCALE = 1.0 / 4294967296.0;
+static const double TWO_PI = 6.283185307179586;
+
+static thread_local CounterRng::KingdomScope* activeRandomScope = nullptr;
+
+CounterRng::KingdomScope::KingdomScope(uint64_t seed, uint32_t kingdom, uint32_t year)
+    : seed(seed), kingdom(kingdom), year(year), previous(activeRandomScope) {
+    for (int i = 0; i < static_cast<int>(STREAM_COUNT); i++) {
+        drawn[i] = 0;
+    }
+    activeRandomScope = this;
 }
 
-int Commander::getLoyalty() const {
-    return loyalty;
+CounterRng::KingdomScope::KingdomScope(uint64_t seed, uint32_t kingdom, uint32_t year,
+    const uint32_t resumeDrawn[STREAM_COUNT])
+    : seed(seed), kingdom(kingdom), year(year), previous(activeRandomScope) {
+    for (int i = 0; i < static_cast<int>(STREAM_COUNT); i++) {
+        drawn[i] = resumeDrawn[i];
+    }
+    activeRandomScope = this;
 }
 
-void Commander::setLoyalty(int newLoyalty) {
-    loyalty = max(0, min(100, newLoyalty));
+CounterRng::KingdomScope::~KingdomScope() {
+    activeRandomScope = previous;
 }
 
-void Commander::specialAction(Kingdom& kingdom) {
-    // Commander's special action: military drill or defense improvement
-    cout << "\nCommander " << name << " conducts special military operations!" << endl;
+const uint32_t* CounterRng::KingdomScope::getDrawn() const {
+    return drawn;
+}
 
-    // Training takes time
-    cout << "Training troops... ";
-    for (int i = 0; i < 3; i++) {
-        cout << "." << flush;
-        crossPlatformSleep(1);
-    }
-    cout << " Complete!" << endl;
+CounterRng::CounterRng(uint64_t seed, uint32_t kingdom, uint32_t year, uint32_t stream)
+    : used(BLOCK_WORDS) {
+    key[0] = static_cast<uint32_t>(seed);
+    key[1] = static_cast<uint32_t>(seed >> 32);
+    counter[0] = 0;
+    counter[1] = kingdom;
+    counter[2] = year;
+    counter[3] = stream;
+}
 
-    int choice = rand() % 2;
-    switch (choice) {
-    case 0: // Military training
-        cout << "The army's training level increases!" << endl;
-        kingdom.getArmy()->setTrainingLevel(
-            kingdom.getArmy()->getTrainingLevel() + 1 + (tacticalSkill / 20)
-        );
-        break;
-    case 1: // Morale boost
-        cout << "Troop morale is significantly improved!" << endl;
-        kingdom.getArmy()->setMorale(
-            min(1.0, kingdom.getArmy()->getMorale() + 0.2 + (charisma * 0.01))
-        );
-        break;
+void CounterRng::philox(const uint32_t counter[4], const uint32_t key[2], uint32_t output[4]) {
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        uint64_t product0 = static_cast<uint64_t>(PHILOX_M0) * c0;
+        uint64_t product1 = static_cast<uint64_t>(PHILOX_M1) * c2;
+        c0 = static_cast<uint32_t>(product1 >> 32) ^ c1 ^ k0;
+        c2 = static_cast<uint32_t>(product0 >> 32) ^ c3 ^ k1;
+        c1 = static_cast<uint32_t>(product1);
+        c3 = static_cast<uint32_t>(product0);
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
     }
+    output[0] = c0;
+    output[1] = c1;
+    output[2] = c2;
+    output[3] = c3;
 }
 
-void Commander::applyEffects(Kingdom& kingdom) {
-    // Commander's passive effects
+void CounterRng::refill() {
+    philox(counter, key, block);
+    counter[0]++;
+    used = 0;
+}
 
-    // Tactical skill affects army strength
-    double armyStrengthBonus = tacticalSkill * 0.02;
-    double currentMorale = kingdom.getArmy()->getMorale();
-    kingdom.getArmy()->setMorale(min(1.0, currentMorale + armyStrengthBonus * 0.1));
+void CounterRng::seek(uint64_t index) {
+    counter[0] = static_cast<uint32_t>(index / BLOCK_WORDS);
+    refill();
+    used = static_cast<uint32_t>(index % BLOCK_WORDS);
+}
 
-    // Loyalty affects chance of rebellion
-    if (loyalty < 30 && rand() % 100 < (30 - loyalty)) {
-        cout << "\nWARNING: Commander " << name << " is plotting against you!" << endl;
-        // Potentially trigger rebellion event
+uint32_t CounterRng::next() {
+    if (used == BLOCK_WORDS) {
+        refill();
     }
+    return block[used++];
 }
 
-// GuildLeader implementation
-GuildLeader::GuildLeader(const string& name, int charisma, int intelligence, int strength,
-    const string& guildType, int businessAcumen)
-    : Leader(name, charisma, intelligence, strength), guildType(guildType), businessAcumen(businessAcumen) {
+double CounterRng::uniform() {
+    return next() * WORD_SCALE;
 }
 
-GuildLeader::~GuildLeader() {}
-
-string GuildLeader::getGuildType() const {
-    return guildType;
+int CounterRng::below(int bound) {
+    // Multiply-shift instead of modulo: no division and no bias toward small values
+    return bound > 0 ? static_cast<int>((static_cast<uint64_t>(next()) * static_cast<uint32_t>(bound)) >> 32) : 0;
 }
 
-int GuildLeader::getBusinessAcumen() const {
-    return businessAcumen;
+// Box-Muller; the first word is shifted half a step so the logarithm never sees zero
+static inline void boxMuller(uint32_t first, uint32_t second, double& cosine, double& sine) {
+    double radius = sqrt(-2.0 * log((first + 0.5) * WORD_SCALE));
+    double angle = TWO_PI * (second * WORD_SCALE);
+    cosine = radius * cos(angle);
+    sine = radius * sin(angle);
 }
 
-void GuildLeader::specialAction(Kingdom& kingdom) {
-    // Guild leader's special action: economic boost or trade deals
-    cout << "\nGuild Leader " << name << " of the " << guildType << " Guild initiates a special project!" << endl;
+double CounterRng::normal() {
+    double cosine, sine;
+    uint32_t first = next();
+    boxMuller(first, next(), cosine, sine);
+    return cosine;
+}
 
-    if (guildType == "Merchants") {
-        cout << "New trade deals bring increased tax revenue!" << endl;
-        kingdom.getEconomy()->setTreasuryGold(
-            kingdom.getEconomy()->getTreasuryGold() + 100 + (businessAcumen * 5)
-        );
+void CounterRng::fillUniform(double* output, size_t count) {
+    size_t i = 0;
+    while (i < count && used < BLOCK_WORDS) {
+        output[i++] = block[used++] * WORD_SCALE;
     }
-    else if (guildType == "Craftsmen") {
-        cout << "Improved crafting techniques boost resource production!" << endl;
-        kingdom.getMarket()->getWood()->changeAmount(50 + (businessAcumen * 2));
-        kingdom.getMarket()->getIron()->changeAmount(20 + (businessAcumen * 1));
+    // Whole blocks go straight to the output
+    uint32_t words[BLOCK_WORDS];
+    for (; i + BLOCK_WORDS <= count; i += BLOCK_WORDS) {
+        philox(counter, key, words);
+        counter[0]++;
+        for (int lane = 0; lane < BLOCK_WORDS; lane++) {
+            output[i + lane] = words[lane] * WORD_SCALE;
+        }
     }
-    else if (guildType == "Farmers") {
-        cout << "Agricultural innovations increase food stocks!" << endl;
-        kingdom.getMarket()->getFood()->changeAmount(100 + (businessAcumen * 5));
+    while (i < count) {
+        output[i++] = uniform();
     }
 }
 
-void GuildLeader::applyEffects(Kingdom& kingdom) {
-    // Guild leader's passive effects
-
-    // Business acumen affects economy
-    double economyBonus = businessAcumen * 0.02;
-    kingdom.getEconomy()->setInflation(
-        max(0.01, kingdom.getEconomy()->getInflation() - economyBonus * 0.01)
-    );
-
-    // Guild type specific effects
-    if (guildType == "Merchants") {
-        // Merchants boost trade income
-        int merchantCount = kingdom.getPopulation()->getMerchants();
-        int bonusGold = (merchantCount * businessAcumen) / 100;
-        kingdom.getEconomy()->setTreasuryGold(
-            kingdom.getEconomy()->getTreasuryGold() + bonusGold
-        );
+void CounterRng::fillNormal(double* output, size_t count) {
+    double cosine, sine;
+    for (size_t i = 0; i < count; i += 2) {
+        uint32_t first = next();
+        boxMuller(first, next(), cosine, sine);
+        output[i] = cosine;
+        if (i + 1 < count) {
+            output[i + 1] = sine;
+        }
     }
-    else if (guildType == "Craftsmen") {
-        // Craftsmen improve resource efficiency
-        // Implementation would adjust resource production rates
+}
+
+// Philox over a tile of kingdoms at once: every lane runs the same rounds on its own
+// counter, which the compiler turns into SIMD multiplies
+static void philoxAcross(uint64_t seed, uint32_t firstKingdom, size_t count, uint32_t year,
+    uint32_t stream, uint32_t block, uint32_t* words) {
+    enum { TILE = 16 };
+    for (size_t start = 0; start < count; start += TILE) {
+        uint32_t c0[TILE], c1[TILE], c2[TILE], c3[TILE];
+        for (int i = 0; i < TILE; i++) {
+            c0[i] = block;
+            c1[i] = firstKingdom + static_cast<uint32_t>(start) + i;
+            c2[i] = year;
+            c3[i] = stream;
+        }
+        uint32_t k0 = static_cast<uint32_t>(seed);
+        uint32_t k1 = static_cast<uint32_t>(seed >> 32);
+        for (int round = 0; round < PHILOX_ROUNDS; round++) {
+            for (int i = 0; i < TILE; i++) {
+                uint64_t product0 = static_cast<uint64_t>(PHILOX_M0) * c0[i];
+                uint64_t product1 = static_cast<uint64_t>(PHILOX_M1) * c2[i];
+                c0[i] = static_cast<uint32_t>(product1 >> 32) ^ c1[i] ^ k0;
+                c2[i] = static_cast<uint32_t>(product0 >> 32) ^ c3[i] ^ k1;
+                c1[i] = static_cast<uint32_t>(product1);
+                c3[i] = static_cast<uint32_t>(product0);
+            }
+            k0 += PHILOX_W0;
+            k1 += PHILOX_W1;
+        }
+        size_t width = min(static_cast<size_t>(TILE), count - start);
+        for (size_t i = 0; i < width; i++) {
+            words[start + i] = c0[i];
+            words[count + start + i] = c1[i];
+            words[2 * count + start + i] = c2[i];
+            words[3 * count + start + i] = c3[i];
+        }
     }
-    else if (guildType == "Farmers") {
-        // Farmers improve food production
-        kingdom.getMarket()->getFood()->changeAmount((businessAcumen / 10) + 5);
+}
+
+void CounterRng::uniformAcross(uint64_t seed, uint32_t firstKingdom, size_t count, uint32_t year,
+    uint32_t stream, uint32_t block, double* output) {
+    vector<uint32_t> words(BLOCK_WORDS * count);
+    philoxAcross(seed, firstKingdom, count, year, stream, block, words.data());
+    for (size_t i = 0; i < words.size(); i++) {
+        output[i] = words[i] * WORD_SCALE;
     }
 }
 
-// ------------------------
-// Population implementation
-// ------------------------
+void CounterRng::normalAcross(uint64_t seed, uint32_t firstKingdom, size_t count, uint32_t year,
+    uint32_t stream, uint32_t block, double* output) {
+    // Lanes 0 and 1 form one Box-Muller pair and lanes 2 and 3 the other, as in fillNormal
+    vector<uint32_t> words(BLOCK_WORDS * count);
+    philoxAcross(seed, firstKingdom, count, year, stream, block, words.data());
+    for (size_t pair = 0; pair < BLOCK_WORDS; pair += 2) {
+        const uint32_t* first = &words[pair * count];
+        const uint32_t* second = &words[(pair + 1) * count];
+        for (size_t i = 0; i < count; i++) {
+            boxMuller(first[i], second[i], output[pair * count + i], output[(pair + 1) * count + i]);
+        }
+    }
+}
 
-Population::Population(int initialPeasants, int initialMerchants, int initialNobles)
-    : peasants(initialPeasants), merchants(initialMerchants), nobles(initialNobles),
-    growthRate(0.05), happiness(0.5) {
+int CounterRng::draw(Stream stream, int bound) {
+    KingdomScope* scope = activeRandomScope;
+    if (!scope) {
+        return bound > 0 ? rand() % bound : 0;
+    }
+    CounterRng rng(scope->seed, scope->kingdom, scope->year, stream);
+    rng.seek(scope->drawn[stream]++);
+    return rng.below(bound);
 }
 
-Population::~Population() {}
+double CounterRng::drawUniform(Stream stream) {
+    KingdomScope* scope = activeRandomScope;
+    if (!scope) {
+        // Two rand() calls, since RAND_MAX can be as small as 32767
+        const double range = RAND_MAX + 1.0;
+        return (rand() * range + rand()) / (range * range);
+    }
+    CounterRng rng(scope->seed, scope->kingdom, scope->year, stream);
+    rng.seek(scope->drawn[stream]++);
+    return rng.uniform();
+}
 
-int Population::getPeasants() const {
-    return peasants;
+CounterRng CounterRng::drawMany(Stream stream, uint32_t count) {
+    KingdomScope* scope = activeRandomScope;
+    if (!scope) {
+        return CounterRng((static_cast<uint64_t>(rand()) << 32) ^ static_cast<uint64_t>(rand()), 0, 0, stream);
+    }
+    CounterRng rng(scope->seed, scope->kingdom, scope->year, stream);
+    rng.seek(scope->drawn[stream]);
+    scope->drawn[stream] += count;
+    return rng;
+}
+
+// ----------------------------
+// SobolSequence implementation
+// ----------------------------
+
+// Joe-Kuo primitive polynomials for dimensions 2 and up: degree, coefficients and the
+// initial direction numbers. Dimension 1 is the van der Corput sequence
+static const struct {
+    int degree;
+    uint32_t coefficients;
+    uint32_t initial[5];
+} sobolPolynomials[SobolSequence::MAX_DIMENSIONS - 1] = {
+    { 1, 0, { 1 } },
+    { 2, 1, { 1, 3 } },
+    { 3, 1, { 1, 3, 1 } },
+    { 3, 2, { 1, 1, 1 } },
+    { 4, 1, { 1, 1, 3, 3 } },
+    { 4, 4, { 1, 3, 5, 13 } },
+    { 5, 2, { 1, 1, 5, 5, 17 } },
+    { 5, 4, { 1, 1, 5, 5, 5 } },
+    { 5, 7, { 1, 1, 7, 11, 19 } },
+    { 5, 11, { 1, 1, 5, 1, 1 } },
+    { 5, 13, { 1, 1, 1, 3, 11 } }
+};
+
+SobolSequence::SobolSequence(int dimensionCount)
+    : dimensions(max(1, min(static_cast<int>(MAX_DIMENSIONS), dimensionCount))), index(0) {
+    for (int bit = 0; bit < BITS; bit++) {
+        directions[0][bit] = 1u << (BITS - 1 - bit);
+    }
+    for (int d = 1; d < dimensions; d++) {
+        int degree = sobolPolynomials[d - 1].degree;
+        uint32_t coefficients = sobolPolynomials[d - 1].coefficients;
+        for (int bit = 0; bit < degree; bit++) {
+            directions[d][bit] = sobolPolynomials[d - 1].initial[bit] << (BITS - 1 - bit);
+        }
+        for (int bit = degree; bit < BITS; bit++) {
+            uint32_t value = directions[d][bit - degree] ^ (directions[d][bit - degree] >> degree);
+            for (int k = 1; k < degree; k++) {
+                if ((coefficients >> (degree - 1 - k)) & 1) {
+                    value ^= directions[d][bit - k];
+                }
+            }
+            directions[d][bit] = value;
+        }
+    }
+    memset(state, 0, sizeof(state));
 }
 
-int Population::getMerchants() const {
-    return merchants;
+int SobolSequence::getDimensions() const {
+    return dimensions;
 }
 
-int Population::getNobles() const {
-    return nobles;
+void SobolSequence::next(double* point) {
+    // Gray-code order: each point differs from the last in the direction of the lowest zero bit
+    uint32_t lowestZero = 0;
+    while ((index >> lowestZero) & 1) {
+        lowestZero++;
+    }
+    index++;
+    for (int d = 0; d < dimensions; d++) {
+        state[d] ^= directions[d][min(lowestZero, static_cast<uint32_t>(BITS - 1))];
+        point[d] = state[d] / 4294967296.0;
+    }
 }
 
-int Population::getTotal() const {
-    return peasants + merchants + nobles;
+// ----------------------------
+// PhaseProfiler implementation
+// ----------------------------
+
+atomic<bool> PhaseProfiler::enabled(false);
+
+static const char* const phaseNames[PhaseProfiler::PHASE_COUNT] = {
+    "population", "happiness", "morale", "economy", "prices", "production", "diplomacy", "bank",
+    "leader", "dynasty", "resources", "events", "unrest", "taxes", "recording"
+};
+
+#ifdef __linux__
+// Opens one user-space hardware counter on the calling thread, joined to groupFd if it is open
+static int openHardwareCounter(uint64_t config, int groupFd) {
+    perf_event_attr attributes;
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof(attributes);
+    attributes.config = config;
+    attributes.read_format = PERF_FORMAT_GROUP;
+    // The leader starts stopped so the whole group is switched on at once
+    attributes.disabled = groupFd < 0 ? 1 : 0;
+    // Kernel counts need privileges the default perf_event_paranoid setting withholds
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC));
+}
+#endif
+
+PhaseProfiler::PhaseProfiler() {
+}
+
+PhaseProfiler::~PhaseProfiler() {
+#ifdef __linux__
+    for (size_t i = 0; i < threads.size(); i++) {
+        for (int j = 0; j < COUNTER_COUNT; j++) {
+            if (threads[i]->fds[j] >= 0) {
+                close(threads[i]->fds[j]);
+            }
+        }
+    }
+#endif
 }
 
-double Population::getGrowthRate() const {
-    return growthRate;
+PhaseProfiler& PhaseProfiler::instance() {
+    static PhaseProfiler profiler;
+    return profiler;
 }
 
-double Population::getHappiness() const {
-    return happiness;
+void PhaseProfiler::enable() {
+    // Built now, so it outlives any atexit handler registered after this call
+    instance();
+    enabled.store(true, memory_order_relaxed);
 }
 
-void Population::setPeasants(int count) {
-    peasants = max(0, count);
+bool PhaseProfiler::isEnabled() {
+    return enabled.load(memory_order_relaxed);
 }
 
-void Population::setMerchants(int count) {
-    merchants = max(0, count);
+const char* PhaseProfiler::getPhaseName(Phase phase) {
+    return phaseNames[phase];
 }
 
-void Population::setNobles(int count) {
-    nobles = max(0, count);
+PhaseProfiler::ThreadCounters& PhaseProfiler::threadCounters() {
+    // Counters only see the thread that opened them, so every thread gets its own group
+    thread_local ThreadCounters* counters = nullptr;
+    if (!counters) {
+        unique_ptr<ThreadCounters> created(new ThreadCounters());
+        created->groupFd = -1;
+        created->openError = 0;
+        int opened = 0;
+#ifdef __linux__
+        static const uint64_t configs[COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+        };
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            created->fds[i] = openHardwareCounter(configs[i], created->groupFd);
+            created->slots[i] = -1;
+            if (created->fds[i] < 0) {
+                created->openError = errno;
+                continue;
+            }
+            if (created->groupFd < 0) {
+                created->groupFd = created->fds[i];
+            }
+            created->slots[i] = opened++;
+        }
+        if (created->groupFd >= 0) {
+            ioctl(created->groupFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(created->groupFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#else
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            created->fds[i] = -1;
+            created->slots[i] = -1;
+        }
+        created->openError = ENOSYS;
+#endif
+        lock_guard<std::mutex> lock(mutex);
+        counters = created.get();
+        threads.push_back(move(created));
+    }
+    return *counters;
 }
 
-void Population::setGrowthRate(double rate) {
-    growthRate = max(0.0, min(0.2, rate));
+void PhaseProfiler::readCounters(const ThreadCounters& counters, uint64_t values[COUNTER_COUNT]) {
+    // A group read returns the number of counters followed by their values in opening order
+    uint64_t group[COUNTER_COUNT + 1] = {};
+#ifdef __linux__
+    if (counters.groupFd >= 0 && read(counters.groupFd, group, sizeof(group)) <= 0) {
+        group[0] = 0;
+    }
+#endif
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        int slot = counters.slots[i];
+        values[i] = slot >= 0 && static_cast<uint64_t>(slot) < group[0] ? group[1 + slot] : 0;
+    }
 }
 
-void Population::setHappiness(double value) {
-    happiness = max(0.0, min(1.0, value));
+PhaseProfiler::Timeline::Timeline()
+    : counters(enabled.load(memory_order_relaxed) ? &instance().threadCounters() : nullptr), phase(-1) {
 }
 
-void Population::updatePopulation(const Economy& economy, const Army& army) {
-    // Update growth rate based on conditions
-    double taxBurden = economy.getPeasantTaxRate() + economy.getMerchantTaxRate() + economy.getNobleTaxRate();
-    double foodSecurity = 1.0; // Placeholder, would be calculated from food resources
+PhaseProfiler::Timeline::~Timeline() {
+    close();
+}
 
-    // Adjust growth rate based on conditions
-    growthRate = 0.05 + (happiness * 0.05) - (taxBurden * 0.1) + (foodSecurity * 0.02);
-    growthRate = max(0.01, min(0.2, growthRate)); // Clamp to reasonable range
+void PhaseProfiler::Timeline::enter(Phase next) {
+    if (!counters) {
+        return;
+    }
+    close();
+    phase = next;
+    readCounters(*counters, start);
+    startTime = chrono::steady_clock::now();
+}
 
-    // Apply growth to different population groups
-    peasants += static_cast<int>(peasants * growthRate);
-    merchants += static_cast<int>(merchants * (growthRate * 0.8)); // Merchants grow more slowly
-    nobles += static_cast<int>(nobles * (growthRate * 0.5)); // Nobles grow very slowly
+void PhaseProfiler::Timeline::close() {
+    if (!counters || phase < 0) {
+        return;
+    }
+    // Clock first, counters second, so neither measurement includes the other's cost
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    uint64_t values[COUNTER_COUNT];
+    readCounters(*counters, values);
+
+    counters->calls[phase]++;
+    counters->nanoseconds[phase] += static_cast<uint64_t>(
+        chrono::duration_cast<chrono::nanoseconds>(now - startTime).count());
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counters->counts[phase][i] += values[i] - start[i];
+    }
+    phase = -1;
+}
+
+string PhaseProfiler::report() {
+    PhaseProfiler& profiler = instance();
+    lock_guard<std::mutex> lock(profiler.mutex);
+
+    uint64_t calls[PHASE_COUNT] = {};
+    uint64_t nanoseconds[PHASE_COUNT] = {};
+    uint64_t counts[PHASE_COUNT + 1][COUNTER_COUNT] = {};   // Last row is the total
+    bool counted[COUNTER_COUNT] = { true, true, true, true };
+    int openError = 0;
+    for (size_t t = 0; t < profiler.threads.size(); t++) {
+        const ThreadCounters& thread = *profiler.threads[t];
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            // A column means something only if every thread was able to count it
+            counted[i] = counted[i] && thread.slots[i] >= 0;
+        }
+        openError = thread.openError ? thread.openError : openError;
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            calls[p] += thread.calls[p];
+            nanoseconds[p] += thread.nanoseconds[p];
+            for (int i = 0; i < COUNTER_COUNT; i++) {
+                counts[p][i] += thread.counts[p][i];
+                counts[PHASE_COUNT][i] += thread.counts[p][i];
+            }
+        }
+    }
+    uint64_t totalNanoseconds = 0;
+    uint64_t totalCalls = 0;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        totalNanoseconds += nanoseconds[p];
+        totalCalls += calls[p];
+    }
 
-    // Potential for social mobility
-    if (rand() % 100 < 5) { // 5% chance each year
-        int socialMobility = max(1, static_cast<int>(peasants * 0.01));
-        peasants -= socialMobility;
-        merchants += socialMobility;
+    ostringstream report;
+    report << "===== Phase Profile =====\n";
+    if (totalCalls == 0) {
+        report << "  No simulated years were profiled.\n";
+        return report.str();
+    }
+    if (openError) {
+        report << "  Hardware counters unavailable (" << strerror(openError)
+            << "); those columns show -\n";
     }
 
-    if (rand() % 100 < 2) { // 2% chance each year
-        int socialMobility = max(1, static_cast<int>(merchants * 0.01));
-        merchants -= socialMobility;
-        nobles += socialMobility;
+    char row[160];
+    snprintf(row, sizeof(row), "  %-11s %9s %10s %6s %12s %12s %5s %9s %9s  %s\n", "Phase", "Calls",
+        "Time ms", "Share", "Cycles/call", "Instr/call", "IPC", "Cache/ki", "Branch/ki", "Bound");
+    report << row;
+    for (int p = 0; p <= PHASE_COUNT; p++) {
+        bool total = p == PHASE_COUNT;
+        uint64_t phaseCalls = total ? totalCalls : calls[p];
+        uint64_t phaseNanoseconds = total ? totalNanoseconds : nanoseconds[p];
+        if (phaseCalls == 0) {
+            continue;
+        }
+        const uint64_t* phaseCounts = counts[p];
+        double instructions = static_cast<double>(phaseCounts[COUNTER_INSTRUCTIONS]);
+        double ipc = phaseCounts[COUNTER_CYCLES] > 0 ?
+            instructions / phaseCounts[COUNTER_CYCLES] : 0.0;
+        double cacheRate = instructions > 0 ? phaseCounts[COUNTER_CACHE_MISSES] * 1000.0 / instructions : 0.0;
+        double branchRate = instructions > 0 ? phaseCounts[COUNTER_BRANCH_MISSES] * 1000.0 / instructions : 0.0;
+
+        // Formats one counter column, or a dash when the counter never opened
+        auto column = [](bool available, const char* format, double value) {
+            char text[32];
+            if (available) {
+                snprintf(text, sizeof(text), format, value);
+            }
+            else {
+                snprintf(text, sizeof(text), "-");
+            }
+            return string(text);
+        };
+        bool rates = counted[COUNTER_INSTRUCTIONS] && instructions > 0;
+        const char* bound = "-";
+        if (rates && counted[COUNTER_CYCLES]) {
+            if (counted[COUNTER_CACHE_MISSES] && ipc < 1.0 && cacheRate >= 1.0) {
+                bound = "memory";
+            }
+            else if (counted[COUNTER_BRANCH_MISSES] && branchRate >= 5.0) {
+                bound = "branch";
+            }
+            else {
+                bound = "compute";
+            }
+        }
+
+        snprintf(row, sizeof(row), "  %-11s %9llu %10.3f %5.1f%% %12s %12s %5s %9s %9s  %s\n",
+            total ? "total" : phaseNames[p], static_cast<unsigned long long>(phaseCalls),
+            phaseNanoseconds / 1e6, totalNanoseconds > 0 ? 100.0 * phaseNanoseconds / totalNanoseconds : 0.0,
+            column(counted[COUNTER_CYCLES], "%.0f", static_cast<double>(phaseCounts[COUNTER_CYCLES]) / phaseCalls).c_str(),
+            column(counted[COUNTER_INSTRUCTIONS], "%.0f", instructions / phaseCalls).c_str(),
+            column(counted[COUNTER_CYCLES] && rates, "%.2f", ipc).c_str(),
+            column(counted[COUNTER_CACHE_MISSES] && rates, "%.2f", cacheRate).c_str(),
+            column(counted[COUNTER_BRANCH_MISSES] && rates, "%.2f", branchRate).c_str(), bound);
+        report << row;
     }
+    report << "  Cache/ki and Branch/ki are misses per 1000 instructions. Memory-bound phases run\n"
+        << "  under 1 IPC with 1+ cache misses/ki; branch-bound phases have 5+ branch misses/ki.\n";
+    return report.str();
 }
 
-void Population::calculateHappiness(const Economy& economy, const Army& army) {
-    // Factors affecting happiness
-    double taxFactor = 1.0 - ((economy.getPeasantTaxRate() * 2) +
-        (economy.getMerchantTaxRate() * 1.5) +
-        (economy.getNobleTaxRate() * 0.5));
-    double armyPresence = min(1.0, static_cast<double>(army.getTotal()) / static_cast<double>(getTotal()) * 0.5);
-    double inflationFactor = 1.0 - (economy.getInflation() * 2.0);
+void PhaseProfiler::printReport() {
+    Logger::flush();
+    cout << report() << flush;
+}
 
-    // Calculate new happiness
-    double newHappiness = (happiness * 0.7) + (taxFactor * 0.1) +
-        (armyPresence * 0.1) + (inflationFactor * 0.1);
+// ------------------------
+// Headroom implementation
+// ------------------------
 
-    // Clamp to valid range
-    happiness = max(0.0, min(1.0, newHappiness));
-}
+atomic<uint64_t> Headroom::saturations(0);
 
-bool Population::checkRebellion() const {
-    // Check if population is going to rebel
-    if (happiness < 0.2) {
-        // Very unhappy population might rebel
-        return (rand() % 100) < ((0.2 - happiness) * 100 * 2);
+int Headroom::narrow(long long value) {
+    if (value > INT_MAX || value < INT_MIN) {
+        saturations.fetch_add(1, memory_order_relaxed);
+        return value > INT_MAX ? INT_MAX : INT_MIN;
     }
-    return false;
+    return static_cast<int>(value);
 }
 
-// -------------------
-// Army implementation
-// -------------------
+int Headroom::truncate(double value) {
+    // Checked before the cast, which is undefined out of range
+    if (value < 2147483648.0 && value > -2147483649.0) {
+        return static_cast<int>(value);
+    }
+    saturations.fetch_add(1, memory_order_relaxed);
+    return value >= 2147483648.0 ? INT_MAX : value <= -2147483649.0 ? INT_MIN : 0;
+}
 
-Army::Army(int initialInfantry, int initialCavalry, int initialArchers)
-    : infantry(initialInfantry), cavalry(initialCavalry), archers(initialArchers),
-    morale(0.7), trainingLevel(1), isAtWar(false) {
+uint64_t Headroom::getSaturations() {
+    return saturations.load(memory_order_relaxed);
 }
 
-Army::~Army() {}
+// ------------------------
+// Resource implementations
+// ------------------------
 
-int Army::getInfantry() const {
-    return infantry;
-}
+// Names that commands and the exchange look resources up by
+static const StringTable::Handle foodName = StringTable::intern("Food");
+static const StringTable::Handle woodName = StringTable::intern("Wood");
+static const StringTable::Handle stoneName = StringTable::intern("Stone");
+static const StringTable::Handle ironName = StringTable::intern("Iron");
 
-int Army::getCavalry() const {
-    return cavalry;
+Resource::Resource(const string& name, int amount, double value)
+    : nameHandle(StringTable::intern(name)), amount(amount), value(value) {
 }
 
-int Army::getArchers() const {
-    return archers;
-}
+Resource::~Resource() {}
 
-int Army::getTotal() const {
-    return infantry + cavalry + archers;
+const string& Resource::getName() const {
+    return StringTable::lookup(nameHandle);
 }
 
-double Army::getMorale() const {
-    return morale;
+StringTable::Handle Resource::getNameHandle() const {
+    return nameHandle;
 }
 
-int Army::getTrainingLevel() const {
-    return trainingLevel;
+int Resource::getAmount() const {
+    return amount;
 }
 
-bool Army::getWarStatus() const {
-    return isAtWar;
+double Resource::getValue() const {
+    return value;
 }
 
-void Army::setInfantry(int count) {
-    infantry = max(0, count);
+void Resource::setAmount(int newAmount) {
+    amount = newAmount < 0 ? 0 : newAmount;
 }
 
-void Army::setCavalry(int count) {
-    cavalry = max(0, count);
+void Resource::changeAmount(int delta) {
+    amount = Headroom::narrow(static_cast<long long>(amount) + delta);
+    if (amount < 0) amount = 0;
 }
 
-void Army::setArchers(int count) {
-    archers = max(0, count);
+void Resource::setValue(double newValue) {
+    value = newValue > 0 ? newValue : 0; // Ensure value is non-negative
 }
 
-void Army::setMorale(double value) {
-    morale = max(0.0, min(1.0, value));
+
+double Resource::getTotalValue() const {
+    return amount * value;
 }
 
-void Army::setTrainingLevel(int level) {
-    trainingLevel = max(1, level);
+void Resource::applyEffects(Kingdom& kingdom) {
+    // Base implementation does nothing
 }
 
-void Army::setWarStatus(bool status) {
-    isAtWar = status;
+// Food implementation
+Food::Food(int amount, double value)
+    : Resource("Food", amount, value) {
 }
 
-void Army::trainArmy() {
-    // Training the army takes time and resources but improves effectiveness
-    cout << "Training army units... ";
-    for (int i = 0; i < 3; i++) {
-        cout << "." << flush;
-        crossPlatformSleep(1);
+void Food::applyEffects(Kingdom& kingdom) {
+    // Agents already felt their food supply individually
+    if (kingdom.getPopulation()->isAgentMode()) {
+        return;
     }
-    cout << " Complete!" << endl;
 
-    // Improve training level
-    trainingLevel++;
+    // Food directly affects population happiness
+    double happinessModifier = 0;
+    int totalPopulation = kingdom.getPopulation()->getTotal();
 
-    // Boost morale
-    morale = min(1.0, morale + 0.1);
+    if (totalPopulation > 0) {
+        double foodPerPerson = static_cast<double>(amount) / totalPopulation;
+        if (foodPerPerson > 1.5) {
+            happinessModifier = 0.1; // Plenty of food
+        }
+        else if (foodPerPerson > 1.0) {
+            happinessModifier = 0.05; // Adequate food
+        }
+        else if (foodPerPerson < 0.5) {
+            happinessModifier = -0.2; // Shortage
+        }
+        else if (foodPerPerson < 0.25) {
+            happinessModifier = -0.4; // Severe shortage
+        }
+    }
 
-    cout << "Army training level increased to " << trainingLevel << endl;
-    cout << "Morale improved to " << static_cast<int>(morale * 100) << "%" << endl;
+    double currentHappiness = kingdom.getPopulation()->getHappiness();
+    kingdom.getPopulation()->setHappiness(currentHappiness + happinessModifier);
 }
 
-int Army::calculateStrength() const {
-    // Calculate the overall military strength
-    int baseStrength = infantry + (cavalry * 3) + (archers * 2);
-    double moraleMultiplier = 0.5 + (morale * 0.5); // 0.5 - 1.0
-    double trainingMultiplier = 0.8 + (trainingLevel * 0.2); // Starts at 1.0
-
-    return static_cast<int>(baseStrength * moraleMultiplier * trainingMultiplier);
+// Gold implementation
+Gold::Gold(int amount, double value)
+    : Resource("Gold", amount, value) {
 }
 
-void Army::updateMorale(const Economy& economy, const Population& population) {
-    // Factors affecting morale
-    double payFactor = min(1.0, static_cast<double>(economy.getTreasuryGold()) /
-        (getTotal() * 5)); // Can the kingdom pay the troops?
-    double populationSupport = population.getHappiness();
-    double warEffect = isAtWar ? -0.1 : 0.05; // War decreases morale over time
-
-    // Calculate new morale
-    double newMorale = (morale * 0.7) + (payFactor * 0.1) +
-        (populationSupport * 0.1) + warEffect;
-
-    // Clamp to valid range
-    morale = max(0.1, min(1.0, newMorale));
+void Gold::applyEffects(Kingdom& kingdom) {
+    // Gold is handled by the Economy class
 }
 
-int Army::calculateDesertion() {
-    // Calculate how many troops desert based on morale
-    if (morale < 0.4) {
-        double desertionRate = (0.4 - morale) * 0.5; // Up to 20% desertion for very low morale
-        int deserters = static_cast<int>(getTotal() * desertionRate);
+// Wood implementation
+Wood::Wood(int amount, double value)
+    : Resource("Wood", amount, value) {
+}
 
-        // Distribute desertion across unit types
-        int infantryDeserters = min(infantry, static_cast<int>(deserters * 0.6));
-        int cavalryDeserters = min(cavalry, static_cast<int>(deserters * 0.2));
-        int archerDeserters = min(archers, static_cast<int>(deserters * 0.2));
+void Wood::applyEffects(Kingdom& kingdom) {
+    // Wood effects might include building capacity, etc.
+}
 
-        infantry -= infantryDeserters;
-        cavalry -= cavalryDeserters;
-        archers -= archerDeserters;
+// Stone implementation
+Stone::Stone(int amount, double value)
+    : Resource("Stone", amount, value) {
+}
 
-        return infantryDeserters + cavalryDeserters + archerDeserters;
-    }
-    return 0;
+void Stone::applyEffects(Kingdom& kingdom) {
+    // Stone effects might include building capacity, etc.
 }
 
-bool Army::checkRebellion(const Population& population) const {
-    // Check if the army will rebel against the ruler
-    if (morale < 0.2 && population.getHappiness() < 0.3) {
-        // Both army and population are very unhappy
-        return (rand() % 100) < ((0.2 - morale) * 100 * 3);
+// Iron implementation
+Iron::Iron(int amount, double value)
+    : Resource("Iron", amount, value) {
+}
+
+void Iron::applyEffects(Kingdom& kingdom) {
+    // Iron affects army equipment quality
+    if (amount > 100) {
+        int currentLevel = kingdom.getArmy()->getTrainingLevel();
+        kingdom.getArmy()->setTrainingLevel(currentLevel + 1);
     }
-    return false;
 }
 
-// ----------------------
-// Economy implementation
-// ----------------------
+// ---------------------
+// Leader implementations
+// ---------------------
 
-Economy::Economy(double initialPeasantTaxRate, double initialMerchantTaxRate, double initialNobleTaxRate)
-    : peasantTaxRate(initialPeasantTaxRate), merchantTaxRate(initialMerchantTaxRate),
-    nobleTaxRate(initialNobleTaxRate), inflation(0.02), treasuryGold(1000), debt(0) {
+Leader::Leader(const string& name, int charisma, int intelligence, int strength)
+    : nameHandle(StringTable::intern(name)), charisma(charisma), intelligence(intelligence), strength(strength) {
 }
 
-Economy::~Economy() {}
+Leader::~Leader() {}
 
-double Economy::getPeasantTaxRate() const {
-    return peasantTaxRate;
+const string& Leader::getName() const {
+    return StringTable::lookup(nameHandle);
 }
 
-double Economy::getMerchantTaxRate() const {
-    return merchantTaxRate;
+StringTable::Handle Leader::getNameHandle() const {
+    return nameHandle;
 }
 
-double Economy::getNobleTaxRate() const {
-    return nobleTaxRate;
+int Leader::getCharisma() const {
+    return charisma;
 }
 
-double Economy::getInflation() const {
-    return inflation;
+int Leader::getIntelligence() const {
+    return intelligence;
 }
 
-int Economy::getTreasuryGold() const {
-    return treasuryGold;
+int Leader::getStrength() const {
+    return strength;
 }
 
-int Economy::getDebt() const {
-    return debt;
+void Leader::setName(const string& newName) {
+    nameHandle = StringTable::intern(newName);
 }
 
-void Economy::setPeasantTaxRate(double rate) {
-    peasantTaxRate = max(0.0, min(0.5, rate));
+void Leader::applyEffects(Kingdom& kingdom) {
+    // Base implementation does nothing
 }
 
-void Economy::setMerchantTaxRate(double rate) {
-    merchantTaxRate = max(0.0, min(0.5, rate));
+size_t Leader::memoryUsage() const {
+    return 0;
 }
 
-void Economy::setNobleTaxRate(double rate) {
-    nobleTaxRate = max(0.0, min(0.5, rate));
+// King implementation
+King::King(const string& name, int charisma, int intelligence, int strength, int royalBloodline)
+    : Leader(name, charisma, intelligence, strength), royalBloodline(royalBloodline), yearsInPower(0) {
 }
 
-void Economy::setInflation(double value) {
-    inflation = max(0.01, min(0.2, value));
+King::~King() {}
+
+int King::getRoyalBloodline() const {
+    return royalBloodline;
 }
 
-void Economy::setTreasuryGold(int amount) {
-    treasuryGold = max(0, amount);
+int King::getYearsInPower() const {
+    return yearsInPower;
 }
 
-void Economy::setDebt(int amount) {
-    debt = max(0, amount);
+void King::incrementYearsInPower() {
+    yearsInPower++;
 }
 
-int Economy::collectTaxes(const Population& population) {
-    // Calculate tax revenue from different population groups
-    int peasantTax = static_cast<int>(population.getPeasants() * 2 * peasantTaxRate);
-    int merchantTax = static_cast<int>(population.getMerchants() * 10 * merchantTaxRate);
-    int nobleTax = static_cast<int>(population.getNobles() * 50 * nobleTaxRate);
+void King::setYearsInPower(int years) {
+    yearsInPower = max(0, years);
+}
 
-    int totalTax = peasantTax + merchantTax + nobleTax;
-    treasuryGold += totalTax;
+void King::specialAction(Kingdom& kingdom) {
+    // King's royal decree: temporarily boost economy or population
+    Logger::info("\nKing {} issues a Royal Decree!", getName());
 
-    return totalTax;
+    int choice = rand() % 3;
+    switch (choice) {
+    case 0: // Economic stimulus
+        Logger::info("The decree stimulates the economy, increasing treasury by 10%.");
+        kingdom.getEconomy()->setTreasuryGold(
+            static_cast<int>(kingdom.getEconomy()->getTreasuryGold() * 1.1)
+        );
+        break;
+    case 1: // Population happiness
+        Logger::info("The decree grants minor tax relief, improving happiness.");
+        kingdom.getPopulation()->setHappiness(
+            kingdom.getPopulation()->getHappiness() + 0.1
+        );
+        break;
+    case 2: // Military morale
+        Logger::info("The decree honors the military, boosting army morale.");
+        kingdom.getArmy()->setMorale(
+            kingdom.getArmy()->getMorale() + 0.15
+        );
+        break;
+    }
 }
 
-void Economy::updateEconomy(const Population& population, const Army& army) {
-    // Update economic factors
+void King::applyEffects(Kingdom& kingdom) {
+    // King's passive effects based on stats
 
-    // Army maintenance costs
-    int armyCost = army.getTotal() * 2;
-    treasuryGold -= min(treasuryGold, armyCost);
+    // Charisma affects diplomatic relations
+    double diplomacyBonus = charisma * 0.01;
+    // Implement diplomacy effects when needed
 
-    // Bureaucracy costs
-    int bureaucracyCost = population.getTotal() / 10;
-    treasuryGold -= min(treasuryGold, bureaucracyCost);
+    // Intelligence affects economy
+    double economyBonus = intelligence * 0.01;
+    kingdom.getEconomy()->setInflation(
+        max(0.01, kingdom.getEconomy()->getInflation() - economyBonus)
+    );
 
-    // Update inflation based on economic activity
-    double economicActivity = static_cast<double>(population.getTotal()) / 1000.0;
-    double treasuryRatio = min(1.0, static_cast<double>(treasuryGold) / 10000.0);
+    // Strength affects army
+    double armyBonus = strength * 0.01;
+    kingdom.getArmy()->setMorale(
+        min(1.0, kingdom.getArmy()->getMorale() + armyBonus)
+    );
 
-    // Inflation increases with high economic activity and low treasury
-    inflation = (inflation * 0.8) + (economicActivity * 0.05) - (treasuryRatio * 0.03);
-    inflation = max(0.01, min(0.2, inflation));
+    // Royal bloodline affects population loyalty
+    double loyaltyBonus = royalBloodline * 0.02;
+    kingdom.getPopulation()->setHappiness(
+        min(1.0, kingdom.getPopulation()->getHappiness() + loyaltyBonus)
+    );
+}
 
-    // Apply debt interest
-    if (debt > 0) {
-        int interest = static_cast<int>(debt * 0.1); // 10% interest
-        debt += interest;
-    }
+// Commander implementation
+Commander::Commander(const string& name, int charisma, int intelligence, int strength, int tacticalSkill)
+    : Leader(name, charisma, intelligence, strength), tacticalSkill(tacticalSkill), loyalty(50 + CounterRng::draw(CounterRng::STREAM_LEADER, 51)) {
 }
 
-double Economy::calculateUnrest(const Population& population) const {
-    // Calculate economic unrest level
-    double taxBurden = (peasantTaxRate + merchantTaxRate + nobleTaxRate) / 3.0;
-    double inflationImpact = inflation * 5.0;
-    double happinessOffset = population.getHappiness();
+Commander::~Commander() {}
 
-    return min(1.0, (taxBurden * 0.5) + (inflationImpact * 0.3) - (happinessOffset * 0.5));
+int Commander::getTacticalSkill() const {
+    return tacticalSkill;
 }
 
-bool Economy::checkRiots(const Population& population) const {
-    // Check if economic conditions will cause riots
-    double unrest = calculateUnrest(population);
-    return (unrest > 0.6) && ((rand() % 100) < (unrest * 100));
+int Commander::getLoyalty() const {
+    return loyalty;
 }
 
-// --------------------
-// Market implementation
-// --------------------
-
-Market::Market()
-    : food(make_shared<Food>(1000)), gold(make_shared<Gold>(500)),
-    wood(make_shared<Wood>(500)), stone(make_shared<Stone>(300)),
-    iron(make_shared<Iron>(200)), priceFluctuation(0.1) {
+void Commander::setLoyalty(int newLoyalty) {
+    loyalty = max(0, min(100, newLoyalty));
 }
 
-Market::~Market() {}
+void Commander::specialAction(Kingdom& kingdom) {
+    // Commander's special action: military drill or defense improvement
+    Logger::info("\nCommander {} conducts special military operations!", getName());
 
-shared_ptr<Food> Market::getFood() const {
-    return food;
-}
+    // Training takes time
+    Logger::flush();
+    cout << "Training troops... ";
+    for (int i = 0; i < 3; i++) {
+        cout << "." << flush;
+        crossPlatformSleep(1);
+    }
+    cout << " Complete!" << endl;
 
-shared_ptr<Gold> Market::getGold() const {
-    return gold;
+    int choice = rand() % 2;
+    switch (choice) {
+    case 0: // Military training
+        Logger::info("The army's training level increases!");
+        kingdom.getArmy()->setTrainingLevel(
+            kingdom.getArmy()->getTrainingLevel() + 1 + (tacticalSkill / 20)
+        );
+        break;
+    case 1: // Morale boost
+        Logger::info("Troop morale is significantly improved!");
+        kingdom.getArmy()->setMorale(
+            min(1.0, kingdom.getArmy()->getMorale() + 0.2 + (charisma * 0.01))
+        );
+        break;
+    }
 }
 
-shared_ptr<Wood> Market::getWood() const {
-    return wood;
+void Commander::applyEffects(Kingdom& kingdom) {
+    // Commander's passive effects
+
+    // Tactical skill affects army strength
+    double armyStrengthBonus = tacticalSkill * 0.02;
+    double currentMorale = kingdom.getArmy()->getMorale();
+    kingdom.getArmy()->setMorale(min(1.0, currentMorale + armyStrengthBonus * 0.1));
+
+    // Loyalty affects chance of rebellion
+    if (loyalty < 30 && CounterRng::draw(CounterRng::STREAM_LEADER, 100) < (30 - loyalty)) {
+        Logger::warning("\nWARNING: Commander {} is plotting against you!", getName());
+        // Potentially trigger rebellion event
+    }
 }
 
-shared_ptr<Stone> Market::getStone() const {
-    return stone;
+// GuildLeader implementation
+static const StringTable::Handle merchantsGuild = StringTable::intern("Merchants");
+static const StringTable::Handle craftsmenGuild = StringTable::intern("Craftsmen");
+static const StringTable::Handle farmersGuild = StringTable::intern("Farmers");
+
+GuildLeader::GuildLeader(const string& name, int charisma, int intelligence, int strength,
+    const string& guildType, int businessAcumen)
+    : Leader(name, charisma, intelligence, strength), guildTypeHandle(StringTable::intern(guildType)),
+      businessAcumen(businessAcumen) {
 }
 
-shared_ptr<Iron> Market::getIron() const {
-    return iron;
+GuildLeader::~GuildLeader() {}
+
+const string& GuildLeader::getGuildType() const {
+    return StringTable::lookup(guildTypeHandle);
 }
 
-void Market::updatePrices(const Economy& economy) {
-    // Update resource prices based on economy and random fluctuations
-    double inflationFactor = 1.0 + economy.getInflation();
+StringTable::Handle GuildLeader::getGuildTypeHandle() const {
+    return guildTypeHandle;
+}
 
-    // Apply inflation to base values
-    food->setValue(1.0 * inflationFactor * (1.0 + ((rand() % 20) - 10) * 0.01));
-    wood->setValue(2.0 * inflationFactor * (1.0 + ((rand() % 20) - 10) * 0.01));
-    stone->setValue(3.0 * inflationFactor * (1.0 + ((rand() % 20) - 10) * 0.01));
-    iron->setValue(5.0 * inflationFactor * (1.0 + ((rand() % 20) - 10) * 0.01));
+int GuildLeader::getBusinessAcumen() const {
+    return businessAcumen;
 }
 
-bool Market::buyResource(const string& resourceType, int amount, Economy& economy) {
-    // Buy resources from the market
-    int cost = 0;
-    shared_ptr<Resource> resource = nullptr;
+void GuildLeader::specialAction(Kingdom& kingdom) {
+    // Guild leader's special action: economic boost or trade deals
+    Logger::info("\nGuild Leader {} of the {} Guild initiates a special project!", getName(), getGuildType());
 
-    if (resourceType == "Food") {
-        cost = static_cast<int>(amount * food->getValue());
-        resource = food;
+    if (guildTypeHandle == merchantsGuild) {
+        Logger::info("New trade deals bring increased tax revenue!");
+        kingdom.getEconomy()->setTreasuryGold(
+            kingdom.getEconomy()->getTreasuryGold() + 100 + (businessAcumen * 5)
+        );
     }
-    else if (resourceType == "Wood") {
-        cost = static_cast<int>(amount * wood->getValue());
-        resource = wood;
+    else if (guildTypeHandle == craftsmenGuild) {
+        Logger::info("Improved crafting techniques boost resource production!");
+        kingdom.getMarket()->getWood()->changeAmount(50 + (businessAcumen * 2));
+        kingdom.getMarket()->getIron()->changeAmount(20 + (businessAcumen * 1));
     }
-    else if (resourceType == "Stone") {
-        cost = static_cast<int>(amount * stone->getValue());
-        resource = stone;
+    else if (guildTypeHandle == farmersGuild) {
+        Logger::info("Agricultural innovations increase food stocks!");
+        kingdom.getMarket()->getFood()->changeAmount(100 + (businessAcumen * 5));
     }
-    else if (resourceType == "Iron") {
-        cost = static_cast<int>(amount * iron->getValue());
-        resource = iron;
+}
+
+void GuildLeader::applyEffects(Kingdom& kingdom) {
+    // Guild leader's passive effects
+
+    // Business acumen affects economy
+    double economyBonus = businessAcumen * 0.02;
+    kingdom.getEconomy()->setInflation(
+        max(0.01, kingdom.getEconomy()->getInflation() - economyBonus * 0.01)
+    );
+
+    // Guild type specific effects
+    if (guildTypeHandle == merchantsGuild) {
+        // Merchants boost trade income
+        int merchantCount = kingdom.getPopulation()->getMerchants();
+        int bonusGold = Headroom::narrow(static_cast<long long>(merchantCount) * businessAcumen / 100);
+        kingdom.getEconomy()->setTreasuryGold(
+            Headroom::narrow(static_cast<long long>(kingdom.getEconomy()->getTreasuryGold()) + bonusGold)
+        );
     }
-    else {
-        return false;
+    else if (guildTypeHandle == craftsmenGuild) {
+        // Craftsmen improve resource efficiency
+        // Implementation would adjust resource production rates
     }
-
-    // Check if the kingdom can afford it
-    if (economy.getTreasuryGold() >= cost) {
-        economy.setTreasuryGold(economy.getTreasuryGold() - cost);
-        resource->changeAmount(amount);
-        return true;
+    else if (guildTypeHandle == farmersGuild) {
+        // Farmers improve food production
+        kingdom.getMarket()->getFood()->changeAmount((businessAcumen / 10) + 5);
     }
-
-    return false;
 }
 
-bool Market::sellResource(const string& resourceType, int amount, Economy& economy) {
-    // Sell resources to the market
-    int revenue = 0;
-    shared_ptr<Resource> resource = nullptr;
+// ----------------------
+// Dynasty implementation
+// ----------------------
 
-    if (resourceType == "Food") {
-        if (food->getAmount() < amount) return false;
-        revenue = static_cast<int>(amount * food->getValue() * 0.9); // 10% market fee
-        resource = food;
+static const char* const houseNameTable[] = {
+    "Ashford", "Blackmoor", "Crane", "Dunmore", "Everhart", "Fairholt", "Greystone", "Harrow",
+    "Ironwood", "Kestrel", "Lockwood", "Marrow", "Northcott", "Ravenscar", "Stormhold", "Thornbury"
+};
+static const int HOUSE_NAME_COUNT = sizeof(houseNameTable) / sizeof(houseNameTable[0]);
+
+static const char* const givenNameTable[] = {
+    "Aldric", "Beatrix", "Cedric", "Daria", "Edmund", "Freya", "Godfrey", "Helena",
+    "Ingram", "Juliana", "Konrad", "Lysande", "Matthias", "Nerys", "Osric", "Philippa",
+    "Quentin", "Rowena", "Sigmund", "Theda", "Ulric", "Viviane", "Walter", "Ysolde",
+    "Alaric", "Brunhild", "Casimir", "Edith", "Leofric", "Matilda", "Roland", "Sybil"
+};
+static const int GIVEN_NAME_COUNT = sizeof(givenNameTable) / sizeof(givenNameTable[0]);
+
+Dynasty::Dynasty()
+    : ruler(NO_NOBLE), livingCount(0), capacity(0), lastYear(0) {
+}
+
+Dynasty::~Dynasty() {}
+
+void Dynasty::clear() {
+    parent.clear();
+    firstChild.clear();
+    nextSibling.clear();
+    birthYear.clear();
+    house.clear();
+    lifespan.clear();
+    charisma.clear();
+    intelligence.clear();
+    strength.clear();
+    legitimacy.clear();
+    givenName.clear();
+    alive.clear();
+    score.clear();
+    heapPosition.clear();
+    freeRows.clear();
+    candidates.clear();
+    deaths.clear();
+    comingOfAge.clear();
+    houseNames.clear();
+    ruler = NO_NOBLE;
+    livingCount = 0;
+    capacity = 0;
+    lastYear = 0;
+}
+
+void Dynasty::found(int houseCount, int noblesPerHouse, int year) {
+    houseCount = max(1, min(0xFFFF, houseCount));
+    noblesPerHouse = max(1, noblesPerHouse);
+    int offset = CounterRng::draw(CounterRng::STREAM_DYNASTY, HOUSE_NAME_COUNT);
+    for (int h = 0; h < houseCount; h++) {
+        string name = houseNameTable[(offset + h) % HOUSE_NAME_COUNT];
+        if (h >= HOUSE_NAME_COUNT) {
+            name += " " + to_string(h / HOUSE_NAME_COUNT + 1);
+        }
+        int houseId = static_cast<int>(houseNames.size());
+        houseNames.push_back(StringTable::intern(name));
+
+        // Each member descends from an earlier one, so the house grows as a tree
+        vector<uint32_t> members;
+        members.push_back(addNoble(NO_NOBLE, houseId, year - 40 - CounterRng::draw(CounterRng::STREAM_DYNASTY, 30), year));
+        for (int m = 1; m < noblesPerHouse; m++) {
+            uint32_t parentRow = members[CounterRng::draw(CounterRng::STREAM_DYNASTY, static_cast<int>(members.size()))];
+            if (birthYear[parentRow] > year - 18) {
+                parentRow = members[0];
+            }
+            int born = min(year, birthYear[parentRow] + 18 + CounterRng::draw(CounterRng::STREAM_DYNASTY, 18));
+            members.push_back(addNoble(parentRow, houseId, born, year));
+        }
     }
-    else if (resourceType == "Wood") {
-        if (wood->getAmount() < amount) return false;
-        revenue = static_cast<int>(amount * wood->getValue() * 0.9);
-        resource = wood;
+    capacity = max(capacity, 2 * livingCount);
+    lastYear = year;
+}
+
+uint32_t Dynasty::addNoble(uint32_t parentRow, int houseId, int born, int year) {
+    uint32_t row;
+    if (!freeRows.empty()) {
+        row = freeRows.back();
+        freeRows.pop_back();
     }
-    else if (resourceType == "Stone") {
-        if (stone->getAmount() < amount) return false;
-        revenue = static_cast<int>(amount * stone->getValue() * 0.9);
-        resource = stone;
+    else {
+        row = static_cast<uint32_t>(parent.size());
+        parent.push_back(NO_NOBLE);
+        firstChild.push_back(NO_NOBLE);
+        nextSibling.push_back(NO_NOBLE);
+        birthYear.push_back(0);
+        house.push_back(0);
+        lifespan.push_back(0);
+        charisma.push_back(0);
+        intelligence.push_back(0);
+        strength.push_back(0);
+        legitimacy.push_back(0);
+        givenName.push_back(0);
+        alive.push_back(0);
+        score.push_back(0.0f);
+        heapPosition.push_back(NO_NOBLE);
     }
-    else if (resourceType == "Iron") {
-        if (iron->getAmount() < amount) return false;
-        revenue = static_cast<int>(amount * iron->getValue() * 0.9);
-        resource = iron;
+
+    parent[row] = parentRow;
+    firstChild[row] = NO_NOBLE;
+    nextSibling[row] = NO_NOBLE;
+    if (parentRow != NO_NOBLE) {
+        nextSibling[row] = firstChild[parentRow];
+        firstChild[parentRow] = row;
+    }
+    birthYear[row] = born;
+    house[row] = static_cast<uint16_t>(houseId);
+
+    // Founders' traits are drawn; a child lands halfway between a parent and the draw
+    uint8_t* traits[3] = { &charisma[row], &intelligence[row], &strength[row] };
+    const vector<uint8_t>* parentTraits[3] = { &charisma, &intelligence, &strength };
+    for (int t = 0; t < 3; t++) {
+        int drawn = 20 + CounterRng::draw(CounterRng::STREAM_DYNASTY, 71);
+        *traits[t] = static_cast<uint8_t>(parentRow == NO_NOBLE ? drawn : ((*parentTraits[t])[parentRow] + drawn) / 2);
+    }
+    legitimacy[row] = static_cast<uint8_t>(parentRow == NO_NOBLE ? 10 + CounterRng::draw(CounterRng::STREAM_DYNASTY, 11) :
+        legitimacy[parentRow] / 2);
+    givenName[row] = static_cast<uint8_t>(CounterRng::draw(CounterRng::STREAM_DYNASTY, GIVEN_NAME_COUNT));
+    alive[row] = 1;
+    heapPosition[row] = NO_NOBLE;
+    score[row] = 0.35f * charisma[row] + 0.35f * intelligence[row] + 0.3f * strength[row] + legitimacy[row];
+    livingCount++;
+
+    // Founding members always outlive the founding year
+    int age = year - born;
+    lifespan[row] = static_cast<uint8_t>(min(255, max(age + 1 + CounterRng::draw(CounterRng::STREAM_DYNASTY, 10),
+        45 + CounterRng::draw(CounterRng::STREAM_DYNASTY, 40))));
+    deaths.push_back(YearEntry(born + lifespan[row], row));
+    push_heap(deaths.begin(), deaths.end(), greater<YearEntry>());
+    if (age >= AGE_OF_MAJORITY) {
+        pushCandidate(row);
     }
     else {
-        return false;
+        comingOfAge.push_back(YearEntry(born + AGE_OF_MAJORITY, row));
+        push_heap(comingOfAge.begin(), comingOfAge.end(), greater<YearEntry>());
     }
-
-    // Complete the transaction
-    resource->changeAmount(-amount);
-    economy.setTreasuryGold(economy.getTreasuryGold() + revenue);
-    return true;
-}
-
-void Market::produceResources(const Population& population) {
-    // Calculate resource production based on population
-    int peasantProduction = population.getPeasants() / 5;
-    int merchantProduction = population.getMerchants() / 2;
-
-    // Food production (mainly from peasants)
-    food->changeAmount(peasantProduction * 2);
-
-    // Wood production
-    wood->changeAmount(peasantProduction);
-
-    // Stone production
-    stone->changeAmount(peasantProduction / 2);
-
-    // Iron production (less common)
-    iron->changeAmount(peasantProduction / 4);
-
-    // Gold from merchant activity
-    gold->changeAmount(merchantProduction * 2);
-}
-
-void Market::consumeResources(const Population& population, const Army& army) {
-    // Calculate resource consumption
-    int totalPopulation = population.getTotal();
-    int totalArmy = army.getTotal();
-
-    // Food consumption
-    int foodConsumption = totalPopulation + (totalArmy * 2); // Army eats more
-    food->changeAmount(-min(food->getAmount(), foodConsumption));
-
-    // Wood consumption (for heating, building, etc.)
-    int woodConsumption = totalPopulation / 10;
-    wood->changeAmount(-min(wood->getAmount(), woodConsumption));
-
-    // Iron consumption (for tools, weapons)
-    int ironConsumption = totalPopulation / 50 + totalArmy / 20;
-    iron->changeAmount(-min(iron->getAmount(), ironConsumption));
-}
-
-// ------------------------
-// Diplomacy implementation
-// ------------------------
-
-Diplomacy::Diplomacy(int maxForeignKingdoms)
-    : maxKingdoms(maxForeignKingdoms), kingdomCount(0) {
-
-    foreignKingdoms = new Kingdom[maxKingdoms];
-
-    // Initialize with some default kingdoms
-    addKingdom("Northlands", 500 + rand() % 500);
-    addKingdom("Eastern Empire", 600 + rand() % 600);
-    addKingdom("Southern Realms", 400 + rand() % 400);
-}
-
-Diplomacy::~Diplomacy() {
-    delete[] foreignKingdoms;
+    return row;
 }
 
-void Diplomacy::addKingdom(const string& name, int strength) {
-    if (kingdomCount < maxKingdoms) {
-        foreignKingdoms[kingdomCount].name = name;
-        foreignKingdoms[kingdomCount].relationLevel = 0; // Neutral
-        foreignKingdoms[kingdomCount].isAlly = false;
-        foreignKingdoms[kingdomCount].atWar = false;
-        foreignKingdoms[kingdomCount].strength = strength;
-        kingdomCount++;
+void Dynasty::die(uint32_t row) {
+    alive[row] = 0;
+    livingCount--;
+    if (heapPosition[row] != NO_NOBLE) {
+        removeCandidate(row);
     }
+    release(row);
 }
 
-bool Diplomacy::improveRelations(const string& kingdomName, Economy& economy) {
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            // Lower cost and increase relation impact
-            int cost = 20 + (foreignKingdoms[i].relationLevel * 5); // Reduced cost
-
-            if (economy.getTreasuryGold() >= cost) {
-                economy.setTreasuryGold(economy.getTreasuryGold() - cost);
-                foreignKingdoms[i].relationLevel = min(10, foreignKingdoms[i].relationLevel + 2); // +2 instead of +1
-                cout << "Spent " << cost << " gold to improve relations!" << endl;
-                return true;
-            }
-            else {
-                cout << "Not enough gold! Need " << cost << " gold." << endl;
-                return false;
+void Dynasty::release(uint32_t row) {
+    // A dead noble stays in the tree while a child still points to them
+    while (row != NO_NOBLE && !alive[row] && firstChild[row] == NO_NOBLE) {
+        uint32_t up = parent[row];
+        if (up != NO_NOBLE) {
+            uint32_t* link = &firstChild[up];
+            while (*link != row) {
+                link = &nextSibling[*link];
             }
+            *link = nextSibling[row];
         }
+        parent[row] = NO_NOBLE;
+        freeRows.push_back(row);
+        row = up;
     }
-    cout << "Kingdom '" << kingdomName << "' not found!" << endl;
-    return false;
 }
 
-bool Diplomacy::declareWar(const string& kingdomName, Army& army) {
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            if (!foreignKingdoms[i].atWar) {
-                foreignKingdoms[i].atWar = true;
-                foreignKingdoms[i].isAlly = false;
-                foreignKingdoms[i].relationLevel = max(-10, foreignKingdoms[i].relationLevel - 5); // More significant drop
-                army.setWarStatus(true);
-                cout << "Your army mobilizes for war!" << endl;
-                return true;
-            }
-            cout << "Already at war with " << kingdomName << "!" << endl;
-            return false;
-        }
+void Dynasty::rescore(uint32_t row) {
+    score[row] = 0.35f * charisma[row] + 0.35f * intelligence[row] + 0.3f * strength[row] + legitimacy[row];
+    if (heapPosition[row] != NO_NOBLE) {
+        siftUp(heapPosition[row]);
+        siftDown(heapPosition[row]);
     }
-    cout << "Kingdom '" << kingdomName << "' not found!" << endl;
-    return false;
 }
 
-bool Diplomacy::signPeace(const string& kingdomName, Economy& economy) {
-    // Find the kingdom
-    Army army;
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            if (foreignKingdoms[i].atWar) {
-                // Peace treaties often require reparations
-                int cost = 200 + (foreignKingdoms[i].strength / 10);
-
-                if (economy.getTreasuryGold() >= cost) {
-                    economy.setTreasuryGold(economy.getTreasuryGold() - cost);
-                    foreignKingdoms[i].atWar = false;
-                    foreignKingdoms[i].relationLevel = 0; // Reset to neutral
-
-                    // Check if still at war with any kingdom
-                    bool stillAtWar = false;
-                    for (int j = 0; j < kingdomCount; j++) {
-                        if (foreignKingdoms[j].atWar) {
-                            stillAtWar = true;
-                            break;
-                        }
-                    }
-
-                    // Update army war status if no longer at war with anyone
-                    if (!stillAtWar) {
-                        army.setWarStatus(false);
-                    }
-
-                    return true;
-                }
-                else {
-                    return false; // Not enough gold
-                }
-            }
-            return false; // Not at war
+void Dynasty::siftUp(uint32_t position) {
+    uint32_t row = candidates[position];
+    while (position > 0) {
+        uint32_t above = (position - 1) / 2;
+        if (score[candidates[above]] >= score[row]) {
+            break;
         }
+        candidates[position] = candidates[above];
+        heapPosition[candidates[position]] = position;
+        position = above;
     }
-    return false; // Kingdom not found
+    candidates[position] = row;
+    heapPosition[row] = position;
 }
 
-bool Diplomacy::formAlliance(const string& kingdomName) {
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            if (!foreignKingdoms[i].atWar && foreignKingdoms[i].relationLevel >= 5) { // Lowered from 7
-                foreignKingdoms[i].isAlly = true;
-                foreignKingdoms[i].relationLevel = min(10, foreignKingdoms[i].relationLevel + 1); // Bonus relation
-                cout << kingdomName << " is now your ally!" << endl;
-                return true;
-            }
-            cout << "Cannot ally! Relations too low (need 5+) or at war." << endl;
-            return false;
+void Dynasty::siftDown(uint32_t position) {
+    const uint32_t count = static_cast<uint32_t>(candidates.size());
+    uint32_t row = candidates[position];
+    while (true) {
+        uint32_t best = 2 * position + 1;
+        if (best >= count) {
+            break;
         }
-    }
-    cout << "Kingdom '" << kingdomName << "' not found!" << endl;
-    return false;
-}
-
-bool Diplomacy::establishTrade(const string& kingdomName, Market& market, Economy& economy) {
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            if (!foreignKingdoms[i].atWar && foreignKingdoms[i].relationLevel >= 2) { // Lowered from 3
-                // Increase trade benefits
-                market.getFood()->changeAmount(100 + (foreignKingdoms[i].relationLevel * 20));
-                market.getWood()->changeAmount(50 + (foreignKingdoms[i].relationLevel * 10));
-                market.getIron()->changeAmount(30 + (foreignKingdoms[i].relationLevel * 5));
-                economy.setTreasuryGold(economy.getTreasuryGold() + 200 + (foreignKingdoms[i].relationLevel * 50));
-                cout << "Trade deal boosts resources and treasury!" << endl;
-                return true;
-            }
-            cout << "Cannot trade! Relations too low (need 2+) or at war." << endl;
-            return false;
+        if (best + 1 < count && score[candidates[best + 1]] > score[candidates[best]]) {
+            best++;
+        }
+        if (score[candidates[best]] <= score[row]) {
+            break;
         }
+        candidates[position] = candidates[best];
+        heapPosition[candidates[position]] = position;
+        position = best;
     }
-    cout << "Kingdom '" << kingdomName << "' not found!" << endl;
-    return false;
+    candidates[position] = row;
+    heapPosition[row] = position;
 }
 
-void Diplomacy::updateDiplomacy(const Army& army, const Economy& economy) {
-    // Update relations with foreign kingdoms based on various factors
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].atWar) {
-            // War affects relations
-            foreignKingdoms[i].relationLevel = max(-10, foreignKingdoms[i].relationLevel - 1);
-
-            // Simulate war outcomes
-            int playerStrength = army.calculateStrength();
-            int enemyStrength = foreignKingdoms[i].strength;
+void Dynasty::pushCandidate(uint32_t row) {
+    candidates.push_back(row);
+    siftUp(static_cast<uint32_t>(candidates.size()) - 1);
+}
 
-            // Random battle outcomes
-            if (rand() % 100 < 20) { // 20% chance of a significant battle
-                if (playerStrength > enemyStrength) {
-                    // Player victory
-                    cout << "Your forces defeat " << foreignKingdoms[i].name << " in battle!" << endl;
-                    foreignKingdoms[i].strength = max(100, foreignKingdoms[i].strength - (playerStrength / 10));
-                }
-                else {
-                    // Enemy victory
-                    cout << "Your forces suffer defeat against " << foreignKingdoms[i].name << "!" << endl;
-                    // Some army losses would be calculated here
-                }
-            }
-        }
-        else {
-            // Natural relation drift
-            int drift = (rand() % 3) - 1; // -1, 0, or 1
-            foreignKingdoms[i].relationLevel = max(-10, min(10, foreignKingdoms[i].relationLevel + drift));
-        }
+void Dynasty::removeCandidate(uint32_t row) {
+    uint32_t position = heapPosition[row];
+    uint32_t last = candidates.back();
+    candidates.pop_back();
+    heapPosition[row] = NO_NOBLE;
+    if (last != row) {
+        candidates[position] = last;
+        heapPosition[last] = position;
+        siftUp(position);
+        siftDown(heapPosition[last]);
     }
 }
 
-void Diplomacy::listKingdoms() const {
-    // Display information about all foreign kingdoms
-    cout << "\n===== Foreign Kingdoms =====" << endl;
-    for (int i = 0; i < kingdomCount; i++) {
-        cout << i + 1 << ". " << foreignKingdoms[i].name << ":" << endl;
-        cout << "   Relation: ";
-
-        if (foreignKingdoms[i].relationLevel >= 7) {
-            cout << "Friendly";
-        }
-        else if (foreignKingdoms[i].relationLevel >= 3) {
-            cout << "Cordial";
-        }
-        else if (foreignKingdoms[i].relationLevel >= 0) {
-            cout << "Neutral";
-        }
-        else if (foreignKingdoms[i].relationLevel >= -3) {
-            cout << "Suspicious";
+bool Dynasty::advanceYear(int year) {
+    lastYear = year;
+    bool rulerDied = false;
+    while (!deaths.empty() && deaths.front().first <= year) {
+        pop_heap(deaths.begin(), deaths.end(), greater<YearEntry>());
+        YearEntry entry = deaths.back();
+        deaths.pop_back();
+        uint32_t row = entry.second;
+        // Rows are reused, so the entry must still describe the noble living there
+        if (!alive[row] || birthYear[row] + lifespan[row] != entry.first) {
+            continue;
         }
-        else {
-            cout << "Hostile";
+        if (row == ruler) {
+            ruler = NO_NOBLE;
+            rulerDied = true;
         }
+        die(row);
+    }
 
-        cout << " (" << foreignKingdoms[i].relationLevel << ")" << endl;
-
-        cout << "   Status: ";
-        if (foreignKingdoms[i].atWar) {
-            cout << "At War";
-        }
-        else if (foreignKingdoms[i].isAlly) {
-            cout << "Allied";
-        }
-        else {
-            cout << "Peaceful";
+    while (!comingOfAge.empty() && comingOfAge.front().first <= year) {
+        pop_heap(comingOfAge.begin(), comingOfAge.end(), greater<YearEntry>());
+        YearEntry entry = comingOfAge.back();
+        comingOfAge.pop_back();
+        uint32_t row = entry.second;
+        if (alive[row] && birthYear[row] + AGE_OF_MAJORITY == entry.first && heapPosition[row] == NO_NOBLE &&
+            row != ruler) {
+            pushCandidate(row);
         }
+    }
 
-        cout << endl;
-        cout << "   Military Strength: " << foreignKingdoms[i].strength << endl;
+    // About one birth a year per forty nobles, to parents picked from the adults
+    int births = livingCount / 40 + (CounterRng::draw(CounterRng::STREAM_DYNASTY, 40) < livingCount % 40 ? 1 : 0);
+    for (int b = 0; b < births && livingCount < capacity && !candidates.empty(); b++) {
+        uint32_t parentRow = candidates[CounterRng::draw(CounterRng::STREAM_DYNASTY, static_cast<int>(candidates.size()))];
+        addNoble(parentRow, house[parentRow], year, year);
     }
+    return rulerDied;
 }
 
-int Diplomacy::getRelationLevel(const string& kingdomName) const {
-    // Get relation level with a specific kingdom
-    for (int i = 0; i < kingdomCount; i++) {
-        if (foreignKingdoms[i].name == kingdomName) {
-            return foreignKingdoms[i].relationLevel;
+uint32_t Dynasty::crownSuccessor() {
+    if (candidates.empty()) {
+        return NO_NOBLE;
+    }
+    uint32_t heir = candidates[0];
+    removeCandidate(heir);
+    ruler = heir;
+
+    // The new ruler's children move up the line of succession
+    for (uint32_t child = firstChild[heir]; child != NO_NOBLE; child = nextSibling[child]) {
+        if (alive[child] && legitimacy[child] < 40) {
+            legitimacy[child] = 40;
+            rescore(child);
         }
     }
-    return 0; // Kingdom not found, return neutral
+    return heir;
 }
 
-// ------------------
-// Bank implementation
-// ------------------
-
-Bank::Bank(double initialInterestRate, int initialMaxLoan)
-    : interestRate(initialInterestRate), maxLoanAmount(initialMaxLoan),
-    currentLoans(0), corruptionLevel(0) {
+void Dynasty::clearRuler() {
+    ruler = NO_NOBLE;
 }
 
-Bank::~Bank() {}
+unique_ptr<Leader> Dynasty::makeLeader(uint32_t noble) const {
+    string name = getNobleName(noble);
+    int c = charisma[noble];
+    int i = intelligence[noble];
+    int s = strength[noble];
+    if (s >= c && s >= i) {
+        return make_unique<Commander>(name, c, i, s, (s + i) / 2);
+    }
+    if (i > c) {
+        return make_unique<GuildLeader>(name, c, i, s, "Merchants", i);
+    }
+    return make_unique<King>(name, c, i, s, legitimacy[noble]);
+}
 
-double Bank::getInterestRate() const {
-    return interestRate;
+string Dynasty::getNobleName(uint32_t noble) const {
+    if (noble >= parent.size()) {
+        return "";
+    }
+    return string(givenNameTable[givenName[noble]]) + " of House " + StringTable::lookup(houseNames[house[noble]]);
 }
 
-int Bank::getMaxLoanAmount() const {
-    return maxLoanAmount;
+uint32_t Dynasty::getParent(uint32_t noble) const {
+    return noble < parent.size() ? parent[noble] : NO_NOBLE;
 }
 
-int Bank::getCurrentLoans() const {
-    return currentLoans;
+int Dynasty::getBirthYear(uint32_t noble) const {
+    return noble < birthYear.size() ? birthYear[noble] : 0;
 }
 
-int Bank::getCorruptionLevel() const {
-    return corruptionLevel;
+double Dynasty::getScore(uint32_t noble) const {
+    return noble < score.size() ? score[noble] : 0.0;
 }
 
-void Bank::setInterestRate(double rate) {
-    interestRate = max(0.01, min(0.2, rate));
+bool Dynasty::isCandidate(uint32_t noble) const {
+    return noble < heapPosition.size() && heapPosition[noble] != NO_NOBLE;
 }
 
-void Bank::setMaxLoanAmount(int amount) {
-    maxLoanAmount = max(100, amount);
+uint32_t Dynasty::getBestCandidate() const {
+    return candidates.empty() ? NO_NOBLE : candidates[0];
 }
 
-void Bank::setCorruptionLevel(int level) {
-    corruptionLevel = max(0, min(100, level));
+uint32_t Dynasty::getRuler() const {
+    return ruler;
 }
 
-bool Bank::takeLoan(int amount, Economy& economy) {
-    // Take a loan from the bank
-    if (amount <= 0 || amount > maxLoanAmount) {
-        return false;
-    }
+int Dynasty::getLivingCount() const {
+    return livingCount;
+}
 
-    // Add loan to debt
-    economy.setDebt(economy.getDebt() + amount);
+int Dynasty::getCandidateCount() const {
+    return static_cast<int>(candidates.size());
+}
 
-    // Add money to treasury
-    economy.setTreasuryGold(economy.getTreasuryGold() + amount);
+int Dynasty::getHouseCount() const {
+    return static_cast<int>(houseNames.size());
+}
 
-    // Track loan amount
-    currentLoans += amount;
+size_t Dynasty::getRowCount() const {
+    return parent.size();
+}
 
-    return true;
+size_t Dynasty::memoryUsage() const {
+    size_t bytes = (parent.capacity() + firstChild.capacity() + nextSibling.capacity() + heapPosition.capacity() +
+        freeRows.capacity() + candidates.capacity()) * sizeof(uint32_t);
+    bytes += birthYear.capacity() * sizeof(int32_t) + house.capacity() * sizeof(uint16_t) + score.capacity() * sizeof(float);
+    bytes += lifespan.capacity() + charisma.capacity() + intelligence.capacity() + strength.capacity() +
+        legitimacy.capacity() + givenName.capacity() + alive.capacity();
+    bytes += (deaths.capacity() + comingOfAge.capacity()) * sizeof(YearEntry);
+    bytes += houseNames.capacity() * sizeof(StringTable::Handle);
+    return bytes;
 }
 
-bool Bank::repayLoan(int amount, Economy& economy) {
-    // Repay a loan to the bank
-    if (amount <= 0 || amount > economy.getTreasuryGold() || amount > economy.getDebt()) {
-        return false;
-    }
+// ---------------------------
+// CitizenAgents implementation
+// ---------------------------
 
-    // Deduct payment from treasury
-    economy.setTreasuryGold(economy.getTreasuryGold() - amount);
+CitizenAgents::CitizenAgents()
+    : averageHappiness(0.5), discontentShare(0.0) {
+    classCounts[PEASANT] = 0;
+    classCounts[MERCHANT] = 0;
+    classCounts[NOBLE] = 0;
+}
 
-    // Reduce debt
-    economy.setDebt(economy.getDebt() - amount);
+CitizenAgents::~CitizenAgents() {}
 
-    // Track loan repayment
-    currentLoans -= amount;
-    if (currentLoans < 0) currentLoans = 0;
+int CitizenAgents::getCount() const {
+    return static_cast<int>(socialClass.size());
+}
 
-    return true;
+int CitizenAgents::getClassCount(int socialClassId) const {
+    if (socialClassId < PEASANT || socialClassId > NOBLE) {
+        return 0;
+    }
+    return classCounts[socialClassId];
 }
 
-void Bank::updateInterest(Economy& economy) {
-    // Apply interest to outstanding debt
-    int interest = static_cast<int>(economy.getDebt() * interestRate);
-    economy.setDebt(economy.getDebt() + interest);
+double CitizenAgents::getAverageHappiness() const {
+    return averageHappiness;
 }
 
-void Bank::attemptCorruption(Economy& economy, Population& population) {
-    // Simulate corruption in the banking system
-    if (corruptionLevel > 0) {
-        // Chance of corruption scandal
-        if (rand() % 100 < corruptionLevel) {
-            int corruptionAmount = (economy.getTreasuryGold() * corruptionLevel) / 1000;
-            economy.setTreasuryGold(economy.getTreasuryGold() - corruptionAmount);
+double CitizenAgents::getDiscontentShare() const {
+    return discontentShare;
+}
 
-            cout << "A corruption scandal has cost the treasury " << corruptionAmount << " gold!" << endl;
+size_t CitizenAgents::memoryUsage() const {
+    return socialClass.capacity() + (wealth.capacity() + loyalty.capacity() + happiness.capacity()) * sizeof(float);
+}
 
-            // Corruption affects population happiness
-            double happinessImpact = -0.05 - (static_cast<double>(corruptionLevel) / 1000.0);
-            population.setHappiness(population.getHappiness() + happinessImpact);
+void CitizenAgents::addAgents(int socialClassId, int count, double initialHappiness) {
+    // Starting wealth is spread around each class's yearly steady state
+    static const float baseWealth[3] = { 18.0f, 85.0f, 400.0f };
+    if (count <= 0) {
+        return;
+    }
+
+    size_t first = socialClass.size();
+    size_t total = first + count;
+    socialClass.resize(total, static_cast<uint8_t>(socialClassId));
+    wealth.resize(total);
+    loyalty.resize(total);
+    happiness.resize(total, static_cast<float>(initialHappiness));
+
+    // Two draws per agent, all from one generator of the keyed stream
+    CounterRng rng = CounterRng::drawMany(CounterRng::STREAM_AGENTS, 2u * static_cast<uint32_t>(count));
+    float* __restrict w = wealth.data() + first;
+    float* __restrict l = loyalty.data() + first;
+    for (int i = 0; i < count; i++) {
+        w[i] = baseWealth[socialClassId] * (0.5f + rng.below(100) * 0.01f);
+        l[i] = 0.4f + rng.below(40) * 0.01f;
+    }
+    classCounts[socialClassId] += count;
+}
+
+void CitizenAgents::removeAgents(const int excess[3]) {
+    // Swap-remove from the back; agent order carries no meaning
+    int remaining[3] = { excess[0], excess[1], excess[2] };
+    int n = getCount();
+
+    for (int i = n - 1; i >= 0 && (remaining[0] + remaining[1] + remaining[2]) > 0; i--) {
+        int cls = socialClass[i];
+        if (remaining[cls] > 0) {
+            n--;
+            socialClass[i] = socialClass[n];
+            wealth[i] = wealth[n];
+            loyalty[i] = loyalty[n];
+            happiness[i] = happiness[n];
+            remaining[cls]--;
+            classCounts[cls]--;
         }
     }
+
+    socialClass.resize(n);
+    wealth.resize(n);
+    loyalty.resize(n);
+    happiness.resize(n);
 }
 
-// ---------------------------
-// RandomEvents implementation
-// ---------------------------
+void CitizenAgents::syncCounts(int peasants, int merchants, int nobles, double initialHappiness) {
+    const int target[3] = { peasants, merchants, nobles };
+    int excess[3] = { 0, 0, 0 };
+    bool shrink = false;
 
-RandomEvents::RandomEvents(int chance)
-    : eventChance(chance), lastEventTime(time(0)) {
-}
+    for (int c = PEASANT; c <= NOBLE; c++) {
+        if (classCounts[c] > target[c]) {
+            excess[c] = classCounts[c] - target[c];
+            shrink = true;
+        }
+    }
+    if (shrink) {
+        removeAgents(excess);
+    }
 
-RandomEvents::~RandomEvents() {}
+    // Exact room the first time; after that half again, so yearly growth does not copy
+    // every column every year
+    size_t total = static_cast<size_t>(peasants) + merchants + nobles;
+    if (total > socialClass.capacity()) {
+        size_t room = max(total, socialClass.capacity() + socialClass.capacity() / 2);
+        socialClass.reserve(room);
+        wealth.reserve(room);
+        loyalty.reserve(room);
+        happiness.reserve(room);
+    }
 
-bool RandomEvents::checkForEvent() {
-    // Check if a random event should occur
-    time_t currentTime = time(0);
-    if (difftime(currentTime, lastEventTime) > 5) { // At least 5 seconds since last event
-        if (rand() % 100 < eventChance) {
-            lastEventTime = currentTime;
-            return true;
+    for (int c = PEASANT; c <= NOBLE; c++) {
+        if (classCounts[c] < target[c]) {
+            addAgents(c, target[c] - classCounts[c], initialHappiness);
         }
     }
-    return false;
 }
 
-RandomEvents::EventType RandomEvents::generateEvent() const {
-    // Generate a random event
-    return static_cast<EventType>(rand() % 10); // 10 event types
+template <const Ruleset& rules>
+void CitizenAgents::applyTaxes(double peasantRate, double merchantRate, double nobleRate) {
+    // Agents earn their class income, pay their class rate and feel the burden
+    const float rateP = static_cast<float>(peasantRate);
+    const float rateM = static_cast<float>(merchantRate);
+    const float rateN = static_cast<float>(nobleRate);
+    const float incomeP = static_cast<float>(rules.peasantTaxYield);
+    const float incomeM = static_cast<float>(rules.merchantTaxYield);
+    const float incomeN = static_cast<float>(rules.nobleTaxYield);
+    const float burdenP = static_cast<float>(rules.peasantTaxWeight * rules.agentTaxBurden);
+    const float burdenM = static_cast<float>(rules.merchantTaxWeight * rules.agentTaxBurden);
+    const float burdenN = static_cast<float>(rules.nobleTaxWeight * rules.agentTaxBurden);
+    const float wealthMemory = static_cast<float>(rules.agentWealthMemory);
+    const float happinessMemory = static_cast<float>(rules.happinessMemory);
+    const float happinessPerTax = static_cast<float>(rules.happinessPerTax);
+    const uint8_t* __restrict cls = socialClass.data();
+    float* __restrict w = wealth.data();
+    float* __restrict h = happiness.data();
+    const int n = getCount();
+
+    for (int i = 0; i < n; i++) {
+        const bool isPeasant = cls[i] == PEASANT;
+        const bool isMerchant = cls[i] == MERCHANT;
+        const float rate = isPeasant ? rateP : (isMerchant ? rateM : rateN);
+        const float income = isPeasant ? incomeP : (isMerchant ? incomeM : incomeN);
+        const float burden = isPeasant ? burdenP : (isMerchant ? burdenM : burdenN);
+
+        w[i] = w[i] * wealthMemory + income * (1.0f - rate);
+        h[i] = h[i] * happinessMemory + happinessPerTax * (1.0f - rate * burden);
+    }
 }
 
-void RandomEvents::applyEvent(EventType event, Kingdom& kingdom) {
-    // Apply the effects of a random event
-    switch (event) {
-    case PLAGUE:
-        describePlagueEvent(kingdom);
-        break;
-    case GOOD_HARVEST:
-        describeGoodHarvestEvent(kingdom);
-        break;
-    case DROUGHT:
-        describeDroughtEvent(kingdom);
-        break;
-    case FOREIGN_INVASION:
-        describeForeignInvasionEvent(kingdom);
-        break;
-    case REBELLION:
-        describeRebellionEvent(kingdom);
-        break;
-    case ASSASSINATION:
-        describeAssassinationEvent(kingdom);
-        break;
-    case DISCOVERY:
-        describeDiscoveryEvent(kingdom);
-        break;
-    case FESTIVAL:
-        describeFestivalEvent(kingdom);
-        break;
-    case FIRE:
-        describeFireEvent(kingdom);
-        break;
-    case EARTHQUAKE:
-        describeEarthquakeEvent(kingdom);
-        break;
+void CitizenAgents::applyFood(double foodPerPerson) {
+    // Same thresholds as Food::applyEffects; poor agents suffer shortages most
+    float modifier = 0.0f;
+    if (foodPerPerson > 1.5) {
+        modifier = 0.1f;
+    }
+    else if (foodPerPerson > 1.0) {
+        modifier = 0.05f;
+    }
+    else if (foodPerPerson < 0.25) {
+        modifier = -0.4f;
+    }
+    else if (foodPerPerson < 0.5) {
+        modifier = -0.2f;
+    }
+
+    const float* __restrict w = wealth.data();
+    float* __restrict h = happiness.data();
+    const int n = getCount();
+
+    if (modifier >= 0.0f) {
+        for (int i = 0; i < n; i++) {
+            h[i] += modifier;
+        }
+    }
+    else {
+        for (int i = 0; i < n; i++) {
+            const float cushion = w[i] * 0.01f < 1.0f ? w[i] * 0.01f : 1.0f;
+            h[i] += modifier * (1.5f - cushion);
+        }
     }
 }
 
-void RandomEvents::describePlagueEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: PLAGUE =====" << endl;
-    cout << "A terrible plague sweeps through your kingdom!" << endl;
+template <const Ruleset& rules>
+void CitizenAgents::applyArmy(double armyPresence, double inflation, bool atWar) {
+    // Army presence and prices move happiness; loyalty follows happiness
+    const float boost = static_cast<float>(rules.happinessPerArmy * armyPresence +
+        rules.happinessPerInflation * (1.0 - inflation * rules.inflationUnhappiness));
+    const float warStrain = atWar ? static_cast<float>(rules.warLoyaltyLoss) : 0.0f;
+    const float loyaltyMemory = static_cast<float>(rules.loyaltyMemory);
+    const float loyaltyPerHappiness = static_cast<float>(rules.loyaltyPerHappiness);
+    float* __restrict h = happiness.data();
+    float* __restrict l = loyalty.data();
+    const int n = getCount();
+
+    for (int i = 0; i < n; i++) {
+        float hi = h[i] + boost;
+        hi = hi < 0.0f ? 0.0f : (hi > 1.0f ? 1.0f : hi);
+        float li = l[i] * loyaltyMemory + hi * loyaltyPerHappiness - warStrain;
+        li = li < 0.0f ? 0.0f : (li > 1.0f ? 1.0f : li);
+        h[i] = hi;
+        l[i] = li;
+    }
+}
+
+void CitizenAgents::shiftHappiness(double delta) {
+    const float d = static_cast<float>(delta);
+    float* __restrict h = happiness.data();
+    const int n = getCount();
+
+    for (int i = 0; i < n; i++) {
+        float hi = h[i] + d;
+        h[i] = hi < 0.0f ? 0.0f : (hi > 1.0f ? 1.0f : hi);
+    }
+}
 
-    // Reduce population
-    int populationLoss = kingdom.getPopulation()->getTotal() / 10; // 10% loss
-    kingdom.getPopulation()->setPeasants(kingdom.getPopulation()->getPeasants() -
-        (populationLoss * 8 / 10));
-    kingdom.getPopulation()->setMerchants(static_cast<int>(kingdom.getPopulation()->getMerchants() -
-        (populationLoss * 1.5 / 10)));
-    kingdom.getPopulation()->setNobles(static_cast<int>(kingdom.getPopulation()->getNobles() -
-        (populationLoss * 0.5 / 10)));
+void CitizenAgents::summarize() {
+    // An agent is discontented when both unhappy and disloyal
+    const float* __restrict h = happiness.data();
+    const float* __restrict l = loyalty.data();
+    const int n = getCount();
+    double total = 0.0;
+    int discontented = 0;
 
-    // Affect happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.2);
+    for (int i = 0; i < n; i++) {
+        total += h[i];
+        discontented += (h[i] < 0.25f) & (l[i] < 0.4f);
+    }
 
-    cout << "The plague claims " << populationLoss << " lives." << endl;
-    cout << "Population morale has decreased significantly." << endl;
+    averageHappiness = n > 0 ? total / n : 0.5;
+    discontentShare = n > 0 ? static_cast<double>(discontented) / n : 0.0;
 }
 
-void RandomEvents::describeGoodHarvestEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: GOOD HARVEST =====" << endl;
-    cout << "A bountiful harvest blesses your kingdom!" << endl;
+// ----------------------
+// Ruleset implementation
+// ----------------------
 
-    // Increase food stocks
-    int foodGain = kingdom.getPopulation()->getPeasants() * 2;
-    kingdom.getMarket()->getFood()->changeAmount(foodGain);
+constexpr Ruleset standardRuleset{};
+Ruleset designerRuleset;
+
+// Every rule by name, for the designer file
+struct RulesetField {
+    const char* name;
+    double Ruleset::* real;
+    int Ruleset::* integer;
+};
+
+static const RulesetField rulesetFields[] = {
+    { "baseGrowth", &Ruleset::baseGrowth, nullptr },
+    { "growthPerHappiness", &Ruleset::growthPerHappiness, nullptr },
+    { "growthPerTaxBurden", &Ruleset::growthPerTaxBurden, nullptr },
+    { "growthPerFoodSecurity", &Ruleset::growthPerFoodSecurity, nullptr },
+    { "minGrowth", &Ruleset::minGrowth, nullptr },
+    { "maxGrowth", &Ruleset::maxGrowth, nullptr },
+    { "merchantGrowthShare", &Ruleset::merchantGrowthShare, nullptr },
+    { "nobleGrowthShare", &Ruleset::nobleGrowthShare, nullptr },
+    { "peasantRiseChance", nullptr, &Ruleset::peasantRiseChance },
+    { "merchantRiseChance", nullptr, &Ruleset::merchantRiseChance },
+    { "socialMobilityShare", &Ruleset::socialMobilityShare, nullptr },
+    { "armyPresenceWeight", &Ruleset::armyPresenceWeight, nullptr },
+    { "peasantTaxWeight", &Ruleset::peasantTaxWeight, nullptr },
+    { "merchantTaxWeight", &Ruleset::merchantTaxWeight, nullptr },
+    { "nobleTaxWeight", &Ruleset::nobleTaxWeight, nullptr },
+    { "inflationUnhappiness", &Ruleset::inflationUnhappiness, nullptr },
+    { "happinessMemory", &Ruleset::happinessMemory, nullptr },
+    { "happinessPerTax", &Ruleset::happinessPerTax, nullptr },
+    { "happinessPerArmy", &Ruleset::happinessPerArmy, nullptr },
+    { "happinessPerInflation", &Ruleset::happinessPerInflation, nullptr },
+    { "rebellionHappiness", &Ruleset::rebellionHappiness, nullptr },
+    { "agentRebellionShare", &Ruleset::agentRebellionShare, nullptr },
+    { "rebellionChanceScale", &Ruleset::rebellionChanceScale, nullptr },
+    { "agentWealthMemory", &Ruleset::agentWealthMemory, nullptr },
+    { "agentTaxBurden", &Ruleset::agentTaxBurden, nullptr },
+    { "loyaltyMemory", &Ruleset::loyaltyMemory, nullptr },
+    { "loyaltyPerHappiness", &Ruleset::loyaltyPerHappiness, nullptr },
+    { "warLoyaltyLoss", &Ruleset::warLoyaltyLoss, nullptr },
+    { "soldierPay", nullptr, &Ruleset::soldierPay },
+    { "moraleMemory", &Ruleset::moraleMemory, nullptr },
+    { "moralePerPay", &Ruleset::moralePerPay, nullptr },
+    { "moralePerSupport", &Ruleset::moralePerSupport, nullptr },
+    { "warMoraleLoss", &Ruleset::warMoraleLoss, nullptr },
+    { "peaceMoraleGain", &Ruleset::peaceMoraleGain, nullptr },
+    { "minMorale", &Ruleset::minMorale, nullptr },
+    { "mutinyMorale", &Ruleset::mutinyMorale, nullptr },
+    { "mutinyHappiness", &Ruleset::mutinyHappiness, nullptr },
+    { "mutinyChanceScale", &Ruleset::mutinyChanceScale, nullptr },
+    { "peasantTaxYield", nullptr, &Ruleset::peasantTaxYield },
+    { "merchantTaxYield", nullptr, &Ruleset::merchantTaxYield },
+    { "nobleTaxYield", nullptr, &Ruleset::nobleTaxYield },
+    { "soldierUpkeep", nullptr, &Ruleset::soldierUpkeep },
+    { "citizensPerBureaucrat", nullptr, &Ruleset::citizensPerBureaucrat },
+    { "activityScale", &Ruleset::activityScale, nullptr },
+    { "treasuryScale", &Ruleset::treasuryScale, nullptr },
+    { "inflationMemory", &Ruleset::inflationMemory, nullptr },
+    { "inflationPerActivity", &Ruleset::inflationPerActivity, nullptr },
+    { "inflationPerTreasury", &Ruleset::inflationPerTreasury, nullptr },
+    { "minInflation", &Ruleset::minInflation, nullptr },
+    { "maxInflation", &Ruleset::maxInflation, nullptr },
+    { "unrestTaxWeight", &Ruleset::unrestTaxWeight, nullptr },
+    { "inflationImpact", &Ruleset::inflationImpact, nullptr },
+    { "unrestInflationWeight", &Ruleset::unrestInflationWeight, nullptr },
+    { "unrestHappinessWeight", &Ruleset::unrestHappinessWeight, nullptr },
+    { "riotUnrest", &Ruleset::riotUnrest, nullptr },
+    { "foodBasePrice", &Ruleset::foodBasePrice, nullptr },
+    { "woodBasePrice", &Ruleset::woodBasePrice, nullptr },
+    { "stoneBasePrice", &Ruleset::stoneBasePrice, nullptr },
+    { "ironBasePrice", &Ruleset::ironBasePrice, nullptr },
+    { "priceSwing", nullptr, &Ruleset::priceSwing },
+    { "marketFee", &Ruleset::marketFee, nullptr },
+    { "peasantsPerWorker", nullptr, &Ruleset::peasantsPerWorker },
+    { "foodPerWorker", nullptr, &Ruleset::foodPerWorker },
+    { "workersPerWood", nullptr, &Ruleset::workersPerWood },
+    { "workersPerStone", nullptr, &Ruleset::workersPerStone },
+    { "workersPerIron", nullptr, &Ruleset::workersPerIron },
+    { "merchantsPerTrade", nullptr, &Ruleset::merchantsPerTrade },
+    { "goldPerTrade", nullptr, &Ruleset::goldPerTrade },
+    { "foodPerCitizen", nullptr, &Ruleset::foodPerCitizen },
+    { "foodPerSoldier", nullptr, &Ruleset::foodPerSoldier },
+    { "citizensPerWood", nullptr, &Ruleset::citizensPerWood },
+    { "citizensPerIron", nullptr, &Ruleset::citizensPerIron },
+    { "soldiersPerIron", nullptr, &Ruleset::soldiersPerIron },
+    { "scorePerCitizen", nullptr, &Ruleset::scorePerCitizen },
+    { "scorePerSoldier", nullptr, &Ruleset::scorePerSoldier },
+    { "goldPerPoint", nullptr, &Ruleset::goldPerPoint },
+    { "happinessScore", nullptr, &Ruleset::happinessScore },
+    { "scorePerYear", nullptr, &Ruleset::scorePerYear },
+    { "debtPerPoint", nullptr, &Ruleset::debtPerPoint },
+    { "inflationPenalty", nullptr, &Ruleset::inflationPenalty }
+};
+
+bool Ruleset::load(const string& filename) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        Logger::error("Error: Could not open ruleset {}!", filename);
+        return false;
+    }
 
-    // Boost happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() + 0.15);
+    Ruleset loaded;
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        line = line.substr(0, line.find('#'));
+        size_t equals = line.find('=');
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
 
-    cout << "Food stocks increase by " << foodGain << " units." << endl;
-    cout << "The people rejoice at the abundance!" << endl;
-}
+        // Both sides trimmed; the value must be a whole number or real
+        string key = equals == string::npos ? line : line.substr(0, equals);
+        string value = equals == string::npos ? "" : line.substr(equals + 1);
+        key.erase(0, key.find_first_not_of(" \t"));
+        key.erase(key.find_last_not_of(" \t\r") + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        value.erase(value.find_last_not_of(" \t\r") + 1);
+
+        const RulesetField* field = nullptr;
+        for (size_t i = 0; i < sizeof(rulesetFields) / sizeof(rulesetFields[0]); i++) {
+            if (key == rulesetFields[i].name) {
+                field = &rulesetFields[i];
+                break;
+            }
+        }
+        if (!field || value.empty()) {
+            Logger::error("Error: {} line {}: expected a known rule = value!", filename, lineNumber);
+            return false;
+        }
 
-void RandomEvents::describeDroughtEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: DROUGHT =====" << endl;
-    cout << "A severe drought strikes your kingdom!" << endl;
+        char* end = nullptr;
+        if (field->real) {
+            loaded.*(field->real) = strtod(value.c_str(), &end);
+        }
+        else {
+            loaded.*(field->integer) = static_cast<int>(strtol(value.c_str(), &end, 10));
+        }
+        if (*end != '\0') {
+            Logger::error("Error: {} line {}: {} is not a number!", filename, lineNumber, value);
+            return false;
+        }
+    }
 
-    // Reduce food production
-    int foodLoss = kingdom.getMarket()->getFood()->getAmount() / 3;
-    kingdom.getMarket()->getFood()->changeAmount(-foodLoss);
+    *this = loaded;
+    return true;
+}
 
-    // Lower happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.1);
+bool Ruleset::save(const string& filename) const {
+    ofstream file(filename);
+    if (!file.is_open()) {
+        Logger::error("Error: Could not create ruleset {}!", filename);
+        return false;
+    }
 
-    cout << "Food stocks decrease by " << foodLoss << " units." << endl;
-    cout << "The people grow anxious about the future." << endl;
+    // Enough digits that loading gives back the exact same doubles
+    file.precision(17);
+    for (size_t i = 0; i < sizeof(rulesetFields) / sizeof(rulesetFields[0]); i++) {
+        file << rulesetFields[i].name << " = ";
+        if (rulesetFields[i].real) {
+            file << this->*(rulesetFields[i].real) << endl;
+        }
+        else {
+            file << this->*(rulesetFields[i].integer) << endl;
+        }
+    }
+    return file.good();
 }
 
-void RandomEvents::describeForeignInvasionEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: FOREIGN INVASION =====" << endl;
-    cout << "A neighboring kingdom invades your lands!" << endl;
+// ------------------------
+// Population implementation
+// ------------------------
+
+Population::Population(int initialPeasants, int initialMerchants, int initialNobles)
+    : peasants(initialPeasants), merchants(initialMerchants), nobles(initialNobles),
+    growthRate(0.05), happiness(0.5) {
+}
 
-    // Reduce army strength
-    int armyLoss = kingdom.getArmy()->getTotal() / 10;
-    kingdom.getArmy()->setInfantry(kingdom.getArmy()->getInfantry() - (armyLoss * 6 / 10));
-    kingdom.getArmy()->setCavalry(kingdom.getArmy()->getCavalry() - (armyLoss * 2 / 10));
-    kingdom.getArmy()->setArchers(kingdom.getArmy()->getArchers() - (armyLoss * 2 / 10));
+Population::~Population() {}
 
-    // Set war status
-    kingdom.getArmy()->setWarStatus(true);
+int Population::getPeasants() const {
+    return peasants;
+}
 
-    // Lower morale
-    kingdom.getArmy()->setMorale(kingdom.getArmy()->getMorale() - 0.15);
+int Population::getMerchants() const {
+    return merchants;
+}
 
-    cout << "Your army loses " << armyLoss << " troops in the conflict." << endl;
-    cout << "The kingdom is now at war!" << endl;
+int Population::getNobles() const {
+    return nobles;
 }
 
-void RandomEvents::describeRebellionEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: REBELLION =====" << endl;
-    cout << "The people rise up against your rule!" << endl;
+int Population::getTotal() const {
+    return Headroom::narrow(static_cast<long long>(peasants) + merchants + nobles);
+}
 
-    // Reduce population and army
-    int populationLoss = kingdom.getPopulation()->getTotal() / 10;
-    kingdom.getPopulation()->setPeasants(kingdom.getPopulation()->getPeasants() - populationLoss);
+double Population::getGrowthRate() const {
+    return growthRate;
+}
 
-    int armyLoss = kingdom.getArmy()->getTotal() / 10;
-    kingdom.getArmy()->setInfantry(kingdom.getArmy()->getInfantry() - armyLoss);
+double Population::getHappiness() const {
+    return happiness;
+}
 
-    // Lower happiness and morale
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.2);
-    kingdom.getArmy()->setMorale(kingdom.getArmy()->getMorale() - 0.2);
+void Population::setPeasants(int count) {
+    peasants = max(0, count);
+}
 
-    cout << "The rebellion claims " << populationLoss << " citizens and " << armyLoss << " soldiers." << endl;
-    cout << "Your rule is questioned by many." << endl;
+void Population::setMerchants(int count) {
+    merchants = max(0, count);
 }
 
-void RandomEvents::describeAssassinationEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: ASSASSINATION ATTEMPT =====" << endl;
-    cout << "An assassin attempts to kill your ruler!" << endl;
+void Population::setNobles(int count) {
+    nobles = max(0, count);
+}
 
-    // 50% chance of success
-    if (rand() % 2 == 0) {
-        cout << "The attempt fails, but the kingdom is shaken!" << endl;
-        kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.1);
-    }
-    else {
-        cout << "The ruler is gravely wounded and must be replaced!" << endl;
-        // Replace ruler with a new one
-        kingdom.setRuler(make_unique<King>("New King", 50, 50, 50, 50));
-        kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.3);
-    }
+void Population::setGrowthRate(double rate) {
+    growthRate = max(0.0, min(0.2, rate));
 }
 
-void RandomEvents::describeDiscoveryEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: DISCOVERY =====" << endl;
-    cout << "Your scholars uncover a valuable resource deposit!" << endl;
+void Population::setHappiness(double value) {
+    double previous = happiness;
+    happiness = max(0.0, min(1.0, value));
 
-    // Randomly increase one resource
-    int resourceType = rand() % 3;
-    if (resourceType == 0) {
-        int ironGain = 100 + (rand() % 100);
-        kingdom.getMarket()->getIron()->changeAmount(ironGain);
-        cout << "A new iron mine yields " << ironGain << " units!" << endl;
+    // Events and leaders move every citizen by the same amount
+    if (agents && happiness != previous) {
+        agents->shiftHappiness(happiness - previous);
+        agents->summarize();
     }
-    else if (resourceType == 1) {
-        int woodGain = 200 + (rand() % 200);
-        kingdom.getMarket()->getWood()->changeAmount(woodGain);
-        cout << "A lush forest provides " << woodGain << " units of wood!" << endl;
-    }
-    else {
-        int stoneGain = 150 + (rand() % 150);
-        kingdom.getMarket()->getStone()->changeAmount(stoneGain);
-        cout << "A quarry yields " << stoneGain << " units of stone!" << endl;
-    }
-
-    // Boost happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() + 0.1);
 }
 
-void RandomEvents::describeFestivalEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: FESTIVAL =====" << endl;
-    cout << "A grand festival is held in the kingdom!" << endl;
+void Population::enableAgentMode() {
+    if (!agents) {
+        agents = make_unique<CitizenAgents>();
+        agents->syncCounts(peasants, merchants, nobles, happiness);
+        agents->summarize();
+    }
+}
 
-    // Boost happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() + 0.2);
+void Population::disableAgentMode() {
+    agents.reset();
+}
 
-    // Small economic cost
-    kingdom.getEconomy()->setTreasuryGold(kingdom.getEconomy()->getTreasuryGold() - 100);
+bool Population::isAgentMode() const {
+    return agents != nullptr;
+}
 
-    cout << "The festival costs 100 gold but greatly improves morale!" << endl;
+CitizenAgents* Population::getAgents() const {
+    return agents.get();
 }
 
-void RandomEvents::describeFireEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: FIRE =====" << endl;
-    cout << "A massive fire ravages part of the kingdom!" << endl;
+template <const Ruleset& rules>
+void Population::updatePopulation(const Economy& economy, const Army& army) {
+    // Update growth rate based on conditions
+    double taxBurden = economy.getPeasantTaxRate() + economy.getMerchantTaxRate() + economy.getNobleTaxRate();
+    double foodSecurity = 1.0; // Placeholder, would be calculated from food resources
 
-    // Reduce resources
-    int woodLoss = kingdom.getMarket()->getWood()->getAmount() / 4;
-    int foodLoss = kingdom.getMarket()->getFood()->getAmount() / 5;
-    kingdom.getMarket()->getWood()->changeAmount(-woodLoss);
-    kingdom.getMarket()->getFood()->changeAmount(-foodLoss);
+    // Adjust growth rate based on conditions
+    growthRate = rules.baseGrowth + (happiness * rules.growthPerHappiness) - (taxBurden * rules.growthPerTaxBurden) +
+        (foodSecurity * rules.growthPerFoodSecurity);
+    growthRate = max(rules.minGrowth, min(rules.maxGrowth, growthRate)); // Clamp to reasonable range
 
-    // Lower happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.15);
+    // Apply growth to different population groups
+    peasants = Headroom::narrow(static_cast<long long>(peasants) + Headroom::truncate(peasants * growthRate));
+    merchants = Headroom::narrow(static_cast<long long>(merchants) +
+        Headroom::truncate(merchants * (growthRate * rules.merchantGrowthShare))); // Merchants grow more slowly
+    nobles = Headroom::narrow(static_cast<long long>(nobles) +
+        Headroom::truncate(nobles * (growthRate * rules.nobleGrowthShare))); // Nobles grow very slowly
+
+    // Potential for social mobility; at least one rises, if there is anyone to rise
+    if (CounterRng::draw(CounterRng::STREAM_POPULATION, 100) < rules.peasantRiseChance) {
+        int socialMobility = min(peasants, max(1, static_cast<int>(peasants * rules.socialMobilityShare)));
+        peasants -= socialMobility;
+        merchants = Headroom::narrow(static_cast<long long>(merchants) + socialMobility);
+    }
 
-    cout << "The fire destroys " << woodLoss << " wood and " << foodLoss << " food." << endl;
-    cout << "The people mourn their losses." << endl;
+    if (CounterRng::draw(CounterRng::STREAM_POPULATION, 100) < rules.merchantRiseChance) {
+        int socialMobility = min(merchants, max(1, static_cast<int>(merchants * rules.socialMobilityShare)));
+        merchants -= socialMobility;
+        nobles = Headroom::narrow(static_cast<long long>(nobles) + socialMobility);
+    }
 }
 
-void RandomEvents::describeEarthquakeEvent(Kingdom& kingdom) {
-    cout << "\n===== EVENT: EARTHQUAKE =====" << endl;
-    cout << "An earthquake shakes the kingdom to its core!" << endl;
+template <const Ruleset& rules>
+void Population::calculateHappiness(const Economy& economy, const Army& army, double foodPerPerson) {
+    double armyPresence = min(1.0, static_cast<double>(army.getTotal()) / static_cast<double>(getTotal()) * rules.armyPresenceWeight);
 
-    // Reduce stone and population
-    int stoneLoss = kingdom.getMarket()->getStone()->getAmount() / 3;
-    kingdom.getMarket()->getStone()->changeAmount(-stoneLoss);
+    if (agents) {
+        // Agent mode: every citizen reacts individually, happiness is the mean
+        agents->syncCounts(peasants, merchants, nobles, happiness);
+        agents->applyTaxes<rules>(economy.getPeasantTaxRate(), economy.getMerchantTaxRate(), economy.getNobleTaxRate());
+        agents->applyFood(foodPerPerson);
+        agents->applyArmy<rules>(armyPresence, economy.getInflation(), army.getWarStatus());
+        agents->summarize();
+        happiness = max(0.0, min(1.0, agents->getAverageHappiness()));
+        return;
+    }
 
-    int populationLoss = kingdom.getPopulation()->getTotal() / 20;
-    kingdom.getPopulation()->setPeasants(kingdom.getPopulation()->getPeasants() - populationLoss);
+    // Factors affecting happiness
+    double taxFactor = 1.0 - ((economy.getPeasantTaxRate() * rules.peasantTaxWeight) +
+        (economy.getMerchantTaxRate() * rules.merchantTaxWeight) +
+        (economy.getNobleTaxRate() * rules.nobleTaxWeight));
+    double inflationFactor = 1.0 - (economy.getInflation() * rules.inflationUnhappiness);
 
-    // Lower happiness
-    kingdom.getPopulation()->setHappiness(kingdom.getPopulation()->getHappiness() - 0.2);
+    // Calculate new happiness
+    double newHappiness = (happiness * rules.happinessMemory) + (taxFactor * rules.happinessPerTax) +
+        (armyPresence * rules.happinessPerArmy) + (inflationFactor * rules.happinessPerInflation);
 
-    cout << "The earthquake destroys " << stoneLoss << " stone and claims " << populationLoss << " lives." << endl;
-    cout << "The kingdom struggles to recover." << endl;
+    // Clamp to valid range
+    happiness = max(0.0, min(1.0, newHappiness));
 }
 
-// ---------------------
-// Kingdom implementation
-// ---------------------
+template <const Ruleset& rules>
+bool Population::checkRebellion() const {
+    // In agent mode rebellion emerges from the share of discontented citizens
+    if (agents) {
+        double share = agents->getDiscontentShare();
+        if (share > rules.agentRebellionShare) {
+            return CounterRng::draw(CounterRng::STREAM_REBELLION, 100) < ((share - rules.agentRebellionShare) * 100 * rules.rebellionChanceScale);
+        }
+        return false;
+    }
 
-Kingdom::Kingdom(const string& kingdomName)
-    : name(kingdomName), gameYear(1), score(0) {
-    population = make_unique<Population>();
-    army = make_unique<Army>();
-    economy = make_unique<Economy>();
-    market = make_unique<Market>();
-    diplomacy = make_unique<Diplomacy>();
-    bank = make_unique<Bank>();
-    events = make_unique<RandomEvents>();
-    ruler = make_unique<King>("Default King", 50, 50, 50, 50);
+    // Check if population is going to rebel
+    if (happiness < rules.rebellionHappiness) {
+        // Very unhappy population might rebel
+        return CounterRng::draw(CounterRng::STREAM_REBELLION, 100) < ((rules.rebellionHappiness - happiness) * 100 * rules.rebellionChanceScale);
+    }
+    return false;
 }
 
-Kingdom::~Kingdom() {}
+// -------------------
+// Army implementation
+// -------------------
 
-string Kingdom::getName() const {
-    return name;
+Army::Army(int initialInfantry, int initialCavalry, int initialArchers)
+    : infantry(initialInfantry), cavalry(initialCavalry), archers(initialArchers),
+    morale(0.7), trainingLevel(1), isAtWar(false) {
 }
 
-Population* Kingdom::getPopulation() const {
-    return population.get();
-}
+Army::~Army() {}
 
-Army* Kingdom::getArmy() const {
-    return army.get();
+int Army::getInfantry() const {
+    return infantry;
 }
 
-Economy* Kingdom::getEconomy() const {
-    return economy.get();
+int Army::getCavalry() const {
+    return cavalry;
 }
 
-Market* Kingdom::getMarket() const {
-    return market.get();
+int Army::getArchers() const {
+    return archers;
 }
 
-Diplomacy* Kingdom::getDiplomacy() const {
-    return diplomacy.get();
+int Army::getTotal() const {
+    return Headroom::narrow(static_cast<long long>(infantry) + cavalry + archers);
 }
 
-Bank* Kingdom::getBank() const {
-    return bank.get();
+double Army::getMorale() const {
+    return morale;
 }
 
-RandomEvents* Kingdom::getEvents() const {
-    return events.get();
+int Army::getTrainingLevel() const {
+    return trainingLevel;
 }
 
-Leader* Kingdom::getRuler() const {
-    return ruler.get();
+bool Army::getWarStatus() const {
+    return isAtWar;
 }
 
-int Kingdom::getGameYear() const {
-    return gameYear;
+void Army::setInfantry(int count) {
+    infantry = max(0, count);
 }
 
-int Kingdom::getScore() const {
-    return score;
+void Army::setCavalry(int count) {
+    cavalry = max(0, count);
 }
 
-void Kingdom::setName(const string& newName) {
-    name = newName;
+void Army::setArchers(int count) {
+    archers = max(0, count);
 }
 
-void Kingdom::setRuler(unique_ptr<Leader> newRuler) {
-    ruler = move(newRuler);
+void Army::setMorale(double value) {
+    morale = max(0.0, min(1.0, value));
 }
 
-void Kingdom::setGameYear(int year) {
-    gameYear = max(1, year);
+void Army::setTrainingLevel(int level) {
+    trainingLevel = max(1, level);
 }
 
-void Kingdom::setScore(int newScore) {
-    score = max(0, newScore);
+void Army::setWarStatus(bool status) {
+    isAtWar = status;
 }
 
-void Kingdom::advanceYear() {
-    cout << "\nAdvancing to year " << gameYear + 1 << "..." << endl;
+void Army::trainArmy() {
+    // Training improves effectiveness; the menu shows the drill animation
+    // Improve training level
+    trainingLevel++;
 
-    // Update all systems
-    population->updatePopulation(*economy, *army);
-    population->calculateHappiness(*economy, *army);
-    army->updateMorale(*economy, *population);
-    economy->updateEconomy(*population, *army);
-    market->updatePrices(*economy);
-    market->produceResources(*population);
-    market->consumeResources(*population, *army);
-    diplomacy->updateDiplomacy(*army, *economy);
-    bank->updateInterest(*economy);
-    bank->attemptCorruption(*economy, *population);
+    // Boost morale
+    morale = min(1.0, morale + 0.1);
 
-    // Apply leader effects
-    ruler->applyEffects(*this);
+    Logger::info("Army training level increased to {}", trainingLevel);
+    Logger::info("Morale improved to {}%", static_cast<int>(morale * 100));
+}
 
-    // Apply resource effects
-    market->getFood()->applyEffects(*this);
-    market->getIron()->applyEffects(*this);
+int Army::calculateStrength() const {
+    // Calculate the overall military strength
+    int baseStrength = infantry + (cavalry * 3) + (archers * 2);
+    double moraleMultiplier = 0.5 + (morale * 0.5); // 0.5 - 1.0
+    double trainingMultiplier = 0.8 + (trainingLevel * 0.2); // Starts at 1.0
 
-    // Check for random events
-    if (events->checkForEvent()) {
-        RandomEvents::EventType event = events->generateEvent();
-        events->applyEvent(event, *this);
-    }
+    return static_cast<int>(baseStrength * moraleMultiplier * trainingMultiplier);
+}
 
-    // Check for rebellions or riots
-    if (population->checkRebellion() || army->checkRebellion(*population) || economy->checkRiots(*population)) {
-        cout << "\nWARNING: Unrest threatens the stability of your kingdom!" << endl;
-        events->applyEvent(RandomEvents::REBELLION, *this);
-    }
+template <const Ruleset& rules>
+void Army::updateMorale(const Economy& economy, const Population& population) {
+    // Factors affecting morale
+    double payFactor = min(1.0, static_cast<double>(economy.getTreasuryGold()) /
+        (getTotal() * rules.soldierPay)); // Can the kingdom pay the troops?
+    double populationSupport = population.getHappiness();
+    double warEffect = isAtWar ? -rules.warMoraleLoss : rules.peaceMoraleGain; // War decreases morale over time
 
-    // Collect taxes
-    int taxes = economy->collectTaxes(*population);
-    cout << "Collected " << taxes << " gold in taxes." << endl;
+    // Calculate new morale
+    double newMorale = (morale * rules.moraleMemory) + (payFactor * rules.moralePerPay) +
+        (populationSupport * rules.moralePerSupport) + warEffect;
 
-    // Increment year and calculate score
-    gameYear++;
-    calculateScore();
+    // Clamp to valid range
+    morale = max(rules.minMorale, min(1.0, newMorale));
 }
 
-void Kingdom::calculateScore() {
-    // Calculate score based on various factors
-    score = (population->getTotal() * 10) +
-        (army->getTotal() * 20) +
-        (economy->getTreasuryGold() / 10) +
-        (static_cast<int>(population->getHappiness() * 1000)) +
-        (gameYear * 100);
+int Army::calculateDesertion() {
+    // Calculate how many troops desert based on morale
+    if (morale < 0.4) {
+        double desertionRate = (0.4 - morale) * 0.5; // Up to 20% desertion for very low morale
+        int deserters = static_cast<int>(getTotal() * desertionRate);
 
-    // Deduct points for debt and inflation
-    score -= (economy->getDebt() / 5);
-    score -= static_cast<int>(economy->getInflation() * 2000);
+        // Distribute desertion across unit types
+        int infantryDeserters = min(infantry, static_cast<int>(deserters * 0.6));
+        int cavalryDeserters = min(cavalry, static_cast<int>(deserters * 0.2));
+        int archerDeserters = min(archers, static_cast<int>(deserters * 0.2));
+
+        infantry -= infantryDeserters;
+        cavalry -= cavalryDeserters;
+        archers -= archerDeserters;
+
+        return infantryDeserters + cavalryDeserters + archerDeserters;
+    }
+    return 0;
 }
 
-bool Kingdom::isGameOver() const {
-    // Game over if population is too low, treasury is bankrupt, or massive debt
-    return (population->getTotal() < 10) ||
-        (economy->getTreasuryGold() <= 0 && economy->getDebt() > 5000) ||
-        (population->getHappiness() < 0.1 && army->getMorale() < 0.1);
+template <const Ruleset& rules>
+bool Army::checkRebellion(const Population& population) const {
+    // Check if the army will rebel against the ruler
+    if (morale < rules.mutinyMorale && population.getHappiness() < rules.mutinyHappiness) {
+        // Both army and population are very unhappy
+        return CounterRng::draw(CounterRng::STREAM_MUTINY, 100) < ((rules.mutinyMorale - morale) * 100 * rules.mutinyChanceScale);
+    }
+    return false;
 }
 
-void Kingdom::displayStatus() const {
-    cout << "\n===== Kingdom Status: " << name << " (Year " << gameYear << ") =====" << endl;
-    cout << "Ruler: " << ruler->getName() << endl;
-    cout << "Score: " << score << endl;
-
-    cout << "\nPopulation:" << endl;
-    cout << "  Peasants: " << population->getPeasants() << endl;
-    cout << "  Merchants: " << population->getMerchants() << endl;
-    cout << "  Nobles: " << population->getNobles() << endl;
-    cout << "  Happiness: " << static_cast<int>(population->getHappiness() * 100) << "%" << endl;
-
-    cout << "\nArmy:" << endl;
-    cout << "  Infantry: " << army->getInfantry() << endl;
-    cout << "  Cavalry: " << army->getCavalry() << endl;
-    cout << "  Archers: " << army->getArchers() << endl;
-    cout << "  Morale: " << static_cast<int>(army->getMorale() * 100) << "%" << endl;
-    cout << "  Training Level: " << army->getTrainingLevel() << endl;
-    cout << "  Status: " << (army->getWarStatus() ? "At War" : "At Peace") << endl;
-
-    cout << "\nEconomy:" << endl;
-    cout << "  Treasury: " << economy->getTreasuryGold() << " gold" << endl;
-    cout << "  Debt: " << economy->getDebt() << " gold" << endl;
-    cout << "  Inflation: " << static_cast<int>(economy->getInflation() * 100) << "%" << endl;
-
-    cout << "\nMarket:" << endl;
-    cout << "  Food: " << market->getFood()->getAmount() << " (Value: " << market->getFood()->getValue() << ")" << endl;
-    cout << "  Wood: " << market->getWood()->getAmount() << " (Value: " << market->getWood()->getValue() << ")" << endl;
-    cout << "  Stone: " << market->getStone()->getAmount() << " (Value: " << market->getStone()->getValue() << ")" << endl;
-    cout << "  Iron: " << market->getIron()->getAmount() << " (Value: " << market->getIron()->getValue() << ")" << endl;
+// ----------------------
+// Economy implementation
+// ----------------------
+
+Economy::Economy(double initialPeasantTaxRate, double initialMerchantTaxRate, double initialNobleTaxRate)
+    : peasantTaxRate(initialPeasantTaxRate), merchantTaxRate(initialMerchantTaxRate),
+    nobleTaxRate(initialNobleTaxRate), inflation(0.02), treasuryGold(1000), debt(0) {
 }
 
-bool Kingdom::saveGame(const string& filename) const {
-    ofstream file(filename);
-    if (!file.is_open()) {
-        cout << "Error: Could not open file to save game!" << endl;
-        return false;
-    }
+Economy::~Economy() {}
 
-    // Save basic kingdom data
-    file << name << endl;
-    file << gameYear << endl;
-    file << score << endl;
-
-    // Save population data
-    file << population->getPeasants() << endl;
-    file << population->getMerchants() << endl;
-    file << population->getNobles() << endl;
-    file << population->getHappiness() << endl;
-    file << population->getGrowthRate() << endl;
-
-    // Save army data
-    file << army->getInfantry() << endl;
-    file << army->getCavalry() << endl;
-    file << army->getArchers() << endl;
-    file << army->getMorale() << endl;
-    file << army->getTrainingLevel() << endl;
-    file << army->getWarStatus() << endl;
-
-    // Save economy data
-    file << economy->getTreasuryGold() << endl;
-    file << economy->getDebt() << endl;
-    file << economy->getPeasantTaxRate() << endl;
-    file << economy->getMerchantTaxRate() << endl;
-    file << economy->getNobleTaxRate() << endl;
-    file << economy->getInflation() << endl;
-
-    // Save market data
-    file << market->getFood()->getAmount() << endl;
-    file << market->getWood()->getAmount() << endl;
-    file << market->getStone()->getAmount() << endl;
-    file << market->getIron()->getAmount() << endl;
-
-    // Save ruler data (simplified, assuming King)
-    file << ruler->getName() << endl;
-    file << dynamic_cast<King*>(ruler.get())->getRoyalBloodline() << endl;
-    file << dynamic_cast<King*>(ruler.get())->getYearsInPower() << endl;
+double Economy::getPeasantTaxRate() const {
+    return peasantTaxRate;
+}
 
-    file.close();
-    cout << "Game saved successfully!" << endl;
-    return true;
+double Economy::getMerchantTaxRate() const {
+    return merchantTaxRate;
 }
 
-bool Kingdom::loadGame(const string& filename) {
-    ifstream file(filename);
-    if (!file.is_open()) {
-        cout << "Error: Could not open file to load game!" << endl;
-        return false;
-    }
+double Economy::getNobleTaxRate() const {
+    return nobleTaxRate;
+}
 
-    string rulerName;
-    int royalBloodline, yearsInPower;
-    string tempName;
-    int tempInt;
-    double tempDouble;
+double Economy::getInflation() const {
+    return inflation;
+}
 
-    // Load basic kingdom data
-    getline(file, tempName);
-    setName(tempName);
-    file >> tempInt; setGameYear(tempInt);
-    file >> tempInt; setScore(tempInt);
-    file.ignore(); // Clear newline
+int Economy::getTreasuryGold() const {
+    return treasuryGold;
+}
 
-    // Load population data
-    file >> tempInt; population->setPeasants(tempInt);
-    file >> tempInt; population->setMerchants(tempInt);
-    file >> tempInt; population->setNobles(tempInt);
-    file >> tempDouble; population->setHappiness(tempDouble);
-    file >> tempDouble; population->setGrowthRate(tempDouble);
+int Economy::getDebt() const {
+    return debt;
+}
 
-    // Load army data
-    file >> tempInt; army->setInfantry(tempInt);
-    file >> tempInt; army->setCavalry(tempInt);
-    file >> tempInt; army->setArchers(tempInt);
-    file >> tempDouble; army->setMorale(tempDouble);
-    file >> tempInt; army->setTrainingLevel(tempInt);
-    file >> tempInt; army->setWarStatus(tempInt != 0);
+void Economy::setPeasantTaxRate(double rate) {
+    peasantTaxRate = max(0.0, min(0.5, rate));
+}
 
-    // Load economy data
-    file >> tempInt; economy->setTreasuryGold(tempInt);
-    file >> tempInt; economy->setDebt(tempInt);
-    file >> tempDouble; economy->setPeasantTaxRate(tempDouble);
-    file >> tempDouble; economy->setMerchantTaxRate(tempDouble);
-    file >> tempDouble; economy->setNobleTaxRate(tempDouble);
-    file >> tempDouble; economy->setInflation(tempDouble);
+void Economy::setMerchantTaxRate(double rate) {
+    merchantTaxRate = max(0.0, min(0.5, rate));
+}
 
-    // Load market data
-    file >> tempInt; market->getFood()->setAmount(tempInt);
-    file >> tempInt; market->getWood()->setAmount(tempInt);
-    file >> tempInt; market->getStone()->setAmount(tempInt);
-    file >> tempInt; market->getIron()->setAmount(tempInt);
+void Economy::setNobleTaxRate(double rate) {
+    nobleTaxRate = max(0.0, min(0.5, rate));
+}
 
-    // Load ruler data
-    file.ignore();
-    getline(file, rulerName);
-    file >> royalBloodline >> yearsInPower;
-    setRuler(make_unique<King>(rulerName, 50, 50, 50, royalBloodline));
-    dynamic_cast<King*>(ruler.get())->incrementYearsInPower(); // Simplified restoration
+void Economy::setInflation(double value) {
+    inflation = max(0.01, min(0.2, value));
+}
 
-    file.close();
-    cout << "Game loaded successfully!" << endl;
-    cout << "Kingdom: " << name << ", Year: " << gameYear << ", Score: " << score << endl;
-    return true;
+void Economy::setTreasuryGold(int amount) {
+    treasuryGold = max(0, amount);
 }
 
-void Kingdom::handleEvent(RandomEvents::EventType event) {
-    events->applyEvent(event, *this);
+void Economy::setDebt(int amount) {
+    debt = max(0, amount);
 }
 
-void Kingdom::holdElections() {
-    cout << "\n===== ELECTIONS =====" << endl;
-    cout << "The people demand a new ruler!" << endl;
+template <const Ruleset& rules>
+int Economy::collectTaxes(const Population& population) {
+    // Calculate tax revenue from different population groups
+    int peasantTax = Headroom::truncate(static_cast<double>(population.getPeasants()) * rules.peasantTaxYield * peasantTaxRate);
+    int merchantTax = Headroom::truncate(static_cast<double>(population.getMerchants()) * rules.merchantTaxYield * merchantTaxRate);
+    int nobleTax = Headroom::truncate(static_cast<double>(population.getNobles()) * rules.nobleTaxYield * nobleTaxRate);
 
-    // Randomly select a new ruler type
-    int leaderType = rand() % 3;
-    if (leaderType == 0) {
-        setRuler(make_unique<King>("Elected King", 60, 50, 50, 60));
-        cout << "A new King is crowned!" << endl;
-    }
-    else if (leaderType == 1) {
-        setRuler(make_unique<Commander>("Elected Commander", 50, 50, 70, 60));
-        cout << "A military Commander takes charge!" << endl;
-    }
-    else {
-        setRuler(make_unique<GuildLeader>("Elected Guild Leader", 50, 60, 50, "Merchants", 60));
-        cout << "A Guild Leader rises to power!" << endl;
-    }
+    int totalTax = Headroom::narrow(static_cast<long long>(peasantTax) + merchantTax + nobleTax);
+    treasuryGold = Headroom::narrow(static_cast<long long>(treasuryGold) + totalTax);
 
-    // Boost happiness due to change
-    population->setHappiness(population->getHappiness() + 0.1);
+    return totalTax;
 }
 
-// -------------------------
-// Utility functions
-// -------------------------
+template <const Ruleset& rules>
+void Economy::updateEconomy(const Population& population, const Army& army) {
+    // Update economic factors
 
-void displayMainMenu() {
-    cout << "\n===== Stronghold: Kingdom Management =====" << endl;
-    cout << "1. Advance Year" << endl;
-    cout << "2. Display Status" << endl;
-    cout << "3. Manage Resources" << endl;
-    cout << "4. Manage Army" << endl;
-    cout << "5. Manage Economy" << endl;
-    cout << "6. Manage Diplomacy" << endl;
-    cout << "7. Manage Bank" << endl;
-    cout << "8. Hold Elections" << endl;
-    cout << "9. Perform Ruler Action" << endl;
-    cout << "10. Trigger Random Event" << endl;
-    cout << "11. Save Game" << endl;
-    cout << "12. Load Game" << endl;
-    cout << "13. Exit" << endl;
-    cout << "Enter choice: ";
+    // Army maintenance costs
+    int armyCost = Headroom::narrow(static_cast<long long>(army.getTotal()) * rules.soldierUpkeep);
+    treasuryGold -= min(treasuryGold, armyCost);
+
+    // Bureaucracy costs
+    int bureaucracyCost = population.getTotal() / rules.citizensPerBureaucrat;
+    treasuryGold -= min(treasuryGold, bureaucracyCost);
+
+    // Update inflation based on economic activity
+    double economicActivity = static_cast<double>(population.getTotal()) / rules.activityScale;
+    double treasuryRatio = min(1.0, static_cast<double>(treasuryGold) / rules.treasuryScale);
+
+    // Inflation increases with high economic activity and low treasury
+    inflation = (inflation * rules.inflationMemory) + (economicActivity * rules.inflationPerActivity) -
+        (treasuryRatio * rules.inflationPerTreasury);
+    inflation = max(rules.minInflation, min(rules.maxInflation, inflation));
 }
 
-bool processMenuChoice(int choice, Kingdom& kingdom) {
-    string filename;
-    switch (choice) {
-    case 1:
-        kingdom.advanceYear();
-        pauseScreen();
-        break;
-    case 2:
-        kingdom.displayStatus();
-        pauseScreen();
-        break;
-    case 3:
-        displayResourceManagementMenu(kingdom);
-        break;
-    case 4:
-        displayArmyMenu(kingdom);
-        break;
-    case 5:
-        displayEconomyMenu(kingdom);
-        break;
-    case 6:
-        displayDiplomacyMenu(kingdom);
-        break;
-    case 7:
-        displayBankMenu(kingdom);
-        break;
-    case 8:
-        kingdom.holdElections();
-        pauseScreen();
-        break;
-    case 9:
-        kingdom.getRuler()->specialAction(kingdom);
-        pauseScreen();
-        break;
-    case 10:
-        kingdom.handleEvent(kingdom.getEvents()->generateEvent());
-        pauseScreen();
-        break;
-    case 11:
-        cout << "Enter save file name (e.g., savegame.txt): ";
-        getline(cin, filename);
-        if (filename.empty()) {
-            cout << "Error: Filename cannot be empty!" << endl;
-        }
-        else {
-            kingdom.saveGame(filename);
-        }
-        pauseScreen();
-        break;
-    case 12:
-        cout << "Enter load file name (e.g., savegame.txt): ";
-        getline(cin, filename);
-        if (filename.empty()) {
-            cout << "Error: Filename cannot be empty!" << endl;
+template <const Ruleset& rules>
+double Economy::calculateUnrest(const Population& population) const {
+    // Calculate economic unrest level
+    double taxBurden = (peasantTaxRate + merchantTaxRate + nobleTaxRate) / 3.0;
+    double inflationImpact = inflation * rules.inflationImpact;
+    double happinessOffset = population.getHappiness();
+
+    return min(1.0, (taxBurden * rules.unrestTaxWeight) + (inflationImpact * rules.unrestInflationWeight) -
+        (happinessOffset * rules.unrestHappinessWeight));
+}
+
+template <const Ruleset& rules>
+bool Economy::checkRiots(const Population& population) const {
+    // Check if economic conditions will cause riots
+    double unrest = calculateUnrest<rules>(population);
+    return (unrest > rules.riotUnrest) && (CounterRng::draw(CounterRng::STREAM_RIOTS, 100) < (unrest * 100));
+}
+
+// ----------------------------
+// PriceHistory implementation
+// ----------------------------
+
+// Bit-level helpers for the XOR block encoding
+static void writeBits(vector<uint8_t>& bits, size_t& position, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((position >> 3) >= bits.size()) {
+            bits.push_back(0);
         }
-        else {
-            kingdom.loadGame(filename);
+        if ((value >> i) & 1) {
+            bits[position >> 3] |= static_cast<uint8_t>(0x80 >> (position & 7));
         }
-        pauseScreen();
-        break;
-    case 13:
-        cout << "Exiting game..." << endl;
-        return false;
-    default:
-        cout << "Invalid choice!" << endl;
-        pauseScreen();
+        position++;
     }
-    return true;
 }
 
-bool validateIntInput(int& value, const string& prompt, int min, int max) {
-    cout << prompt;
-    cin >> value;
-    if (cin.fail() || value < min || value > max) {
-        cin.clear();
-        cin.ignore(10000, '\n');
-        cout << "Invalid input! Must be between " << min << " and " << max << "." << endl;
-        return false;
+static uint64_t readBits(const vector<uint8_t>& bits, size_t& position, int count) {
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++) {
+        value = (value << 1) | ((bits[position >> 3] >> (7 - (position & 7))) & 1);
+        position++;
     }
-    cin.ignore();
-    return true;
+    return value;
 }
 
-bool validateDoubleInput(double& value, const string& prompt, double min, double max) {
-    cout << prompt;
-    cin >> value;
-    if (cin.fail() || value < min || value > max) {
-        cin.clear();
-        cin.ignore(10000, '\n');
-        cout << "Invalid input! Must be between " << min << " and " << max << "." << endl;
-        return false;
+static int countLeadingZeros(uint64_t value) {
+    int count = 0;
+    while (count < 64 && !(value & (1ULL << (63 - count)))) {
+        count++;
     }
-    cin.ignore();
-    return true;
+    return count;
 }
 
-bool validateStringInput(string& value, const string& prompt, int minLength, int maxLength) {
-    cout << prompt;
-    getline(cin, value);
-    if (value.length() < minLength || value.length() > maxLength) {
-        cout << "Invalid input! Length must be between " << minLength << " and " << maxLength << "." << endl;
+static int countTrailingZeros(uint64_t value) {
+    int count = 0;
+    while (count < 64 && !(value & (1ULL << count))) {
+        count++;
+    }
+    return count;
+}
+
+static bool logReturn(double previous, double value, double& result) {
+    if (previous <= 0.0 || value <= 0.0) {
         return false;
     }
+    result = log(value / previous);
     return true;
 }
 
-void displayResourceManagementMenu(Kingdom& kingdom) {
-    int choice;
-    int amount;
-    string resourceType;
+PriceHistory::PriceHistory(int recentYears)
+    : recentCapacity(max(2, (recentYears + BLOCK_YEARS - 1) / BLOCK_YEARS) * BLOCK_YEARS),
+    recentStart(0), recentCount(0), firstRecentYear(0),
+    hasLastBlockValue(false), lastBlockValue(0.0), detailedBlocks(0) {
+}
 
-    do {
-        cout << "\n===== Resource Management =====" << endl;
-        cout << "1. Buy Resources" << endl;
-        cout << "2. Sell Resources" << endl;
-        cout << "3. View Market" << endl;
-        cout << "4. Back" << endl;
-        cout << "Enter choice: ";
+PriceHistory::~PriceHistory() {}
 
-        if (validateIntInput(choice, "", 1, 4)) {
-            switch (choice) {
-            case 1:
+void PriceHistory::clearSummary(Summary& summary) {
+    summary.count = 0;
+    summary.minimum = 0.0;
+    summary.maximum = 0.0;
+    summary.sum = 0.0;
+    summary.sumSquares = 0.0;
+    summary.returnCount = 0;
+    summary.returnSum = 0.0;
+    summary.returnSumSquares = 0.0;
+}
+
+void PriceHistory::addValue(Summary& summary, double value) {
+    summary.minimum = summary.count == 0 ? value : min(summary.minimum, value);
+    summary.maximum = summary.count == 0 ? value : max(summary.maximum, value);
+    summary.count++;
+    summary.sum += value;
+    summary.sumSquares += value * value;
+}
+
+void PriceHistory::addReturn(Summary& summary, double previous, double value) {
+    double r;
+    if (logReturn(previous, value, r)) {
+        summary.returnCount++;
+        summary.returnSum += r;
+        summary.returnSumSquares += r * r;
+    }
+}
+
+void PriceHistory::mergeSummary(Summary& into, const Summary& from) {
+    if (from.count == 0) {
+        return;
+    }
+    into.minimum = into.count == 0 ? from.minimum : min(into.minimum, from.minimum);
+    into.maximum = into.count == 0 ? from.maximum : max(into.maximum, from.maximum);
+    into.count += from.count;
+    into.sum += from.sum;
+    into.sumSquares += from.sumSquares;
+    into.returnCount += from.returnCount;
+    into.returnSum += from.returnSum;
+    into.returnSumSquares += from.returnSumSquares;
+}
+
+void PriceHistory::encodeBlock(const double* values, int count, vector<uint8_t>& bits) {
+    // Gorilla-style: XOR with the previous value, store only the meaningful bits
+    size_t position = 0;
+    uint64_t previous = 0;
+    bits.clear();
+
+    for (int i = 0; i < count; i++) {
+        uint64_t current;
+        memcpy(&current, &values[i], sizeof(current));
+
+        if (i == 0) {
+            writeBits(bits, position, current, 64);
+        }
+        else {
+            uint64_t x = current ^ previous;
+            if (x == 0) {
+                writeBits(bits, position, 0, 1);
+            }
+            else {
+                int leading = min(countLeadingZeros(x), 63);
+                int trailing = countTrailingZeros(x);
+                int significant = 64 - leading - trailing;
+                writeBits(bits, position, 1, 1);
+                writeBits(bits, position, leading, 6);
+                writeBits(bits, position, significant - 1, 6);
+                writeBits(bits, position, x >> trailing, significant);
+            }
+        }
+        previous = current;
+    }
+    bits.shrink_to_fit();
+}
+
+void PriceHistory::decodeBlock(const vector<uint8_t>& bits, int count, double* values) {
+    size_t position = 0;
+    uint64_t previous = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t current;
+        if (i == 0) {
+            current = readBits(bits, position, 64);
+        }
+        else if (readBits(bits, position, 1) == 0) {
+            current = previous;
+        }
+        else {
+            int leading = static_cast<int>(readBits(bits, position, 6));
+            int significant = static_cast<int>(readBits(bits, position, 6)) + 1;
+            uint64_t x = readBits(bits, position, significant) << (64 - leading - significant);
+            current = previous ^ x;
+        }
+        memcpy(&values[i], &current, sizeof(current));
+        previous = current;
+    }
+}
+
+double PriceHistory::recentAt(int index) const {
+    return recent[(recentStart + index) % recentCapacity];
+}
+
+void PriceHistory::pushRecent(double price) {
+    if (recentCount == recentCapacity) {
+        sealOldestBlock();
+    }
+    // Until the ring first fills it starts at 0, so the next slot is the end of the vector
+    size_t slot = (recentStart + recentCount) % recentCapacity;
+    if (slot == recent.size()) {
+        recent.push_back(price);
+    }
+    else {
+        recent[slot] = price;
+    }
+    recentCount++;
+}
+
+void PriceHistory::sealOldestBlock() {
+    // Move the oldest BLOCK_YEARS of the ring into a compressed block
+    double values[BLOCK_YEARS];
+    for (int i = 0; i < BLOCK_YEARS; i++) {
+        values[i] = recentAt(i);
+    }
+
+    Block block;
+    block.firstYear = firstRecentYear;
+    block.yearCount = BLOCK_YEARS;
+    block.hasEntryReturn = hasLastBlockValue && logReturn(lastBlockValue, values[0], block.entryReturn);
+    if (!block.hasEntryReturn) {
+        block.entryReturn = 0.0;
+    }
+
+    clearSummary(block.summary);
+    for (int i = 0; i < BLOCK_YEARS; i++) {
+        addValue(block.summary, values[i]);
+        if (i > 0) {
+            addReturn(block.summary, values[i - 1], values[i]);
+        }
+    }
+    if (block.hasEntryReturn) {
+        block.summary.returnCount++;
+        block.summary.returnSum += block.entryReturn;
+        block.summary.returnSumSquares += block.entryReturn * block.entryReturn;
+    }
+    encodeBlock(values, BLOCK_YEARS, block.bits);
+
+    blocks.push_back(block);
+    detailedBlocks++;
+    hasLastBlockValue = true;
+    lastBlockValue = values[BLOCK_YEARS - 1];
+    recentStart = (recentStart + BLOCK_YEARS) % recentCapacity;
+    recentCount -= BLOCK_YEARS;
+    firstRecentYear += BLOCK_YEARS;
+
+    coarsen();
+}
+
+void PriceHistory::coarsen() {
+    // Old blocks keep only their summary...
+    while (detailedBlocks > MAX_DETAILED_BLOCKS) {
+        Block& oldest = blocks[blocks.size() - detailedBlocks];
+        vector<uint8_t>().swap(oldest.bits);
+        detailedBlocks--;
+    }
+
+    // ...and the shortest neighbouring summaries merge so memory stays bounded
+    while (static_cast<int>(blocks.size()) > MAX_BLOCKS) {
+        int coarseCount = static_cast<int>(blocks.size()) - detailedBlocks;
+        int bestIndex = 0;
+        for (int i = 1; i + 1 < coarseCount; i++) {
+            if (blocks[i].yearCount + blocks[i + 1].yearCount <
+                blocks[bestIndex].yearCount + blocks[bestIndex + 1].yearCount) {
+                bestIndex = i;
+            }
+        }
+        blocks[bestIndex].yearCount += blocks[bestIndex + 1].yearCount;
+        mergeSummary(blocks[bestIndex].summary, blocks[bestIndex + 1].summary);
+        blocks.erase(blocks.begin() + bestIndex + 1);
+    }
+}
+
+void PriceHistory::record(int year, double price) {
+    if (recentCount == 0 && blocks.empty()) {
+        firstRecentYear = year;
+    }
+    else {
+        int lastYear = getLastYear();
+        if (year <= lastYear) {
+            return; // Already recorded
+        }
+
+        // Missing years repeat the previous price
+        double previous = recentCount > 0 ? recentAt(recentCount - 1) : lastBlockValue;
+        for (int y = lastYear + 1; y < year; y++) {
+            pushRecent(previous);
+        }
+    }
+    pushRecent(price);
+}
+
+bool PriceHistory::isEmpty() const {
+    return recentCount == 0 && blocks.empty();
+}
+
+int PriceHistory::getFirstYear() const {
+    if (!blocks.empty()) {
+        return blocks[0].firstYear;
+    }
+    return recentCount > 0 ? firstRecentYear : 0;
+}
+
+int PriceHistory::getLastYear() const {
+    return recentCount > 0 ? firstRecentYear + recentCount - 1 : 0;
+}
+
+size_t PriceHistory::getMemoryUsage() const {
+    size_t bytes = sizeof(PriceHistory) + recent.capacity() * sizeof(double) + blocks.capacity() * sizeof(Block);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        bytes += blocks[i].bits.capacity();
+    }
+    return bytes;
+}
+
+void PriceHistory::accumulate(int fromYear, int toYear, Summary& result) const {
+    clearSummary(result);
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const Block& block = blocks[b];
+        int lastYear = block.firstYear + block.yearCount - 1;
+        if (lastYear < fromYear || block.firstYear > toYear) {
+            continue;
+        }
+
+        // Whole blocks answer from their summary
+        if (block.firstYear >= fromYear && lastYear <= toYear) {
+            mergeSummary(result, block.summary);
+            continue;
+        }
+
+        // A coarsened block cut by the range counts only its covered years, each at the
+        // block's average; its minimum and maximum still bound them
+        if (block.bits.empty()) {
+            int covered = min(lastYear, toYear) - max(block.firstYear, fromYear) + 1;
+            double share = static_cast<double>(covered) / block.yearCount;
+            Summary part = block.summary;
+            part.count = covered;
+            part.sum *= share;
+            part.sumSquares *= share;
+            part.returnCount = static_cast<int>(lround(block.summary.returnCount * share));
+            part.returnSum *= share;
+            part.returnSumSquares *= share;
+            mergeSummary(result, part);
+            continue;
+        }
+
+        double values[BLOCK_YEARS];
+        decodeBlock(block.bits, block.yearCount, values);
+        for (int i = 0; i < block.yearCount; i++) {
+            int year = block.firstYear + i;
+            if (year < fromYear || year > toYear) {
+                continue;
+            }
+            addValue(result, values[i]);
+            if (i > 0) {
+                addReturn(result, values[i - 1], values[i]);
+            }
+            else if (block.hasEntryReturn) {
+                result.returnCount++;
+                result.returnSum += block.entryReturn;
+                result.returnSumSquares += block.entryReturn * block.entryReturn;
+            }
+        }
+    }
+
+    for (int i = 0; i < recentCount; i++) {
+        int year = firstRecentYear + i;
+        if (year < fromYear || year > toYear) {
+            continue;
+        }
+        addValue(result, recentAt(i));
+        if (i > 0) {
+            addReturn(result, recentAt(i - 1), recentAt(i));
+        }
+        else if (hasLastBlockValue) {
+            addReturn(result, lastBlockValue, recentAt(i));
+        }
+    }
+}
+
+double PriceHistory::getPrice(int year) const {
+    if (recentCount > 0 && year >= firstRecentYear && year <= getLastYear()) {
+        return recentAt(year - firstRecentYear);
+    }
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        const Block& block = blocks[b];
+        if (year >= block.firstYear && year < block.firstYear + block.yearCount) {
+            if (block.bits.empty()) {
+                return block.summary.sum / block.summary.count;
+            }
+            double values[BLOCK_YEARS];
+            decodeBlock(block.bits, block.yearCount, values);
+            return values[year - block.firstYear];
+        }
+    }
+    return 0.0; // Year not recorded
+}
+
+double PriceHistory::movingAverage(int endYear, int window) const {
+    return getStats(endYear - window + 1, endYear).mean;
+}
+
+PriceHistory::Stats PriceHistory::getStats(int fromYear, int toYear) const {
+    Summary summary;
+    accumulate(fromYear, toYear, summary);
+
+    Stats stats = { summary.count, summary.minimum, summary.maximum, 0.0, 0.0 };
+    if (summary.count > 0) {
+        stats.mean = summary.sum / summary.count;
+    }
+    if (summary.returnCount > 1) {
+        double meanReturn = summary.returnSum / summary.returnCount;
+        double variance = summary.returnSumSquares / summary.returnCount - meanReturn * meanReturn;
+        stats.volatility = sqrt(max(0.0, variance));
+    }
+    return stats;
+}
+
+// --------------------
+// Market implementation
+// --------------------
+
+Market::Market()
+    : food(make_shared<Food>(1000)), gold(make_shared<Gold>(500)),
+    wood(make_shared<Wood>(500)), stone(make_shared<Stone>(300)),
+    iron(make_shared<Iron>(200)), priceFluctuation(0.1), exchange(nullptr), exchangeId(-1) {
+}
+
+Market::~Market() {}
+
+void Market::setExchange(Exchange* shared, int kingdomId) {
+    exchange = shared;
+    exchangeId = kingdomId;
+}
+
+Exchange* Market::getExchange() const {
+    return exchange;
+}
+
+const shared_ptr<Food>& Market::getFood() const {
+    return food;
+}
+
+const shared_ptr<Gold>& Market::getGold() const {
+    return gold;
+}
+
+const shared_ptr<Wood>& Market::getWood() const {
+    return wood;
+}
+
+const shared_ptr<Stone>& Market::getStone() const {
+    return stone;
+}
+
+const shared_ptr<Iron>& Market::getIron() const {
+    return iron;
+}
+
+template <const Ruleset& rules>
+void Market::updatePrices(const Economy& economy) {
+    // Update resource prices based on economy and random fluctuations
+    double inflationFactor = 1.0 + economy.getInflation();
+    const int swing = rules.priceSwing;
+
+    // Apply inflation to base values
+    food->setValue(rules.foodBasePrice * inflationFactor * (1.0 + (CounterRng::draw(CounterRng::STREAM_PRICES, 2 * swing) - swing) * 0.01));
+    wood->setValue(rules.woodBasePrice * inflationFactor * (1.0 + (CounterRng::draw(CounterRng::STREAM_PRICES, 2 * swing) - swing) * 0.01));
+    stone->setValue(rules.stoneBasePrice * inflationFactor * (1.0 + (CounterRng::draw(CounterRng::STREAM_PRICES, 2 * swing) - swing) * 0.01));
+    iron->setValue(rules.ironBasePrice * inflationFactor * (1.0 + (CounterRng::draw(CounterRng::STREAM_PRICES, 2 * swing) - swing) * 0.01));
+}
+
+void Market::recordPrices(int year) {
+    foodHistory.record(year, food->getValue());
+    woodHistory.record(year, wood->getValue());
+    stoneHistory.record(year, stone->getValue());
+    ironHistory.record(year, iron->getValue());
+}
+
+void Market::clearPriceHistory() {
+    foodHistory = PriceHistory();
+    woodHistory = PriceHistory();
+    stoneHistory = PriceHistory();
+    ironHistory = PriceHistory();
+}
+
+bool Market::hasPriceHistory() const {
+    return !foodHistory.isEmpty() || !woodHistory.isEmpty() || !stoneHistory.isEmpty() || !ironHistory.isEmpty();
+}
+
+const PriceHistory* Market::getPriceHistory(const string& resourceType) const {
+    StringTable::Handle type = StringTable::find(resourceType);
+    if (type == foodName) return &foodHistory;
+    if (type == woodName) return &woodHistory;
+    if (type == stoneName) return &stoneHistory;
+    if (type == ironName) return &ironHistory;
+    return nullptr;
+}
+
+size_t Market::memoryUsage() const {
+    // make_shared puts each resource and its two reference counts in one block
+    size_t bytes = sizeof(Food) + sizeof(Gold) + sizeof(Wood) + sizeof(Stone) + sizeof(Iron) + 5 * 2 * sizeof(long);
+    // The histories live inside the market; only what they allocate is extra
+    bytes += foodHistory.getMemoryUsage() + woodHistory.getMemoryUsage() + stoneHistory.getMemoryUsage() +
+        ironHistory.getMemoryUsage() - 4 * sizeof(PriceHistory);
+    return bytes;
+}
+
+bool Market::buyResource(const string& resourceType, int amount, Economy& economy) {
+    // Buy resources from the market
+    int cost = 0;
+    Resource* resource = nullptr;
+    StringTable::Handle type = StringTable::find(resourceType);
+
+    if (type == foodName) {
+        cost = static_cast<int>(amount * food->getValue());
+        resource = food.get();
+    }
+    else if (type == woodName) {
+        cost = static_cast<int>(amount * wood->getValue());
+        resource = wood.get();
+    }
+    else if (type == stoneName) {
+        cost = static_cast<int>(amount * stone->getValue());
+        resource = stone.get();
+    }
+    else if (type == ironName) {
+        cost = static_cast<int>(amount * iron->getValue());
+        resource = iron.get();
+    }
+    else {
+        return false;
+    }
+
+    // On an exchange the gold is held in escrow until a seller fills the bid
+    if (exchange != nullptr) {
+        return exchange->placeOrder(exchangeId, resourceType, OrderBook::BUY, resource->getValue(), amount) >= 0;
+    }
+
+    // Check if the kingdom can afford it
+    if (economy.getTreasuryGold() >= cost) {
+        economy.setTreasuryGold(economy.getTreasuryGold() - cost);
+        resource->changeAmount(amount);
+        return true;
+    }
+
+    return false;
+}
+
+template <const Ruleset& rules>
+bool Market::sellResource(const string& resourceType, int amount, Economy& economy) {
+    // Sell resources to the market, less its fee
+    const double share = 1.0 - rules.marketFee;
+    int revenue = 0;
+    Resource* resource = nullptr;
+    StringTable::Handle type = StringTable::find(resourceType);
+
+    if (type == foodName) {
+        if (food->getAmount() < amount) return false;
+        revenue = static_cast<int>(amount * food->getValue() * share);
+        resource = food.get();
+    }
+    else if (type == woodName) {
+        if (wood->getAmount() < amount) return false;
+        revenue = static_cast<int>(amount * wood->getValue() * share);
+        resource = wood.get();
+    }
+    else if (type == stoneName) {
+        if (stone->getAmount() < amount) return false;
+        revenue = static_cast<int>(amount * stone->getValue() * share);
+        resource = stone.get();
+    }
+    else if (type == ironName) {
+        if (iron->getAmount() < amount) return false;
+        revenue = static_cast<int>(amount * iron->getValue() * share);
+        resource = iron.get();
+    }
+    else {
+        return false;
+    }
+
+    // On an exchange the goods are offered at what the market would have paid for them
+    if (exchange != nullptr) {
+        return exchange->placeOrder(exchangeId, resourceType, OrderBook::SELL, resource->getValue() * share,
+            amount) >= 0;
+    }
+
+    // Complete the transaction
+    resource->changeAmount(-amount);
+    economy.setTreasuryGold(economy.getTreasuryGold() + revenue);
+    return true;
+}
+
+template <const Ruleset& rules>
+void Market::projectProduction(const Population& population, int amounts[4]) const {
+    // Calculate resource production based on population
+    int peasantProduction = population.getPeasants() / rules.peasantsPerWorker;
+
+    // Food production (mainly from peasants)
+    amounts[Exchange::FOOD] = Headroom::narrow(static_cast<long long>(peasantProduction) * rules.foodPerWorker);
+    amounts[Exchange::WOOD] = peasantProduction / rules.workersPerWood;
+    amounts[Exchange::STONE] = peasantProduction / rules.workersPerStone;
+    amounts[Exchange::IRON] = peasantProduction / rules.workersPerIron;   // Iron production (less common)
+}
+
+template <const Ruleset& rules>
+void Market::projectConsumption(const Population& population, const Army& army, int amounts[4]) const {
+    int totalPopulation = population.getTotal();
+    int totalArmy = army.getTotal();
+
+    amounts[Exchange::FOOD] = Headroom::narrow(static_cast<long long>(totalPopulation) * rules.foodPerCitizen +
+        (static_cast<long long>(totalArmy) * rules.foodPerSoldier)); // Army eats more
+    amounts[Exchange::WOOD] = totalPopulation / rules.citizensPerWood;   // For heating, building, etc.
+    amounts[Exchange::STONE] = 0;
+    amounts[Exchange::IRON] = totalPopulation / rules.citizensPerIron + totalArmy / rules.soldiersPerIron; // For tools, weapons
+}
+
+template <const Ruleset& rules>
+void Market::produceResources(const Population& population) {
+    int production[4];
+    projectProduction<rules>(population, production);
+
+    food->changeAmount(production[Exchange::FOOD]);
+    wood->changeAmount(production[Exchange::WOOD]);
+    stone->changeAmount(production[Exchange::STONE]);
+    iron->changeAmount(production[Exchange::IRON]);
+
+    // Gold from merchant activity
+    int merchantProduction = population.getMerchants() / rules.merchantsPerTrade;
+    gold->changeAmount(merchantProduction * rules.goldPerTrade);
+}
+
+template <const Ruleset& rules>
+void Market::consumeResources(const Population& population, const Army& army) {
+    int consumption[4];
+    projectConsumption<rules>(population, army, consumption);
+
+    food->changeAmount(-min(food->getAmount(), consumption[Exchange::FOOD]));
+    wood->changeAmount(-min(wood->getAmount(), consumption[Exchange::WOOD]));
+    iron->changeAmount(-min(iron->getAmount(), consumption[Exchange::IRON]));
+}
+
+// ------------------------
+// OrderBook implementation
+// ------------------------
+
+OrderBook::OrderBook(int maxPriceTicks)
+    : maxTick(max(1, maxPriceTicks)), bestBid(0), bestAsk(max(1, maxPriceTicks) + 1), auctionMode(false),
+    nextId(0), tailId(0), tailSlot(0), deadOrders(0) {
+    bidLevels.resize(maxTick + 1);
+    askLevels.resize(maxTick + 1);
+    for (int i = 0; i <= maxTick; i++) {
+        bidLevels[i].head = 0;
+        bidLevels[i].volume = 0;
+        askLevels[i].head = 0;
+        askLevels[i].volume = 0;
+    }
+}
+
+OrderBook::~OrderBook() {}
+
+int OrderBook::getBestBid() const {
+    return bestBid;
+}
+
+int OrderBook::getBestAsk() const {
+    return bestAsk;
+}
+
+int OrderBook::getMaxTick() const {
+    return maxTick;
+}
+
+int OrderBook::getDepth(Side side, int price) const {
+    if (price < 1 || price > maxTick) {
+        return 0;
+    }
+    return side == BUY ? bidLevels[price].volume : askLevels[price].volume;
+}
+
+int OrderBook::slotOf(int orderId) const {
+    if (orderId < 0 || orderId >= nextId) {
+        return -1;
+    }
+    if (orderId >= tailId) {
+        return static_cast<int>(tailSlot) + (orderId - tailId);
+    }
+
+    // Kept across a compaction: still in id order, just closer together
+    int low = 0;
+    int high = static_cast<int>(tailSlot);
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (orders[mid].id < orderId) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    return low < static_cast<int>(tailSlot) && orders[low].id == orderId ? low : -1;
+}
+
+const OrderBook::Order* OrderBook::getOrder(int orderId) const {
+    int slot = slotOf(orderId);
+    return slot < 0 ? nullptr : &orders[slot];
+}
+
+OrderBook::Order* OrderBook::getOrder(int orderId) {
+    int slot = slotOf(orderId);
+    return slot < 0 ? nullptr : &orders[slot];
+}
+
+size_t OrderBook::getStoredOrderCount() const {
+    return orders.size();
+}
+
+bool OrderBook::isAuctionMode() const {
+    return auctionMode;
+}
+
+void OrderBook::setAuctionMode(bool enabled) {
+    auctionMode = enabled;
+}
+
+void OrderBook::compact() {
+    // A level's queue is always in id order, so rebuilding it from the kept orders in
+    // slot order keeps time priority
+    for (size_t slot = 0; slot < orders.size(); slot++) {
+        PriceLevel& level = orders[slot].side == BUY ? bidLevels[orders[slot].price] : askLevels[orders[slot].price];
+        level.queue.clear();
+        level.head = 0;
+    }
+
+    size_t kept = 0;
+    for (size_t slot = 0; slot < orders.size(); slot++) {
+        if (orders[slot].quantity > 0) {
+            orders[kept] = orders[slot];
+            PriceLevel& level = orders[kept].side == BUY ? bidLevels[orders[kept].price] : askLevels[orders[kept].price];
+            level.queue.push_back(static_cast<int>(kept));
+            kept++;
+        }
+    }
+    orders.resize(kept);
+    tailId = nextId;
+    tailSlot = kept;
+    deadOrders = 0;
+}
+
+void OrderBook::rest(int slot) {
+    const Order& order = orders[slot];
+    PriceLevel& level = order.side == BUY ? bidLevels[order.price] : askLevels[order.price];
+    level.queue.push_back(slot);
+    level.volume += order.quantity;
+
+    if (order.side == BUY && order.price > bestBid) {
+        bestBid = order.price;
+    }
+    else if (order.side == SELL && order.price < bestAsk) {
+        bestAsk = order.price;
+    }
+}
+
+void OrderBook::popFront(PriceLevel& level) {
+    // Skip filled and cancelled orders so the front is always live
+    while (level.head < level.queue.size() && orders[level.queue[level.head]].quantity == 0) {
+        level.head++;
+    }
+
+    if (level.head == level.queue.size()) {
+        level.queue.clear();
+        level.head = 0;
+    }
+    else if (level.head > 64 && level.head * 2 > level.queue.size()) {
+        level.queue.erase(level.queue.begin(), level.queue.begin() + level.head);
+        level.head = 0;
+    }
+}
+
+void OrderBook::refreshBestBid() {
+    while (bestBid > 0 && bidLevels[bestBid].volume == 0) {
+        bestBid--;
+    }
+}
+
+void OrderBook::refreshBestAsk() {
+    while (bestAsk <= maxTick && askLevels[bestAsk].volume == 0) {
+        bestAsk++;
+    }
+}
+
+void OrderBook::match(int executionPrice, bool useRestingPrice, vector<Fill>& fills) {
+    while (bestBid >= bestAsk) {
+        if (!useRestingPrice && (bestBid < executionPrice || bestAsk > executionPrice)) {
+            break;
+        }
+
+        PriceLevel& bidLevel = bidLevels[bestBid];
+        PriceLevel& askLevel = askLevels[bestAsk];
+        Order& bid = orders[bidLevel.queue[bidLevel.head]];
+        Order& ask = orders[askLevel.queue[askLevel.head]];
+
+        // Continuous trading executes at the price of the order that was resting first
+        int quantity = min(bid.quantity, ask.quantity);
+        int price = executionPrice;
+        if (useRestingPrice) {
+            price = bid.id < ask.id ? bid.price : ask.price;
+        }
+
+        Fill fill = { bid.id, ask.id, bid.kingdomId, ask.kingdomId, price, quantity };
+        fills.push_back(fill);
+
+        bid.quantity -= quantity;
+        ask.quantity -= quantity;
+        bidLevel.volume -= quantity;
+        askLevel.volume -= quantity;
+
+        if (bid.quantity == 0) {
+            deadOrders++;
+            popFront(bidLevel);
+            if (bidLevel.volume == 0) {
+                refreshBestBid();
+            }
+        }
+        if (ask.quantity == 0) {
+            deadOrders++;
+            popFront(askLevel);
+            if (askLevel.volume == 0) {
+                refreshBestAsk();
+            }
+        }
+    }
+}
+
+int OrderBook::submit(Side side, int kingdomId, int price, int quantity, vector<Fill>& fills,
+    long long reserved) {
+    if (price < 1 || price > maxTick || quantity <= 0) {
+        return -1;
+    }
+
+    // Drop filled and cancelled orders once they are at least half the book
+    if (deadOrders >= 1024 && deadOrders * 2 >= orders.size()) {
+        compact();
+    }
+
+    Order order = { nextId++, kingdomId, side, price, quantity, reserved };
+    orders.push_back(order);
+    rest(static_cast<int>(orders.size()) - 1);
+
+    if (!auctionMode) {
+        match(0, true, fills);
+    }
+    return order.id;
+}
+
+bool OrderBook::cancel(int orderId) {
+    int slot = slotOf(orderId);
+    if (slot < 0 || orders[slot].quantity == 0) {
+        return false;
+    }
+
+    Order& order = orders[slot];
+    PriceLevel& level = order.side == BUY ? bidLevels[order.price] : askLevels[order.price];
+    level.volume -= order.quantity;
+    order.quantity = 0;
+    deadOrders++;
+    popFront(level);
+
+    if (level.volume == 0) {
+        if (order.side == BUY) {
+            refreshBestBid();
+        }
+        else {
+            refreshBestAsk();
+        }
+    }
+    return true;
+}
+
+int OrderBook::runAuction(vector<Fill>& fills) {
+    if (bestBid < bestAsk) {
+        return 0; // Nothing crosses
+    }
+
+    // Cumulative demand at or above each price and supply at or below it
+    int low = bestAsk;
+    int high = bestBid;
+    int span = high - low + 1;
+    vector<long long> demand(span, 0);
+    vector<long long> supply(span, 0);
+
+    long long running = 0;
+    for (int p = high; p >= low; p--) {
+        running += bidLevels[p].volume;
+        demand[p - low] = running;
+    }
+    running = 0;
+    for (int p = low; p <= high; p++) {
+        running += askLevels[p].volume;
+        supply[p - low] = running;
+    }
+
+    // Maximise executed volume, then minimise the leftover imbalance
+    int clearingPrice = low;
+    long long bestVolume = -1;
+    long long bestImbalance = 0;
+    for (int i = 0; i < span; i++) {
+        long long volume = min(demand[i], supply[i]);
+        long long imbalance = demand[i] > supply[i] ? demand[i] - supply[i] : supply[i] - demand[i];
+        if (volume > bestVolume || (volume == bestVolume && imbalance < bestImbalance)) {
+            bestVolume = volume;
+            bestImbalance = imbalance;
+            clearingPrice = low + i;
+        }
+    }
+
+    match(clearingPrice, false, fills);
+    return clearingPrice;
+}
+
+// -----------------------
+// Exchange implementation
+// -----------------------
+
+Exchange::Exchange()
+    : tradeCount(0), tradedVolume(0) {
+}
+
+Exchange::~Exchange() {}
+
+int Exchange::resourceIndex(const string& resourceType) {
+    StringTable::Handle type = StringTable::find(resourceType);
+    if (type == foodName) return FOOD;
+    if (type == woodName) return WOOD;
+    if (type == stoneName) return STONE;
+    if (type == ironName) return IRON;
+    return -1;
+}
+
+int Exchange::registerKingdom(Kingdom* kingdom) {
+    int id = static_cast<int>(kingdoms.size());
+    kingdoms.push_back(kingdom);
+    pendingTicks.push_back(0);
+    kingdom->getMarket()->setExchange(this, id);
+    return id;
+}
+
+int Exchange::getKingdomCount() const {
+    return static_cast<int>(kingdoms.size());
+}
+
+long long Exchange::getPendingTicks(int kingdomId) const {
+    return pendingTicks[kingdomId];
+}
+
+OrderBook& Exchange::getBook(int resource) {
+    return books[resource];
+}
+
+long long Exchange::getTradeCount() const {
+    return tradeCount;
+}
+
+long long Exchange::getTradedVolume() const {
+    return tradedVolume;
+}
+
+void Exchange::setAuctionMode(bool enabled) {
+    for (int r = 0; r < RESOURCE_COUNT; r++) {
+        books[r].setAuctionMode(enabled);
+    }
+}
+
+// Stock of one tradeable resource, indexed by Exchange::ResourceType
+static Resource* resourceOf(Kingdom* kingdom, int resource) {
+    Market* market = kingdom->getMarket();
+    switch (resource) {
+    case Exchange::FOOD:
+        return market->getFood().get();
+    case Exchange::WOOD:
+        return market->getWood().get();
+    case Exchange::STONE:
+        return market->getStone().get();
+    default:
+        return market->getIron().get();
+    }
+}
+
+Resource* Exchange::getResource(int kingdomId, int resource) const {
+    return resourceOf(kingdoms[kingdomId], resource);
+}
+
+void Exchange::creditTicks(int kingdomId, long long ticks) {
+    // Gold is paid out in whole coins; fractions wait for the next credit
+    pendingTicks[kingdomId] += ticks;
+    long long gold = pendingTicks[kingdomId] / 100;
+    if (gold > 0) {
+        Economy* economy = kingdoms[kingdomId]->getEconomy();
+        economy->setTreasuryGold(economy->getTreasuryGold() + static_cast<int>(gold));
+        pendingTicks[kingdomId] -= gold * 100;
+    }
+}
+
+void Exchange::releaseEscrow(int resource, int orderId) {
+    OrderBook::Order* order = books[resource].getOrder(orderId);
+    if (order == nullptr || order->reserved <= 0) {
+        return;
+    }
+
+    if (order->side == OrderBook::BUY) {
+        creditTicks(order->kingdomId, order->reserved);
+    }
+    else {
+        getResource(order->kingdomId, resource)->changeAmount(static_cast<int>(order->reserved));
+    }
+    order->reserved = 0;
+}
+
+void Exchange::settle(int resource) {
+    for (size_t i = 0; i < fills.size(); i++) {
+        const OrderBook::Fill& fill = fills[i];
+        long long value = static_cast<long long>(fill.price) * fill.quantity;
+
+        // Buyer receives goods paid from escrow, seller is paid in gold
+        getResource(fill.buyerId, resource)->changeAmount(fill.quantity);
+        books[resource].getOrder(fill.buyOrderId)->reserved -= value;
+        books[resource].getOrder(fill.sellOrderId)->reserved -= fill.quantity;
+        creditTicks(fill.sellerId, value);
+
+        tradeCount++;
+        tradedVolume += fill.quantity;
+    }
+
+    // A completed bid refunds whatever it saved below its limit price
+    for (size_t i = 0; i < fills.size(); i++) {
+        if (books[resource].getOrder(fills[i].buyOrderId)->quantity == 0) {
+            releaseEscrow(resource, fills[i].buyOrderId);
+        }
+    }
+    fills.clear();
+}
+
+int Exchange::placeOrder(int kingdomId, const string& resourceType, OrderBook::Side side,
+    double price, int quantity) {
+    int resource = resourceIndex(resourceType);
+    if (resource < 0 || kingdomId < 0 || kingdomId >= getKingdomCount() || quantity <= 0) {
+        return -1;
+    }
+
+    int ticks = static_cast<int>(price * 100.0 + 0.5);
+    if (ticks < 1 || ticks > books[resource].getMaxTick()) {
+        return -1;
+    }
+
+    // Hold back the buyer's gold or the seller's goods until the order completes
+    long long reserved = 0;
+    if (side == OrderBook::BUY) {
+        Economy* economy = kingdoms[kingdomId]->getEconomy();
+        long long gold = (static_cast<long long>(ticks) * quantity + 99) / 100;
+        if (economy->getTreasuryGold() < gold) {
+            return -1;
+        }
+        economy->setTreasuryGold(economy->getTreasuryGold() - static_cast<int>(gold));
+        reserved = gold * 100;
+    }
+    else {
+        Resource* stock = getResource(kingdomId, resource);
+        if (stock->getAmount() < quantity) {
+            return -1;
+        }
+        stock->changeAmount(-quantity);
+        reserved = quantity;
+    }
+
+    int orderId = books[resource].submit(side, kingdomId, ticks, quantity, fills, reserved);
+    settle(resource);
+    return orderId;
+}
+
+bool Exchange::cancelOrder(const string& resourceType, int orderId) {
+    int resource = resourceIndex(resourceType);
+    if (resource < 0 || !books[resource].cancel(orderId)) {
+        return false;
+    }
+    releaseEscrow(resource, orderId);
+    return true;
+}
+
+void Exchange::runAuctions() {
+    for (int r = 0; r < RESOURCE_COUNT; r++) {
+        if (books[r].runAuction(fills) > 0) {
+            settle(r);
+        }
+    }
+}
+
+// ---------------------------
+// TradeNetwork implementation
+// ---------------------------
+
+TradeNetwork::TradeNetwork()
+    : componentCount(0), topologyChanged(false), lastSolvedComponents(0), lastSolvedGoods(0), lastPlanned(0),
+    lastShipped(0), lastTransportCost(0) {
+}
+
+TradeNetwork::~TradeNetwork() {}
+
+int TradeNetwork::addKingdom(Kingdom* kingdom) {
+    int id = static_cast<int>(kingdoms.size());
+    kingdoms.push_back(kingdom);
+    for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+        supply.push_back(0);
+        demand.push_back(0);
+        solvedSupply.push_back(0);
+        solvedDemand.push_back(0);
+    }
+    componentOf.push_back(-1);
+    localIndex.push_back(-1);
+    touchedKingdoms.push_back(id);
+    topologyChanged = true;
+    return id;
+}
+
+int TradeNetwork::addRoute(int from, int to, int capacity, int costPerUnit) {
+    int count = getKingdomCount();
+    if (from < 0 || from >= count || to < 0 || to >= count || from == to || capacity <= 0 || costPerUnit < 0) {
+        return -1;
+    }
+
+    Route route = { from, to, capacity, costPerUnit, true };
+    routes.push_back(route);
+    for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+        routeFlows.push_back(0);
+        routeUsed.push_back(0);
+        routeUsed.push_back(0);
+    }
+    touchedKingdoms.push_back(from);
+    touchedKingdoms.push_back(to);
+    topologyChanged = true;
+    return static_cast<int>(routes.size()) - 1;
+}
+
+void TradeNetwork::setRouteActive(int routeId, bool active) {
+    if (routeId < 0 || routeId >= getRouteCount() || routes[routeId].active == active) {
+        return;
+    }
+
+    routes[routeId].active = active;
+    for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+        routeFlows[routeId * Exchange::RESOURCE_COUNT + r] = 0;
+        routeUsed[(routeId * Exchange::RESOURCE_COUNT + r) * 2] = 0;
+        routeUsed[(routeId * Exchange::RESOURCE_COUNT + r) * 2 + 1] = 0;
+    }
+    touchedKingdoms.push_back(routes[routeId].from);
+    touchedKingdoms.push_back(routes[routeId].to);
+    topologyChanged = true;
+}
+
+int TradeNetwork::getKingdomCount() const {
+    return static_cast<int>(kingdoms.size());
+}
+
+int TradeNetwork::getRouteCount() const {
+    return static_cast<int>(routes.size());
+}
+
+const TradeNetwork::Route& TradeNetwork::getRoute(int routeId) const {
+    return routes[routeId];
+}
+
+int TradeNetwork::getFlow(int routeId, int resource) const {
+    return routeFlows[routeId * Exchange::RESOURCE_COUNT + resource];
+}
+
+int TradeNetwork::getComponentCount() const {
+    return componentCount;
+}
+
+int TradeNetwork::getLastSolvedComponents() const {
+    return lastSolvedComponents;
+}
+
+int TradeNetwork::getLastSolvedGoods() const {
+    return lastSolvedGoods;
+}
+
+long long TradeNetwork::getLastPlanned() const {
+    return lastPlanned;
+}
+
+long long TradeNetwork::getLastShipped() const {
+    return lastShipped;
+}
+
+long long TradeNetwork::getLastTransportCost() const {
+    return lastTransportCost;
+}
+
+bool TradeNetwork::wasSolved(int kingdomId) const {
+    return componentOf[kingdomId] >= 0 && componentOf[kingdomId] < static_cast<int>(componentSolved.size()) &&
+        componentSolved[componentOf[kingdomId]];
+}
+
+// Union-find root with path halving
+static int findRoot(vector<int>& parent, int node) {
+    while (parent[node] != node) {
+        parent[node] = parent[parent[node]];
+        node = parent[node];
+    }
+    return node;
+}
+
+void TradeNetwork::rebuildComponents() {
+    int count = getKingdomCount();
+    vector<int> parent(count);
+    for (int i = 0; i < count; i++) {
+        parent[i] = i;
+    }
+    for (size_t i = 0; i < routes.size(); i++) {
+        if (routes[i].active) {
+            parent[findRoot(parent, routes[i].from)] = findRoot(parent, routes[i].to);
+        }
+    }
+
+    // Number the components and group their members and routes
+    vector<int> componentOfRoot(count, -1);
+    componentCount = 0;
+    componentMembers.clear();
+    componentRoutes.clear();
+    for (int i = 0; i < count; i++) {
+        int root = findRoot(parent, i);
+        if (componentOfRoot[root] < 0) {
+            componentOfRoot[root] = componentCount++;
+            componentMembers.push_back(vector<int>());
+            componentRoutes.push_back(vector<int>());
+        }
+        componentOf[i] = componentOfRoot[root];
+        componentMembers[componentOf[i]].push_back(i);
+    }
+    for (size_t i = 0; i < routes.size(); i++) {
+        if (routes[i].active) {
+            componentRoutes[componentOf[routes[i].from]].push_back(static_cast<int>(i));
+        }
+    }
+
+    // Only components holding a changed route endpoint need solving again
+    componentDirty.assign(componentCount, false);
+    for (size_t i = 0; i < touchedKingdoms.size(); i++) {
+        componentDirty[componentOf[touchedKingdoms[i]]] = true;
+    }
+    touchedKingdoms.clear();
+    topologyChanged = false;
+}
+
+void TradeNetwork::computeBalances() {
+    int production[Exchange::RESOURCE_COUNT];
+    int consumption[Exchange::RESOURCE_COUNT];
+
+    for (int k = 0; k < getKingdomCount(); k++) {
+        Kingdom* kingdom = kingdoms[k];
+        if (kingdom->usesDesignerRules()) {
+            kingdom->getMarket()->projectProduction<designerRuleset>(*kingdom->getPopulation(), production);
+            kingdom->getMarket()->projectConsumption<designerRuleset>(*kingdom->getPopulation(), *kingdom->getArmy(), consumption);
+        }
+        else {
+            kingdom->getMarket()->projectProduction<standardRuleset>(*kingdom->getPopulation(), production);
+            kingdom->getMarket()->projectConsumption<standardRuleset>(*kingdom->getPopulation(), *kingdom->getArmy(), consumption);
+        }
+
+        for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+            int net = production[r] - consumption[r];
+            supply[k * Exchange::RESOURCE_COUNT + r] = max(0, net);
+            demand[k * Exchange::RESOURCE_COUNT + r] = max(0, -net);
+        }
+    }
+}
+
+bool TradeNetwork::balanceChanged(int kingdomIndex, int resource) const {
+    int index = kingdomIndex * Exchange::RESOURCE_COUNT + resource;
+    return supply[index] != solvedSupply[index] || demand[index] != solvedDemand[index];
+}
+
+void TradeNetwork::solveComponent(int component, int firstResource) {
+    const vector<int>& members = componentMembers[component];
+    const vector<int>& routeIds = componentRoutes[component];
+    int memberCount = static_cast<int>(members.size());
+
+    for (int i = 0; i < memberCount; i++) {
+        localIndex[members[i]] = i;
+        for (int r = firstResource; r < Exchange::RESOURCE_COUNT; r++) {
+            int index = members[i] * Exchange::RESOURCE_COUNT + r;
+            solvedSupply[index] = supply[index];
+            solvedDemand[index] = demand[index];
+        }
+    }
+
+    // Goods are solved in order of need; each one uses the capacity the previous left
+    vector<int> forwardLeft(routeIds.size());
+    vector<int> backwardLeft(routeIds.size());
+    for (size_t i = 0; i < routeIds.size(); i++) {
+        forwardLeft[i] = routes[routeIds[i]].capacity;
+        backwardLeft[i] = routes[routeIds[i]].capacity;
+        for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+            int index = routeIds[i] * Exchange::RESOURCE_COUNT + r;
+            if (r < firstResource) {
+                forwardLeft[i] -= routeUsed[index * 2];
+                backwardLeft[i] -= routeUsed[index * 2 + 1];
+            }
+            else {
+                routeFlows[index] = 0;
+                routeUsed[index * 2] = 0;
+                routeUsed[index * 2 + 1] = 0;
+            }
+        }
+    }
+
+    int source = memberCount;
+    int sink = memberCount + 1;
+    int nodeCount = memberCount + 2;
+
+    for (int r = firstResource; r < Exchange::RESOURCE_COUNT && !routeIds.empty(); r++) {
+        vector<Arc> arcs;
+        vector<vector<int> > adjacency(nodeCount);
+        long long totalSupply = 0;
+        long long totalDemand = 0;
+
+        // Paired arcs: index ^ 1 is always the residual twin
+        struct ArcBuilder {
+            static void add(vector<Arc>& arcs, vector<vector<int> >& adjacency, int from, int to, int capacity, int cost) {
+                Arc forward = { to, capacity, cost, 0 };
+                Arc backward = { from, 0, -cost, 0 };
+                adjacency[from].push_back(static_cast<int>(arcs.size()));
+                arcs.push_back(forward);
+                adjacency[to].push_back(static_cast<int>(arcs.size()));
+                arcs.push_back(backward);
+            }
+        };
+
+        for (int i = 0; i < memberCount; i++) {
+            int index = members[i] * Exchange::RESOURCE_COUNT + r;
+            if (supply[index] > 0) {
+                ArcBuilder::add(arcs, adjacency, source, i, supply[index], 0);
+                totalSupply += supply[index];
+            }
+            if (demand[index] > 0) {
+                ArcBuilder::add(arcs, adjacency, i, sink, demand[index], 0);
+                totalDemand += demand[index];
+            }
+        }
+        if (totalSupply == 0 || totalDemand == 0) {
+            continue;
+        }
+
+        vector<int> forwardArc(routeIds.size());
+        vector<int> backwardArc(routeIds.size());
+        for (size_t i = 0; i < routeIds.size(); i++) {
+            const Route& route = routes[routeIds[i]];
+            forwardArc[i] = static_cast<int>(arcs.size());
+            ArcBuilder::add(arcs, adjacency, localIndex[route.from], localIndex[route.to], forwardLeft[i], route.costPerUnit);
+            backwardArc[i] = static_cast<int>(arcs.size());
+            ArcBuilder::add(arcs, adjacency, localIndex[route.to], localIndex[route.from], backwardLeft[i], route.costPerUnit);
+        }
+
+        // Successive shortest paths with a queue-based Bellman-Ford
+        vector<long long> distance(nodeCount);
+        vector<int> previousArc(nodeCount);
+        vector<bool> queued(nodeCount);
+        vector<int> queue;
+        while (true) {
+            for (int i = 0; i < nodeCount; i++) {
+                distance[i] = -1;
+                previousArc[i] = -1;
+                queued[i] = false;
+            }
+            distance[source] = 0;
+            queue.assign(1, source);
+            queued[source] = true;
+
+            for (size_t head = 0; head < queue.size(); head++) {
+                int node = queue[head];
+                queued[node] = false;
+                for (size_t j = 0; j < adjacency[node].size(); j++) {
+                    const Arc& arc = arcs[adjacency[node][j]];
+                    if (arc.capacity - arc.flow <= 0) {
+                        continue;
+                    }
+                    long long candidate = distance[node] + arc.cost;
+                    if (distance[arc.to] < 0 || candidate < distance[arc.to]) {
+                        distance[arc.to] = candidate;
+                        previousArc[arc.to] = adjacency[node][j];
+                        if (!queued[arc.to]) {
+                            queued[arc.to] = true;
+                            queue.push_back(arc.to);
+                        }
+                    }
+                }
+            }
+            if (distance[sink] < 0) {
+                break;
+            }
+
+            int pushed = -1;
+            for (int node = sink; node != source; node = arcs[previousArc[node] ^ 1].to) {
+                const Arc& arc = arcs[previousArc[node]];
+                int residual = arc.capacity - arc.flow;
+                pushed = pushed < 0 ? residual : min(pushed, residual);
+            }
+            for (int node = sink; node != source; node = arcs[previousArc[node] ^ 1].to) {
+                arcs[previousArc[node]].flow += pushed;
+                arcs[previousArc[node] ^ 1].flow -= pushed;
+            }
+        }
+
+        for (size_t i = 0; i < routeIds.size(); i++) {
+            int forwardFlow = arcs[forwardArc[i]].flow;
+            int backwardFlow = arcs[backwardArc[i]].flow;
+            int index = routeIds[i] * Exchange::RESOURCE_COUNT + r;
+            routeFlows[index] = forwardFlow - backwardFlow;
+            routeUsed[index * 2] = forwardFlow;
+            routeUsed[index * 2 + 1] = backwardFlow;
+            forwardLeft[i] -= forwardFlow;
+            backwardLeft[i] -= backwardFlow;
+        }
+    }
+
+    for (int i = 0; i < memberCount; i++) {
+        localIndex[members[i]] = -1;
+    }
+}
+
+void TradeNetwork::applyFlows() {
+    lastPlanned = 0;
+    lastShipped = 0;
+    lastTransportCost = 0;
+    for (size_t i = 0; i < routes.size(); i++) {
+        if (!routes[i].active) {
+            continue;
+        }
+        for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+            int flow = routeFlows[i * Exchange::RESOURCE_COUNT + r];
+            if (flow == 0) {
+                continue;
+            }
+
+            Kingdom* exporter = kingdoms[flow > 0 ? routes[i].from : routes[i].to];
+            Kingdom* importer = kingdoms[flow > 0 ? routes[i].to : routes[i].from];
+            Resource* exported = resourceOf(exporter, r);
+            Economy* buyer = importer->getEconomy();
+            int amount = min(abs(flow), exported->getAmount());
+            lastPlanned += abs(flow);
+
+            // Goods move at the exporter's price plus the route's cost, as far as the importer can pay
+            double unitPrice = exported->getValue() + routes[i].costPerUnit;
+            if (unitPrice > 0.0) {
+                amount = min(amount, static_cast<int>(max(0, buyer->getTreasuryGold()) / unitPrice));
+            }
+            if (amount <= 0) {
+                continue;
+            }
+            int payment = static_cast<int>(amount * exported->getValue());
+            int transport = amount * routes[i].costPerUnit;
+            exported->changeAmount(-amount);
+            resourceOf(importer, r)->changeAmount(amount);
+            buyer->setTreasuryGold(buyer->getTreasuryGold() - payment - transport);
+            exporter->getEconomy()->setTreasuryGold(exporter->getEconomy()->getTreasuryGold() + payment);
+            lastShipped += amount;
+            lastTransportCost += transport;
+        }
+    }
+}
+
+void TradeNetwork::solve(bool everything) {
+    if (topologyChanged) {
+        rebuildComponents();
+    }
+
+    computeBalances();
+    componentFirstGood.assign(componentCount, Exchange::RESOURCE_COUNT);
+    for (int c = 0; c < componentCount; c++) {
+        if (everything || componentDirty[c]) {
+            componentFirstGood[c] = 0;
+        }
+    }
+    for (int k = 0; k < getKingdomCount(); k++) {
+        int& first = componentFirstGood[componentOf[k]];
+        for (int r = 0; r < first; r++) {
+            if (balanceChanged(k, r)) {
+                first = r;
+                break;
+            }
+        }
+    }
+
+    lastSolvedComponents = 0;
+    lastSolvedGoods = 0;
+    componentSolved.assign(componentCount, false);
+    for (int c = 0; c < componentCount; c++) {
+        if (componentFirstGood[c] < Exchange::RESOURCE_COUNT) {
+            solveComponent(c, componentFirstGood[c]);
+            componentDirty[c] = false;
+            componentSolved[c] = true;
+            lastSolvedComponents++;
+            lastSolvedGoods += Exchange::RESOURCE_COUNT - componentFirstGood[c];
+        }
+    }
+}
+
+void TradeNetwork::advanceYear() {
+    solve();
+    applyFlows();
+}
+
+// ---------------------------
+// BattleEngine implementation
+// ---------------------------
+
+BattleEngine::BattleEngine() {}
+
+BattleEngine::~BattleEngine() {}
+
+int BattleEngine::addBattle(const Force& attacker, const Force& defender) {
+    // Training sharpens every soldier the same way calculateStrength does
+    attackerInfantry.push_back(static_cast<float>(attacker.infantry));
+    attackerCavalry.push_back(static_cast<float>(attacker.cavalry));
+    attackerArchers.push_back(static_cast<float>(attacker.archers));
+    attackerMorale.push_back(static_cast<float>(attacker.morale));
+    attackerQuality.push_back(0.8f + attacker.trainingLevel * 0.2f);
+    attackerTraining.push_back(attacker.trainingLevel);
+
+    defenderInfantry.push_back(static_cast<float>(defender.infantry));
+    defenderCavalry.push_back(static_cast<float>(defender.cavalry));
+    defenderArchers.push_back(static_cast<float>(defender.archers));
+    defenderMorale.push_back(static_cast<float>(defender.morale));
+    defenderQuality.push_back(0.8f + defender.trainingLevel * 0.2f);
+    defenderTraining.push_back(defender.trainingLevel);
+
+    active.push_back(1.0f);
+    roundsFought.push_back(0.0f);
+    return getBattleCount() - 1;
+}
+
+int BattleEngine::getBattleCount() const {
+    return static_cast<int>(active.size());
+}
+
+void BattleEngine::clear() {
+    attackerInfantry.clear();
+    attackerCavalry.clear();
+    attackerArchers.clear();
+    attackerMorale.clear();
+    attackerQuality.clear();
+    attackerTraining.clear();
+    defenderInfantry.clear();
+    defenderCavalry.clear();
+    defenderArchers.clear();
+    defenderMorale.clear();
+    defenderQuality.clear();
+    defenderTraining.clear();
+    active.clear();
+    roundsFought.clear();
+}
+
+void BattleEngine::resolveAll(int maxRounds) {
+    // Share of enemy firepower that turns into casualties each round
+    const float lethality = 0.08f;
+    const float breakingMorale = 0.2f;
+    const int n = getBattleCount();
+
+    float* __restrict aInf = attackerInfantry.data();
+    float* __restrict aCav = attackerCavalry.data();
+    float* __restrict aArc = attackerArchers.data();
+    float* __restrict aMor = attackerMorale.data();
+    const float* __restrict aQual = attackerQuality.data();
+    float* __restrict dInf = defenderInfantry.data();
+    float* __restrict dCav = defenderCavalry.data();
+    float* __restrict dArc = defenderArchers.data();
+    float* __restrict dMor = defenderMorale.data();
+    const float* __restrict dQual = defenderQuality.data();
+    float* __restrict act = active.data();
+    float* __restrict rounds = roundsFought.data();
+
+    for (int round = 0; round < maxRounds; round++) {
+        for (int i = 0; i < n; i++) {
+            // Both sides fire at once; firepower uses the calculateStrength weights
+            const float aFire = (aInf[i] + aCav[i] * 3.0f + aArc[i] * 2.0f) * aQual[i] * (0.5f + 0.5f * aMor[i]);
+            const float dFire = (dInf[i] + dCav[i] * 3.0f + dArc[i] * 2.0f) * dQual[i] * (0.5f + 0.5f * dMor[i]);
+
+            // Infantry holds the front line, archers stand behind it
+            const float aExposure = aInf[i] * 1.2f + aCav[i] + aArc[i] * 0.5f + 1e-6f;
+            const float dExposure = dInf[i] * 1.2f + dCav[i] + dArc[i] * 0.5f + 1e-6f;
+            float aRate = act[i] * lethality * dFire / aExposure;
+            float dRate = act[i] * lethality * aFire / dExposure;
+            aRate = aRate > 0.8f ? 0.8f : aRate; // Keeps infantry losses below the whole line
+            dRate = dRate > 0.8f ? 0.8f : dRate;
+
+            const float aBefore = aInf[i] + aCav[i] + aArc[i];
+            const float dBefore = dInf[i] + dCav[i] + dArc[i];
+            aInf[i] -= aInf[i] * aRate * 1.2f;
+            aCav[i] -= aCav[i] * aRate;
+            aArc[i] -= aArc[i] * aRate * 0.5f;
+            dInf[i] -= dInf[i] * dRate * 1.2f;
+            dCav[i] -= dCav[i] * dRate;
+            dArc[i] -= dArc[i] * dRate * 0.5f;
+            const float aAfter = aInf[i] + aCav[i] + aArc[i];
+            const float dAfter = dInf[i] + dCav[i] + dArc[i];
+
+            // Morale falls with the share of the force lost this round
+            float aM = aMor[i] - 1.5f * (aBefore - aAfter) / (aBefore + 1e-6f);
+            float dM = dMor[i] - 1.5f * (dBefore - dAfter) / (dBefore + 1e-6f);
+            aMor[i] = aM < 0.0f ? 0.0f : aM;
+            dMor[i] = dM < 0.0f ? 0.0f : dM;
+
+            // A battle stops once either side breaks or is wiped out
+            rounds[i] += act[i];
+            const bool fighting = (aMor[i] > breakingMorale) & (dMor[i] > breakingMorale) & (aAfter >= 1.0f) & (dAfter >= 1.0f);
+            act[i] = fighting ? act[i] : 0.0f;
+        }
+    }
+}
+
+BattleEngine::Result BattleEngine::getResult(int battle) const {
+    Result result;
+    result.attacker.infantry = static_cast<int>(attackerInfantry[battle] + 0.5f);
+    result.attacker.cavalry = static_cast<int>(attackerCavalry[battle] + 0.5f);
+    result.attacker.archers = static_cast<int>(attackerArchers[battle] + 0.5f);
+    result.attacker.morale = attackerMorale[battle];
+    result.attacker.trainingLevel = attackerTraining[battle];
+    result.defender.infantry = static_cast<int>(defenderInfantry[battle] + 0.5f);
+    result.defender.cavalry = static_cast<int>(defenderCavalry[battle] + 0.5f);
+    result.defender.archers = static_cast<int>(defenderArchers[battle] + 0.5f);
+    result.defender.morale = defenderMorale[battle];
+    result.defender.trainingLevel = defenderTraining[battle];
+    result.rounds = static_cast<int>(roundsFought[battle]);
+
+    // The side still holding the field with more strength wins
+    result.attackerWon = calculateStrength(result.attacker) > calculateStrength(result.defender);
+    return result;
+}
+
+int BattleEngine::calculateStrength(const Force& force) {
+    // Same formula as Army::calculateStrength
+    int baseStrength = force.infantry + (force.cavalry * 3) + (force.archers * 2);
+    double moraleMultiplier = 0.5 + (force.morale * 0.5);
+    double trainingMultiplier = 0.8 + (force.trainingLevel * 0.2);
+    return static_cast<int>(baseStrength * moraleMultiplier * trainingMultiplier);
+}
+
+BattleEngine::Force BattleEngine::forceFromStrength(int strength) {
+    // Foreign kingdoms field a 60/20/20 mix at average morale and basic training
+    Force force;
+    force.morale = 0.7;
+    force.trainingLevel = 1;
+    int units = static_cast<int>(strength / (0.85 * 1.6));
+    force.infantry = units * 6 / 10;
+    force.cavalry = units * 2 / 10;
+    force.archers = units - force.infantry - force.cavalry;
+    return force;
+}
+
+// Player army as a battle force, split evenly across simultaneous fronts
+static BattleEngine::Force forceFromArmy(const Army& army, int fronts) {
+    BattleEngine::Force force;
+    force.infantry = army.getInfantry() / fronts;
+    force.cavalry = army.getCavalry() / fronts;
+    force.archers = army.getArchers() / fronts;
+    force.morale = army.getMorale();
+    force.trainingLevel = army.getTrainingLevel();
+    return force;
+}
+
+// ------------------------
+// Diplomacy implementation
+// ------------------------
+
+Diplomacy::Diplomacy(int maxForeignKingdoms)
+    : maxKingdoms(maxForeignKingdoms), kingdomCount(0), relationCost(20), peaceCost(200), firstBattle(0) {
+
+    foreignKingdoms = new Kingdom[maxKingdoms];
+
+    // Initialize with some default kingdoms
+    addKingdom("Northlands", 500 + rand() % 500);
+    addKingdom("Eastern Empire", 600 + rand() % 600);
+    addKingdom("Southern Realms", 400 + rand() % 400);
+}
+
+Diplomacy::~Diplomacy() {
+    delete[] foreignKingdoms;
+}
+
+void Diplomacy::addKingdom(const string& name, int strength) {
+    if (kingdomCount < maxKingdoms) {
+        foreignKingdoms[kingdomCount].nameHandle = StringTable::intern(name);
+        foreignKingdoms[kingdomCount].relationLevel = 0; // Neutral
+        foreignKingdoms[kingdomCount].isAlly = false;
+        foreignKingdoms[kingdomCount].atWar = false;
+        foreignKingdoms[kingdomCount].strength = strength;
+        kingdomCount++;
+    }
+}
+
+void Diplomacy::clearKingdoms() {
+    kingdomCount = 0;
+}
+
+int Diplomacy::getRelationCost() const {
+    return relationCost;
+}
+
+int Diplomacy::getPeaceCost() const {
+    return peaceCost;
+}
+
+void Diplomacy::setRelationCost(int cost) {
+    relationCost = max(0, cost);
+}
+
+void Diplomacy::setPeaceCost(int cost) {
+    peaceCost = max(0, cost);
+}
+
+void Diplomacy::setCapacity(int maxForeignKingdoms) {
+    if (maxForeignKingdoms <= maxKingdoms) {
+        return;
+    }
+    Kingdom* grown = new Kingdom[maxForeignKingdoms];
+    copy(foreignKingdoms, foreignKingdoms + kingdomCount, grown);
+    delete[] foreignKingdoms;
+    foreignKingdoms = grown;
+    maxKingdoms = maxForeignKingdoms;
+}
+
+bool Diplomacy::improveRelations(const string& kingdomName, Economy& economy) {
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            // Lower cost and increase relation impact
+            int cost = relationCost + (foreignKingdoms[i].relationLevel * 5); // Reduced cost
+
+            if (economy.getTreasuryGold() >= cost) {
+                economy.setTreasuryGold(economy.getTreasuryGold() - cost);
+                foreignKingdoms[i].relationLevel = min(10, foreignKingdoms[i].relationLevel + 2); // +2 instead of +1
+                Logger::info("Spent {} gold to improve relations!", cost);
+                return true;
+            }
+            else {
+                Logger::warning("Not enough gold! Need {} gold.", cost);
+                return false;
+            }
+        }
+    }
+    Logger::warning("Kingdom '{}' not found!", kingdomName);
+    return false;
+}
+
+bool Diplomacy::declareWar(const string& kingdomName, Army& army) {
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            if (!foreignKingdoms[i].atWar) {
+                foreignKingdoms[i].atWar = true;
+                foreignKingdoms[i].isAlly = false;
+                foreignKingdoms[i].relationLevel = max(-10, foreignKingdoms[i].relationLevel - 5); // More significant drop
+                army.setWarStatus(true);
+                Logger::info("Your army mobilizes for war!");
+                return true;
+            }
+            Logger::warning("Already at war with {}!", kingdomName);
+            return false;
+        }
+    }
+    Logger::warning("Kingdom '{}' not found!", kingdomName);
+    return false;
+}
+
+bool Diplomacy::signPeace(const string& kingdomName, Economy& economy) {
+    // Find the kingdom
+    Army army;
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            if (foreignKingdoms[i].atWar) {
+                // Peace treaties often require reparations
+                int cost = peaceCost + (foreignKingdoms[i].strength / 10);
+
+                if (economy.getTreasuryGold() >= cost) {
+                    economy.setTreasuryGold(economy.getTreasuryGold() - cost);
+                    foreignKingdoms[i].atWar = false;
+                    foreignKingdoms[i].relationLevel = 0; // Reset to neutral
+
+                    // Check if still at war with any kingdom
+                    bool stillAtWar = false;
+                    for (int j = 0; j < kingdomCount; j++) {
+                        if (foreignKingdoms[j].atWar) {
+                            stillAtWar = true;
+                            break;
+                        }
+                    }
+
+                    // Update army war status if no longer at war with anyone
+                    if (!stillAtWar) {
+                        army.setWarStatus(false);
+                    }
+
+                    return true;
+                }
+                else {
+                    return false; // Not enough gold
+                }
+            }
+            return false; // Not at war
+        }
+    }
+    return false; // Kingdom not found
+}
+
+bool Diplomacy::formAlliance(const string& kingdomName) {
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            if (!foreignKingdoms[i].atWar && foreignKingdoms[i].relationLevel >= 5) { // Lowered from 7
+                foreignKingdoms[i].isAlly = true;
+                foreignKingdoms[i].relationLevel = min(10, foreignKingdoms[i].relationLevel + 1); // Bonus relation
+                Logger::info("{} is now your ally!", kingdomName);
+                return true;
+            }
+            Logger::warning("Cannot ally! Relations too low (need 5+) or at war.");
+            return false;
+        }
+    }
+    Logger::warning("Kingdom '{}' not found!", kingdomName);
+    return false;
+}
+
+bool Diplomacy::establishTrade(const string& kingdomName, Market& market, Economy& economy) {
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            if (!foreignKingdoms[i].atWar && foreignKingdoms[i].relationLevel >= 2) { // Lowered from 3
+                // Increase trade benefits
+                market.getFood()->changeAmount(100 + (foreignKingdoms[i].relationLevel * 20));
+                market.getWood()->changeAmount(50 + (foreignKingdoms[i].relationLevel * 10));
+                market.getIron()->changeAmount(30 + (foreignKingdoms[i].relationLevel * 5));
+                economy.setTreasuryGold(economy.getTreasuryGold() + 200 + (foreignKingdoms[i].relationLevel * 50));
+                Logger::info("Trade deal boosts resources and treasury!");
+                return true;
+            }
+            Logger::warning("Cannot trade! Relations too low (need 2+) or at war.");
+            return false;
+        }
+    }
+    Logger::warning("Kingdom '{}' not found!", kingdomName);
+    return false;
+}
+
+void Diplomacy::updateDiplomacy(Army& army, const Economy& economy) {
+    // All of this year's battles are resolved together
+    BattleEngine battles;
+    queueBattles(army, battles);
+    battles.resolveAll();
+    applyBattles(army, battles);
+}
+
+void Diplomacy::queueBattles(const Army& army, BattleEngine& battles) {
+    // Update relations with foreign kingdoms based on various factors
+    battleFronts.clear();
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].atWar) {
+            // War affects relations
+            foreignKingdoms[i].relationLevel = max(-10, foreignKingdoms[i].relationLevel - 1);
+
+            // 20% chance of a significant battle on this front
+            if (CounterRng::draw(CounterRng::STREAM_DIPLOMACY, 100) < 20) {
+                battleFronts.push_back(i);
+            }
+        }
+        else {
+            // Natural relation drift
+            int drift = CounterRng::draw(CounterRng::STREAM_DIPLOMACY, 3) - 1; // -1, 0, or 1
+            foreignKingdoms[i].relationLevel = max(-10, min(10, foreignKingdoms[i].relationLevel + drift));
+        }
+    }
+
+    firstBattle = battles.getBattleCount();
+    if (battleFronts.empty()) {
+        return;
+    }
+    int fronts = static_cast<int>(battleFronts.size());
+    BattleEngine::Force playerForce = forceFromArmy(army, fronts);
+    for (int b = 0; b < fronts; b++) {
+        battles.addBattle(playerForce, BattleEngine::forceFromStrength(foreignKingdoms[battleFronts[b]].strength));
+    }
+}
+
+void Diplomacy::applyBattles(Army& army, const BattleEngine& battles) {
+    if (battleFronts.empty()) {
+        return;
+    }
+
+    // The army has not moved since queueBattles, so this is the force that fought
+    int fronts = static_cast<int>(battleFronts.size());
+    BattleEngine::Force playerForce = forceFromArmy(army, fronts);
+    int infantryLost = 0;
+    int cavalryLost = 0;
+    int archersLost = 0;
+    double moraleTotal = 0.0;
+    for (int b = 0; b < fronts; b++) {
+        BattleEngine::Result result = battles.getResult(firstBattle + b);
+        Kingdom& enemy = foreignKingdoms[battleFronts[b]];
+        int casualties = (playerForce.infantry - result.attacker.infantry) +
+            (playerForce.cavalry - result.attacker.cavalry) + (playerForce.archers - result.attacker.archers);
+
+        infantryLost += playerForce.infantry - result.attacker.infantry;
+        cavalryLost += playerForce.cavalry - result.attacker.cavalry;
+        archersLost += playerForce.archers - result.attacker.archers;
+        enemy.strength = max(100, BattleEngine::calculateStrength(result.defender));
+
+        if (result.attackerWon) {
+            Logger::info("Your forces defeat {} in battle, losing {} troops!", StringTable::lookup(enemy.nameHandle), casualties);
+            moraleTotal += min(1.0, result.attacker.morale + 0.1);
+        }
+        else {
+            Logger::info("Your forces suffer defeat against {}, losing {} troops!", StringTable::lookup(enemy.nameHandle), casualties);
+            moraleTotal += result.attacker.morale;
+        }
+    }
+
+    army.setInfantry(army.getInfantry() - infantryLost);
+    army.setCavalry(army.getCavalry() - cavalryLost);
+    army.setArchers(army.getArchers() - archersLost);
+    army.setMorale(moraleTotal / fronts);
+    battleFronts.clear();
+}
+
+void Diplomacy::listKingdoms() const {
+    // Display information about all foreign kingdoms
+    cout << "\n===== Foreign Kingdoms =====" << endl;
+    for (int i = 0; i < kingdomCount; i++) {
+        cout << i + 1 << ". " << StringTable::lookup(foreignKingdoms[i].nameHandle) << ":" << endl;
+        cout << "   Relation: ";
+
+        if (foreignKingdoms[i].relationLevel >= 7) {
+            cout << "Friendly";
+        }
+        else if (foreignKingdoms[i].relationLevel >= 3) {
+            cout << "Cordial";
+        }
+        else if (foreignKingdoms[i].relationLevel >= 0) {
+            cout << "Neutral";
+        }
+        else if (foreignKingdoms[i].relationLevel >= -3) {
+            cout << "Suspicious";
+        }
+        else {
+            cout << "Hostile";
+        }
+
+        cout << " (" << foreignKingdoms[i].relationLevel << ")" << endl;
+
+        cout << "   Status: ";
+        if (foreignKingdoms[i].atWar) {
+            cout << "At War";
+        }
+        else if (foreignKingdoms[i].isAlly) {
+            cout << "Allied";
+        }
+        else {
+            cout << "Peaceful";
+        }
+
+        cout << endl;
+        cout << "   Military Strength: " << foreignKingdoms[i].strength << endl;
+    }
+}
+
+int Diplomacy::getRelationLevel(const string& kingdomName) const {
+    // Get relation level with a specific kingdom
+    StringTable::Handle target = StringTable::find(kingdomName);
+    for (int i = 0; i < kingdomCount; i++) {
+        if (foreignKingdoms[i].nameHandle == target) {
+            return foreignKingdoms[i].relationLevel;
+        }
+    }
+    return 0; // Kingdom not found, return neutral
+}
+
+size_t Diplomacy::memoryUsage() const {
+    return maxKingdoms * sizeof(Kingdom) + battleFronts.capacity() * sizeof(int);
+}
+
+// -------------------------
+// LoanLedger implementation
+// -------------------------
+
+typedef pair<int32_t, uint32_t> MaturityEntry;
+
+LoanLedger::LoanLedger()
+    : outstanding(0.0), loanCount(0), year(0) {
+}
+
+LoanLedger::~LoanLedger() {}
+
+uint32_t LoanLedger::addLoan(double principal, double yearlyRate, int termYears, Schedule loanSchedule) {
+    principal = max(0.0, principal);
+    yearlyRate = max(0.0, yearlyRate);
+    termYears = max(1, termYears);
+
+    // Annuity installment, so the last one clears the balance
+    double installment;
+    if (loanSchedule == BULLET) {
+        installment = principal * yearlyRate;
+    }
+    else if (yearlyRate > 0.0) {
+        installment = principal * yearlyRate / (1.0 - pow(1.0 + yearlyRate, -termYears));
+    }
+    else {
+        installment = principal / termYears;
+    }
+
+    uint32_t row;
+    if (!freeRows.empty()) {
+        row = freeRows.back();
+        freeRows.pop_back();
+    }
+    else {
+        row = static_cast<uint32_t>(balance.size());
+        balance.push_back(0.0);
+        rate.push_back(0.0);
+        payment.push_back(0.0);
+        maturity.push_back(0);
+        schedule.push_back(AMORTIZING);
+        open.push_back(0);
+    }
+    balance[row] = principal;
+    rate[row] = yearlyRate;
+    payment[row] = installment;
+    maturity[row] = year + termYears;
+    schedule[row] = loanSchedule;
+    open[row] = 1;
+
+    maturities.push_back(MaturityEntry(maturity[row], row));
+    push_heap(maturities.begin(), maturities.end(), greater<MaturityEntry>());
+    outstanding += principal;
+    loanCount++;
+    return row;
+}
+
+uint32_t LoanLedger::restoreLoan(const Loan& loan) {
+    uint32_t row = addLoan(loan.balance, loan.rate, loan.yearsLeft, loan.schedule);
+    // A loan that fell behind owes more than its installment would clear; keep the installment
+    payment[row] = max(0.0, loan.payment);
+    return row;
+}
+
+void LoanLedger::closeLoan(uint32_t row) {
+    outstanding -= balance[row];
+    balance[row] = 0.0;
+    payment[row] = 0.0;
+    open[row] = 0;
+    freeRows.push_back(row);
+    loanCount--;
+}
+
+double LoanLedger::prepay(double amount) {
+    // Earliest maturity first; amortizing loans keep their installment and end sooner
+    vector<MaturityEntry> order;
+    for (size_t row = 0; row < balance.size(); row++) {
+        if (open[row]) {
+            order.push_back(MaturityEntry(maturity[row], static_cast<uint32_t>(row)));
+        }
+    }
+    sort(order.begin(), order.end());
+
+    double applied = 0.0;
+    for (size_t i = 0; i < order.size() && applied < amount; i++) {
+        uint32_t row = order[i].second;
+        double paid = min(balance[row], amount - applied);
+        balance[row] -= paid;
+        applied += paid;
+    }
+    outstanding -= applied;
+    return applied;
+}
+
+void LoanLedger::writeDown(double amount) {
+    if (outstanding <= 0.0 || amount <= 0.0) {
+        return;
+    }
+    double factor = max(0.0, 1.0 - amount / outstanding);
+    for (size_t row = 0; row < balance.size(); row++) {
+        balance[row] *= factor;
+        payment[row] *= factor;
+    }
+    outstanding *= factor;
+}
+
+LoanLedger::YearSummary LoanLedger::advanceYear(double funds) {
+    YearSummary summary = { 0.0, 0.0, 0.0, 0, 0 };
+    year++;
+
+    // Closed rows hold zeros, so both passes run over every row without branching
+    const size_t rows = balance.size();
+    double* __restrict b = balance.data();
+    const double* __restrict r = rate.data();
+    const double* __restrict p = payment.data();
+    double interest = 0.0;
+    double due = 0.0;
+    for (size_t i = 0; i < rows; i++) {
+        double accrued = b[i] * r[i];
+        b[i] += accrued;
+        interest += accrued;
+        due += min(b[i], p[i]);
+    }
+
+    // Short funds pay every installment in the same proportion; the rest stays owed
+    double share = due > 0.0 ? min(1.0, max(0.0, funds) / due) : 0.0;
+    double total = 0.0;
+    for (size_t i = 0; i < rows; i++) {
+        b[i] -= min(b[i], p[i]) * share;
+        total += b[i];
+    }
+    outstanding = total;
+    summary.interest = interest;
+    summary.due = due;
+    summary.paid = due * share;
+    funds -= summary.paid;
+
+    // A loan at maturity owes what is left in one sum, or rolls over for a year
+    while (!maturities.empty() && maturities.front().first <= year) {
+        pop_heap(maturities.begin(), maturities.end(), greater<MaturityEntry>());
+        MaturityEntry entry = maturities.back();
+        maturities.pop_back();
+        uint32_t row = entry.second;
+        if (!open[row] || maturity[row] != entry.first) {
+            continue;
+        }
+
+        double settled = min(balance[row], max(0.0, funds));
+        balance[row] -= settled;
+        outstanding -= settled;
+        funds -= settled;
+        summary.paid += settled;
+        if (balance[row] < 0.5) {
+            closeLoan(row);
+            summary.matured++;
+        }
+        else {
+            maturity[row] = year + 1;
+            payment[row] = balance[row] * (1.0 + rate[row]);
+            maturities.push_back(MaturityEntry(maturity[row], row));
+            push_heap(maturities.begin(), maturities.end(), greater<MaturityEntry>());
+            summary.defaulted++;
+        }
+    }
+    return summary;
+}
+
+double LoanLedger::getOutstanding() const {
+    return outstanding;
+}
+
+double LoanLedger::getScheduledPayments() const {
+    double total = 0.0;
+    for (size_t row = 0; row < balance.size(); row++) {
+        total += min(balance[row] * (1.0 + rate[row]), payment[row]);
+    }
+    return total;
+}
+
+int LoanLedger::getLoanCount() const {
+    return loanCount;
+}
+
+int LoanLedger::getYear() const {
+    return year;
+}
+
+size_t LoanLedger::getRowCount() const {
+    return balance.size();
+}
+
+bool LoanLedger::getLoan(uint32_t row, Loan& loan) const {
+    if (row >= balance.size() || !open[row]) {
+        return false;
+    }
+    loan.balance = balance[row];
+    loan.rate = rate[row];
+    loan.payment = payment[row];
+    loan.yearsLeft = maturity[row] - year;
+    loan.schedule = static_cast<Schedule>(schedule[row]);
+    return true;
+}
+
+size_t LoanLedger::memoryUsage() const {
+    return balance.capacity() * sizeof(double) + rate.capacity() * sizeof(double) +
+        payment.capacity() * sizeof(double) + maturity.capacity() * sizeof(int32_t) +
+        schedule.capacity() + open.capacity() + freeRows.capacity() * sizeof(uint32_t) +
+        maturities.capacity() * sizeof(MaturityEntry);
+}
+
+// ------------------
+// Bank implementation
+// ------------------
+
+Bank::Bank(double initialInterestRate, int initialMaxLoan)
+    : interestRate(initialInterestRate), maxLoanAmount(initialMaxLoan),
+    loanTerm(10), corruptionLevel(0) {
+}
+
+Bank::~Bank() {}
+
+double Bank::getInterestRate() const {
+    return interestRate;
+}
+
+int Bank::getMaxLoanAmount() const {
+    return maxLoanAmount;
+}
+
+int Bank::getCurrentLoans() const {
+    return static_cast<int>(llround(ledger.getOutstanding()));
+}
+
+int Bank::getLoanTerm() const {
+    return loanTerm;
+}
+
+int Bank::getCorruptionLevel() const {
+    return corruptionLevel;
+}
+
+const LoanLedger& Bank::getLedger() const {
+    return ledger;
+}
+
+LoanLedger& Bank::getLedgerMutable() {
+    return ledger;
+}
+
+void Bank::setInterestRate(double rate) {
+    interestRate = max(0.01, min(0.2, rate));
+}
+
+void Bank::setMaxLoanAmount(int amount) {
+    maxLoanAmount = max(100, amount);
+}
+
+void Bank::setLoanTerm(int years) {
+    loanTerm = max(1, min(50, years));
+}
+
+void Bank::setCorruptionLevel(int level) {
+    corruptionLevel = max(0, min(100, level));
+}
+
+bool Bank::takeLoan(int amount, Economy& economy) {
+    // Take a loan from the bank
+    if (amount <= 0 || amount > maxLoanAmount) {
+        return false;
+    }
+
+    // Add loan to debt
+    economy.setDebt(economy.getDebt() + amount);
+
+    // Add money to treasury
+    economy.setTreasuryGold(economy.getTreasuryGold() + amount);
+
+    // Each loan gets today's rate and term for its whole life
+    ledger.addLoan(amount, interestRate, loanTerm);
+
+    return true;
+}
+
+bool Bank::repayLoan(int amount, Economy& economy) {
+    // Repay a loan to the bank
+    if (amount <= 0 || amount > economy.getTreasuryGold() || amount > economy.getDebt()) {
+        return false;
+    }
+
+    // Deduct payment from treasury
+    economy.setTreasuryGold(economy.getTreasuryGold() - amount);
+
+    // Reduce debt
+    economy.setDebt(economy.getDebt() - amount);
+
+    // Early repayment goes to the loans that mature first
+    ledger.prepay(amount);
+
+    return true;
+}
+
+void Bank::updateInterest(Economy& economy) {
+    // Debt from outside the bank (loaded games, events) is booked as a loan; debt
+    // cleared outside it writes the loans down
+    long long tracked = llround(ledger.getOutstanding());
+    if (economy.getDebt() > tracked) {
+        ledger.addLoan(static_cast<double>(economy.getDebt() - tracked), interestRate, loanTerm);
+    }
+    else if (economy.getDebt() < tracked) {
+        ledger.writeDown(static_cast<double>(tracked - economy.getDebt()));
+    }
+
+    // Installments come out of the treasury; whatever it cannot cover stays owed
+    LoanLedger::YearSummary summary = ledger.advanceYear(max(0, economy.getTreasuryGold()));
+    int paid = min(economy.getTreasuryGold(), static_cast<int>(llround(summary.paid)));
+    economy.setTreasuryGold(economy.getTreasuryGold() - max(0, paid));
+    economy.setDebt(static_cast<int>(llround(ledger.getOutstanding())));
+
+    if (summary.due > 0.0) {
+        Logger::info("Paid {} gold on loans ({} gold of interest).", paid, static_cast<int>(llround(summary.interest)));
+    }
+    if (summary.paid + 0.5 < summary.due) {
+        Logger::warning("The treasury fell {} gold short of this year's loan installments!",
+            static_cast<int>(llround(summary.due - summary.paid)));
+    }
+    if (summary.defaulted > 0) {
+        Logger::warning("{} loans reached maturity unpaid and roll over for another year.", summary.defaulted);
+    }
+}
+
+void Bank::attemptCorruption(Economy& economy, Population& population) {
+    // Simulate corruption in the banking system
+    if (corruptionLevel > 0) {
+        // Chance of corruption scandal
+        if (CounterRng::draw(CounterRng::STREAM_BANK, 100) < corruptionLevel) {
+            int corruptionAmount = (economy.getTreasuryGold() * corruptionLevel) / 1000;
+            economy.setTreasuryGold(economy.getTreasuryGold() - corruptionAmount);
+
+            Logger::info("A corruption scandal has cost the treasury {} gold!", corruptionAmount);
+
+            // Corruption affects population happiness
+            double happinessImpact = -0.05 - (static_cast<double>(corruptionLevel) / 1000.0);
+            population.setHappiness(population.getHappiness() + happinessImpact);
+        }
+    }
+}
+
+// -------------------------------
+// InterbankNetwork implementation
+// -------------------------------
+
+InterbankNetwork::InterbankNetwork(double interestRate)
+    : interestRate(max(0.0, interestRate)), year(0) {
+}
+
+InterbankNetwork::~InterbankNetwork() {}
+
+int InterbankNetwork::addKingdom(Kingdom* kingdom) {
+    kingdoms.push_back(kingdom);
+    return static_cast<int>(kingdoms.size()) - 1;
+}
+
+int InterbankNetwork::addBank() {
+    return addKingdom(nullptr);
+}
+
+bool InterbankNetwork::bookLoan(int lender, int borrower, double principal) {
+    int count = getBankCount();
+    if (lender < 0 || lender >= count || borrower < 0 || borrower >= count || lender == borrower || principal <= 0.0) {
+        return false;
+    }
+    loanLender.push_back(static_cast<uint32_t>(lender));
+    loanBorrower.push_back(static_cast<uint32_t>(borrower));
+    loanDue.push_back(principal * (1.0 + interestRate));
+    return true;
+}
+
+bool InterbankNetwork::lend(int lender, int borrower, int amount) {
+    int count = getBankCount();
+    if (lender < 0 || lender >= count || borrower < 0 || borrower >= count || !kingdoms[lender] || !kingdoms[borrower]) {
+        return false;
+    }
+    Economy* lenderEconomy = kingdoms[lender]->getEconomy();
+    if (amount <= 0 || amount > lenderEconomy->getTreasuryGold() || !bookLoan(lender, borrower, amount)) {
+        return false;
+    }
+    lenderEconomy->setTreasuryGold(lenderEconomy->getTreasuryGold() - amount);
+    Economy* borrowerEconomy = kingdoms[borrower]->getEconomy();
+    borrowerEconomy->setTreasuryGold(borrowerEconomy->getTreasuryGold() + amount);
+    return true;
+}
+
+void InterbankNetwork::buildClaims() {
+    // Counting sort of the loans by lender
+    const size_t banks = kingdoms.size();
+    const size_t loans = loanDue.size();
+    claimStart.assign(banks + 1, 0);
+    obligations.assign(banks, 0.0);
+    for (size_t k = 0; k < loans; k++) {
+        claimStart[loanLender[k] + 1]++;
+        obligations[loanBorrower[k]] += loanDue[k];
+    }
+    for (size_t i = 0; i < banks; i++) {
+        claimStart[i + 1] += claimStart[i];
+    }
+    claimDebtor.resize(loans);
+    claimAmount.resize(loans);
+    vector<uint32_t> fill(claimStart.begin(), claimStart.end() - 1);
+    for (size_t k = 0; k < loans; k++) {
+        uint32_t slot = fill[loanLender[k]]++;
+        claimDebtor[slot] = loanBorrower[k];
+        claimAmount[slot] = loanDue[k];
+    }
+}
+
+InterbankNetwork::YearMetrics InterbankNetwork::clear(const vector<double>& outsideAssets) {
+    const int banks = getBankCount();
+    YearMetrics metrics = { ++year, banks, getLoanCount(), 0, 0, 0, 0, 0.0, 0.0, 0.0 };
+    buildClaims();
+
+    vector<double> assets(banks, 0.0);
+    vector<uint8_t> fundamental(banks, 0);
+    for (int i = 0; i < banks; i++) {
+        assets[i] = i < static_cast<int>(outsideAssets.size()) ? max(0.0, outsideAssets[i]) : 0.0;
+        double claims = 0.0;
+        for (uint32_t k = claimStart[i]; k < claimStart[i + 1]; k++) {
+            claims += claimAmount[k];
+        }
+        // Short even if every debtor paid in full
+        fundamental[i] = assets[i] + claims < obligations[i] ? 1 : 0;
+        metrics.obligations += obligations[i];
+    }
+
+    // Everyone starts out paying in full; payments only fall from there, so the
+    // sweep settles on the greatest clearing vector. Updating in place lets a default
+    // reach the rest of the network within the same sweep
+    payments = obligations;
+    paidShare.assign(banks, 1.0);
+    received.assign(banks, 0.0);
+    defaulted.assign(banks, 0);
+    const double tolerance = 1e-9 * max(1.0, metrics.obligations);
+    const int maxIterations = 1000;
+    double largestChange;
+    do {
+        largestChange = 0.0;
+        int newDefaults = 0;
+        for (int i = 0; i < banks; i++) {
+            double inflow = 0.0;
+            for (uint32_t k = claimStart[i]; k < claimStart[i + 1]; k++) {
+                inflow += claimAmount[k] * paidShare[claimDebtor[k]];
+            }
+            received[i] = inflow;
+            if (obligations[i] <= 0.0) {
+                continue;
+            }
+            double payment = min(obligations[i], assets[i] + inflow);
+            largestChange = max(largestChange, payments[i] - payment);
+            payments[i] = payment;
+            paidShare[i] = payment / obligations[i];
+            if (!defaulted[i] && payment < obligations[i] - tolerance) {
+                defaulted[i] = 1;
+                newDefaults++;
+            }
+        }
+        metrics.iterations++;
+        metrics.cascadeRounds += newDefaults > 0 ? 1 : 0;
+    } while (largestChange > tolerance && metrics.iterations < maxIterations);
+
+    // What each lender actually got, from the final shares
+    for (int i = 0; i < banks; i++) {
+        double inflow = 0.0;
+        for (uint32_t k = claimStart[i]; k < claimStart[i + 1]; k++) {
+            inflow += claimAmount[k] * paidShare[claimDebtor[k]];
+        }
+        received[i] = inflow;
+
+        double unpaid = obligations[i] - payments[i];
+        if (defaulted[i]) {
+            metrics.defaults++;
+            metrics.contagionDefaults += fundamental[i] ? 0 : 1;
+        }
+        metrics.shortfall += unpaid;
+        metrics.largestShortfall = max(metrics.largestShortfall, unpaid);
+    }
+
+    // Every loan was due this year
+    loanLender.clear();
+    loanBorrower.clear();
+    loanDue.clear();
+    history.push_back(metrics);
+    return metrics;
+}
+
+InterbankNetwork::YearMetrics InterbankNetwork::advanceYear() {
+    const int banks = getBankCount();
+    vector<double> assets(banks, 0.0);
+    for (int i = 0; i < banks; i++) {
+        if (kingdoms[i]) {
+            assets[i] = kingdoms[i]->getEconomy()->getTreasuryGold();
+        }
+    }
+    YearMetrics metrics = clear(assets);
+
+    for (int i = 0; i < banks; i++) {
+        if (!kingdoms[i]) {
+            continue;
+        }
+        Economy* economy = kingdoms[i]->getEconomy();
+        long long net = llround(received[i] - payments[i]);
+        economy->setTreasuryGold(static_cast<int>(max(0LL, economy->getTreasuryGold() + net)));
+        if (defaulted[i]) {
+            Logger::KingdomScope scope(kingdoms[i]->getNameHandle());
+            Logger::warning("The bank of {} defaults on {} gold of interbank loans!", kingdoms[i]->getName(),
+                static_cast<int>(llround(obligations[i] - payments[i])));
+        }
+    }
+    if (metrics.defaults > 0) {
+        Logger::info("Interbank clearing: {} of {} banks defaulted, {} through contagion; {} gold unpaid.",
+            metrics.defaults, banks, metrics.contagionDefaults, static_cast<int>(llround(metrics.shortfall)));
+    }
+    return metrics;
+}
+
+int InterbankNetwork::getBankCount() const {
+    return static_cast<int>(kingdoms.size());
+}
+
+int InterbankNetwork::getLoanCount() const {
+    return static_cast<int>(loanDue.size());
+}
+
+double InterbankNetwork::getInterestRate() const {
+    return interestRate;
+}
+
+void InterbankNetwork::setInterestRate(double rate) {
+    interestRate = max(0.0, rate);
+}
+
+double InterbankNetwork::getPayment(int bank) const {
+    return bank >= 0 && bank < static_cast<int>(payments.size()) ? payments[bank] : 0.0;
+}
+
+double InterbankNetwork::getReceived(int bank) const {
+    return bank >= 0 && bank < static_cast<int>(received.size()) ? received[bank] : 0.0;
+}
+
+bool InterbankNetwork::isDefaulted(int bank) const {
+    return bank >= 0 && bank < static_cast<int>(defaulted.size()) && defaulted[bank] != 0;
+}
+
+const vector<InterbankNetwork::YearMetrics>& InterbankNetwork::getHistory() const {
+    return history;
+}
+
+// ---------------------------
+// EventLibrary implementation
+// ---------------------------
+
+// The built-in events, in RandomEvents::EventType order; weights default to 1
+static const char* builtinEvents = R"(
+event PLAGUE
+    weight 0.5 + min(2, population / 5000) + (1 - happiness)
+    say A terrible plague sweeps through your kingdom!
+    let loss = int(population / 10)
+    peasants -= int(loss * 8 / 10)
+    merchants -= loss * 1.5 / 10
+    nobles -= loss * 0.5 / 10
+    happiness -= 0.2
+    say The plague claims {loss} lives.
+    say Population morale has decreased significantly.
+
+event GOOD HARVEST
+    weight 0.5 + happiness
+    say A bountiful harvest blesses your kingdom!
+    let gain = peasants * 2
+    food += gain
+    happiness += 0.15
+    say Food stocks increase by {gain} units.
+    say The people rejoice at the abundance!
+
+event DROUGHT
+    weight 0.5 + 2 * max(0, 1 - food / max(1, population * 2))
+    say A severe drought strikes your kingdom!
+    let loss = int(food / 3)
+    food -= loss
+    happiness -= 0.1
+    say Food stocks decrease by {loss} units.
+    say The people grow anxious about the future.
+
+event FOREIGN INVASION
+    weight 0.5 + max(0, 1 - soldiers * 10 / max(1, population)) + at_war
+    say A neighboring kingdom invades your lands!
+    let loss = int(soldiers / 10)
+    infantry -= int(loss * 6 / 10)
+    cavalry -= int(loss * 2 / 10)
+    archers -= int(loss * 2 / 10)
+    at_war = 1
+    morale -= 0.15
+    say Your army loses {loss} troops in the conflict.
+    say The kingdom is now at war!
+
+event REBELLION
+    weight 0.25 + 4 * max(0, 0.5 - happiness)
+    say The people rise up against your rule!
+    let citizens = int(population / 10)
+    peasants -= citizens
+    let troops = int(soldiers / 10)
+    infantry -= troops
+    happiness -= 0.2
+    morale -= 0.2
+    say The rebellion claims {citizens} citizens and {troops} soldiers.
+    say Your rule is questioned by many.
+
+event ASSASSINATION ATTEMPT
+    weight 0.5 + (1 - morale)
+    say An assassin attempts to kill your ruler!
+    if random(2) == 0
+        say The attempt fails, but the kingdom is shaken!
+        happiness -= 0.1
+    else
+        say The ruler is gravely wounded and must be replaced!
+        new_ruler
+        happiness -= 0.3
+    end
+
+event DISCOVERY
+    say Your scholars uncover a valuable resource deposit!
+    let kind = random(3)
+    if kind == 0
+        let gain = 100 + random(100)
+        iron += gain
+        say A new iron mine yields {gain} units!
+    else
+        if kind == 1
+            let gain = 200 + random(200)
+            wood += gain
+            say A lush forest provides {gain} units of wood!
+        else
+            let gain = 150 + random(150)
+            stone += gain
+            say A quarry yields {gain} units of stone!
+        end
+    end
+    happiness += 0.1
+
+event FESTIVAL
+    when treasury >= 100
+    weight 0.5 + happiness
+    say A grand festival is held in the kingdom!
+    happiness += 0.2
+    treasury -= 100
+    say The festival costs 100 gold but greatly improves morale!
+
+event FIRE
+    weight 0.5 + min(1.5, wood / 2000)
+    say A massive fire ravages part of the kingdom!
+    let woodLoss = int(wood / 4)
+    let foodLoss = int(food / 5)
+    wood -= woodLoss
+    food -= foodLoss
+    happiness -= 0.15
+    say The fire destroys {woodLoss} wood and {foodLoss} food.
+    say The people mourn their losses.
+
+event EARTHQUAKE
+    say An earthquake shakes the kingdom to its core!
+    let stoneLoss = int(stone / 3)
+    stone -= stoneLoss
+    let loss = int(population / 20)
+    peasants -= loss
+    happiness -= 0.2
+    say The earthquake destroys {stoneLoss} stone and claims {loss} lives.
+    say The kingdom struggles to recover.
+)";
+
+struct EventFieldName {
+    const char* name;
+    bool writable;
+    double scale;   // Hazard buckets: linear up to scale, 0 for log-spaced counts, -1 for a flag
+};
+
+// Indexed by EventLibrary::Field
+static const EventFieldName eventFieldNames[EventLibrary::FIELD_COUNT] = {
+    { "peasants", true, 0.0 }, { "merchants", true, 0.0 }, { "nobles", true, 0.0 },
+    { "population", false, 0.0 }, { "happiness", true, 1.0 }, { "infantry", true, 0.0 },
+    { "cavalry", true, 0.0 }, { "archers", true, 0.0 }, { "soldiers", false, 0.0 },
+    { "morale", true, 1.0 }, { "at_war", true, -1.0 }, { "treasury", true, 0.0 },
+    { "debt", true, 0.0 }, { "inflation", true, 0.25 }, { "food", true, 0.0 },
+    { "wood", true, 0.0 }, { "stone", true, 0.0 }, { "iron", true, 0.0 },
+    { "year", false, 0.0 }
+};
+
+// Recursive descent over one line, emitting stack code as it goes
+struct EventParser {
+    vector<EventLibrary::Instruction>& code;
+    vector<double>& constants;
+    const vector<string>& locals;
+    string text;
+    size_t position;
+    int depth;
+    string error;
+
+    EventParser(vector<EventLibrary::Instruction>& codeOut, vector<double>& constantsOut, const vector<string>& localNames)
+        : code(codeOut), constants(constantsOut), locals(localNames), position(0), depth(0) {
+    }
+
+    void emit(EventLibrary::OpCode op, int32_t operand, int stackChange) {
+        EventLibrary::Instruction instruction = { op, operand };
+        code.push_back(instruction);
+        depth += stackChange;
+        if (depth > EventLibrary::MAX_STACK && error.empty()) {
+            error = "expression is too deep";
+        }
+    }
+
+    void skipSpaces() {
+        while (position < text.size() && isspace(static_cast<unsigned char>(text[position]))) {
+            position++;
+        }
+    }
+
+    // Consumes the token if it is next
+    bool accept(const char* token) {
+        skipSpaces();
+        size_t length = strlen(token);
+        if (text.compare(position, length, token) != 0) {
+            return false;
+        }
+        // Words must not run into a longer name, operators into a longer operator
+        char after = position + length < text.size() ? text[position + length] : ' ';
+        if (isalpha(static_cast<unsigned char>(token[0])) && (isalnum(static_cast<unsigned char>(after)) || after == '_')) {
+            return false;
+        }
+        if ((token[0] == '<' || token[0] == '>' || token[0] == '=') && length == 1 && after == '=') {
+            return false;
+        }
+        position += length;
+        return true;
+    }
+
+    string readName() {
+        skipSpaces();
+        size_t start = position;
+        while (position < text.size() && (isalnum(static_cast<unsigned char>(text[position])) || text[position] == '_')) {
+            position++;
+        }
+        return text.substr(start, position - start);
+    }
+
+    int findRegister(const string& name) const {
+        for (size_t i = 0; i < locals.size(); i++) {
+            if (locals[i] == name) {
+                return EventLibrary::FIELD_COUNT + static_cast<int>(i);
+            }
+        }
+        for (int i = 0; i < EventLibrary::FIELD_COUNT; i++) {
+            if (name == eventFieldNames[i].name) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    bool atEnd() {
+        skipSpaces();
+        return position >= text.size();
+    }
+
+    void expression() {
+        conjunction();
+        while (error.empty() && accept("or")) {
+            conjunction();
+            emit(EventLibrary::OP_OR, 0, -1);
+        }
+    }
+
+    void conjunction() {
+        negation();
+        while (error.empty() && accept("and")) {
+            negation();
+            emit(EventLibrary::OP_AND, 0, -1);
+        }
+    }
+
+    void negation() {
+        if (accept("not")) {
+            negation();
+            emit(EventLibrary::OP_NOT, 0, 0);
+            return;
+        }
+        comparison();
+    }
+
+    void comparison() {
+        sum();
+        static const struct { const char* token; EventLibrary::OpCode op; } comparisons[] = {
+            { "<=", EventLibrary::OP_LESS_EQUAL }, { ">=", EventLibrary::OP_GREATER_EQUAL },
+            { "==", EventLibrary::OP_EQUAL }, { "!=", EventLibrary::OP_NOT_EQUAL },
+            { "<", EventLibrary::OP_LESS }, { ">", EventLibrary::OP_GREATER }
+        };
+        for (size_t i = 0; i < sizeof(comparisons) / sizeof(comparisons[0]); i++) {
+            if (accept(comparisons[i].token)) {
+                sum();
+                emit(comparisons[i].op, 0, -1);
+                return;
+            }
+        }
+    }
+
+    void sum() {
+        product();
+        while (error.empty()) {
+            if (accept("+")) {
+                product();
+                emit(EventLibrary::OP_ADD, 0, -1);
+            }
+            else if (accept("-")) {
+                product();
+                emit(EventLibrary::OP_SUBTRACT, 0, -1);
+            }
+            else {
+                return;
+            }
+        }
+    }
+
+    void product() {
+        unary();
+        while (error.empty()) {
+            if (accept("*")) {
+                unary();
+                emit(EventLibrary::OP_MULTIPLY, 0, -1);
+            }
+            else if (accept("/")) {
+                unary();
+                emit(EventLibrary::OP_DIVIDE, 0, -1);
+            }
+            else {
+                return;
+            }
+        }
+    }
+
+    void unary() {
+        if (accept("-")) {
+            unary();
+            emit(EventLibrary::OP_NEGATE, 0, 0);
+            return;
+        }
+        primary();
+    }
+
+    void primary() {
+        skipSpaces();
+        if (!error.empty()) {
+            return;
+        }
+        if (accept("(")) {
+            expression();
+            if (!accept(")")) {
+                error = "missing )";
+            }
+            return;
+        }
+        if (position < text.size() && (isdigit(static_cast<unsigned char>(text[position])) || text[position] == '.')) {
+            char* end = nullptr;
+            double value = strtod(text.c_str() + position, &end);
+            position = end - text.c_str();
+            emit(EventLibrary::OP_CONSTANT, static_cast<int32_t>(constants.size()), 1);
+            constants.push_back(value);
+            return;
+        }
+
+        string name = readName();
+        if (name.empty()) {
+            error = "expected a value";
+            return;
+        }
+        if (accept("(")) {
+            // Functions: int(x), random(n), min(a, b), max(a, b)
+            expression();
+            EventLibrary::OpCode op;
+            if (name == "int" || name == "random") {
+                op = name == "int" ? EventLibrary::OP_TRUNCATE : EventLibrary::OP_RANDOM;
+                emit(op, 0, 0);
+            }
+            else if ((name == "min" || name == "max") && accept(",")) {
+                expression();
+                op = name == "min" ? EventLibrary::OP_MIN : EventLibrary::OP_MAX;
+                emit(op, 0, -1);
+            }
+            else {
+                error = "unknown function " + name;
+                return;
+            }
+            if (!accept(")")) {
+                error = "missing )";
+            }
+            return;
+        }
+        int reg = findRegister(name);
+        if (reg < 0) {
+            error = "unknown name " + name;
+            return;
+        }
+        emit(EventLibrary::OP_LOAD, reg, 1);
+    }
+};
+
+EventLibrary::EventLibrary()
+    : revision(0) {
+    loadText(builtinEvents, "built-in events");
+}
+
+EventLibrary& EventLibrary::shared() {
+    static EventLibrary library;
+    return library;
+}
+
+bool EventLibrary::load(const string& filename) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        Logger::error("Error: Could not open event file {}!", filename);
+        return false;
+    }
+    return compile(file, filename);
+}
+
+bool EventLibrary::loadText(const string& text, const string& source) {
+    istringstream in(text);
+    return compile(in, source);
+}
+
+bool EventLibrary::compile(istream& in, const string& source) {
+    // Nothing changes unless the whole source compiles
+    vector<Event> compiledEvents = events;
+    vector<Instruction> compiledCode = code;
+    vector<double> compiledConstants = constants;
+    vector<Message> compiledMessages = messages;
+
+    // One event at a time: its lines are collected, then compiled together
+    struct Line {
+        int number;
+        string text;
+    };
+    string eventName;
+    vector<Line> lines;
+    string text;
+    int lineNumber = 0;
+    string error;
+    int errorLine = 0;
+
+    auto compileEvent = [&]() {
+        if (eventName.empty()) {
+            return;
+        }
+        Event event;
+        event.name = eventName;
+        vector<string> locals;
+        EventParser parser(compiledCode, compiledConstants, locals);
+        auto parse = [&parser, &error, &errorLine](const Line& line, size_t start) {
+            parser.text = line.text;
+            parser.position = start;
+            parser.depth = 0;
+            parser.expression();
+            if (parser.error.empty() && !parser.atEnd()) {
+                parser.error = "unexpected " + parser.text.substr(parser.position);
+            }
+            if (!parser.error.empty() && error.empty()) {
+                error = parser.error;
+                errorLine = line.number;
+            }
+        };
+
+        // Weight program: every "when" must hold, then the weight is the result
+        event.weight = static_cast<int32_t>(compiledCode.size());
+        vector<size_t> failJumps;
+        bool hasWeight = false;
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].text.compare(0, 5, "when ") == 0) {
+                parse(lines[i], 5);
+                failJumps.push_back(compiledCode.size());
+                parser.emit(OP_JUMP_IF_FALSE, 0, -1);
+            }
+        }
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (lines[i].text.compare(0, 7, "weight ") == 0) {
+                parse(lines[i], 7);
+                hasWeight = true;
+            }
+        }
+        if (!hasWeight) {
+            parser.emit(OP_CONSTANT, static_cast<int32_t>(compiledConstants.size()), 1);
+            compiledConstants.push_back(1.0);
+        }
+        parser.emit(OP_RETURN, 0, -1);
+        for (size_t i = 0; i < failJumps.size(); i++) {
+            compiledCode[failJumps[i]].operand = static_cast<int32_t>(compiledCode.size());
+        }
+        parser.emit(OP_CONSTANT, static_cast<int32_t>(compiledConstants.size()), 1);
+        compiledConstants.push_back(0.0);
+        parser.emit(OP_RETURN, 0, -1);
+
+        // Effect program: statements in order, if/else blocks patched once closed
+        event.effect = static_cast<int32_t>(compiledCode.size());
+        vector<size_t> openBlocks;
+        for (size_t i = 0; i < lines.size() && error.empty(); i++) {
+            const Line& line = lines[i];
+            parser.text = line.text;
+            parser.position = 0;
+            string word = parser.readName();
+            if (word == "when" || word == "weight") {
+                continue;
+            }
+            if (word == "say") {
+                // {name} prints a field or local; everything else is text
+                Message message;
+                string rest = line.text.substr(3);
+                rest.erase(0, rest.find_first_not_of(" \t"));
+                size_t open;
+                while ((open = rest.find('{')) != string::npos) {
+                    size_t close = rest.find('}', open);
+                    int reg = close == string::npos ? -1 : parser.findRegister(rest.substr(open + 1, close - open - 1));
+                    if (reg < 0) {
+                        error = "say needs a known {name}";
+                        errorLine = line.number;
+                        break;
+                    }
+                    message.pieces.push_back(rest.substr(0, open));
+                    message.registers.push_back(reg);
+                    rest = rest.substr(close + 1);
+                }
+                message.pieces.push_back(rest);
+                parser.emit(OP_SAY, static_cast<int32_t>(compiledMessages.size()), 0);
+                compiledMessages.push_back(message);
+            }
+            else if (word == "new_ruler") {
+                parser.emit(OP_NEW_RULER, 0, 0);
+            }
+            else if (word == "if") {
+                parse(line, parser.position);
+                openBlocks.push_back(compiledCode.size());
+                parser.emit(OP_JUMP_IF_FALSE, 0, -1);
+            }
+            else if (word == "else" || word == "end") {
+                if (openBlocks.empty()) {
+                    error = word + " without if";
+                    errorLine = line.number;
+                    break;
+                }
+                size_t pending = openBlocks.back();
+                openBlocks.pop_back();
+                if (word == "else") {
+                    openBlocks.push_back(compiledCode.size());
+                    parser.emit(OP_JUMP, 0, 0);
+                }
+                compiledCode[pending].operand = static_cast<int32_t>(compiledCode.size());
+            }
+            else {
+                // Assignment: [let] name (= | += | -= | *=) expression
+                bool declare = word == "let";
+                string name = declare ? parser.readName() : word;
+                int reg = parser.findRegister(name);
+                if (declare && reg < EventLibrary::FIELD_COUNT) {
+                    if (reg >= 0 || locals.size() >= MAX_LOCALS) {
+                        error = reg >= 0 ? name + " is already a field" : "too many locals";
+                        errorLine = line.number;
+                        break;
+                    }
+                    locals.push_back(name);
+                    reg = FIELD_COUNT + static_cast<int>(locals.size()) - 1;
+                }
+                if (reg < 0 || (reg < FIELD_COUNT && !eventFieldNames[reg].writable)) {
+                    error = reg < 0 ? "unknown statement " + word : name + " cannot be changed";
+                    errorLine = line.number;
+                    break;
+                }
+                OpCode combine = OP_RETURN;
+                if (parser.accept("+=")) {
+                    combine = OP_ADD;
+                }
+                else if (parser.accept("-=")) {
+                    combine = OP_SUBTRACT;
+                }
+                else if (parser.accept("*=")) {
+                    combine = OP_MULTIPLY;
+                }
+                else if (!parser.accept("=")) {
+                    error = "expected = after " + name;
+                    errorLine = line.number;
+                    break;
+                }
+                if (combine != OP_RETURN) {
+                    parser.emit(OP_LOAD, reg, 1);
+                }
+                parse(line, parser.position);
+                if (combine != OP_RETURN) {
+                    parser.emit(combine, 0, -1);
+                }
+                parser.emit(OP_STORE, reg, -1);
+            }
+        }
+        if (error.empty() && !openBlocks.empty()) {
+            error = "if without end in " + eventName;
+            errorLine = lineNumber;
+        }
+        parser.emit(OP_CONSTANT, static_cast<int32_t>(compiledConstants.size()), 1);
+        compiledConstants.push_back(0.0);
+        parser.emit(OP_RETURN, 0, -1);
+
+        // A known name takes over the old slot so EventType indices stay put
+        for (size_t i = 0; i < compiledEvents.size(); i++) {
+            if (compiledEvents[i].name == event.name) {
+                compiledEvents[i] = event;
+                return;
+            }
+        }
+        compiledEvents.push_back(event);
+    };
+
+    while (error.empty() && getline(in, text)) {
+        lineNumber++;
+        text = text.substr(0, text.find('#'));
+        text.erase(0, text.find_first_not_of(" \t\r"));
+        text.erase(text.find_last_not_of(" \t\r") + 1);
+        if (text.empty()) {
+            continue;
+        }
+        if (text.compare(0, 6, "event ") == 0) {
+            compileEvent();
+            eventName = text.substr(6);
+            lines.clear();
+        }
+        else if (eventName.empty()) {
+            error = "expected event <name>";
+            errorLine = lineNumber;
+        }
+        else {
+            Line line = { lineNumber, text };
+            lines.push_back(line);
+        }
+    }
+    if (error.empty()) {
+        compileEvent();
+    }
+
+    if (!error.empty()) {
+        Logger::error("Error: {} line {}: {}", source, errorLine, error);
+        return false;
+    }
+    events.swap(compiledEvents);
+    code.swap(compiledCode);
+    constants.swap(compiledConstants);
+    messages.swap(compiledMessages);
+
+    // Weight programs sit just before their effect programs
+    for (size_t i = 0; i < events.size(); i++) {
+        events[i].inputs = 0;
+        for (int32_t pc = events[i].weight; pc < events[i].effect; pc++) {
+            if (code[pc].op == OP_LOAD && code[pc].operand < FIELD_COUNT) {
+                events[i].inputs |= 1u << code[pc].operand;
+            }
+        }
+    }
+    revision++;
+    return true;
+}
+
+int EventLibrary::getEventCount() const {
+    return static_cast<int>(events.size());
+}
+
+const string& EventLibrary::getEventName(int event) const {
+    return events[event].name;
+}
+
+int EventLibrary::findEvent(const string& name) const {
+    for (size_t i = 0; i < events.size(); i++) {
+        if (events[i].name == name) {
+            return static_cast<int>(i);
+        }
+    }
+    return -1;
+}
+
+size_t EventLibrary::getCodeSize() const {
+    return code.size() * sizeof(Instruction) + constants.size() * sizeof(double);
+}
+
+double EventLibrary::run(int32_t entry, double* registers, uint32_t& written, Kingdom* kingdom) const {
+    double stack[MAX_STACK];
+    int top = 0;
+    const Instruction* program = code.data();
+    for (int32_t pc = entry;; pc++) {
+        const Instruction& instruction = program[pc];
+        switch (instruction.op) {
+        case OP_CONSTANT:
+            stack[top++] = constants[instruction.operand];
+            break;
+        case OP_LOAD:
+            stack[top++] = registers[instruction.operand];
+            break;
+        case OP_STORE:
+            registers[instruction.operand] = stack[--top];
+            written |= instruction.operand < FIELD_COUNT ? 1u << instruction.operand : 0u;
+            break;
+        case OP_ADD:
+            top--;
+            stack[top - 1] += stack[top];
+            break;
+        case OP_SUBTRACT:
+            top--;
+            stack[top - 1] -= stack[top];
+            break;
+        case OP_MULTIPLY:
+            top--;
+            stack[top - 1] *= stack[top];
+            break;
+        case OP_DIVIDE:
+            top--;
+            stack[top - 1] = stack[top] != 0.0 ? stack[top - 1] / stack[top] : 0.0;
+            break;
+        case OP_NEGATE:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        case OP_LESS:
+            top--;
+            stack[top - 1] = stack[top - 1] < stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_LESS_EQUAL:
+            top--;
+            stack[top - 1] = stack[top - 1] <= stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_GREATER:
+            top--;
+            stack[top - 1] = stack[top - 1] > stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_GREATER_EQUAL:
+            top--;
+            stack[top - 1] = stack[top - 1] >= stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_EQUAL:
+            top--;
+            stack[top - 1] = stack[top - 1] == stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_NOT_EQUAL:
+            top--;
+            stack[top - 1] = stack[top - 1] != stack[top] ? 1.0 : 0.0;
+            break;
+        case OP_AND:
+            top--;
+            stack[top - 1] = stack[top - 1] != 0.0 && stack[top] != 0.0 ? 1.0 : 0.0;
+            break;
+        case OP_OR:
+            top--;
+            stack[top - 1] = stack[top - 1] != 0.0 || stack[top] != 0.0 ? 1.0 : 0.0;
+            break;
+        case OP_NOT:
+            stack[top - 1] = stack[top - 1] == 0.0 ? 1.0 : 0.0;
+            break;
+        case OP_TRUNCATE:
+            stack[top - 1] = static_cast<double>(static_cast<long long>(stack[top - 1]));
+            break;
+        case OP_RANDOM: {
+            int range = static_cast<int>(stack[top - 1]);
+            stack[top - 1] = CounterRng::draw(CounterRng::STREAM_EVENTS, range);
+            break;
+        }
+        case OP_MIN:
+            top--;
+            stack[top - 1] = min(stack[top - 1], stack[top]);
+            break;
+        case OP_MAX:
+            top--;
+            stack[top - 1] = max(stack[top - 1], stack[top]);
+            break;
+        case OP_JUMP:
+            pc = instruction.operand - 1;
+            break;
+        case OP_JUMP_IF_FALSE:
+            if (stack[--top] == 0.0) {
+                pc = instruction.operand - 1;
+            }
+            break;
+        case OP_SAY:
+            // Text is only built when someone will read it
+            if (Logger::getLevel() <= Logger::LEVEL_INFO) {
+                const Message& message = messages[instruction.operand];
+                ostringstream text;
+                for (size_t i = 0; i < message.pieces.size(); i++) {
+                    text << message.pieces[i];
+                    if (i < message.registers.size()) {
+                        double value = registers[message.registers[i]];
+                        if (value == floor(value)) {
+                            text << static_cast<long long>(value);
+                        }
+                        else {
+                            text << value;
+                        }
+                    }
+                }
+                Logger::info("{}", text.str());
+            }
+            break;
+        case OP_NEW_RULER:
+            if (kingdom) {
+                kingdom->succeedRuler();
+            }
+            break;
+        case OP_RETURN:
+            return stack[top - 1];
+        }
+    }
+}
+
+void EventLibrary::gather(const Kingdom& kingdom, double* registers) {
+    const Population& population = *kingdom.getPopulation();
+    const Army& army = *kingdom.getArmy();
+    const Economy& economy = *kingdom.getEconomy();
+    const Market& market = *kingdom.getMarket();
+    registers[FIELD_PEASANTS] = population.getPeasants();
+    registers[FIELD_MERCHANTS] = population.getMerchants();
+    registers[FIELD_NOBLES] = population.getNobles();
+    registers[FIELD_POPULATION] = population.getTotal();
+    registers[FIELD_HAPPINESS] = population.getHappiness();
+    registers[FIELD_INFANTRY] = army.getInfantry();
+    registers[FIELD_CAVALRY] = army.getCavalry();
+    registers[FIELD_ARCHERS] = army.getArchers();
+    registers[FIELD_SOLDIERS] = army.getTotal();
+    registers[FIELD_MORALE] = army.getMorale();
+    registers[FIELD_AT_WAR] = army.getWarStatus() ? 1.0 : 0.0;
+    registers[FIELD_TREASURY] = economy.getTreasuryGold();
+    registers[FIELD_DEBT] = economy.getDebt();
+    registers[FIELD_INFLATION] = economy.getInflation();
+    registers[FIELD_FOOD] = market.getFood()->getAmount();
+    registers[FIELD_WOOD] = market.getWood()->getAmount();
+    registers[FIELD_STONE] = market.getStone()->getAmount();
+    registers[FIELD_IRON] = market.getIron()->getAmount();
+    registers[FIELD_YEAR] = kingdom.getGameYear();
+}
+
+void EventLibrary::scatter(const double* registers, uint32_t written, Kingdom& kingdom) {
+    // Only fields the event assigned go back, each through its clamping setter
+    for (int field = 0; written != 0; field++, written >>= 1) {
+        if (!(written & 1)) {
+            continue;
+        }
+        double value = registers[field];
+        switch (field) {
+        case FIELD_PEASANTS: kingdom.getPopulation()->setPeasants(Headroom::truncate(value)); break;
+        case FIELD_MERCHANTS: kingdom.getPopulation()->setMerchants(Headroom::truncate(value)); break;
+        case FIELD_NOBLES: kingdom.getPopulation()->setNobles(Headroom::truncate(value)); break;
+        case FIELD_HAPPINESS: kingdom.getPopulation()->setHappiness(value); break;
+        case FIELD_INFANTRY: kingdom.getArmy()->setInfantry(Headroom::truncate(value)); break;
+        case FIELD_CAVALRY: kingdom.getArmy()->setCavalry(Headroom::truncate(value)); break;
+        case FIELD_ARCHERS: kingdom.getArmy()->setArchers(Headroom::truncate(value)); break;
+        case FIELD_MORALE: kingdom.getArmy()->setMorale(value); break;
+        case FIELD_AT_WAR: kingdom.getArmy()->setWarStatus(value != 0.0); break;
+        case FIELD_TREASURY: kingdom.getEconomy()->setTreasuryGold(Headroom::truncate(value)); break;
+        case FIELD_DEBT: kingdom.getEconomy()->setDebt(Headroom::truncate(value)); break;
+        case FIELD_INFLATION: kingdom.getEconomy()->setInflation(value); break;
+        case FIELD_FOOD: kingdom.getMarket()->getFood()->setAmount(Headroom::truncate(value)); break;
+        case FIELD_WOOD: kingdom.getMarket()->getWood()->setAmount(Headroom::truncate(value)); break;
+        case FIELD_STONE: kingdom.getMarket()->getStone()->setAmount(Headroom::truncate(value)); break;
+        case FIELD_IRON: kingdom.getMarket()->getIron()->setAmount(Headroom::truncate(value)); break;
+        }
+    }
+}
+
+double EventLibrary::getWeight(int event, const Kingdom& kingdom) const {
+    double registers[REGISTER_COUNT];
+    gather(kingdom, registers);
+    return getWeight(event, registers);
+}
+
+double EventLibrary::getWeight(int event, double* registers) const {
+    uint32_t written = 0;
+    return max(0.0, run(events[event].weight, registers, written, nullptr));
+}
+
+uint32_t EventLibrary::getWeightInputs(int event) const {
+    return events[event].inputs;
+}
+
+int EventLibrary::getRevision() const {
+    return revision;
+}
+
+int EventLibrary::chooseEvent(const Kingdom& kingdom) const {
+    double registers[REGISTER_COUNT];
+    uint32_t written = 0;
+    gather(kingdom, registers);
+
+    vector<double> cumulative(events.size());
+    double total = 0.0;
+    for (size_t i = 0; i < events.size(); i++) {
+        total += max(0.0, run(events[i].weight, registers, written, nullptr));
+        cumulative[i] = total;
+    }
+    if (total <= 0.0) {
+        return -1;
+    }
+    double pick = CounterRng::drawUniform(CounterRng::STREAM_EVENTS) * total;
+    return static_cast<int>(upper_bound(cumulative.begin(), cumulative.end(), pick) - cumulative.begin());
+}
+
+void EventLibrary::apply(int event, Kingdom& kingdom) const {
+    Kingdom* kingdoms[1] = { &kingdom };
+    apply(event, kingdoms, 1);
+}
+
+void EventLibrary::apply(int event, Kingdom* const* kingdoms, int count) const {
+    if (event < 0 || event >= getEventCount()) {
+        return;
+    }
+    double registers[REGISTER_COUNT];
+    for (int i = 0; i < count; i++) {
+        Logger::info("\n===== EVENT: {} =====", events[event].name);
+        uint32_t written = 0;
+        gather(*kingdoms[i], registers);
+        run(events[event].effect, registers, written, kingdoms[i]);
+        scatter(registers, written, *kingdoms[i]);
+    }
+}
+
+// -------------------------
+// AliasTable implementation
+// -------------------------
+
+AliasTable::AliasTable()
+    : total(0.0) {
+}
+
+void AliasTable::build(const double* weights, int count) {
+    threshold.assign(count, 0.0f);
+    alias.assign(count, 0);
+    total = 0.0;
+    for (int i = 0; i < count; i++) {
+        total += max(0.0, weights[i]);
+    }
+    if (total <= 0.0) {
+        threshold.clear();
+        alias.clear();
+        return;
+    }
+
+    // Scaled so the average is 1; small entries borrow the rest of their slot from a large one
+    vector<double> scaled(count);
+    vector<int> small;
+    vector<int> large;
+    for (int i = 0; i < count; i++) {
+        scaled[i] = max(0.0, weights[i]) * count / total;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        int lender = large.back();
+        int borrower = small.back();
+        small.pop_back();
+        threshold[borrower] = static_cast<float>(scaled[borrower]);
+        alias[borrower] = lender;
+        scaled[lender] -= 1.0 - scaled[borrower];
+        if (scaled[lender] < 1.0) {
+            large.pop_back();
+            small.push_back(lender);
+        }
+    }
+    // Whatever is left is 1 up to rounding
+    for (size_t i = 0; i < large.size(); i++) {
+        threshold[large[i]] = 1.0f;
+        alias[large[i]] = large[i];
+    }
+    for (size_t i = 0; i < small.size(); i++) {
+        threshold[small[i]] = 1.0f;
+        alias[small[i]] = small[i];
+    }
+}
+
+int AliasTable::size() const {
+    return static_cast<int>(threshold.size());
+}
+
+double AliasTable::getTotal() const {
+    return total;
+}
+
+int AliasTable::sample(double u) const {
+    if (threshold.empty()) {
+        return -1;
+    }
+    double scaled = u * threshold.size();
+    int slot = min(static_cast<int>(scaled), static_cast<int>(threshold.size()) - 1);
+    return scaled - slot < threshold[slot] ? slot : static_cast<int>(alias[slot]);
+}
+
+double AliasTable::getProbability(int index) const {
+    if (threshold.empty()) {
+        return 0.0;
+    }
+    double share = threshold[index];
+    for (size_t i = 0; i < alias.size(); i++) {
+        if (static_cast<int>(alias[i]) == index && static_cast<int>(i) != index) {
+            share += 1.0 - threshold[i];
+        }
+    }
+    return share / threshold.size();
+}
+
+// ---------------------------
+// EventSampler implementation
+// ---------------------------
+
+static int hazardBucket(int field, double value) {
+    double scale = eventFieldNames[field].scale;
+    if (scale < 0.0) {
+        return value != 0.0 ? 1 : 0;
+    }
+    if (scale > 0.0) {
+        int bucket = static_cast<int>(value / scale * EventSampler::BUCKET_COUNT);
+        return max(0, min(EventSampler::BUCKET_COUNT - 1, bucket));
+    }
+    // Counts: zero, then two buckets per doubling; value = mantissa * 2^exponent
+    if (value < 1.0) {
+        return 0;
+    }
+    int exponent;
+    double mantissa = frexp(value, &exponent);
+    int halfOctaves = 2 * (exponent - 1) + (mantissa >= 0.70710678118654752 ? 1 : 0);
+    return min(EventSampler::BUCKET_COUNT - 1, 1 + halfOctaves);
+}
+
+// The value a whole bucket is judged by
+static double hazardValue(int field, int bucket) {
+    double scale = eventFieldNames[field].scale;
+    if (scale < 0.0) {
+        return bucket;
+    }
+    if (scale > 0.0) {
+        return (bucket + 0.5) * scale / EventSampler::BUCKET_COUNT;
+    }
+    return bucket == 0 ? 0.0 : pow(2.0, (bucket - 0.5) / 2.0);
+}
+
+bool EventSampler::HazardKey::operator==(const HazardKey& other) const {
+    return low == other.low && high == other.high;
+}
+
+size_t EventSampler::HazardKeyHash::operator()(const HazardKey& key) const {
+    uint64_t mixed = (key.low ^ (key.high * 0x9e3779b97f4a7c15ull)) * 0xff51afd7ed558ccdull;
+    return static_cast<size_t>(mixed ^ (mixed >> 32));
+}
+
+EventSampler::EventSampler(const EventLibrary& eventLibrary)
+    : library(eventLibrary), revision(-1), inputs(0), cachedEntries(0), hits(0), misses(0) {
+}
+
+EventSampler& EventSampler::forThisThread() {
+    thread_local EventSampler sampler(EventLibrary::shared());
+    return sampler;
+}
+
+void EventSampler::refresh() {
+    // Loading events regroups them; a full cache starts over
+    if (revision == library.getRevision()) {
+        if (cachedEntries > MAX_CACHED_ENTRIES) {
+            for (size_t g = 0; g < groups.size(); g++) {
+                groups[g].tables.clear();
+                groups[g].built.assign(groups[g].built.size(), 0);
+            }
+            cachedEntries = 0;
+        }
+        return;
+    }
+    revision = library.getRevision();
+    groups.clear();
+    groupOf.assign(library.getEventCount(), 0);
+    slotOf.assign(library.getEventCount(), 0);
+    inputs = 0;
+    cachedEntries = 0;
+    for (int event = 0; event < library.getEventCount(); event++) {
+        uint32_t eventInputs = library.getWeightInputs(event);
+        size_t g = 0;
+        while (g < groups.size() && groups[g].inputs != eventInputs) {
+            g++;
+        }
+        if (g == groups.size()) {
+            groups.push_back(HazardGroup());
+            groups[g].inputs = eventInputs;
+            for (int field = 0; field < EventLibrary::FIELD_COUNT; field++) {
+                if (eventInputs & (1u << field)) {
+                    groups[g].fields.push_back(field);
+                }
+            }
+        }
+        if (groups[g].fields.size() <= MAX_DENSE_FIELDS && groups[g].dense.empty()) {
+            size_t combinations = 1;
+            for (size_t i = 0; i < groups[g].fields.size(); i++) {
+                combinations *= BUCKET_COUNT;
+            }
+            groups[g].dense.resize(combinations);
+            groups[g].built.assign(combinations, 0);
+        }
+        groupOf[event] = static_cast<int>(g);
+        slotOf[event] = static_cast<int>(groups[g].events.size());
+        groups[g].events.push_back(event);
+        inputs |= eventInputs;
+    }
+}
+
+const AliasTable& EventSampler::lookup(HazardGroup& group, const int* buckets) {
+    // Small groups: the buckets index the table directly
+    AliasTable* table = nullptr;
+    if (!group.dense.empty()) {
+        size_t index = 0;
+        for (size_t i = 0; i < group.fields.size(); i++) {
+            index = index * BUCKET_COUNT + buckets[group.fields[i]];
+        }
+        table = &group.dense[index];
+        if (group.built[index]) {
+            hits++;
+            return *table;
+        }
+        group.built[index] = 1;
+    }
+
+    // Otherwise BUCKET_BITS for each field the group reads, in field order
+    HazardKey key = { 0, 0 };
+    for (size_t i = 0; i < group.fields.size(); i++) {
+        uint64_t bucket = static_cast<uint64_t>(buckets[group.fields[i]]);
+        int bit = static_cast<int>(i) * BUCKET_BITS;
+        if (bit < 64) {
+            key.low |= bucket << bit;
+            if (bit + BUCKET_BITS > 64) {
+                key.high |= bucket >> (64 - bit);
+            }
+        }
+        else {
+            key.high |= bucket << (bit - 64);
+        }
+    }
+    if (!table) {
+        unordered_map<HazardKey, AliasTable, HazardKeyHash>::iterator existing = group.tables.find(key);
+        if (existing != group.tables.end()) {
+            hits++;
+            return existing->second;
+        }
+        table = &group.tables[key];
+    }
+
+    // First kingdom in this bucket: run the group's weight programs at the bucket's values
+    misses++;
+    double registers[EventLibrary::REGISTER_COUNT] = {};
+    for (size_t i = 0; i < group.fields.size(); i++) {
+        registers[group.fields[i]] = hazardValue(group.fields[i], buckets[group.fields[i]]);
+    }
+    vector<double> weights(group.events.size());
+    for (size_t i = 0; i < group.events.size(); i++) {
+        weights[i] = library.getWeight(group.events[i], registers);
+    }
+    table->build(weights.data(), static_cast<int>(weights.size()));
+    cachedEntries += weights.size();
+    return *table;
+}
+
+void EventSampler::findTables(const Kingdom& kingdom) {
+    double registers[EventLibrary::REGISTER_COUNT];
+    int buckets[EventLibrary::FIELD_COUNT] = {};
+    EventLibrary::gather(kingdom, registers);
+    for (int field = 0; field < EventLibrary::FIELD_COUNT; field++) {
+        if (inputs & (1u << field)) {
+            buckets[field] = hazardBucket(field, registers[field]);
+        }
+    }
+    found.resize(groups.size());
+    for (size_t g = 0; g < groups.size(); g++) {
+        found[g] = &lookup(groups[g], buckets);
+    }
+}
+
+int EventSampler::sample(const Kingdom& kingdom) {
+    const Kingdom* kingdoms[1] = { &kingdom };
+    int chosen;
+    sample(kingdoms, 1, &chosen);
+    return chosen;
+}
+
+void EventSampler::sample(const Kingdom* const* kingdoms, int count, int* chosen) {
+    refresh();
+    for (int i = 0; i < count; i++) {
+        findTables(*kingdoms[i]);
+
+        // One draw picks the group by its total weight, and what is left of it the event
+        double total = 0.0;
+        for (size_t g = 0; g < found.size(); g++) {
+            total += found[g]->getTotal();
+        }
+        chosen[i] = -1;
+        if (total <= 0.0) {
+            continue;
+        }
+        double pick = CounterRng::drawUniform(CounterRng::STREAM_EVENTS) * total;
+        size_t g = 0;
+        while (g + 1 < found.size() && (found[g]->getTotal() <= 0.0 || pick >= found[g]->getTotal())) {
+            pick -= found[g]->getTotal();
+            g++;
+        }
+        int slot = found[g]->sample(pick / found[g]->getTotal());
+        chosen[i] = slot >= 0 ? groups[g].events[slot] : -1;
+    }
+}
+
+double EventSampler::getProbability(const Kingdom& kingdom, int event) {
+    refresh();
+    findTables(kingdom);
+    double total = 0.0;
+    for (size_t g = 0; g < found.size(); g++) {
+        total += found[g]->getTotal();
+    }
+    const AliasTable* table = found[groupOf[event]];
+    return total > 0.0 ? table->getTotal() / total * table->getProbability(slotOf[event]) : 0.0;
+}
+
+int EventSampler::getGroupCount() const {
+    return static_cast<int>(groups.size());
+}
+
+size_t EventSampler::getTableCount() const {
+    size_t count = 0;
+    for (size_t g = 0; g < groups.size(); g++) {
+        count += groups[g].tables.size();
+        for (size_t i = 0; i < groups[g].built.size(); i++) {
+            count += groups[g].built[i] ? 1 : 0;
+        }
+    }
+    return count;
+}
+
+uint64_t EventSampler::getHits() const {
+    return hits;
+}
+
+uint64_t EventSampler::getMisses() const {
+    return misses;
+}
+
+// ---------------------------
+// RandomEvents implementation
+// ---------------------------
+
+RandomEvents::RandomEvents(int chance)
+    : eventChance(chance), lastEventYear(0) {
+}
+
+RandomEvents::~RandomEvents() {}
+
+int RandomEvents::getEventChance() const {
+    return eventChance;
+}
+
+int RandomEvents::getLastEventYear() const {
+    return lastEventYear;
+}
+
+void RandomEvents::setEventChance(int chance) {
+    eventChance = max(0, min(100, chance));
+}
+
+void RandomEvents::setLastEventYear(int year) {
+    lastEventYear = year;
+}
+
+bool RandomEvents::checkForEvent(int year) {
+    // One draw a year from the events stream; nothing outside the kingdom's state decides it
+    if (CounterRng::draw(CounterRng::STREAM_EVENTS, 100) < eventChance) {
+        lastEventYear = year;
+        return true;
+    }
+    return false;
+}
+
+int RandomEvents::generateEvent(const Kingdom& kingdom) const {
+    // Weighted by the kingdom's state, drawn from this thread's cached alias tables
+    return EventSampler::forThisThread().sample(kingdom);
+}
+
+void RandomEvents::applyEvent(int event, Kingdom& kingdom) {
+    EventLibrary::shared().apply(event, kingdom);
+}
+
+// ---------------------
+// Kingdom implementation
+// ---------------------
+
+Kingdom::Kingdom(const string& kingdomName)
+    : nameHandle(StringTable::intern(kingdomName)), metrics(nullptr), metricsId(0), designerRules(false), gameYear(1), score(0) {
+    // A fresh seed per kingdom from rand(), so srand() still decides how a game plays out
+    randomSeed = (static_cast<uint64_t>(rand()) << 40) ^ (static_cast<uint64_t>(rand()) << 20) ^
+        static_cast<uint64_t>(rand());
+    randomId = 0;
+    population = make_unique<Population>();
+    army = make_unique<Army>();
+    economy = make_unique<Economy>();
+    market = make_unique<Market>();
+    diplomacy = make_unique<Diplomacy>();
+    bank = make_unique<Bank>();
+    events = make_unique<RandomEvents>();
+    ruler = make_unique<King>("Default King", 50, 50, 50, 50);
+    // The noble houses are founded by the first succession that needs them
+    dynasty = make_unique<Dynasty>();
+}
+
+Kingdom::~Kingdom() {}
+
+const string& Kingdom::getName() const {
+    return StringTable::lookup(nameHandle);
+}
+
+StringTable::Handle Kingdom::getNameHandle() const {
+    return nameHandle;
+}
+
+Population* Kingdom::getPopulation() const {
+    return population.get();
+}
+
+Army* Kingdom::getArmy() const {
+    return army.get();
+}
+
+Economy* Kingdom::getEconomy() const {
+    return economy.get();
+}
+
+Market* Kingdom::getMarket() const {
+    return market.get();
+}
+
+Diplomacy* Kingdom::getDiplomacy() const {
+    return diplomacy.get();
+}
+
+Bank* Kingdom::getBank() const {
+    return bank.get();
+}
+
+RandomEvents* Kingdom::getEvents() const {
+    return events.get();
+}
+
+Leader* Kingdom::getRuler() const {
+    return ruler.get();
+}
+
+Dynasty* Kingdom::getDynasty() const {
+    return dynasty.get();
+}
+
+int Kingdom::getGameYear() const {
+    return gameYear;
+}
+
+int Kingdom::getScore() const {
+    return score;
+}
+
+void Kingdom::setName(const string& newName) {
+    nameHandle = StringTable::intern(newName);
+}
+
+void Kingdom::setRuler(unique_ptr<Leader> newRuler) {
+    // A ruler set from outside is not one of the houses' nobles
+    ruler = move(newRuler);
+    dynasty->clearRuler();
+}
+
+void Kingdom::setGameYear(int year) {
+    gameYear = max(1, year);
+}
+
+void Kingdom::setScore(int newScore) {
+    score = max(0, newScore);
+}
+
+void Kingdom::useDesignerRules(bool enabled) {
+    designerRules = enabled;
+}
+
+bool Kingdom::usesDesignerRules() const {
+    return designerRules;
+}
+
+void Kingdom::setRandomKey(uint64_t seed, uint32_t kingdomId) {
+    randomSeed = seed;
+    randomId = kingdomId;
+}
+
+uint64_t Kingdom::getRandomSeed() const {
+    return randomSeed;
+}
+
+uint32_t Kingdom::getRandomId() const {
+    return randomId;
+}
+
+void Kingdom::advanceYear() {
+    // The shipped rules get their own copy of the year with the constants folded in
+    if (designerRules) {
+        simulateYear<designerRuleset>();
+    }
+    else {
+        simulateYear<standardRuleset>();
+    }
+}
+
+template <const Ruleset& rules>
+void Kingdom::simulateYear() {
+    Logger::KingdomScope scope(nameHandle);
+    CounterRng::KingdomScope randomScope(randomSeed, randomId, static_cast<uint32_t>(gameYear + 1));
+
+    // With --profile, each stretch below is charged to its phase until the next enter()
+    PhaseProfiler::Timeline phases;
+    BattleEngine battles;
+    openYear<rules>(battles, phases);
+    battles.resolveAll();
+    closeYear<rules>(battles, phases);
+}
+
+int Kingdom::advanceYearTogether(const vector<Kingdom*>& kingdoms, TradeNetwork* trade) {
+    // Last year's surpluses reach the kingdoms short of them before the new year starts
+    if (trade) {
+        trade->advanceYear();
+    }
+
+    // Each kingdom's first half leaves its draw counts here for its second
+    const size_t streams = CounterRng::STREAM_COUNT;
+    vector<uint32_t> drawn(kingdoms.size() * streams);
+    BattleEngine battles;
+    for (size_t i = 0; i < kingdoms.size(); i++) {
+        Kingdom& kingdom = *kingdoms[i];
+        Logger::KingdomScope scope(kingdom.nameHandle);
+        CounterRng::KingdomScope randomScope(kingdom.randomSeed, kingdom.randomId,
+            static_cast<uint32_t>(kingdom.gameYear + 1));
+        PhaseProfiler::Timeline phases;
+        if (kingdom.designerRules) {
+            kingdom.openYear<designerRuleset>(battles, phases);
+        }
+        else {
+            kingdom.openYear<standardRuleset>(battles, phases);
+        }
+        copy(randomScope.getDrawn(), randomScope.getDrawn() + streams, &drawn[i * streams]);
+    }
+
+    // Every front of every kingdom in one pass
+    battles.resolveAll();
+
+    for (size_t i = 0; i < kingdoms.size(); i++) {
+        Kingdom& kingdom = *kingdoms[i];
+        Logger::KingdomScope scope(kingdom.nameHandle);
+        CounterRng::KingdomScope randomScope(kingdom.randomSeed, kingdom.randomId,
+            static_cast<uint32_t>(kingdom.gameYear + 1), &drawn[i * streams]);
+        PhaseProfiler::Timeline phases;
+        if (kingdom.designerRules) {
+            kingdom.closeYear<designerRuleset>(battles, phases);
+        }
+        else {
+            kingdom.closeYear<standardRuleset>(battles, phases);
+        }
+    }
+    return battles.getBattleCount();
+}
+
+template <const Ruleset& rules>
+void Kingdom::openYear(BattleEngine& battles, PhaseProfiler::Timeline& phases) {
+    Logger::info("\nAdvancing to year {}...", gameYear + 1);
+
+    // Update all systems
+    phases.enter(PhaseProfiler::PHASE_POPULATION);
+    population->updatePopulation<rules>(*economy, *army);
+    phases.enter(PhaseProfiler::PHASE_HAPPINESS);
+    double foodPerPerson = population->getTotal() > 0 ?
+        static_cast<double>(market->getFood()->getAmount()) / population->getTotal() : 0.0;
+    population->calculateHappiness<rules>(*economy, *army, foodPerPerson);
+    phases.enter(PhaseProfiler::PHASE_MORALE);
+    army->updateMorale<rules>(*economy, *population);
+    phases.enter(PhaseProfiler::PHASE_ECONOMY);
+    economy->updateEconomy<rules>(*population, *army);
+    phases.enter(PhaseProfiler::PHASE_PRICES);
+    market->updatePrices<rules>(*economy);
+    market->recordPrices(gameYear + 1);
+    phases.enter(PhaseProfiler::PHASE_PRODUCTION);
+    market->produceResources<rules>(*population);
+    market->consumeResources<rules>(*population, *army);
+    phases.enter(PhaseProfiler::PHASE_DIPLOMACY);
+    diplomacy->queueBattles(*army, battles);
+}
+
+template <const Ruleset& rules>
+void Kingdom::closeYear(const BattleEngine& battles, PhaseProfiler::Timeline& phases) {
+    // Still charged to diplomacy when both halves share a timeline
+    diplomacy->applyBattles(*army, battles);
+    phases.enter(PhaseProfiler::PHASE_BANK);
+    bank->updateInterest(*economy);
+    bank->attemptCorruption(*economy, *population);
+
+    // Apply leader effects
+    phases.enter(PhaseProfiler::PHASE_LEADER);
+    ruler->applyEffects(*this);
+
+    // Nobles are born, come of age and die; a ruler's death passes on the crown
+    phases.enter(PhaseProfiler::PHASE_DYNASTY);
+    if (dynasty->advanceYear(gameYear + 1)) {
+        Logger::info("\n{} has died.", ruler->getName());
+        succeedRuler();
+    }
+
+    // Apply resource effects
+    phases.enter(PhaseProfiler::PHASE_RESOURCES);
+    market->getFood()->applyEffects(*this);
+    market->getIron()->applyEffects(*this);
+
+    // Check for random events
+    phases.enter(PhaseProfiler::PHASE_EVENTS);
+    if (events->checkForEvent(gameYear)) {
+        int event = events->generateEvent(*this);
+        events->applyEvent(event, *this);
+    }
+
+    // Check for rebellions or riots
+    phases.enter(PhaseProfiler::PHASE_UNREST);
+    if (population->checkRebellion<rules>() || army->checkRebellion<rules>(*population) ||
+        economy->checkRiots<rules>(*population)) {
+        Logger::warning("\nWARNING: Unrest threatens the stability of your kingdom!");
+        events->applyEvent(RandomEvents::REBELLION, *this);
+    }
+
+    // Collect taxes
+    phases.enter(PhaseProfiler::PHASE_TAXES);
+    int taxes = economy->collectTaxes<rules>(*population);
+    Logger::info("Collected {} gold in taxes.", taxes);
+
+    // Increment year and calculate score
+    phases.enter(PhaseProfiler::PHASE_RECORDING);
+    gameYear++;
+    calculateScore<rules>();
+
+    // Copy the state now; serializing and syncing happen on the autosave thread
+    if (autosave || history) {
+        KingdomSnapshot snapshot;
+        captureSnapshot(snapshot);
+        if (autosave) {
+            autosave->submit(snapshot);
+        }
+        if (history) {
+            history->record(snapshot);
+        }
+    }
+    if (metrics) {
+        metrics->append(metricsId, *this);
+    }
+}
+
+template <const Ruleset& rules>
+void Kingdom::calculateScore() {
+    // Calculate score based on various factors
+    long long total = (static_cast<long long>(population->getTotal()) * rules.scorePerCitizen) +
+        (static_cast<long long>(army->getTotal()) * rules.scorePerSoldier) +
+        (economy->getTreasuryGold() / rules.goldPerPoint) +
+        (static_cast<int>(population->getHappiness() * rules.happinessScore)) +
+        (gameYear * rules.scorePerYear);
+
+    // Deduct points for debt and inflation
+    total -= (economy->getDebt() / rules.debtPerPoint);
+    total -= static_cast<int>(economy->getInflation() * rules.inflationPenalty);
+    score = Headroom::narrow(total);
+}
+
+bool Kingdom::isGameOver() const {
+    // Game over if population is too low, treasury is bankrupt, or massive debt
+    return (population->getTotal() < 10) ||
+        (economy->getTreasuryGold() <= 0 && economy->getDebt() > 5000) ||
+        (population->getHappiness() < 0.1 && army->getMorale() < 0.1);
+}
+
+void Kingdom::displayStatus() const {
+    // One write for the whole report instead of a flush per line
+    vector<string> lines = getStatusLines();
+    string report = "\n";
+    for (size_t i = 0; i < lines.size(); i++) {
+        report += lines[i];
+        report += '\n';
+    }
+    cout << report;
+}
+
+vector<string> Kingdom::getStatusLines() const {
+    vector<string> lines;
+    ostringstream line;
+    // Appends the line built so far and starts the next one
+    auto next = [&lines, &line]() {
+        lines.push_back(line.str());
+        line.str("");
+    };
+
+    line << "===== Kingdom Status: " << getName() << " (Year " << gameYear << ") ====="; next();
+    line << "Ruler: " << ruler->getName(); next();
+    line << "Score: " << score; next();
+    next();
+
+    line << "Population:"; next();
+    line << "  Peasants: " << population->getPeasants(); next();
+    line << "  Merchants: " << population->getMerchants(); next();
+    line << "  Nobles: " << population->getNobles(); next();
+    line << "  Happiness: " << static_cast<int>(population->getHappiness() * 100) << "%"; next();
+    next();
+
+    line << "Army:"; next();
+    line << "  Infantry: " << army->getInfantry(); next();
+    line << "  Cavalry: " << army->getCavalry(); next();
+    line << "  Archers: " << army->getArchers(); next();
+    line << "  Morale: " << static_cast<int>(army->getMorale() * 100) << "%"; next();
+    line << "  Training Level: " << army->getTrainingLevel(); next();
+    line << "  Status: " << (army->getWarStatus() ? "At War" : "At Peace"); next();
+    next();
+
+    line << "Economy:"; next();
+    line << "  Treasury: " << economy->getTreasuryGold() << " gold"; next();
+    line << "  Debt: " << economy->getDebt() << " gold"; next();
+    line << "  Inflation: " << static_cast<int>(economy->getInflation() * 100) << "%"; next();
+    next();
+
+    line << "Market:"; next();
+    line << "  Food: " << market->getFood()->getAmount() << " (Value: " << market->getFood()->getValue() << ")"; next();
+    line << "  Wood: " << market->getWood()->getAmount() << " (Value: " << market->getWood()->getValue() << ")"; next();
+    line << "  Stone: " << market->getStone()->getAmount() << " (Value: " << market->getStone()->getValue() << ")"; next();
+    line << "  Iron: " << market->getIron()->getAmount() << " (Value: " << market->getIron()->getValue() << ")"; next();
+    return lines;
+}
+
+bool Kingdom::saveGame(const string& filename) const {
+    ofstream file(filename);
+    if (!file.is_open()) {
+        Logger::error("Error: Could not open file to save game!");
+        return false;
+    }
+
+    KingdomSnapshot snapshot;
+    captureSnapshot(snapshot);
+    file << snapshot.serialize();
+
+    file.close();
+    Logger::info("Game saved successfully!");
+    return true;
+}
+
+void Kingdom::captureSnapshot(KingdomSnapshot& snapshot) const {
+    strncpy(snapshot.name, getName().c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+    snapshot.name[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    snapshot.gameYear = gameYear;
+    snapshot.score = score;
+
+    snapshot.peasants = population->getPeasants();
+    snapshot.merchants = population->getMerchants();
+    snapshot.nobles = population->getNobles();
+    snapshot.happiness = population->getHappiness();
+    snapshot.growthRate = population->getGrowthRate();
+
+    snapshot.infantry = army->getInfantry();
+    snapshot.cavalry = army->getCavalry();
+    snapshot.archers = army->getArchers();
+    snapshot.morale = army->getMorale();
+    snapshot.trainingLevel = army->getTrainingLevel();
+    snapshot.atWar = army->getWarStatus();
+
+    snapshot.treasuryGold = economy->getTreasuryGold();
+    snapshot.debt = economy->getDebt();
+    snapshot.peasantTaxRate = economy->getPeasantTaxRate();
+    snapshot.merchantTaxRate = economy->getMerchantTaxRate();
+    snapshot.nobleTaxRate = economy->getNobleTaxRate();
+    snapshot.inflation = economy->getInflation();
+
+    snapshot.food = market->getFood()->getAmount();
+    snapshot.wood = market->getWood()->getAmount();
+    snapshot.stone = market->getStone()->getAmount();
+    snapshot.iron = market->getIron()->getAmount();
+
+    strncpy(snapshot.rulerName, ruler->getName().c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+    snapshot.rulerName[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    snapshot.rulerCharisma = ruler->getCharisma();
+    snapshot.rulerIntelligence = ruler->getIntelligence();
+    snapshot.rulerStrength = ruler->getStrength();
+    snapshot.rulerStanding = 0;
+    memset(snapshot.guildType, 0, sizeof(snapshot.guildType));
+    if (const Commander* commander = dynamic_cast<const Commander*>(ruler.get())) {
+        snapshot.rulerType = KingdomSnapshot::RULER_COMMANDER;
+        snapshot.rulerTrait = commander->getTacticalSkill();
+        snapshot.rulerStanding = commander->getLoyalty();
+    }
+    else if (const GuildLeader* guildLeader = dynamic_cast<const GuildLeader*>(ruler.get())) {
+        snapshot.rulerType = KingdomSnapshot::RULER_GUILD_LEADER;
+        snapshot.rulerTrait = guildLeader->getBusinessAcumen();
+        strncpy(snapshot.guildType, guildLeader->getGuildType().c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+        snapshot.guildType[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    }
+    else {
+        const King* king = dynamic_cast<const King*>(ruler.get());
+        snapshot.rulerType = KingdomSnapshot::RULER_KING;
+        snapshot.rulerTrait = king ? king->getRoyalBloodline() : 50;
+        snapshot.rulerStanding = king ? king->getYearsInPower() : 0;
+    }
+
+    snapshot.randomSeed = randomSeed;
+    snapshot.randomId = randomId;
+    snapshot.designerRules = designerRules;
+
+    const Resource* resources[5] = { market->getFood().get(), market->getGold().get(), market->getWood().get(),
+        market->getStone().get(), market->getIron().get() };
+    for (int i = 0; i < 5; i++) {
+        snapshot.values[i] = resources[i]->getValue();
+    }
+    snapshot.gold = market->getGold()->getAmount();
+
+    snapshot.interestRate = bank->getInterestRate();
+    snapshot.maxLoanAmount = bank->getMaxLoanAmount();
+    snapshot.loanTerm = bank->getLoanTerm();
+    snapshot.corruptionLevel = bank->getCorruptionLevel();
+    snapshot.relationCost = diplomacy->getRelationCost();
+    snapshot.peaceCost = diplomacy->getPeaceCost();
+    snapshot.eventChance = events->getEventChance();
+    snapshot.lastEventYear = events->getLastEventYear();
+
+    snapshot.foreign.resize(diplomacy->getKingdomCount());
+    for (size_t i = 0; i < snapshot.foreign.size(); i++) {
+        const auto& foreign = diplomacy->getForeignKingdoms()[i];
+        KingdomSnapshot::Foreign& saved = snapshot.foreign[i];
+        memset(&saved, 0, sizeof(saved));
+        strncpy(saved.name, StringTable::lookup(foreign.nameHandle).c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+        saved.strength = foreign.strength;
+        saved.relationLevel = foreign.relationLevel;
+        saved.isAlly = foreign.isAlly;
+        saved.atWar = foreign.atWar;
+    }
+
+    const LoanLedger& ledger = bank->getLedger();
+    LoanLedger::Loan loan;
+    memset(&loan, 0, sizeof(loan));
+    snapshot.loans.clear();
+    for (uint32_t row = 0; row < ledger.getRowCount(); row++) {
+        if (ledger.getLoan(row, loan)) {
+            snapshot.loans.push_back(loan);
+        }
+    }
+    dynasty->save(snapshot.dynasty);
+}
+
+void Kingdom::enableAutosave(const string& filename) {
+    autosave = make_unique<AutosaveWorker>(filename);
+}
+
+void Kingdom::disableAutosave() {
+    autosave.reset();
+}
+
+AutosaveWorker* Kingdom::getAutosave() const {
+    return autosave.get();
+}
+
+void Kingdom::enableAgentMode() {
+    // Year 0 is never simulated, so its streams are free
+    CounterRng::KingdomScope randomScope(randomSeed, randomId, 0);
+    population->enableAgentMode();
+}
+
+void Kingdom::enableHistory() {
+    // Start with the current year so it can be seeked to as well
+    history = make_unique<HistoryRecorder>();
+    KingdomSnapshot snapshot;
+    captureSnapshot(snapshot);
+    history->record(snapshot);
+}
+
+void Kingdom::disableHistory() {
+    history.reset();
+}
+
+HistoryRecorder* Kingdom::getHistory() const {
+    return history.get();
+}
+
+void Kingdom::setMetricsExporter(MetricsExporter* exporter, uint32_t kingdomId) {
+    metrics = exporter;
+    metricsId = kingdomId;
+}
+
+bool Kingdom::loadGame(const string& filename) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        Logger::error("Error: Could not open file to load game!");
+        return false;
+    }
+
+    // The file holds the save fields only; relations, loans and the houses stay as they are
+    KingdomSnapshot snapshot;
+    captureSnapshot(snapshot);
+    string tempName;
+
+    // Load basic kingdom data
+    getline(file, tempName);
+    strncpy(snapshot.name, tempName.c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+    snapshot.name[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    file >> snapshot.gameYear >> snapshot.score;
+    file.ignore(); // Clear newline
+
+    // Load population data
+    file >> snapshot.peasants >> snapshot.merchants >> snapshot.nobles;
+    file >> snapshot.happiness >> snapshot.growthRate;
+
+    // Load army data
+    file >> snapshot.infantry >> snapshot.cavalry >> snapshot.archers;
+    file >> snapshot.morale >> snapshot.trainingLevel >> snapshot.atWar;
+
+    // Load economy data
+    file >> snapshot.treasuryGold >> snapshot.debt;
+    file >> snapshot.peasantTaxRate >> snapshot.merchantTaxRate >> snapshot.nobleTaxRate >> snapshot.inflation;
+
+    // Load market data
+    file >> snapshot.food >> snapshot.wood >> snapshot.stone >> snapshot.iron;
+
+    // Load ruler data
+    file.ignore();
+    getline(file, tempName);
+    strncpy(snapshot.rulerName, tempName.c_str(), KingdomSnapshot::NAME_LENGTH - 1);
+    snapshot.rulerName[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    file >> snapshot.rulerTrait >> snapshot.rulerStanding;
+    snapshot.rulerType = KingdomSnapshot::RULER_KING;
+    snapshot.rulerCharisma = 50;
+    snapshot.rulerIntelligence = 50;
+    snapshot.rulerStrength = 50;
+
+    file.close();
+    restoreSnapshot(snapshot);
+    Logger::info("Game loaded successfully!");
+    Logger::info("Kingdom: {}, Year: {}, Score: {}", getName(), gameYear, score);
+    return true;
+}
+
+void Kingdom::restoreSnapshot(const KingdomSnapshot& snapshot) {
+    setName(snapshot.name);
+    setGameYear(snapshot.gameYear);
+    setScore(snapshot.score);
+
+    population->setPeasants(snapshot.peasants);
+    population->setMerchants(snapshot.merchants);
+    population->setNobles(snapshot.nobles);
+    population->setHappiness(snapshot.happiness);
+    population->setGrowthRate(snapshot.growthRate);
+
+    army->setInfantry(snapshot.infantry);
+    army->setCavalry(snapshot.cavalry);
+    army->setArchers(snapshot.archers);
+    army->setMorale(snapshot.morale);
+    army->setTrainingLevel(snapshot.trainingLevel);
+    army->setWarStatus(snapshot.atWar);
+
+    economy->setTreasuryGold(snapshot.treasuryGold);
+    economy->setDebt(snapshot.debt);
+    economy->setPeasantTaxRate(snapshot.peasantTaxRate);
+    economy->setMerchantTaxRate(snapshot.merchantTaxRate);
+    economy->setNobleTaxRate(snapshot.nobleTaxRate);
+    economy->setInflation(snapshot.inflation);
+
+    market->getFood()->setAmount(snapshot.food);
+    market->getGold()->setAmount(snapshot.gold);
+    market->getWood()->setAmount(snapshot.wood);
+    market->getStone()->setAmount(snapshot.stone);
+    market->getIron()->setAmount(snapshot.iron);
+    Resource* resources[5] = { market->getFood().get(), market->getGold().get(), market->getWood().get(),
+        market->getStone().get(), market->getIron().get() };
+    for (int i = 0; i < 5; i++) {
+        resources[i]->setValue(snapshot.values[i]);
+    }
+
+    randomSeed = snapshot.randomSeed;
+    randomId = snapshot.randomId;
+    designerRules = snapshot.designerRules;
+
+    bank->setInterestRate(snapshot.interestRate);
+    bank->setMaxLoanAmount(snapshot.maxLoanAmount);
+    bank->setLoanTerm(snapshot.loanTerm);
+    bank->setCorruptionLevel(snapshot.corruptionLevel);
+    LoanLedger& ledger = bank->getLedgerMutable();
+    ledger = LoanLedger();
+    for (size_t i = 0; i < snapshot.loans.size(); i++) {
+        ledger.restoreLoan(snapshot.loans[i]);
+    }
+
+    diplomacy->setRelationCost(snapshot.relationCost);
+    diplomacy->setPeaceCost(snapshot.peaceCost);
+    diplomacy->setCapacity(static_cast<int>(snapshot.foreign.size()));
+    diplomacy->clearKingdoms();
+    for (size_t i = 0; i < snapshot.foreign.size(); i++) {
+        diplomacy->addKingdom(snapshot.foreign[i].name, snapshot.foreign[i].strength);
+        auto& foreign = diplomacy->getForeignKingdomsMutable()[i];
+        foreign.relationLevel = snapshot.foreign[i].relationLevel;
+        foreign.isAlly = snapshot.foreign[i].isAlly;
+        foreign.atWar = snapshot.foreign[i].atWar;
+    }
+
+    events->setEventChance(snapshot.eventChance);
+    events->setLastEventYear(static_cast<int>(snapshot.lastEventYear));
+
+    if (snapshot.rulerType == KingdomSnapshot::RULER_COMMANDER) {
+        unique_ptr<Commander> commander = make_unique<Commander>(snapshot.rulerName, snapshot.rulerCharisma,
+            snapshot.rulerIntelligence, snapshot.rulerStrength, snapshot.rulerTrait);
+        commander->setLoyalty(snapshot.rulerStanding);
+        setRuler(move(commander));
+    }
+    else if (snapshot.rulerType == KingdomSnapshot::RULER_GUILD_LEADER) {
+        setRuler(make_unique<GuildLeader>(snapshot.rulerName, snapshot.rulerCharisma, snapshot.rulerIntelligence,
+            snapshot.rulerStrength, snapshot.guildType, snapshot.rulerTrait));
+    }
+    else {
+        unique_ptr<King> king = make_unique<King>(snapshot.rulerName, snapshot.rulerCharisma,
+            snapshot.rulerIntelligence, snapshot.rulerStrength, snapshot.rulerTrait);
+        king->setYearsInPower(snapshot.rulerStanding);
+        setRuler(move(king));
+    }
+
+    // After the ruler, since setting one from outside clears the houses' ruler
+    if (!dynasty->load(snapshot.dynasty.data(), snapshot.dynasty.size())) {
+        Logger::warning("The noble houses could not be restored; they will be founded again.");
+    }
+}
+
+bool Kingdom::compact(CompactKingdom& packed) const {
+    // Zeroed first, padding included, so equal kingdoms pack to equal bytes
+    memset(&packed, 0, sizeof(packed));
+    bool exact = true;
+    packed.name = nameHandle;
+    packed.randomSeed = randomSeed;
+    packed.randomId = randomId;
+    packed.gameYear = gameYear;
+    packed.score = score;
+    packed.designerRules = designerRules ? 1 : 0;
+
+    // Citizen agents are rebuilt from the counts rather than kept
+    packed.peasants = population->getPeasants();
+    packed.merchants = population->getMerchants();
+    packed.nobles = population->getNobles();
+    packed.happiness = population->getHappiness();
+    packed.growthRate = population->getGrowthRate();
+    exact = exact && !population->isAgentMode();
+
+    packed.infantry = army->getInfantry();
+    packed.cavalry = army->getCavalry();
+    packed.archers = army->getArchers();
+    packed.trainingLevel = army->getTrainingLevel();
+    packed.morale = army->getMorale();
+    packed.atWar = army->getWarStatus() ? 1 : 0;
+
+    packed.peasantTaxRate = economy->getPeasantTaxRate();
+    packed.merchantTaxRate = economy->getMerchantTaxRate();
+    packed.nobleTaxRate = economy->getNobleTaxRate();
+    packed.inflation = economy->getInflation();
+    packed.treasuryGold = economy->getTreasuryGold();
+    packed.debt = economy->getDebt();
+
+    const Resource* resources[CompactKingdom::RESOURCE_COUNT] = { market->getFood().get(),
+        market->getGold().get(), market->getWood().get(), market->getStone().get(), market->getIron().get() };
+    for (int i = 0; i < CompactKingdom::RESOURCE_COUNT; i++) {
+        packed.amounts[i] = resources[i]->getAmount();
+        packed.values[i] = resources[i]->getValue();
+    }
+
+    packed.interestRate = bank->getInterestRate();
+    packed.maxLoanAmount = bank->getMaxLoanAmount();
+    packed.loanTerm = bank->getLoanTerm();
+    packed.corruptionLevel = bank->getCorruptionLevel();
+    packed.relationCost = diplomacy->getRelationCost();
+    packed.peaceCost = diplomacy->getPeaceCost();
+    const LoanLedger& ledger = bank->getLedger();
+    LoanLedger::Loan loan;
+    memset(&loan, 0, sizeof(loan));
+    for (uint32_t row = 0; row < ledger.getRowCount(); row++) {
+        if (!ledger.getLoan(row, loan)) {
+            continue;
+        }
+        if (packed.loanCount < CompactKingdom::LOAN_SLOTS) {
+            packed.loans[packed.loanCount++] = loan;
+            continue;
+        }
+        // Loans past the last slot fold into it: balances and installments add up and
+        // the merged loan runs as long as the longest
+        LoanLedger::Loan& merged = packed.loans[CompactKingdom::LOAN_SLOTS - 1];
+        double total = merged.balance + loan.balance;
+        if (total > 0.0) {
+            merged.rate = (merged.rate * merged.balance + loan.rate * loan.balance) / total;
+        }
+        merged.balance = total;
+        merged.payment += loan.payment;
+        merged.yearsLeft = max(merged.yearsLeft, loan.yearsLeft);
+        exact = false;
+    }
+
+    packed.eventChance = static_cast<uint8_t>(events->getEventChance());
+    packed.lastEventYear = events->getLastEventYear();
+
+    packed.rulerName = ruler->getNameHandle();
+    packed.rulerCharisma = static_cast<int16_t>(ruler->getCharisma());
+    packed.rulerIntelligence = static_cast<int16_t>(ruler->getIntelligence());
+    packed.rulerStrength = static_cast<int16_t>(ruler->getStrength());
+    if (const Commander* commander = dynamic_cast<const Commander*>(ruler.get())) {
+        packed.rulerType = CompactKingdom::RULER_COMMANDER;
+        packed.rulerTrait = commander->getTacticalSkill();
+        packed.rulerStanding = commander->getLoyalty();
+    }
+    else if (const GuildLeader* guildLeader = dynamic_cast<const GuildLeader*>(ruler.get())) {
+        packed.rulerType = CompactKingdom::RULER_GUILD_LEADER;
+        packed.rulerTrait = guildLeader->getBusinessAcumen();
+        packed.guildType = guildLeader->getGuildTypeHandle();
+    }
+    else if (const King* king = dynamic_cast<const King*>(ruler.get())) {
+        packed.rulerType = CompactKingdom::RULER_KING;
+        packed.rulerTrait = king->getRoyalBloodline();
+        packed.rulerStanding = king->getYearsInPower();
+    }
+
+    int foreignCount = diplomacy->getKingdomCount();
+    exact = exact && foreignCount <= CompactKingdom::FOREIGN_SLOTS;
+    packed.foreignCount = static_cast<uint8_t>(min(foreignCount, static_cast<int>(CompactKingdom::FOREIGN_SLOTS)));
+    for (int i = 0; i < packed.foreignCount; i++) {
+        const auto& foreign = diplomacy->getForeignKingdoms()[i];
+        packed.foreign[i].name = foreign.nameHandle;
+        packed.foreign[i].relationLevel = static_cast<int16_t>(foreign.relationLevel);
+        packed.foreign[i].strength = foreign.strength;
+        packed.foreign[i].isAlly = foreign.isAlly ? 1 : 0;
+        packed.foreign[i].atWar = foreign.atWar ? 1 : 0;
+    }
+    return exact;
+}
+
+void Kingdom::expand(const CompactKingdom& packed) {
+    nameHandle = packed.name;
+    randomSeed = packed.randomSeed;
+    randomId = packed.randomId;
+    gameYear = packed.gameYear;
+    score = packed.score;
+    designerRules = packed.designerRules != 0;
+
+    population->disableAgentMode();
+    population->setPeasants(packed.peasants);
+    population->setMerchants(packed.merchants);
+    population->setNobles(packed.nobles);
+    population->setHappiness(packed.happiness);
+    population->setGrowthRate(packed.growthRate);
+
+    army->setInfantry(packed.infantry);
+    army->setCavalry(packed.cavalry);
+    army->setArchers(packed.archers);
+    army->setTrainingLevel(packed.trainingLevel);
+    army->setMorale(packed.morale);
+    army->setWarStatus(packed.atWar != 0);
+
+    economy->setPeasantTaxRate(packed.peasantTaxRate);
+    economy->setMerchantTaxRate(packed.merchantTaxRate);
+    economy->setNobleTaxRate(packed.nobleTaxRate);
+    economy->setInflation(packed.inflation);
+    economy->setTreasuryGold(packed.treasuryGold);
+    economy->setDebt(packed.debt);
+
+    market->clearPriceHistory();
+    Resource* resources[CompactKingdom::RESOURCE_COUNT] = { market->getFood().get(),
+        market->getGold().get(), market->getWood().get(), market->getStone().get(), market->getIron().get() };
+    for (int i = 0; i < CompactKingdom::RESOURCE_COUNT; i++) {
+        resources[i]->setAmount(packed.amounts[i]);
+        resources[i]->setValue(packed.values[i]);
+    }
+
+    bank->setInterestRate(packed.interestRate);
+    bank->setMaxLoanAmount(packed.maxLoanAmount);
+    bank->setLoanTerm(packed.loanTerm);
+    bank->setCorruptionLevel(packed.corruptionLevel);
+    diplomacy->setRelationCost(packed.relationCost);
+    diplomacy->setPeaceCost(packed.peaceCost);
+    LoanLedger& ledger = bank->getLedgerMutable();
+    ledger = LoanLedger();
+    for (int i = 0; i < packed.loanCount; i++) {
+        ledger.restoreLoan(packed.loans[i]);
+    }
+
+    events->setEventChance(packed.eventChance);
+    events->setLastEventYear(static_cast<int>(packed.lastEventYear));
+
+    diplomacy->clearKingdoms();
+    for (int i = 0; i < packed.foreignCount; i++) {
+        diplomacy->addKingdom(StringTable::lookup(packed.foreign[i].name), packed.foreign[i].strength);
+        auto& foreign = diplomacy->getForeignKingdomsMutable()[i];
+        foreign.relationLevel = packed.foreign[i].relationLevel;
+        foreign.isAlly = packed.foreign[i].isAlly != 0;
+        foreign.atWar = packed.foreign[i].atWar != 0;
+    }
+
+    // No houses until a successor is needed; succeedRuler founds them then
+    dynasty->clear();
+
+    if (packed.rulerType == CompactKingdom::RULER_COMMANDER) {
+        unique_ptr<Commander> commander = make_unique<Commander>(StringTable::lookup(packed.rulerName), packed.rulerCharisma,
+            packed.rulerIntelligence, packed.rulerStrength, packed.rulerTrait);
+        commander->setLoyalty(packed.rulerStanding);
+        setRuler(move(commander));
+    }
+    else if (packed.rulerType == CompactKingdom::RULER_GUILD_LEADER) {
+        setRuler(make_unique<GuildLeader>(StringTable::lookup(packed.rulerName), packed.rulerCharisma,
+            packed.rulerIntelligence, packed.rulerStrength, StringTable::lookup(packed.guildType), packed.rulerTrait));
+    }
+    else {
+        unique_ptr<King> king = make_unique<King>(StringTable::lookup(packed.rulerName), packed.rulerCharisma,
+            packed.rulerIntelligence, packed.rulerStrength, packed.rulerTrait);
+        king->setYearsInPower(packed.rulerStanding);
+        setRuler(move(king));
+    }
+}
+
+MemoryFootprint Kingdom::getFootprint() const {
+    MemoryFootprint footprint;
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_KINGDOM] = sizeof(Kingdom);
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_POPULATION] = sizeof(Population) +
+        (population->isAgentMode() ? sizeof(CitizenAgents) + population->getAgents()->memoryUsage() : 0);
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_ARMY] = sizeof(Army);
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_ECONOMY] = sizeof(Economy);
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_MARKET] = sizeof(Market) + market->memoryUsage();
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_DIPLOMACY] = sizeof(Diplomacy) + diplomacy->memoryUsage();
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_BANK] = sizeof(Bank) + bank->getLedger().memoryUsage();
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_EVENTS] = sizeof(RandomEvents);
+
+    size_t rulerSize = sizeof(King);
+    if (dynamic_cast<const Commander*>(ruler.get())) {
+        rulerSize = sizeof(Commander);
+    }
+    else if (dynamic_cast<const GuildLeader*>(ruler.get())) {
+        rulerSize = sizeof(GuildLeader);
+    }
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_RULER] = rulerSize + ruler->memoryUsage();
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_DYNASTY] = sizeof(Dynasty) + dynasty->memoryUsage();
+    footprint.bytes[MemoryFootprint::SUBSYSTEM_RECORDING] =
+        (autosave ? sizeof(AutosaveWorker) + stringHeapBytes(autosave->getFilename()) : 0) +
+        (history ? history->getMemoryUsage() : 0);
+    return footprint;
+}
+
+void Kingdom::handleEvent(int event) {
+    events->applyEvent(event, *this);
+}
+
+void Kingdom::holdElections() {
+    Logger::info("\n===== ELECTIONS =====");
+    Logger::info("The people demand a new ruler!");
+
+    // The houses put forward their best-placed noble
+    succeedRuler();
+    if (dynamic_cast<Commander*>(ruler.get())) {
+        Logger::info("A military Commander takes charge!");
+    }
+    else if (dynamic_cast<GuildLeader*>(ruler.get())) {
+        Logger::info("A Guild Leader rises to power!");
+    }
+    else {
+        Logger::info("A new King is crowned!");
+    }
+
+    // Boost happiness due to change
+    population->setHappiness(population->getHappiness() + 0.1);
+}
+
+void Kingdom::succeedRuler() {
+    // Houses are founded on the first succession, from the kingdom's key, so a kingdom
+    // grows the same nobles whether it was built or expanded; year 0 is never simulated,
+    // so its streams are free
+    if (dynasty->getHouseCount() == 0) {
+        CounterRng::KingdomScope randomScope(randomSeed, randomId, 0);
+        dynasty->found(4, 12, gameYear);
+    }
+    uint32_t heir = dynasty->crownSuccessor();
+    if (heir == Dynasty::NO_NOBLE) {
+        setRuler(make_unique<King>("New King", 50, 50, 50, 50));
+        return;
+    }
+    ruler = dynasty->makeLeader(heir);
+    Logger::info("{} takes the throne.", ruler->getName());
+}
+
+// ------------------------------
+// MemoryFootprint implementation
+// ------------------------------
+
+static const char* const subsystemNames[MemoryFootprint::SUBSYSTEM_COUNT] = {
+    "kingdom", "population", "army", "economy", "market", "diplomacy", "bank", "events",
+    "ruler", "dynasty", "recording"
+};
+
+MemoryFootprint::MemoryFootprint() {
+    for (int i = 0; i < SUBSYSTEM_COUNT; i++) {
+        bytes[i] = 0;
+    }
+}
+
+void MemoryFootprint::add(const MemoryFootprint& other) {
+    for (int i = 0; i < SUBSYSTEM_COUNT; i++) {
+        bytes[i] += other.bytes[i];
+    }
+}
+
+size_t MemoryFootprint::getTotal() const {
+    size_t total = 0;
+    for (int i = 0; i < SUBSYSTEM_COUNT; i++) {
+        total += bytes[i];
+    }
+    return total;
+}
+
+const char* MemoryFootprint::getSubsystemName(Subsystem subsystem) {
+    return subsystemNames[subsystem];
+}
+
+// -------------------------------------------------
+// KingdomSnapshot and AutosaveWorker implementation
+// -------------------------------------------------
+
+string KingdomSnapshot::serialize() const {
+    // Same layout, one value per line, that Kingdom::loadGame reads
+    ostringstream out;
+    out << name << '\n' << gameYear << '\n' << score << '\n';
+    out << peasants << '\n' << merchants << '\n' << nobles << '\n' << happiness << '\n' << growthRate << '\n';
+    out << infantry << '\n' << cavalry << '\n' << archers << '\n' << morale << '\n' << trainingLevel << '\n'
+        << atWar << '\n';
+    out << treasuryGold << '\n' << debt << '\n' << peasantTaxRate << '\n' << merchantTaxRate << '\n'
+        << nobleTaxRate << '\n' << inflation << '\n';
+    out << food << '\n' << wood << '\n' << stone << '\n' << iron << '\n';
+    // The file only knows kings; other rulers save a king's defaults
+    bool king = rulerType == RULER_KING;
+    out << rulerName << '\n' << (king ? rulerTrait : 50) << '\n' << (king ? rulerStanding : 0) << '\n';
+    return out.str();
+}
+
+bool KingdomSnapshot::matches(const KingdomSnapshot& other) const {
+    // Packed records hold every fixed field bit for bit, and tails the rest
+    unsigned char record[KingdomArchiveWriter::RECORD_SIZE];
+    unsigned char otherRecord[KingdomArchiveWriter::RECORD_SIZE];
+    KingdomArchiveWriter::pack(*this, record);
+    KingdomArchiveWriter::pack(other, otherRecord);
+    if (memcmp(record, otherRecord, sizeof(record)) != 0) {
+        return false;
+    }
+    vector<unsigned char> tail;
+    vector<unsigned char> otherTail;
+    KingdomArchiveWriter::packTail(*this, tail);
+    KingdomArchiveWriter::packTail(other, otherTail);
+    return tail == otherTail;
+}
+
+AutosaveWorker::AutosaveWorker(const string& filename)
+    : filename(filename), hasPending(false), writing(false), stopping(false), savesWritten(0),
+    savesReplaced(0), failures(0), lastSavedYear(0) {
+    writer = thread(&AutosaveWorker::writerLoop, this);
+}
+
+AutosaveWorker::~AutosaveWorker() {
+    // Let the last snapshot reach the disk before stopping
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+}
+
+void AutosaveWorker::submit(const KingdomSnapshot& snapshot) {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        if (hasPending) {
+            savesReplaced++;
+        }
+        pending = snapshot;
+        hasPending = true;
+    }
+    wake.notify_one();
+}
+
+void AutosaveWorker::flush() {
+    unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this]() { return !hasPending && !writing; });
+}
+
+void AutosaveWorker::writerLoop() {
+    unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return hasPending || stopping; });
+        if (!hasPending) {
+            break;
+        }
+        KingdomSnapshot snapshot = pending;
+        hasPending = false;
+        writing = true;
+        lock.unlock();
+
+        bool saved = writeFileDurably(filename, snapshot.serialize());
+        if (!saved) {
+            Logger::error("Error: Autosave to {} failed!", filename);
+        }
+
+        lock.lock();
+        writing = false;
+        if (saved) {
+            savesWritten++;
+            lastSavedYear = snapshot.gameYear;
+        }
+        else {
+            failures++;
+        }
+        idle.notify_all();
+    }
+}
+
+string AutosaveWorker::getFilename() const {
+    return filename;
+}
+
+int AutosaveWorker::getSavesWritten() const {
+    lock_guard<std::mutex> lock(mutex);
+    return savesWritten;
+}
+
+int AutosaveWorker::getSavesReplaced() const {
+    lock_guard<std::mutex> lock(mutex);
+    return savesReplaced;
+}
+
+int AutosaveWorker::getFailures() const {
+    lock_guard<std::mutex> lock(mutex);
+    return failures;
+}
+
+int AutosaveWorker::getLastSavedYear() const {
+    lock_guard<std::mutex> lock(mutex);
+    return lastSavedYear;
+}
+
+// -------------------------------
+// Kingdom archive implementation
+// -------------------------------
+
+// Archive files are little-endian regardless of the host
+static void putU32(unsigned char* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+static void putU64(unsigned char* out, uint64_t value) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+}
+
+static uint32_t getU32(const unsigned char* in) {
+    return static_cast<uint32_t>(in[0]) | (static_cast<uint32_t>(in[1]) << 8) |
+        (static_cast<uint32_t>(in[2]) << 16) | (static_cast<uint32_t>(in[3]) << 24);
+}
+
+static uint64_t getU64(const unsigned char* in) {
+    return static_cast<uint64_t>(getU32(in)) | (static_cast<uint64_t>(getU32(in + 4)) << 32);
+}
+
+static void putVarint(vector<unsigned char>& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+// At most 10 bytes
+static unsigned char* writeVarint(unsigned char* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = static_cast<unsigned char>(value);
+    return out;
+}
+
+static const unsigned char* getVarint(const unsigned char* in, const unsigned char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        unsigned char byte = *in++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return in;
+        }
+    }
+    return nullptr;
+}
+
+// XOR of two doubles as a (leading, trailing zero bytes) header and the bytes between; at most 9 bytes
+static unsigned char* writeXorBits(unsigned char* out, uint64_t bits) {
+    if (bits == 0) {
+        *out++ = 0x80;
+        return out;
+    }
+    int trailing = 0;
+    while (!(bits & (0xffull << (8 * trailing)))) {
+        trailing++;
+    }
+    int leading = 0;
+    while (!(bits & (0xffull << (8 * (7 - leading))))) {
+        leading++;
+    }
+    *out++ = static_cast<unsigned char>((leading << 4) | trailing);
+    for (int byte = trailing; byte < 8 - leading; byte++) {
+        *out++ = static_cast<unsigned char>(bits >> (8 * byte));
+    }
+    return out;
+}
+
+static void putXorBits(vector<unsigned char>& out, uint64_t bits) {
+    size_t size = out.size();
+    out.resize(size + 9);
+    out.resize(writeXorBits(&out[size], bits) - &out[0]);
+}
+
+static const unsigned char* getXorBits(const unsigned char* in, const unsigned char* end, uint64_t& bits) {
+    if (in >= end) {
+        return nullptr;
+    }
+    int leading = *in >> 4;
+    int trailing = *in & 0x0f;
+    in++;
+    if (leading + trailing > 8 || end - in < 8 - leading - trailing) {
+        return nullptr;
+    }
+    bits = 0;
+    for (int byte = trailing; byte < 8 - leading; byte++) {
+        bits |= static_cast<uint64_t>(*in++) << (8 * byte);
+    }
+    return in;
+}
+
+// Run-length groups of (zero count, literal count, literal bytes) over bytes XOR base,
+// base taken as zeros past its end; a lone zero inside literals stays a literal, since a
+// new group would cost more
+static void putXorRuns(vector<unsigned char>& out, const unsigned char* base, size_t baseLength,
+    const unsigned char* bytes, size_t length) {
+    auto at = [&](size_t i) {
+        return static_cast<unsigned char>(i < baseLength ? bytes[i] ^ base[i] : bytes[i]);
+    };
+    size_t overlap = min(length, baseLength);
+    size_t position = 0;
+    while (position < length) {
+        // Unchanged stretches are skipped a word at a time
+        size_t zeros = 0;
+        while (position + zeros + 8 <= overlap && memcmp(bytes + position + zeros, base + position + zeros, 8) == 0) {
+            zeros += 8;
+        }
+        while (position + zeros < length && at(position + zeros) == 0) {
+            zeros++;
+        }
+        position += zeros;
+        size_t literalStart = position;
+        while (position < length && !(at(position) == 0 && (position + 1 == length || at(position + 1) == 0))) {
+            position++;
+        }
+        putVarint(out, zeros);
+        putVarint(out, position - literalStart);
+        for (size_t i = literalStart; i < position; i++) {
+            out.push_back(at(i));
+        }
+    }
+}
+
+// XORs the literals of length bytes' worth of groups into target
+static const unsigned char* xorZeroRuns(const unsigned char* in, const unsigned char* end, unsigned char* target,
+    size_t length) {
+    size_t produced = 0;
+    while (produced < length) {
+        uint64_t zeros;
+        uint64_t literals;
+        in = in ? getVarint(in, end, zeros) : nullptr;
+        in = in ? getVarint(in, end, literals) : nullptr;
+        if (!in || static_cast<uint64_t>(end - in) < literals || zeros + literals > length - produced) {
+            return nullptr;
+        }
+        produced += static_cast<size_t>(zeros);
+        for (uint64_t i = 0; i < literals; i++) {
+            target[produced++] ^= in[i];
+        }
+        in += literals;
+    }
+    return in;
+}
+
+// Dynasty bytes use the archive's little-endian helpers, so they are written here. Rows
+// have a fixed width and each list is padded to whole groups of 16, so a year's births
+// and deaths leave most bytes where they were last year
+static const size_t dynastyHeaderSize = 32;
+static const size_t dynastyRowSize = 29;
+
+static size_t dynastyPadded(size_t count) {
+    return (count + 15) / 16 * 16;
+}
+
+void Dynasty::save(vector<unsigned char>& out) const {
+    out.clear();
+    if (houseNames.empty()) {
+        return;
+    }
+    size_t rows = parent.size();
+    size_t size = dynastyHeaderSize + dynastyPadded(rows) * dynastyRowSize +
+        (dynastyPadded(freeRows.size()) + dynastyPadded(candidates.size())) * 4;
+    for (size_t h = 0; h < houseNames.size(); h++) {
+        size += 1 + min<size_t>(StringTable::lookup(houseNames[h]).size(), 255);
+    }
+    out.assign(size, 0);
+
+    unsigned char* position = out.data();
+    const uint32_t header[8] = { static_cast<uint32_t>(rows), ruler, static_cast<uint32_t>(livingCount),
+        static_cast<uint32_t>(capacity), static_cast<uint32_t>(lastYear), static_cast<uint32_t>(houseNames.size()),
+        static_cast<uint32_t>(freeRows.size()), static_cast<uint32_t>(candidates.size()) };
+    for (int i = 0; i < 8; i++) {
+        putU32(position + 4 * i, header[i]);
+    }
+    position += dynastyHeaderSize;
+    for (size_t h = 0; h < houseNames.size(); h++) {
+        const string& houseName = StringTable::lookup(houseNames[h]);
+        size_t length = min<size_t>(houseName.size(), 255);
+        *position++ = static_cast<unsigned char>(length);
+        memcpy(position, houseName.data(), length);
+        position += length;
+    }
+
+    for (size_t row = 0; row < rows; row++) {
+        unsigned char* record = position + row * dynastyRowSize;
+        putU32(record, parent[row]);
+        putU32(record + 4, firstChild[row]);
+        putU32(record + 8, nextSibling[row]);
+        putU32(record + 12, static_cast<uint32_t>(birthYear[row]));
+        record[16] = static_cast<unsigned char>(house[row]);
+        record[17] = static_cast<unsigned char>(house[row] >> 8);
+        record[18] = lifespan[row];
+        record[19] = charisma[row];
+        record[20] = intelligence[row];
+        record[21] = strength[row];
+        record[22] = legitimacy[row];
+        record[23] = givenName[row];
+        record[24] = alive[row];
+        uint32_t bits;
+        memcpy(&bits, &score[row], sizeof(bits));
+        putU32(record + 25, bits);
+    }
+    position += dynastyPadded(rows) * dynastyRowSize;
+
+    // The candidate heap's layout picks parents, so it is kept as it is; the year heaps
+    // are not, see load
+    const vector<uint32_t>* lists[2] = { &freeRows, &candidates };
+    for (int l = 0; l < 2; l++) {
+        for (size_t i = 0; i < lists[l]->size(); i++) {
+            putU32(position + 4 * i, (*lists[l])[i]);
+        }
+        position += dynastyPadded(lists[l]->size()) * 4;
+    }
+}
+
+bool Dynasty::load(const unsigned char* in, size_t length) {
+    clear();
+    if (length == 0) {
+        return true;
+    }
+    if (length < dynastyHeaderSize) {
+        return false;
+    }
+    uint32_t header[8];
+    for (int i = 0; i < 8; i++) {
+        header[i] = getU32(in + 4 * i);
+    }
+    const unsigned char* position = in + dynastyHeaderSize;
+    const unsigned char* end = in + length;
+    size_t rows = header[0];
+    for (uint32_t h = 0; h < header[5]; h++) {
+        if (position >= end || end - position - 1 < *position) {
+            clear();
+            return false;
+        }
+        size_t nameLength = *position++;
+        houseNames.push_back(StringTable::intern(string(reinterpret_cast<const char*>(position), nameLength)));
+        position += nameLength;
+    }
+    // Counts past the end are rejected before anything is sized from them
+    uint64_t needed = static_cast<uint64_t>(dynastyPadded(rows)) * dynastyRowSize +
+        (static_cast<uint64_t>(dynastyPadded(header[6])) + dynastyPadded(header[7])) * 4;
+    if (needed != static_cast<uint64_t>(end - position)) {
+        clear();
+        return false;
+    }
+
+    parent.resize(rows);
+    firstChild.resize(rows);
+    nextSibling.resize(rows);
+    birthYear.resize(rows);
+    house.resize(rows);
+    lifespan.resize(rows);
+    charisma.resize(rows);
+    intelligence.resize(rows);
+    strength.resize(rows);
+    legitimacy.resize(rows);
+    givenName.resize(rows);
+    alive.resize(rows);
+    score.resize(rows);
+    heapPosition.assign(rows, NO_NOBLE);
+    lastYear = static_cast<int32_t>(header[4]);
+    bool valid = (header[1] == NO_NOBLE || header[1] < rows) && header[5] > 0;
+    for (size_t row = 0; row < rows; row++) {
+        const unsigned char* record = position + row * dynastyRowSize;
+        parent[row] = getU32(record);
+        firstChild[row] = getU32(record + 4);
+        nextSibling[row] = getU32(record + 8);
+        birthYear[row] = static_cast<int32_t>(getU32(record + 12));
+        house[row] = static_cast<uint16_t>(record[16] | (record[17] << 8));
+        lifespan[row] = record[18];
+        charisma[row] = record[19];
+        intelligence[row] = record[20];
+        strength[row] = record[21];
+        legitimacy[row] = record[22];
+        givenName[row] = record[23];
+        alive[row] = record[24];
+        uint32_t bits = getU32(record + 25);
+        memcpy(&score[row], &bits, sizeof(bits));
+        valid = valid && (parent[row] == NO_NOBLE || parent[row] < rows) &&
+            (firstChild[row] == NO_NOBLE || firstChild[row] < rows) &&
+            (nextSibling[row] == NO_NOBLE || nextSibling[row] < rows) &&
+            house[row] < houseNames.size() && givenName[row] < GIVEN_NAME_COUNT;
+
+        // Entries for the dead or for a row's earlier noble are skipped when they come up,
+        // so only the living's entries matter, and they pop in (year, row) order in any layout
+        if (alive[row]) {
+            deaths.push_back(YearEntry(birthYear[row] + lifespan[row], static_cast<uint32_t>(row)));
+            if (birthYear[row] + AGE_OF_MAJORITY > lastYear) {
+                comingOfAge.push_back(YearEntry(birthYear[row] + AGE_OF_MAJORITY, static_cast<uint32_t>(row)));
+            }
+        }
+    }
+    position += dynastyPadded(rows) * dynastyRowSize;
+    make_heap(deaths.begin(), deaths.end(), greater<YearEntry>());
+    make_heap(comingOfAge.begin(), comingOfAge.end(), greater<YearEntry>());
+
+    vector<uint32_t>* lists[2] = { &freeRows, &candidates };
+    for (int l = 0; l < 2; l++) {
+        lists[l]->resize(header[6 + l]);
+        for (size_t i = 0; i < lists[l]->size(); i++) {
+            (*lists[l])[i] = getU32(position + 4 * i);
+            valid = valid && (*lists[l])[i] < rows;
+        }
+        position += dynastyPadded(lists[l]->size()) * 4;
+    }
+    for (size_t i = 0; valid && i < candidates.size(); i++) {
+        valid = heapPosition[candidates[i]] == NO_NOBLE;
+        heapPosition[candidates[i]] = static_cast<uint32_t>(i);
+    }
+    if (!valid) {
+        clear();
+        return false;
+    }
+    ruler = header[1];
+    livingCount = static_cast<int>(header[2]);
+    capacity = static_cast<int>(header[3]);
+    return true;
+}
+
+static const char archiveMagic[4] = { 'S', 'K', 'A', 'R' };
+static const uint32_t archiveVersion = 4;
+static const size_t archiveFooterSize = 32;
+static const size_t archiveEntrySize = 16;
+static const size_t archiveChunkInfoSize = 20;
+
+KingdomArchiveWriter::KingdomArchiveWriter() : file(nullptr), offset(0), tailBytes(0) {}
+
+KingdomArchiveWriter::~KingdomArchiveWriter() {
+    if (file) {
+        close();
+    }
+}
+
+bool KingdomArchiveWriter::open(const string& filename) {
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        Logger::error("Error: Could not create archive {}!", filename);
+        return false;
+    }
+    offset = 0;
+    tailBytes = 0;
+    records.clear();
+    tails.clear();
+    index.clear();
+    chunks.clear();
+    lastTails.clear();
+
+    unsigned char header[8];
+    memcpy(header, archiveMagic, 4);
+    putU32(header + 4, archiveVersion);
+    return write(header, sizeof(header));
+}
+
+bool KingdomArchiveWriter::write(const void* data, size_t length) {
+    if (fwrite(data, 1, length, file) != length) {
+        Logger::error("Error: Archive write failed!");
+        return false;
+    }
+    offset += length;
+    return true;
+}
+
+// Record layout: three names, then the integers, then the reals and other 64-bit fields
+static const size_t recordIntegerOffset = 192;
+static const int recordIntegerCount = 31;
+static const size_t recordWideOffset = 320;
+static const int recordWideCount = 15;
+
+void KingdomArchiveWriter::pack(const KingdomSnapshot& snapshot, unsigned char* record) {
+    memset(record, 0, RECORD_SIZE);
+    memcpy(record, snapshot.name, KingdomSnapshot::NAME_LENGTH);
+    memcpy(record + 64, snapshot.rulerName, KingdomSnapshot::NAME_LENGTH);
+    memcpy(record + 128, snapshot.guildType, KingdomSnapshot::NAME_LENGTH);
+    record[63] = '\0';
+    record[127] = '\0';
+    record[191] = '\0';
+
+    // The save file's fields first, in the order earlier archives used
+    const int integers[recordIntegerCount] = {
+        snapshot.gameYear, snapshot.score, snapshot.peasants, snapshot.merchants, snapshot.nobles,
+        snapshot.infantry, snapshot.cavalry, snapshot.archers, snapshot.trainingLevel, snapshot.atWar ? 1 : 0,
+        snapshot.treasuryGold, snapshot.debt, snapshot.food, snapshot.wood, snapshot.stone, snapshot.iron,
+        snapshot.rulerTrait, snapshot.rulerStanding,
+        snapshot.gold, snapshot.rulerType, snapshot.rulerCharisma, snapshot.rulerIntelligence, snapshot.rulerStrength,
+        snapshot.maxLoanAmount, snapshot.loanTerm, snapshot.corruptionLevel, snapshot.relationCost, snapshot.peaceCost,
+        snapshot.eventChance, snapshot.designerRules ? 1 : 0, static_cast<int>(snapshot.randomId)
+    };
+    for (int i = 0; i < recordIntegerCount; i++) {
+        putU32(record + recordIntegerOffset + 4 * i, static_cast<uint32_t>(integers[i]));
+    }
+
+    const double reals[13] = {
+        snapshot.happiness, snapshot.growthRate, snapshot.morale, snapshot.peasantTaxRate,
+        snapshot.merchantTaxRate, snapshot.nobleTaxRate, snapshot.inflation,
+        snapshot.values[0], snapshot.values[1], snapshot.values[2], snapshot.values[3], snapshot.values[4],
+        snapshot.interestRate
+    };
+    for (int i = 0; i < 13; i++) {
+        uint64_t bits;
+        memcpy(&bits, &reals[i], sizeof(bits));
+        putU64(record + recordWideOffset + 8 * i, bits);
+    }
+    putU64(record + recordWideOffset + 8 * 13, snapshot.randomSeed);
+    putU64(record + recordWideOffset + 8 * 14, static_cast<uint64_t>(snapshot.lastEventYear));
+}
+
+void KingdomArchiveWriter::unpack(const unsigned char* record, KingdomSnapshot& snapshot) {
+    memcpy(snapshot.name, record, KingdomSnapshot::NAME_LENGTH);
+    memcpy(snapshot.rulerName, record + 64, KingdomSnapshot::NAME_LENGTH);
+    memcpy(snapshot.guildType, record + 128, KingdomSnapshot::NAME_LENGTH);
+    snapshot.name[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    snapshot.rulerName[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+    snapshot.guildType[KingdomSnapshot::NAME_LENGTH - 1] = '\0';
+
+    int integers[recordIntegerCount];
+    for (int i = 0; i < recordIntegerCount; i++) {
+        integers[i] = static_cast<int>(getU32(record + recordIntegerOffset + 4 * i));
+    }
+    snapshot.gameYear = integers[0];
+    snapshot.score = integers[1];
+    snapshot.peasants = integers[2];
+    snapshot.merchants = integers[3];
+    snapshot.nobles = integers[4];
+    snapshot.infantry = integers[5];
+    snapshot.cavalry = integers[6];
+    snapshot.archers = integers[7];
+    snapshot.trainingLevel = integers[8];
+    snapshot.atWar = integers[9] != 0;
+    snapshot.treasuryGold = integers[10];
+    snapshot.debt = integers[11];
+    snapshot.food = integers[12];
+    snapshot.wood = integers[13];
+    snapshot.stone = integers[14];
+    snapshot.iron = integers[15];
+    snapshot.rulerTrait = integers[16];
+    snapshot.rulerStanding = integers[17];
+    snapshot.gold = integers[18];
+    snapshot.rulerType = integers[19];
+    snapshot.rulerCharisma = integers[20];
+    snapshot.rulerIntelligence = integers[21];
+    snapshot.rulerStrength = integers[22];
+    snapshot.maxLoanAmount = integers[23];
+    snapshot.loanTerm = integers[24];
+    snapshot.corruptionLevel = integers[25];
+    snapshot.relationCost = integers[26];
+    snapshot.peaceCost = integers[27];
+    snapshot.eventChance = integers[28];
+    snapshot.designerRules = integers[29] != 0;
+    snapshot.randomId = static_cast<uint32_t>(integers[30]);
+
+    double reals[13];
+    for (int i = 0; i < 13; i++) {
+        uint64_t bits = getU64(record + recordWideOffset + 8 * i);
+        memcpy(&reals[i], &bits, sizeof(bits));
+    }
+    snapshot.happiness = reals[0];
+    snapshot.growthRate = reals[1];
+    snapshot.morale = reals[2];
+    snapshot.peasantTaxRate = reals[3];
+    snapshot.merchantTaxRate = reals[4];
+    snapshot.nobleTaxRate = reals[5];
+    snapshot.inflation = reals[6];
+    for (int i = 0; i < 5; i++) {
+        snapshot.values[i] = reals[7 + i];
+    }
+    snapshot.interestRate = reals[12];
+    snapshot.randomSeed = getU64(record + recordWideOffset + 8 * 13);
+    snapshot.lastEventYear = static_cast<int64_t>(getU64(record + recordWideOffset + 8 * 14));
+}
+
+static uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// Dynasty bytes as fields: the header words, the house names, each row's fields and the
+// free row and candidate lists
+struct DynastyFields {
+    uint32_t header[8];
+    vector<unsigned char> names;
+    vector<uint32_t> rows;          // dynastyFieldCount values per row
+    vector<uint32_t> lists[2];
+};
+
+static const int dynastyFieldCount = 13;
+static const size_t dynastyFieldOffset[dynastyFieldCount] = { 0, 4, 8, 12, 16, 18, 19, 20, 21, 22, 23, 24, 25 };
+static const size_t dynastyFieldWidth[dynastyFieldCount] = { 4, 4, 4, 4, 2, 1, 1, 1, 1, 1, 1, 1, 4 };
+
+// Where each part of Dynasty::save bytes starts; empty bytes are a dynasty with no houses
+struct DynastyLayout {
+    const unsigned char* bytes;
+    uint32_t header[8];
+    size_t rowStart;
+    size_t rows;
+    size_t listStart[2];
+    size_t listSize[2];
+
+    explicit DynastyLayout(const vector<unsigned char>& saved) : bytes(saved.data()), rowStart(dynastyHeaderSize), rows(0) {
+        memset(header, 0, sizeof(header));
+        listStart[0] = listStart[1] = 0;
+        listSize[0] = listSize[1] = 0;
+        if (saved.empty()) {
+            rowStart = 0;
+            return;
+        }
+        for (int i = 0; i < 8; i++) {
+            header[i] = getU32(bytes + 4 * i);
+        }
+        for (uint32_t h = 0; h < header[5]; h++) {
+            rowStart += 1 + bytes[rowStart];
+        }
+        rows = header[0];
+        listStart[0] = rowStart + dynastyPadded(rows) * dynastyRowSize;
+        listSize[0] = header[6];
+        listStart[1] = listStart[0] + dynastyPadded(listSize[0]) * 4;
+        listSize[1] = header[7];
+    }
+
+    uint32_t field(size_t row, int f) const {
+        const unsigned char* value = bytes + rowStart + row * dynastyRowSize + dynastyFieldOffset[f];
+        uint32_t result = 0;
+        for (size_t b = 0; b < dynastyFieldWidth[f]; b++) {
+            result |= static_cast<uint32_t>(value[b]) << (8 * b);
+        }
+        return result;
+    }
+
+    uint32_t entry(int list, size_t i) const {
+        return getU32(bytes + listStart[list] + 4 * i);
+    }
+};
+
+// The exact bytes Dynasty::save writes for these fields
+static void writeDynastyFields(const DynastyFields& fields, vector<unsigned char>& bytes) {
+    bytes.clear();
+    if (fields.header[5] == 0) {
+        return;
+    }
+    size_t rows = fields.rows.size() / dynastyFieldCount;
+    bytes.assign(dynastyHeaderSize + fields.names.size() + dynastyPadded(rows) * dynastyRowSize +
+        (dynastyPadded(fields.lists[0].size()) + dynastyPadded(fields.lists[1].size())) * 4, 0);
+    for (int i = 0; i < 8; i++) {
+        putU32(&bytes[4 * i], fields.header[i]);
+    }
+    size_t position = dynastyHeaderSize;
+    if (!fields.names.empty()) {
+        memcpy(&bytes[position], fields.names.data(), fields.names.size());
+    }
+    position += fields.names.size();
+    for (size_t row = 0; row < rows; row++) {
+        unsigned char* record = &bytes[position + row * dynastyRowSize];
+        for (int f = 0; f < dynastyFieldCount; f++) {
+            uint32_t value = fields.rows[row * dynastyFieldCount + f];
+            for (size_t b = 0; b < dynastyFieldWidth[f]; b++) {
+                record[dynastyFieldOffset[f] + b] = static_cast<unsigned char>(value >> (8 * b));
+            }
+        }
+    }
+    position += dynastyPadded(rows) * dynastyRowSize;
+    for (int l = 0; l < 2; l++) {
+        for (size_t i = 0; i < fields.lists[l].size(); i++) {
+            putU32(&bytes[position + 4 * i], fields.lists[l][i]);
+        }
+        position += dynastyPadded(fields.lists[l].size()) * 4;
+    }
+}
+
+static void clearDynastyFields(DynastyFields& fields) {
+    memset(fields.header, 0, sizeof(fields.header));
+    fields.names.clear();
+    fields.rows.clear();
+    fields.lists[0].clear();
+    fields.lists[1].clear();
+}
+
+// Misses are stored as zigzag varints of their 32-bit difference
+static void putDynastyMiss(vector<unsigned char>& out, uint32_t value, uint32_t predicted) {
+    putVarint(out, zigzag(static_cast<int32_t>(value - predicted)));
+}
+
+static const unsigned char* getDynastyMiss(const unsigned char* in, const unsigned char* end, uint32_t& value) {
+    uint64_t miss;
+    in = in ? getVarint(in, end, miss) : nullptr;
+    if (in) {
+        value += static_cast<uint32_t>(unzigzag(miss));
+    }
+    return in;
+}
+
+// A dynasty as a field-level delta from an earlier one (empty bytes for none): the header
+// words that moved, new house names, then the rows and list entries that changed, each as
+// its distance past the change before and its misses. A value is predicted to be last
+// year's, or for a row or entry that is new, the one before it, so the nobles born in a
+// year cost little more than what sets them apart
+static void putDynastyDelta(vector<unsigned char>& out, const vector<unsigned char>& baseBytes,
+    const vector<unsigned char>& recordBytes) {
+    DynastyLayout base(baseBytes);
+    DynastyLayout record(recordBytes);
+
+    size_t baseNames = base.rowStart - min(base.rowStart, dynastyHeaderSize);
+    size_t recordNames = record.rowStart - min(record.rowStart, dynastyHeaderSize);
+    bool namesChanged = baseNames != recordNames ||
+        (recordNames > 0 && memcmp(base.bytes + dynastyHeaderSize, record.bytes + dynastyHeaderSize, recordNames) != 0);
+    uint64_t mask = namesChanged ? 1u << 8 : 0;
+    for (int i = 0; i < 8; i++) {
+        mask |= record.header[i] != base.header[i] ? 1u << i : 0;
+    }
+    putVarint(out, mask);
+    for (int i = 0; i < 8; i++) {
+        if (mask & (1u << i)) {
+            putDynastyMiss(out, record.header[i], base.header[i]);
+        }
+    }
+    if (namesChanged) {
+        putVarint(out, recordNames);
+        out.insert(out.end(), record.bytes + dynastyHeaderSize, record.bytes + dynastyHeaderSize + recordNames);
+    }
+
+    vector<unsigned char> changes;
+    size_t changed = 0;
+    size_t expected = 0;
+    for (size_t row = 0; row < record.rows; row++) {
+        bool old = row < base.rows;
+        if (old && memcmp(base.bytes + base.rowStart + row * dynastyRowSize,
+            record.bytes + record.rowStart + row * dynastyRowSize, dynastyRowSize) == 0) {
+            continue;
+        }
+        uint32_t predicted[dynastyFieldCount];
+        uint32_t fieldMask = 0;
+        for (int f = 0; f < dynastyFieldCount; f++) {
+            predicted[f] = old ? base.field(row, f) : (row > 0 ? record.field(row - 1, f) : 0);
+            fieldMask |= record.field(row, f) != predicted[f] ? 1u << f : 0;
+        }
+        if (fieldMask == 0) {
+            continue;
+        }
+        putVarint(changes, row - expected);
+        putVarint(changes, fieldMask);
+        for (int f = 0; f < dynastyFieldCount; f++) {
+            if (fieldMask & (1u << f)) {
+                putDynastyMiss(changes, record.field(row, f), predicted[f]);
+            }
+        }
+        changed++;
+        expected = row + 1;
+    }
+    putVarint(out, changed);
+    out.insert(out.end(), changes.begin(), changes.end());
+
+    for (int l = 0; l < 2; l++) {
+        changes.clear();
+        changed = 0;
+        expected = 0;
+        for (size_t i = 0; i < record.listSize[l]; i++) {
+            uint32_t predicted = i < base.listSize[l] ? base.entry(l, i) : (i > 0 ? record.entry(l, i - 1) : 0);
+            if (record.entry(l, i) != predicted) {
+                putVarint(changes, i - expected);
+                putDynastyMiss(changes, record.entry(l, i), predicted);
+                changed++;
+                expected = i + 1;
+            }
+        }
+        putVarint(out, changed);
+        out.insert(out.end(), changes.begin(), changes.end());
+    }
+}
+
+// Where the next of the remaining changes is, or count once none remain
+static const unsigned char* getDynastyGap(const unsigned char* in, const unsigned char* end, uint64_t& remaining,
+    size_t expected, size_t count, size_t& next) {
+    next = count;
+    if (!in || remaining == 0) {
+        return in;
+    }
+    remaining--;
+    uint64_t gap;
+    in = getVarint(in, end, gap);
+    if (!in || expected >= count || gap >= count - expected) {
+        return nullptr;
+    }
+    next = expected + static_cast<size_t>(gap);
+    return in;
+}
+
+// Applies a delta to last year's fields in place, so a long run of years costs only
+// their changes
+static const unsigned char* getDynastyDelta(const unsigned char* in, const unsigned char* end, DynastyFields& fields) {
+    uint64_t mask;
+    in = getVarint(in, end, mask);
+    for (int i = 0; in && i < 8; i++) {
+        if (mask & (1u << i)) {
+            in = getDynastyMiss(in, end, fields.header[i]);
+        }
+    }
+    if (in && (mask & (1u << 8))) {
+        uint64_t length;
+        in = getVarint(in, end, length);
+        if (!in || length > static_cast<uint64_t>(end - in)) {
+            return nullptr;
+        }
+        fields.names.assign(in, in + length);
+        in += length;
+    }
+    // Counts are bounded before anything is sized from them
+    if (!in || fields.header[0] > (1u << 24) || fields.header[6] > (1u << 24) || fields.header[7] > (1u << 24)) {
+        return nullptr;
+    }
+
+    size_t rows = fields.header[0];
+    size_t filled = min(fields.rows.size() / dynastyFieldCount, rows);
+    fields.rows.resize(rows * dynastyFieldCount);
+    uint64_t remaining = 0;
+    size_t next = rows;
+    in = getVarint(in, end, remaining);
+    in = getDynastyGap(in, end, remaining, 0, rows, next);
+    while (in && next < rows) {
+        for (; filled <= next; filled++) {
+            for (int f = 0; f < dynastyFieldCount; f++) {
+                fields.rows[filled * dynastyFieldCount + f] = filled > 0 ? fields.rows[(filled - 1) * dynastyFieldCount + f] : 0;
+            }
+        }
+        uint64_t fieldMask;
+        in = getVarint(in, end, fieldMask);
+        for (int f = 0; in && f < dynastyFieldCount; f++) {
+            if (fieldMask & (1u << f)) {
+                in = getDynastyMiss(in, end, fields.rows[next * dynastyFieldCount + f]);
+            }
+        }
+        in = getDynastyGap(in, end, remaining, next + 1, rows, next);
+    }
+    for (; in && filled < rows; filled++) {
+        for (int f = 0; f < dynastyFieldCount; f++) {
+            fields.rows[filled * dynastyFieldCount + f] = filled > 0 ? fields.rows[(filled - 1) * dynastyFieldCount + f] : 0;
+        }
+    }
+
+    for (int l = 0; in && l < 2; l++) {
+        vector<uint32_t>& list = fields.lists[l];
+        size_t kept = min(list.size(), static_cast<size_t>(fields.header[6 + l]));
+        list.resize(fields.header[6 + l]);
+        for (size_t i = kept; i < list.size(); i++) {
+            list[i] = i > 0 ? list[i - 1] : 0;
+        }
+        in = in ? getVarint(in, end, remaining) : nullptr;
+        in = getDynastyGap(in, end, remaining, 0, list.size(), next);
+        while (in && next < list.size()) {
+            in = getDynastyMiss(in, end, list[next]);
+            // A new entry is predicted from the one before it, as it is now
+            for (size_t i = max(kept, next + 1); i < list.size() && in; i++) {
+                list[i] = list[i - 1];
+            }
+            in = getDynastyGap(in, end, remaining, next + 1, list.size(), next);
+        }
+    }
+    return in;
+}
+
+void KingdomArchiveWriter::packTail(const KingdomSnapshot& snapshot, vector<unsigned char>& tail, bool withDynasty) {
+    tail.clear();
+    putVarint(tail, snapshot.foreign.size());
+    for (size_t i = 0; i < snapshot.foreign.size(); i++) {
+        const KingdomSnapshot::Foreign& foreign = snapshot.foreign[i];
+        size_t length = strnlen(foreign.name, KingdomSnapshot::NAME_LENGTH - 1);
+        tail.push_back(static_cast<unsigned char>(length));
+        tail.insert(tail.end(), foreign.name, foreign.name + length);
+        putVarint(tail, zigzag(foreign.strength));
+        putVarint(tail, zigzag(foreign.relationLevel));
+        tail.push_back(static_cast<unsigned char>((foreign.isAlly ? 1 : 0) | (foreign.atWar ? 2 : 0)));
+    }
+
+    // Loans at fixed width, so one paying down lines up with last year's bytes
+    putVarint(tail, snapshot.loans.size());
+    for (size_t i = 0; i < snapshot.loans.size(); i++) {
+        const LoanLedger::Loan& loan = snapshot.loans[i];
+        unsigned char packed[29];
+        const double reals[3] = { loan.balance, loan.rate, loan.payment };
+        for (int j = 0; j < 3; j++) {
+            uint64_t bits;
+            memcpy(&bits, &reals[j], sizeof(bits));
+            putU64(packed + 8 * j, bits);
+        }
+        putU32(packed + 24, static_cast<uint32_t>(loan.yearsLeft));
+        packed[28] = static_cast<unsigned char>(loan.schedule);
+        tail.insert(tail.end(), packed, packed + sizeof(packed));
+    }
+
+    if (!withDynasty) {
+        putVarint(tail, 0);
+        return;
+    }
+    putVarint(tail, snapshot.dynasty.size());
+    tail.insert(tail.end(), snapshot.dynasty.begin(), snapshot.dynasty.end());
+}
+
+bool KingdomArchiveWriter::unpackTail(const unsigned char* tail, size_t length, KingdomSnapshot& snapshot) {
+    const unsigned char* in = tail;
+    const unsigned char* end = tail + length;
+    uint64_t count;
+    in = getVarint(in, end, count);
+    if (!in || count > length) {
+        return false;
+    }
+    snapshot.foreign.resize(static_cast<size_t>(count));
+    for (size_t i = 0; i < snapshot.foreign.size(); i++) {
+        KingdomSnapshot::Foreign& foreign = snapshot.foreign[i];
+        memset(&foreign, 0, sizeof(foreign));
+        if (in >= end || *in >= KingdomSnapshot::NAME_LENGTH || end - in - 1 < *in) {
+            return false;
+        }
+        size_t nameLength = *in++;
+        memcpy(foreign.name, in, nameLength);
+        in += nameLength;
+        uint64_t strength;
+        uint64_t relationLevel;
+        in = getVarint(in, end, strength);
+        in = in ? getVarint(in, end, relationLevel) : nullptr;
+        if (!in || in >= end) {
+            return false;
+        }
+        foreign.strength = static_cast<int>(unzigzag(strength));
+        foreign.relationLevel = static_cast<int>(unzigzag(relationLevel));
+        foreign.isAlly = (*in & 1) != 0;
+        foreign.atWar = (*in & 2) != 0;
+        in++;
+    }
+
+    in = getVarint(in, end, count);
+    if (!in || count > static_cast<uint64_t>(end - in) / 29) {
+        return false;
+    }
+    snapshot.loans.resize(static_cast<size_t>(count));
+    for (size_t i = 0; i < snapshot.loans.size(); i++) {
+        LoanLedger::Loan& loan = snapshot.loans[i];
+        memset(&loan, 0, sizeof(loan));
+        double* reals[3] = { &loan.balance, &loan.rate, &loan.payment };
+        for (int j = 0; j < 3; j++) {
+            uint64_t bits = getU64(in + 8 * j);
+            memcpy(reals[j], &bits, sizeof(bits));
+        }
+        loan.yearsLeft = static_cast<int32_t>(getU32(in + 24));
+        loan.schedule = static_cast<LoanLedger::Schedule>(in[28]);
+        in += 29;
+    }
+
+    in = getVarint(in, end, count);
+    if (!in || count != static_cast<uint64_t>(end - in)) {
+        return false;
+    }
+    snapshot.dynasty.assign(in, end);
+    return true;
+}
+
+bool KingdomArchiveWriter::add(uint32_t kingdomId, const KingdomSnapshot& snapshot) {
+    if (!file) {
+        return false;
+    }
+    IndexEntry entry = { kingdomId, snapshot.gameYear, static_cast<uint32_t>(chunks.size()),
+        static_cast<uint32_t>(records.size() / RECORD_SIZE) };
+    index.push_back(entry);
+    records.resize(records.size() + RECORD_SIZE);
+    pack(snapshot, &records[records.size() - RECORD_SIZE]);
+
+    // Relations and loans are stored as their XOR with the kingdom's last tail, and the
+    // dynasty as its field changes, unless this one starts over. Each sits behind its
+    // encoded size, so a load can skip straight to its slot
+    packTail(snapshot, tail, false);
+    KingdomTail& last = lastTails[kingdomId];
+    bool keyframe = last.sinceKeyframe == 0 || snapshot.gameYear <= last.newestYear || last.year != last.newestYear;
+    if (keyframe) {
+        last.sinceKeyframe = 0;
+        last.tail.clear();
+        last.dynasty.clear();
+    }
+    encodedTail.clear();
+    encodedTail.push_back(keyframe ? 1 : 0);
+    putXorRuns(encodedTail, last.tail.data(), last.tail.size(), tail.data(), tail.size());
+    putDynastyDelta(encodedTail, last.dynasty, snapshot.dynasty);
+    last.year = snapshot.gameYear;
+    last.newestYear = keyframe ? max(last.newestYear, last.year) : last.year;
+    last.sinceKeyframe = (last.sinceKeyframe + 1) % TAIL_KEYFRAME_INTERVAL;
+    last.tail.swap(tail);
+    last.dynasty = snapshot.dynasty;
+    putVarint(tails, last.tail.size());
+    putVarint(tails, encodedTail.size());
+    tails.insert(tails.end(), encodedTail.begin(), encodedTail.end());
+    if (records.size() == static_cast<size_t>(RECORD_SIZE) * CHUNK_RECORDS) {
+        return flushChunk();
+    }
+    return true;
+}
+
+bool KingdomArchiveWriter::flushChunk() {
+    if (records.empty()) {
+        return true;
+    }
+
+    // XOR each record with the one before it: fields that did not change become zeros
+    for (size_t i = records.size() - 1; i >= RECORD_SIZE; i--) {
+        records[i] ^= records[i - RECORD_SIZE];
+    }
+
+    // Then run-length encode the zeros away
+    compressed.clear();
+    putXorRuns(compressed, nullptr, 0, records.data(), records.size());
+
+    ChunkInfo info = { offset, static_cast<uint32_t>(compressed.size()),
+        static_cast<uint32_t>(records.size() / RECORD_SIZE), static_cast<uint32_t>(tails.size()) };
+    chunks.push_back(info);
+    records.clear();
+    bool ok = write(compressed.data(), compressed.size()) && write(tails.data(), tails.size());
+    tailBytes += tails.size();
+    tails.clear();
+    return ok;
+}
+
+bool KingdomArchiveWriter::close() {
+    if (!file) {
+        return false;
+    }
+    bool ok = flushChunk();
+
+    uint64_t chunkTableOffset = offset;
+    vector<unsigned char> table(chunks.size() * archiveChunkInfoSize);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        unsigned char* out = &table[i * archiveChunkInfoSize];
+        putU64(out, chunks[i].offset);
+        putU32(out + 8, chunks[i].compressedSize);
+        putU32(out + 12, chunks[i].recordCount);
+        putU32(out + 16, chunks[i].tailSize);
+    }
+    ok = ok && write(table.data(), table.size());
+
+    // Sorted by (kingdom, year) so readers can binary search straight from the mapping
+    stable_sort(index.begin(), index.end(), [](const IndexEntry& a, const IndexEntry& b) {
+        return a.kingdomId != b.kingdomId ? a.kingdomId < b.kingdomId : a.year < b.year;
+    });
+    uint64_t indexOffset = offset;
+    vector<unsigned char> entries(index.size() * archiveEntrySize);
+    for (size_t i = 0; i < index.size(); i++) {
+        unsigned char* out = &entries[i * archiveEntrySize];
+        putU32(out, index[i].kingdomId);
+        putU32(out + 4, static_cast<uint32_t>(index[i].year));
+        putU32(out + 8, index[i].chunk);
+        putU32(out + 12, index[i].slot);
+    }
+    ok = ok && write(entries.data(), entries.size());
+
+    unsigned char footer[archiveFooterSize];
+    putU64(footer, chunkTableOffset);
+    putU64(footer + 8, indexOffset);
+    putU64(footer + 16, index.size());
+    putU32(footer + 24, static_cast<uint32_t>(chunks.size()));
+    memcpy(footer + 28, archiveMagic, 4);
+    ok = ok && write(footer, sizeof(footer));
+
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    return ok;
+}
+
+int KingdomArchiveWriter::getSnapshotCount() const {
+    return static_cast<int>(index.size());
+}
+
+uint64_t KingdomArchiveWriter::getBytesWritten() const {
+    return offset;
+}
+
+uint64_t KingdomArchiveWriter::getTailBytesWritten() const {
+    return tailBytes;
+}
+
+KingdomArchiveReader::KingdomArchiveReader()
+    : data(nullptr), size(0), chunkTable(nullptr), index(nullptr), chunkCount(0), entryCount(0),
+#ifdef _WIN32
+    fileHandle(INVALID_HANDLE_VALUE), mappingHandle(nullptr) {
+#else
+    descriptor(-1) {
+#endif
+}
+
+KingdomArchiveReader::~KingdomArchiveReader() {
+    close();
+}
+
+bool KingdomArchiveReader::open(const string& filename) {
+    close();
+#ifdef _WIN32
+    fileHandle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+    LARGE_INTEGER fileSize;
+    if (fileHandle == INVALID_HANDLE_VALUE || !GetFileSizeEx(fileHandle, &fileSize)) {
+        Logger::error("Error: Could not open archive {}!", filename);
+        close();
+        return false;
+    }
+    size = static_cast<size_t>(fileSize.QuadPart);
+    mappingHandle = size > 0 ? CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    data = mappingHandle ? static_cast<const unsigned char*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+#else
+    descriptor = ::open(filename.c_str(), O_RDONLY);
+    struct stat status;
+    if (descriptor < 0 || fstat(descriptor, &status) != 0) {
+        Logger::error("Error: Could not open archive {}!", filename);
+        close();
+        return false;
+    }
+    size = static_cast<size_t>(status.st_size);
+    void* mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0) : MAP_FAILED;
+    data = mapping != MAP_FAILED ? static_cast<const unsigned char*>(mapping) : nullptr;
+#endif
+
+    // Validate the header and footer before trusting any offset
+    const unsigned char* footer = data ? data + size - archiveFooterSize : nullptr;
+    if (!data || size < 8 + archiveFooterSize || memcmp(data, archiveMagic, 4) != 0 ||
+        getU32(data + 4) != archiveVersion || memcmp(footer + 28, archiveMagic, 4) != 0) {
+        Logger::error("Error: {} is not a kingdom archive!", filename);
+        close();
+        return false;
+    }
+    uint64_t chunkTableOffset = getU64(footer);
+    uint64_t indexOffset = getU64(footer + 8);
+    entryCount = getU64(footer + 16);
+    chunkCount = getU32(footer + 24);
+    if (chunkTableOffset + static_cast<uint64_t>(chunkCount) * archiveChunkInfoSize != indexOffset ||
+        indexOffset + entryCount * archiveEntrySize != size - archiveFooterSize) {
+        Logger::error("Error: Archive {} is damaged!", filename);
+        close();
+        return false;
+    }
+    chunkTable = data + chunkTableOffset;
+    index = data + indexOffset;
+    return true;
+}
+
+void KingdomArchiveReader::close() {
+#ifdef _WIN32
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+    if (mappingHandle) {
+        CloseHandle(mappingHandle);
+    }
+    if (fileHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(fileHandle);
+    }
+    fileHandle = INVALID_HANDLE_VALUE;
+    mappingHandle = nullptr;
+#else
+    if (data) {
+        munmap(const_cast<unsigned char*>(data), size);
+    }
+    if (descriptor >= 0) {
+        ::close(descriptor);
+    }
+    descriptor = -1;
+#endif
+    data = nullptr;
+    size = 0;
+    chunkTable = nullptr;
+    index = nullptr;
+    chunkCount = 0;
+    entryCount = 0;
+}
+
+uint64_t KingdomArchiveReader::lowerBound(uint32_t kingdomId, int year) const {
+    uint64_t low = 0;
+    uint64_t high = entryCount;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        const unsigned char* entry = index + middle * archiveEntrySize;
+        uint32_t entryId = getU32(entry);
+        int entryYear = static_cast<int>(getU32(entry + 4));
+        if (entryId < kingdomId || (entryId == kingdomId && entryYear < year)) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool KingdomArchiveReader::findTail(uint64_t entry, const unsigned char*& in, const unsigned char*& end,
+    uint64_t& length) const {
+    const unsigned char* position = index + entry * archiveEntrySize;
+    uint32_t chunk = getU32(position + 8);
+    uint32_t slot = getU32(position + 12);
+    if (chunk >= chunkCount) {
+        return false;
+    }
+    const unsigned char* info = chunkTable + static_cast<size_t>(chunk) * archiveChunkInfoSize;
+    uint64_t chunkOffset = getU64(info);
+    uint32_t compressedSize = getU32(info + 8);
+    uint32_t tailSize = getU32(info + 16);
+    if (chunkOffset + compressedSize + tailSize > size) {
+        return false;
+    }
+
+    // Step over the tails before this one by their encoded sizes
+    in = data + chunkOffset + compressedSize;
+    end = in + tailSize;
+    uint64_t encoded = 0;
+    for (uint32_t i = 0; i <= slot; i++) {
+        if (i > 0) {
+            in += encoded;
+        }
+        in = in ? getVarint(in, end, length) : nullptr;
+        in = in ? getVarint(in, end, encoded) : nullptr;
+        if (!in || length > static_cast<uint64_t>(size) || static_cast<uint64_t>(end - in) < encoded) {
+            return false;
+        }
+    }
+    // Each starts with whether it was stored whole
+    end = in + encoded;
+    return encoded > 0;
+}
+
+bool KingdomArchiveReader::loadEntry(uint64_t entry, KingdomSnapshot& snapshot) const {
+    const unsigned char* position = index + entry * archiveEntrySize;
+    uint32_t chunk = getU32(position + 8);
+    uint32_t slot = getU32(position + 12);
+    if (chunk >= chunkCount) {
+        return false;
+    }
+    const unsigned char* info = chunkTable + static_cast<size_t>(chunk) * archiveChunkInfoSize;
+    uint64_t chunkOffset = getU64(info);
+    uint32_t compressedSize = getU32(info + 8);
+    uint32_t recordCount = getU32(info + 12);
+    uint32_t tailSize = getU32(info + 16);
+    if (slot >= recordCount || chunkOffset + compressedSize + tailSize > size) {
+        return false;
+    }
+
+    // Decode only up to the wanted record, folding the XOR deltas as they arrive
+    const size_t recordSize = KingdomArchiveWriter::RECORD_SIZE;
+    const size_t needed = (static_cast<size_t>(slot) + 1) * recordSize;
+    unsigned char record[KingdomArchiveWriter::RECORD_SIZE] = {};
+    const unsigned char* in = data + chunkOffset;
+    const unsigned char* end = in + compressedSize;
+    size_t produced = 0;
+    while (produced < needed) {
+        uint64_t zeros;
+        uint64_t literals;
+        in = in ? getVarint(in, end, zeros) : nullptr;
+        in = in ? getVarint(in, end, literals) : nullptr;
+        if (!in || static_cast<size_t>(end - in) < literals) {
+            return false;
+        }
+        produced += zeros;
+        for (uint64_t i = 0; i < literals && produced < needed; i++) {
+            record[produced % recordSize] ^= in[i];
+            produced++;
+        }
+        in += literals;
+    }
+    KingdomArchiveWriter::unpack(record, snapshot);
+
+    // Back to the kingdom's last tail stored whole, which is at most
+    // TAIL_KEYFRAME_INTERVAL - 1 entries before this one, then forward through the changes
+    uint32_t kingdomId = getU32(index + entry * archiveEntrySize);
+    uint64_t length;
+    uint64_t first = entry;
+    for (;;) {
+        if (!findTail(first, in, end, length)) {
+            return false;
+        }
+        if (*in & 1) {
+            break;
+        }
+        if (first == 0 || getU32(index + (first - 1) * archiveEntrySize) != kingdomId) {
+            return false;
+        }
+        first--;
+    }
+    vector<unsigned char> tail;
+    DynastyFields dynasty;
+    clearDynastyFields(dynasty);
+    for (uint64_t e = first; e <= entry; e++) {
+        if (!findTail(e, in, end, length)) {
+            return false;
+        }
+        tail.resize(static_cast<size_t>(length));
+        in = xorZeroRuns(in + 1, end, tail.data(), tail.size());
+        in = in ? getDynastyDelta(in, end, dynasty) : nullptr;
+        if (!in) {
+            return false;
+        }
+    }
+    if (!KingdomArchiveWriter::unpackTail(tail.data(), tail.size(), snapshot)) {
+        return false;
+    }
+    writeDynastyFields(dynasty, snapshot.dynasty);
+    return true;
+}
+
+bool KingdomArchiveReader::load(uint32_t kingdomId, int year, KingdomSnapshot& snapshot) const {
+    uint64_t entry = lowerBound(kingdomId, year);
+    if (entry >= entryCount || getU32(index + entry * archiveEntrySize) != kingdomId ||
+        static_cast<int>(getU32(index + entry * archiveEntrySize + 4)) != year) {
+        return false;
+    }
+    return loadEntry(entry, snapshot);
+}
+
+bool KingdomArchiveReader::loadLatest(uint32_t kingdomId, KingdomSnapshot& snapshot) const {
+    // The entry just before the first one of the next kingdom
+    uint64_t entry = lowerBound(kingdomId, INT_MAX);
+    if (entry < entryCount && getU32(index + entry * archiveEntrySize) == kingdomId) {
+        entry++;
+    }
+    if (entry == 0 || getU32(index + (entry - 1) * archiveEntrySize) != kingdomId) {
+        return false;
+    }
+    return loadEntry(entry - 1, snapshot);
+}
+
+uint64_t KingdomArchiveReader::getSnapshotCount() const {
+    return entryCount;
+}
+
+// -------------------------------
+// HistoryRecorder implementation
+// -------------------------------
+
+// Packed record fields in mask order: the save file's reals, integers and names first, as
+// they change most and so keep the mask short, then the rest of the state
+enum HistoryFieldKind {
+    HISTORY_WIDE,       // 8 bytes stored as their XOR with last year's
+    HISTORY_INTEGER,    // 4 bytes stored as their miss against last year's trend
+    HISTORY_TEXT        // A name, stored whole when it changes
+};
+
+struct HistoryField {
+    HistoryFieldKind kind;
+    size_t offset;
+};
+
+static vector<HistoryField> historyFieldOrder() {
+    vector<HistoryField> fields;
+    const int firstWide[2] = { 0, 7 };
+    const int wideCount[2] = { 7, recordWideCount - 7 };
+    const int firstInteger[2] = { 0, 18 };
+    const int integerCount[2] = { 18, recordIntegerCount - 18 };
+    const int firstText[2] = { 0, 2 };
+    const int textCount[2] = { 2, 1 };
+    for (int part = 0; part < 2; part++) {
+        for (int i = 0; i < wideCount[part]; i++) {
+            HistoryField field = { HISTORY_WIDE, recordWideOffset + 8 * (firstWide[part] + i) };
+            fields.push_back(field);
+        }
+        for (int i = 0; i < integerCount[part]; i++) {
+            HistoryField field = { HISTORY_INTEGER, recordIntegerOffset + 4 * (firstInteger[part] + i) };
+            fields.push_back(field);
+        }
+        for (int i = 0; i < textCount[part]; i++) {
+            HistoryField field = { HISTORY_TEXT, static_cast<size_t>(64 * (firstText[part] + i)) };
+            fields.push_back(field);
+        }
+    }
+    return fields;
+}
+
+static const vector<HistoryField> historyFields = historyFieldOrder();
+// The mask bits after the fields flag changed relations and loans, then a changed dynasty
+static const int historyTailBit = recordWideCount + recordIntegerCount + 3;
+static const int historyDynastyBit = historyTailBit + 1;
+// The year is the first integer
+static const size_t historyYearOffset = recordIntegerOffset;
+
+HistoryRecorder::HistoryRecorder(int keyframeInterval) : keyframeInterval(max(1, keyframeInterval)) {
+    memset(previous, 0, sizeof(previous));
+    memset(beforePrevious, 0, sizeof(beforePrevious));
+}
+
+HistoryRecorder::~HistoryRecorder() {}
+
+// Predicted integer field: last year's value plus last year's change
+static int64_t predictField(const unsigned char* older, const unsigned char* base, size_t offset) {
+    int64_t last = static_cast<int32_t>(getU32(base + offset));
+    int64_t before = static_cast<int32_t>(getU32(older + offset));
+    return 2 * last - before;
+}
+
+void HistoryRecorder::startSegment(int year, unsigned char* older, unsigned char* base) {
+    // A keyframe is a delta against empty records whose only trend is the year
+    memset(older, 0, KingdomArchiveWriter::RECORD_SIZE);
+    memset(base, 0, KingdomArchiveWriter::RECORD_SIZE);
+    putU32(older + historyYearOffset, static_cast<uint32_t>(year - 2));
+    putU32(base + historyYearOffset, static_cast<uint32_t>(year - 1));
+}
+
+void HistoryRecorder::encodeDelta(const unsigned char* older, const unsigned char* base, const unsigned char* record,
+    const vector<unsigned char>& baseTail, const vector<unsigned char>& recordTail,
+    const vector<unsigned char>& baseDynasty, const vector<unsigned char>& recordDynasty, vector<unsigned char>& out) {
+    // Mask of mispredicted fields, then each of those fields in mask order
+    uint64_t mask = 0;
+    for (size_t i = 0; i < historyFields.size(); i++) {
+        const HistoryField& field = historyFields[i];
+        bool changed;
+        if (field.kind == HISTORY_WIDE) {
+            changed = memcmp(base + field.offset, record + field.offset, 8) != 0;
+        }
+        else if (field.kind == HISTORY_INTEGER) {
+            changed = static_cast<int32_t>(getU32(record + field.offset)) != predictField(older, base, field.offset);
+        }
+        else {
+            changed = memcmp(base + field.offset, record + field.offset, 64) != 0;
+        }
+        if (changed) {
+            mask |= 1ull << i;
+        }
+    }
+    if (recordTail != baseTail) {
+        mask |= 1ull << historyTailBit;
+    }
+    if (recordDynasty != baseDynasty) {
+        mask |= 1ull << historyDynastyBit;
+    }
+    putVarint(out, mask);
+
+    for (size_t i = 0; i < historyFields.size(); i++) {
+        if (!(mask & (1ull << i))) {
+            continue;
+        }
+        const HistoryField& field = historyFields[i];
+        if (field.kind == HISTORY_WIDE) {
+            // XOR of neighbouring values keeps only the bytes that differ
+            putXorBits(out, getU64(base + field.offset) ^ getU64(record + field.offset));
+        }
+        else if (field.kind == HISTORY_INTEGER) {
+            // Zigzag keeps small misses in either direction to one or two bytes
+            putVarint(out, zigzag(static_cast<int32_t>(getU32(record + field.offset)) -
+                predictField(older, base, field.offset)));
+        }
+        else {
+            const unsigned char* text = record + field.offset;
+            size_t length = strnlen(reinterpret_cast<const char*>(text), 63);
+            out.push_back(static_cast<unsigned char>(length));
+            out.insert(out.end(), text, text + length);
+        }
+    }
+
+    if (mask & (1ull << historyTailBit)) {
+        putVarint(out, recordTail.size());
+        putXorRuns(out, baseTail.data(), baseTail.size(), recordTail.data(), recordTail.size());
+    }
+    if (mask & (1ull << historyDynastyBit)) {
+        putDynastyDelta(out, baseDynasty, recordDynasty);
+    }
+}
+
+const unsigned char* HistoryRecorder::decodeDelta(const unsigned char* in, const unsigned char* end,
+    const unsigned char* older, unsigned char* record, vector<unsigned char>& recordTail,
+    bool& dynastyChanged) {
+    uint64_t mask;
+    in = getVarint(in, end, mask);
+    if (!in) {
+        return nullptr;
+    }
+
+    // Integers are predicted from the record before it is overwritten
+    for (size_t i = 0; i < historyFields.size(); i++) {
+        const HistoryField& field = historyFields[i];
+        unsigned char* value = record + field.offset;
+        if (field.kind == HISTORY_WIDE) {
+            if (!(mask & (1ull << i))) {
+                continue;
+            }
+            uint64_t bits;
+            in = getXorBits(in, end, bits);
+            if (!in) {
+                return nullptr;
+            }
+            putU64(value, getU64(value) ^ bits);
+        }
+        else if (field.kind == HISTORY_INTEGER) {
+            int64_t predicted = predictField(older, record, field.offset);
+            if (mask & (1ull << i)) {
+                uint64_t miss;
+                in = getVarint(in, end, miss);
+                if (!in) {
+                    return nullptr;
+                }
+                predicted += unzigzag(miss);
+            }
+            putU32(value, static_cast<uint32_t>(predicted));
+        }
+        else {
+            if (!(mask & (1ull << i))) {
+                continue;
+            }
+            if (in >= end || *in > 63 || end - in - 1 < *in) {
+                return nullptr;
+            }
+            size_t length = *in++;
+            memset(value, 0, 64);
+            memcpy(value, in, length);
+            in += length;
+        }
+    }
+
+    if (mask & (1ull << historyTailBit)) {
+        uint64_t length;
+        in = getVarint(in, end, length);
+        if (!in || length > (1u << 24)) {
+            return nullptr;
+        }
+        recordTail.resize(static_cast<size_t>(length));
+        in = xorZeroRuns(in, end, recordTail.data(), recordTail.size());
+    }
+    dynastyChanged = (mask & (1ull << historyDynastyBit)) != 0;
+    return in;
+}
+
+// After a keyframe the trend restarts at zero, except for the year
+static void restartTrend(const unsigned char* record, unsigned char* older) {
+    memcpy(older, record, KingdomArchiveWriter::RECORD_SIZE);
+    putU32(older + historyYearOffset, getU32(record + historyYearOffset) - 1);
+}
+
+void HistoryRecorder::record(const KingdomSnapshot& snapshot) {
+    unsigned char packed[KingdomArchiveWriter::RECORD_SIZE];
+    KingdomArchiveWriter::pack(snapshot, packed);
+    KingdomArchiveWriter::packTail(snapshot, tail, false);
+
+    // Loads that jump to another year start a new segment too, and a new dynasty chain
+    bool jump = segments.empty() || snapshot.gameYear != getLastYear() + 1;
+    if (jump || segments.back().yearCount >= keyframeInterval) {
+        size_t chain = 0;
+        for (size_t i = segments.size(); i-- > 0 && !segments[i].dynastyKeyframe;) {
+            chain++;
+        }
+        Segment segment = { snapshot.gameYear, 0, stream.size(), jump || chain + 1 >= DYNASTY_KEYFRAME_SEGMENTS };
+        segments.push_back(segment);
+        startSegment(snapshot.gameYear, beforePrevious, previous);
+        previousTail.clear();
+        if (segment.dynastyKeyframe) {
+            previousDynasty.clear();
+        }
+        encodeDelta(beforePrevious, previous, packed, previousTail, tail, previousDynasty, snapshot.dynasty, stream);
+        restartTrend(packed, beforePrevious);
+    }
+    else {
+        encodeDelta(beforePrevious, previous, packed, previousTail, tail, previousDynasty, snapshot.dynasty, stream);
+        memcpy(beforePrevious, previous, sizeof(beforePrevious));
+    }
+    segments.back().yearCount++;
+    memcpy(previous, packed, sizeof(previous));
+    previousTail.swap(tail);
+    previousDynasty = snapshot.dynasty;
+}
+
+bool HistoryRecorder::seek(int year, KingdomSnapshot& snapshot) const {
+    // Newest timeline first, in case a load replayed some years
+    for (size_t i = segments.size(); i-- > 0;) {
+        const Segment& segment = segments[i];
+        if (year < segment.firstYear || year >= segment.firstYear + segment.yearCount) {
+            continue;
+        }
+        unsigned char older[KingdomArchiveWriter::RECORD_SIZE];
+        unsigned char record[KingdomArchiveWriter::RECORD_SIZE];
+        unsigned char last[KingdomArchiveWriter::RECORD_SIZE];
+        vector<unsigned char> recordTail;
+        DynastyFields dynasty;
+        clearDynastyFields(dynasty);
+        // The dynasty's chain starts some segments back; the years before this segment
+        // are read through for their dynasty changes alone
+        size_t first = i;
+        while (!segments[first].dynastyKeyframe && first > 0) {
+            first--;
+        }
+        const unsigned char* end = stream.data() + stream.size();
+        for (size_t s = first; s <= i; s++) {
+            startSegment(segments[s].firstYear, older, record);
+            recordTail.clear();
+            const unsigned char* in = stream.data() + segments[s].offset;
+            int steps = s < i ? segments[s].yearCount : year - segment.firstYear + 1;
+            for (int step = 0; step < steps; step++) {
+                memcpy(last, record, sizeof(last));
+                bool dynastyChanged;
+                in = decodeDelta(in, end, older, record, recordTail, dynastyChanged);
+                if (in && dynastyChanged) {
+                    in = getDynastyDelta(in, end, dynasty);
+                }
+                if (!in) {
+                    return false;
+                }
+                if (step == 0) {
+                    restartTrend(record, older);
+                }
+                else {
+                    memcpy(older, last, sizeof(older));
+                }
+            }
+        }
+        KingdomArchiveWriter::unpack(record, snapshot);
+        if (!KingdomArchiveWriter::unpackTail(recordTail.data(), recordTail.size(), snapshot)) {
+            return false;
+        }
+        writeDynastyFields(dynasty, snapshot.dynasty);
+        return true;
+    }
+    return false;
+}
+
+void HistoryRecorder::clear() {
+    stream.clear();
+    segments.clear();
+    previousTail.clear();
+    previousDynasty.clear();
+    memset(previous, 0, sizeof(previous));
+    memset(beforePrevious, 0, sizeof(beforePrevious));
+}
+
+int HistoryRecorder::getYearCount() const {
+    int count = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        count += segments[i].yearCount;
+    }
+    return count;
+}
+
+int HistoryRecorder::getFirstYear() const {
+    int first = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (i == 0 || segments[i].firstYear < first) {
+            first = segments[i].firstYear;
+        }
+    }
+    return first;
+}
+
+int HistoryRecorder::getLastYear() const {
+    return segments.empty() ? 0 : segments.back().firstYear + segments.back().yearCount - 1;
+}
+
+size_t HistoryRecorder::getMemoryUsage() const {
+    return sizeof(*this) + stream.capacity() + segments.capacity() * sizeof(Segment) + previousTail.capacity() +
+        tail.capacity() + previousDynasty.capacity();
+}
+
+// -------------------------------
+// MetricsExporter implementation
+// -------------------------------
+
+static const MetricsExporter::Column metricsColumns[] = {
+    { "kingdom", MetricsExporter::COLUMN_INTEGER },
+    { "year", MetricsExporter::COLUMN_INTEGER },
+    { "peasants", MetricsExporter::COLUMN_INTEGER },
+    { "merchants", MetricsExporter::COLUMN_INTEGER },
+    { "nobles", MetricsExporter::COLUMN_INTEGER },
+    { "happiness", MetricsExporter::COLUMN_REAL },
+    { "infantry", MetricsExporter::COLUMN_INTEGER },
+    { "cavalry", MetricsExporter::COLUMN_INTEGER },
+    { "archers", MetricsExporter::COLUMN_INTEGER },
+    { "morale", MetricsExporter::COLUMN_REAL },
+    { "treasury", MetricsExporter::COLUMN_INTEGER },
+    { "debt", MetricsExporter::COLUMN_INTEGER },
+    { "inflation", MetricsExporter::COLUMN_REAL },
+    { "food", MetricsExporter::COLUMN_INTEGER },
+    { "wood", MetricsExporter::COLUMN_INTEGER },
+    { "stone", MetricsExporter::COLUMN_INTEGER },
+    { "iron", MetricsExporter::COLUMN_INTEGER },
+    { "food_price", MetricsExporter::COLUMN_REAL },
+    { "wood_price", MetricsExporter::COLUMN_REAL },
+    { "stone_price", MetricsExporter::COLUMN_REAL },
+    { "iron_price", MetricsExporter::COLUMN_REAL },
+    { "average_relations", MetricsExporter::COLUMN_REAL },
+    { "wars", MetricsExporter::COLUMN_INTEGER },
+    { "score", MetricsExporter::COLUMN_INTEGER }
+};
+static const int metricsColumnCount = sizeof(metricsColumns) / sizeof(metricsColumns[0]);
+static const char metricsMagic[4] = { 'S', 'K', 'M', 'X' };
+static const uint32_t metricsVersion = 1;
+
+static size_t varintLength(uint64_t value) {
+    size_t length = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        length++;
+    }
+    return length;
+}
+
+// CPU time of the calling thread, or 0 where it cannot be read
+static double threadCpuSeconds() {
+#ifdef __linux__
+    timespec now;
+    return clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0 ? now.tv_sec + now.tv_nsec * 1e-9 : 0.0;
+#else
+    return 0.0;
+#endif
+}
+
+static uint64_t integerBits(int64_t value) {
+    return static_cast<uint64_t>(value);
+}
+
+static uint64_t realBits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+MetricsExporter::MetricsExporter()
+    : file(nullptr), fillingRows(0), pendingRows(0), hasPending(false), stopping(false), failed(false),
+    rowCount(0), droppedRows(0), bytesWritten(0), writerSeconds(0.0) {
+}
+
+MetricsExporter::~MetricsExporter() {
+    if (file) {
+        close();
+    }
+}
+
+int MetricsExporter::getColumnCount() {
+    return metricsColumnCount;
+}
+
+const MetricsExporter::Column& MetricsExporter::getColumn(int index) {
+    return metricsColumns[index];
+}
+
+bool MetricsExporter::open(const string& filename) {
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        Logger::error("Error: Could not create metrics file {}!", filename);
+        return false;
+    }
+
+    // Header: magic, version, then the schema as (type, name length, name)
+    vector<unsigned char> header(12);
+    memcpy(&header[0], metricsMagic, 4);
+    putU32(&header[4], metricsVersion);
+    putU32(&header[8], metricsColumnCount);
+    for (int i = 0; i < metricsColumnCount; i++) {
+        size_t length = strlen(metricsColumns[i].name);
+        header.push_back(metricsColumns[i].type);
+        header.push_back(static_cast<unsigned char>(length));
+        header.insert(header.end(), metricsColumns[i].name, metricsColumns[i].name + length);
+    }
+    bytesWritten = 0;
+    rowCount = 0;
+    droppedRows = 0;
+    writerSeconds = 0.0;
+    groupOffsets.clear();
+    failed = fwrite(header.data(), 1, header.size(), file) != header.size();
+    bytesWritten = header.size();
+
+    filling.assign(static_cast<size_t>(metricsColumnCount) * ROW_GROUP_SIZE, 0);
+    pending.assign(filling.size(), 0);
+    fillingRows = 0;
+    stopping = false;
+    writer = thread(&MetricsExporter::writerLoop, this);
+    return !failed;
+}
+
+void MetricsExporter::append(uint32_t kingdomId, const Kingdom& kingdom) {
+    if (!file) {
+        return;
+    }
+    const Population& population = *kingdom.getPopulation();
+    const Army& army = *kingdom.getArmy();
+    const Economy& economy = *kingdom.getEconomy();
+    const Market& market = *kingdom.getMarket();
+    const Diplomacy& diplomacy = *kingdom.getDiplomacy();
+
+    int relations = 0;
+    int wars = 0;
+    for (int i = 0; i < diplomacy.getKingdomCount(); i++) {
+        relations += diplomacy.getForeignKingdoms()[i].relationLevel;
+        wars += diplomacy.getForeignKingdoms()[i].atWar ? 1 : 0;
+    }
+    double averageRelations = diplomacy.getKingdomCount() > 0 ?
+        static_cast<double>(relations) / diplomacy.getKingdomCount() : 0.0;
+
+    const Food& food = *market.getFood();
+    const Wood& wood = *market.getWood();
+    const Stone& stone = *market.getStone();
+    const Iron& iron = *market.getIron();
+
+    // In schema order, reals as their bits
+    const uint64_t row[] = {
+        kingdomId, integerBits(kingdom.getGameYear()), integerBits(population.getPeasants()),
+        integerBits(population.getMerchants()), integerBits(population.getNobles()), realBits(population.getHappiness()),
+        integerBits(army.getInfantry()), integerBits(army.getCavalry()), integerBits(army.getArchers()),
+        realBits(army.getMorale()), integerBits(economy.getTreasuryGold()), integerBits(economy.getDebt()),
+        realBits(economy.getInflation()), integerBits(food.getAmount()), integerBits(wood.getAmount()),
+        integerBits(stone.getAmount()), integerBits(iron.getAmount()), realBits(food.getValue()),
+        realBits(wood.getValue()), realBits(stone.getValue()), realBits(iron.getValue()), realBits(averageRelations),
+        integerBits(wars), integerBits(kingdom.getScore())
+    };
+    static_assert(sizeof(row) / sizeof(row[0]) == metricsColumnCount, "A metrics row must fill every column");
+
+    // One contiguous row; the writer thread does the transpose
+    memcpy(&filling[static_cast<size_t>(fillingRows) * metricsColumnCount], row, sizeof(row));
+    rowCount++;
+    if (++fillingRows == ROW_GROUP_SIZE) {
+        handOff(false);
+    }
+}
+
+void MetricsExporter::handOff(bool wait) {
+    unique_lock<std::mutex> lock(mutex);
+    if (hasPending && !wait) {
+        // The writer is behind: the game thread never stalls on metrics
+        droppedRows += fillingRows;
+        fillingRows = 0;
+        return;
+    }
+    idle.wait(lock, [this]() { return !hasPending; });
+    filling.swap(pending);
+    pendingRows = fillingRows;
+    fillingRows = 0;
+    hasPending = true;
+    wake.notify_one();
+}
+
+void MetricsExporter::writerLoop() {
+    vector<unsigned char> buffer;
+    unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return hasPending || stopping; });
+        if (!hasPending) {
+            break;
+        }
+        lock.unlock();
+        double start = threadCpuSeconds();
+        bool written = writeGroup(pending, pendingRows, buffer);
+        double busy = threadCpuSeconds() - start;
+        lock.lock();
+        writerSeconds += busy;
+        failed = failed || !written;
+        hasPending = false;
+        idle.notify_all();
+    }
+}
+
+bool MetricsExporter::writeGroup(const RowGroup& group, int rows, vector<unsigned char>& buffer) {
+    // Group layout: row count, per column (encoding, size, min, max), then the column chunks
+    const size_t descriptorSize = 1 + 4 + 8 + 8;
+    const size_t headerSize = 4 + descriptorSize * metricsColumnCount;
+    buffer.resize(headerSize + static_cast<size_t>(rows) * 10 * metricsColumnCount);
+    putU32(&buffer[0], static_cast<uint32_t>(rows));
+
+    // Transpose a block of rows at a time, so both sides stay in cache
+    const int block = 64;
+    transposed.resize(group.size());
+    for (int first = 0; first < rows; first += block) {
+        int last = min(rows, first + block);
+        for (int column = 0; column < metricsColumnCount; column++) {
+            uint64_t* target = &transposed[static_cast<size_t>(column) * ROW_GROUP_SIZE];
+            for (int row = first; row < last; row++) {
+                target[row] = group[static_cast<size_t>(row) * metricsColumnCount + column];
+            }
+        }
+    }
+
+    // Each column is then contiguous and encoded in one pass of its own
+    unsigned char* out = &buffer[headerSize];
+    for (int column = 0; column < metricsColumnCount; column++) {
+        const uint64_t* values = &transposed[static_cast<size_t>(column) * ROW_GROUP_SIZE];
+        unsigned char* start = out;
+        Encoding encoding;
+        uint64_t minimumBits;
+        uint64_t maximumBits;
+        if (metricsColumns[column].type == COLUMN_REAL) {
+            encoding = ENCODING_XOR;
+            double minimum = 0.0;
+            double maximum = 0.0;
+            uint64_t previous = 0;
+            for (int row = 0; row < rows; row++) {
+                out = writeXorBits(out, values[row] ^ previous);
+                previous = values[row];
+                double value;
+                memcpy(&value, &values[row], sizeof(value));
+                minimum = row == 0 ? value : min(minimum, value);
+                maximum = row == 0 ? value : max(maximum, value);
+            }
+            minimumBits = realBits(minimum);
+            maximumBits = realBits(maximum);
+        }
+        else {
+            encoding = ENCODING_DELTA_VARINT;
+            int64_t minimum = static_cast<int64_t>(values[0]);
+            int64_t maximum = minimum;
+            int64_t previous = 0;
+            size_t plainSize = 0;
+            for (int row = 0; row < rows; row++) {
+                int64_t value = static_cast<int64_t>(values[row]);
+                out = writeVarint(out, zigzag(value - previous));
+                plainSize += varintLength(zigzag(value));
+                previous = value;
+                minimum = min(minimum, value);
+                maximum = max(maximum, value);
+            }
+            minimumBits = static_cast<uint64_t>(minimum);
+            maximumBits = static_cast<uint64_t>(maximum);
+
+            // Fall back to plain values where the deltas came out larger
+            if (plainSize < static_cast<size_t>(out - start)) {
+                encoding = ENCODING_VARINT;
+                out = start;
+                for (int row = 0; row < rows; row++) {
+                    out = writeVarint(out, zigzag(static_cast<int64_t>(values[row])));
+                }
+            }
+        }
+
+        unsigned char* descriptor = &buffer[4 + descriptorSize * column];
+        descriptor[0] = encoding;
+        putU32(descriptor + 1, static_cast<uint32_t>(out - start));
+        putU64(descriptor + 5, minimumBits);
+        putU64(descriptor + 13, maximumBits);
+    }
+
+    size_t size = out - &buffer[0];
+    bool written = fwrite(buffer.data(), 1, size, file) == size;
+    lock_guard<std::mutex> lock(mutex);
+    groupOffsets.push_back(bytesWritten);
+    bytesWritten += size;
+    return written;
+}
+
+bool MetricsExporter::close() {
+    if (!file) {
+        return false;
+    }
+    if (fillingRows > 0) {
+        handOff(true);
+    }
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+
+    // Footer: every group offset, the row count, the group count and the magic
+    vector<unsigned char> footer(8 * groupOffsets.size() + 16);
+    for (size_t i = 0; i < groupOffsets.size(); i++) {
+        putU64(&footer[8 * i], groupOffsets[i]);
+    }
+    putU64(&footer[8 * groupOffsets.size()], rowCount - droppedRows);
+    putU32(&footer[8 * groupOffsets.size() + 8], static_cast<uint32_t>(groupOffsets.size()));
+    memcpy(&footer[8 * groupOffsets.size() + 12], metricsMagic, 4);
+    bool ok = !failed && fwrite(footer.data(), 1, footer.size(), file) == footer.size();
+    bytesWritten += footer.size();
+    ok = fclose(file) == 0 && ok;
+    file = nullptr;
+    if (!ok) {
+        Logger::error("Error: Writing the metrics file failed!");
+    }
+    return ok;
+}
+
+uint64_t MetricsExporter::getRowCount() const {
+    return rowCount;
+}
+
+uint64_t MetricsExporter::getDroppedRows() const {
+    return droppedRows;
+}
+
+uint64_t MetricsExporter::getBytesWritten() {
+    lock_guard<std::mutex> lock(mutex);
+    return bytesWritten;
+}
+
+double MetricsExporter::getWriterSeconds() {
+    lock_guard<std::mutex> lock(mutex);
+    return writerSeconds;
+}
+
+bool MetricsExporter::exportCsv(const string& filename, ostream& out) {
+    ifstream in(filename, ios::binary);
+    vector<unsigned char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    if (data.size() < 28 || memcmp(&data[0], metricsMagic, 4) != 0 ||
+        memcmp(&data[data.size() - 4], metricsMagic, 4) != 0) {
+        Logger::error("Error: {} is not a metrics file!", filename);
+        return false;
+    }
+
+    // Schema from the header
+    uint32_t columnCount = getU32(&data[8]);
+    vector<ColumnType> types;
+    const unsigned char* position = &data[12];
+    const unsigned char* end = &data[0] + data.size();
+    for (uint32_t i = 0; i < columnCount && position + 2 <= end; i++) {
+        types.push_back(static_cast<ColumnType>(position[0]));
+        size_t length = position[1];
+        out << (i ? "," : "") << string(reinterpret_cast<const char*>(position + 2), min(length, static_cast<size_t>(end - position - 2)));
+        position += 2 + length;
+    }
+    out << '\n';
+    if (types.size() != columnCount) {
+        return false;
+    }
+
+    uint32_t groupCount = getU32(&data[data.size() - 8]);
+    if (data.size() < 16 + 8 * static_cast<size_t>(groupCount)) {
+        return false;
+    }
+    const unsigned char* offsets = &data[data.size() - 16 - 8 * static_cast<size_t>(groupCount)];
+    const size_t descriptorSize = 1 + 4 + 8 + 8;
+    vector<vector<string>> cells(columnCount);
+    for (uint32_t group = 0; group < groupCount; group++) {
+        uint64_t offset = getU64(offsets + 8 * group);
+        if (offset + 4 + descriptorSize * columnCount > data.size()) {
+            return false;
+        }
+        const unsigned char* header = &data[offset];
+        uint32_t rows = getU32(header);
+        const unsigned char* chunk = header + 4 + descriptorSize * columnCount;
+
+        // Decode each column chunk of the group, then print the group row by row
+        for (uint32_t column = 0; column < columnCount; column++) {
+            const unsigned char* descriptor = header + 4 + descriptorSize * column;
+            Encoding encoding = static_cast<Encoding>(descriptor[0]);
+            const unsigned char* chunkEnd = chunk + getU32(descriptor + 1);
+            if (chunkEnd > end) {
+                return false;
+            }
+            cells[column].resize(rows);
+            const unsigned char* in = chunk;
+            uint64_t previous = 0;
+            for (uint32_t row = 0; row < rows; row++) {
+                uint64_t raw;
+                in = encoding == ENCODING_XOR ? getXorBits(in, chunkEnd, raw) : getVarint(in, chunkEnd, raw);
+                if (!in) {
+                    return false;
+                }
+                ostringstream cell;
+                if (encoding == ENCODING_XOR) {
+                    previous ^= raw;
+                    double value;
+                    memcpy(&value, &previous, sizeof(value));
+                    cell << value;
+                }
+                else {
+                    int64_t value = unzigzag(raw) + (encoding == ENCODING_DELTA_VARINT ? static_cast<int64_t>(previous) : 0);
+                    previous = static_cast<uint64_t>(value);
+                    cell << value;
+                }
+                cells[column][row] = cell.str();
+            }
+            chunk = chunkEnd;
+        }
+        for (uint32_t row = 0; row < rows; row++) {
+            for (uint32_t column = 0; column < columnCount; column++) {
+                out << (column ? "," : "") << cells[column][row];
+            }
+            out << '\n';
+        }
+    }
+    return true;
+}
+
+// ----------------------
+// Command implementation
+// ----------------------
+
+Command::Command(Type type, const string& target, int amount)
+    : type(type), target(target), amount(amount) {
+    rates[0] = 0.0;
+    rates[1] = 0.0;
+    rates[2] = 0.0;
+}
+
+Command Command::setTaxRates(double peasantRate, double merchantRate, double nobleRate) {
+    Command command(SET_TAX_RATES);
+    command.rates[0] = peasantRate;
+    command.rates[1] = merchantRate;
+    command.rates[2] = nobleRate;
+    return command;
+}
+
+Command Command::buyResource(const string& resourceType, int amount) {
+    return Command(BUY_RESOURCE, resourceType, amount);
+}
+
+Command Command::sellResource(const string& resourceType, int amount) {
+    return Command(SELL_RESOURCE, resourceType, amount);
+}
+
+Command Command::recruit(const string& unitType, int count) {
+    return Command(RECRUIT, unitType, count);
+}
+
+Command Command::trainArmy() {
+    return Command(TRAIN_ARMY);
+}
+
+Command Command::improveRelations(const string& kingdomName) {
+    return Command(IMPROVE_RELATIONS, kingdomName);
+}
+
+Command Command::declareWar(const string& kingdomName) {
+    return Command(DECLARE_WAR, kingdomName);
+}
+
+Command Command::signPeace(const string& kingdomName) {
+    return Command(SIGN_PEACE, kingdomName);
+}
+
+Command Command::formAlliance(const string& kingdomName) {
+    return Command(FORM_ALLIANCE, kingdomName);
+}
+
+Command Command::establishTrade(const string& kingdomName) {
+    return Command(ESTABLISH_TRADE, kingdomName);
+}
+
+Command Command::takeLoan(int amount) {
+    return Command(TAKE_LOAN, "", amount);
+}
+
+Command Command::repayLoan(int amount) {
+    return Command(REPAY_LOAN, "", amount);
+}
+
+Command Command::holdElections() {
+    return Command(HOLD_ELECTIONS);
+}
+
+Command Command::advanceYear(int years) {
+    return Command(ADVANCE_YEAR, "", years);
+}
+
+Command Command::saveGame(const string& filename) {
+    return Command(SAVE_GAME, filename);
+}
+
+Command Command::loadGame(const string& filename) {
+    return Command(LOAD_GAME, filename);
+}
+
+Command Command::showHistory(int year) {
+    return Command(SHOW_HISTORY, "", year);
+}
+
+bool Command::parse(const string& line, Command& command, string& error) {
+    istringstream words(line);
+    string verb;
+    words >> verb;
+    for (size_t i = 0; i < verb.size(); i++) {
+        verb[i] = static_cast<char>(tolower(verb[i]));
+    }
+
+    // The rest of the line is the target for commands naming a kingdom or file
+    string rest;
+    getline(words >> ws, rest);
+    istringstream arguments(rest);
+    string target;
+    int amount = 0;
+
+    if (verb == "tax") {
+        double peasant, merchant, noble;
+        if (!(arguments >> peasant >> merchant >> noble)) {
+            error = "tax needs three rates";
+            return false;
+        }
+        command = setTaxRates(peasant, merchant, noble);
+    }
+    else if (verb == "buy" || verb == "sell" || verb == "recruit") {
+        if (!(arguments >> target >> amount)) {
+            error = verb + " needs a type and an amount";
+            return false;
+        }
+        if (verb == "buy") command = buyResource(target, amount);
+        else if (verb == "sell") command = sellResource(target, amount);
+        else command = recruit(target, amount);
+    }
+    else if (verb == "loan" || verb == "repay") {
+        if (!(arguments >> amount)) {
+            error = verb + " needs an amount";
+            return false;
+        }
+        command = verb == "loan" ? takeLoan(amount) : repayLoan(amount);
+    }
+    else if (verb == "advance") {
+        if (!(arguments >> amount)) {
+            amount = 1;
+        }
+        command = advanceYear(amount);
+    }
+    else if (verb == "history") {
+        if (!(arguments >> amount)) {
+            error = "history needs a year";
+            return false;
+        }
+        command = showHistory(amount);
+    }
+    else if (verb == "train") {
+        command = trainArmy();
+    }
+    else if (verb == "elections") {
+        command = holdElections();
+    }
+    else if (verb == "relations" || verb == "war" || verb == "peace" || verb == "alliance" ||
+        verb == "trade" || verb == "save" || verb == "load") {
+        if (rest.empty()) {
+            error = verb + " needs a name";
+            return false;
+        }
+        if (verb == "relations") command = improveRelations(rest);
+        else if (verb == "war") command = declareWar(rest);
+        else if (verb == "peace") command = signPeace(rest);
+        else if (verb == "alliance") command = formAlliance(rest);
+        else if (verb == "trade") command = establishTrade(rest);
+        else if (verb == "save") command = saveGame(rest);
+        else command = loadGame(rest);
+    }
+    else {
+        error = "unknown command '" + verb + "'";
+        return false;
+    }
+    return true;
+}
+
+// ---------------------------
+// CommandQueue implementation
+// ---------------------------
+
+CommandQueue::CommandQueue() {}
+
+CommandQueue::~CommandQueue() {}
+
+void CommandQueue::push(const Command& command) {
+    commands.push_back(command);
+}
+
+int CommandQueue::getCount() const {
+    return static_cast<int>(commands.size());
+}
+
+void CommandQueue::clear() {
+    commands.clear();
+}
+
+int CommandQueue::applyAll(Kingdom& kingdom, vector<Result>* results) {
+    int succeeded = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        Result result = apply(commands[i], kingdom);
+        if (result.success) {
+            succeeded++;
+        }
+        if (results) {
+            results->push_back(result);
+        }
+    }
+    commands.clear();
+    return succeeded;
+}
+
+CommandQueue::Result CommandQueue::apply(const Command& command, Kingdom& kingdom) {
+    Logger::KingdomScope scope(kingdom.getNameHandle());
+    Result result = { false, "" };
+    ostringstream message;
+    Economy& economy = *kingdom.getEconomy();
+
+    switch (command.type) {
+    case Command::SET_TAX_RATES:
+        for (int i = 0; i < 3; i++) {
+            if (command.rates[i] < 0.0 || command.rates[i] > 0.5) {
+                result.message = "Invalid input! Tax rates must be between 0 and 0.5.";
+                return result;
+            }
+        }
+        economy.setPeasantTaxRate(command.rates[0]);
+        economy.setMerchantTaxRate(command.rates[1]);
+        economy.setNobleTaxRate(command.rates[2]);
+        message << "Tax rates set to " << command.rates[0] << " (peasants), " << command.rates[1]
+            << " (merchants), " << command.rates[2] << " (nobles)!";
+        result.success = true;
+        break;
+    case Command::BUY_RESOURCE:
+        result.success = command.amount > 0 &&
+            kingdom.getMarket()->buyResource(command.target, command.amount, economy);
+        if (result.success) message << "Purchased " << command.amount << " " << command.target << "!";
+        else message << "Failed to buy! Check funds or resource type.";
+        break;
+    case Command::SELL_RESOURCE:
+        result.success = command.amount > 0 &&
+            (kingdom.usesDesignerRules() ?
+                kingdom.getMarket()->sellResource<designerRuleset>(command.target, command.amount, economy) :
+                kingdom.getMarket()->sellResource<standardRuleset>(command.target, command.amount, economy));
+        if (result.success) message << "Sold " << command.amount << " " << command.target << "!";
+        else message << "Failed to sell! Check stock or resource type.";
+        break;
+    case Command::RECRUIT: {
+        // Recruitment cost per soldier by unit type
+        Army& army = *kingdom.getArmy();
+        int cost;
+        if (command.target == "infantry") cost = 10;
+        else if (command.target == "cavalry") cost = 20;
+        else if (command.target == "archers") cost = 15;
+        else {
+            message << "Unknown unit type! Use infantry, cavalry or archers.";
+            break;
+        }
+        if (command.amount <= 0 || economy.getTreasuryGold() < command.amount * cost) {
+            message << "Failed to recruit! Not enough gold.";
+            break;
+        }
+        if (command.target == "infantry") army.setInfantry(army.getInfantry() + command.amount);
+        else if (command.target == "cavalry") army.setCavalry(army.getCavalry() + command.amount);
+        else army.setArchers(army.getArchers() + command.amount);
+        economy.setTreasuryGold(economy.getTreasuryGold() - command.amount * cost);
+        message << "Recruited " << command.amount << " " << command.target << "!";
+        result.success = true;
+        break;
+    }
+    case Command::TRAIN_ARMY:
+        kingdom.getArmy()->trainArmy();
+        message << "Army training level is now " << kingdom.getArmy()->getTrainingLevel() << ".";
+        result.success = true;
+        break;
+    case Command::IMPROVE_RELATIONS:
+        result.success = kingdom.getDiplomacy()->improveRelations(command.target, economy);
+        if (result.success) message << "Relations with " << command.target << " improved!";
+        else message << "Failed to improve relations! Check funds or kingdom name.";
+        break;
+    case Command::DECLARE_WAR:
+        result.success = kingdom.getDiplomacy()->declareWar(command.target, *kingdom.getArmy());
+        if (result.success) message << "War declared on " << command.target << "!";
+        else message << "Failed to declare war! Already at war or invalid kingdom.";
+        break;
+    case Command::SIGN_PEACE:
+        result.success = kingdom.getDiplomacy()->signPeace(command.target, economy);
+        if (result.success) message << "Peace signed with " << command.target << "!";
+        else message << "Failed to sign peace! Not at war or insufficient funds.";
+        break;
+    case Command::FORM_ALLIANCE:
+        result.success = kingdom.getDiplomacy()->formAlliance(command.target);
+        if (result.success) message << "Alliance formed with " << command.target << "!";
+        else message << "Failed to form alliance! Relations too low or at war.";
+        break;
+    case Command::ESTABLISH_TRADE:
+        result.success = kingdom.getDiplomacy()->establishTrade(command.target, *kingdom.getMarket(), economy);
+        if (result.success) message << "Trade established with " << command.target << "!";
+        else message << "Failed to establish trade! Relations too low or at war.";
+        break;
+    case Command::TAKE_LOAN:
+        result.success = kingdom.getBank()->takeLoan(command.amount, economy);
+        if (result.success) message << "Loan of " << command.amount << " gold taken!";
+        else message << "Failed to take loan! Amount too high.";
+        break;
+    case Command::REPAY_LOAN:
+        result.success = kingdom.getBank()->repayLoan(command.amount, economy);
+        if (result.success) message << "Repaid " << command.amount << " gold of loan!";
+        else message << "Failed to repay loan! Check funds or debt.";
+        break;
+    case Command::HOLD_ELECTIONS:
+        kingdom.holdElections();
+        message << kingdom.getRuler()->getName() << " now rules the kingdom.";
+        result.success = true;
+        break;
+    case Command::ADVANCE_YEAR:
+        for (int year = 0; year < max(1, command.amount) && !kingdom.isGameOver(); year++) {
+            kingdom.advanceYear();
+        }
+        message << "Kingdom is now in year " << kingdom.getGameYear() << ".";
+        result.success = !kingdom.isGameOver();
+        break;
+    case Command::SAVE_GAME:
+        result.success = kingdom.saveGame(command.target);
+        message << (result.success ? "Saved to " : "Could not save to ") << command.target << ".";
+        break;
+    case Command::LOAD_GAME:
+        result.success = kingdom.loadGame(command.target);
+        message << (result.success ? "Loaded from " : "Could not load from ") << command.target << ".";
+        break;
+    case Command::SHOW_HISTORY: {
+        KingdomSnapshot snapshot;
+        if (!kingdom.getHistory()) {
+            message << "History is not being recorded.";
+        }
+        else if (!kingdom.getHistory()->seek(command.amount, snapshot)) {
+            message << "No history recorded for year " << command.amount << ".";
+        }
+        else {
+            message << "Year " << snapshot.gameYear << ": score " << snapshot.score << ", population "
+                << snapshot.peasants + snapshot.merchants + snapshot.nobles << ", army "
+                << snapshot.infantry + snapshot.cavalry + snapshot.archers << ", treasury "
+                << snapshot.treasuryGold << " gold, happiness " << static_cast<int>(snapshot.happiness * 100) << "%";
+            result.success = true;
+        }
+        break;
+    }
+    }
+
+    result.message = message.str();
+    return result;
+}
+
+// ---------------------------
+// ScreenBuffer implementation
+// ---------------------------
+
+ScreenBuffer::ScreenBuffer(int width, int height)
+    : width(width), height(height), back(width * height, ' '), front(width * height, ' '),
+    fullRedraw(true) {
+}
+
+ScreenBuffer::~ScreenBuffer() {}
+
+void ScreenBuffer::clear() {
+    fill(back.begin(), back.end(), ' ');
+}
+
+void ScreenBuffer::writeText(int row, int column, const string& text) {
+    if (row < 0 || row >= height || column < 0 || column >= width) {
+        return;
+    }
+    int length = min(static_cast<int>(text.size()), width - column);
+    memcpy(&back[row * width + column], text.data(), length);
+}
+
+void ScreenBuffer::invalidate() {
+    fullRedraw = true;
+}
+
+string ScreenBuffer::renderFrame() {
+    string frame;
+    if (fullRedraw) {
+        // Start from a blank terminal, then send only the non-blank cells
+        frame += "\x1b[H\x1b[2J";
+        fill(front.begin(), front.end(), ' ');
+        fullRedraw = false;
+    }
+
+    char position[32];
+    for (int row = 0; row < height; row++) {
+        const char* next = &back[row * width];
+        char* shown = &front[row * width];
+        int column = 0;
+        while (column < width) {
+            if (next[column] == shown[column]) {
+                column++;
+                continue;
+            }
+            // Bridge short unchanged gaps; a cursor move costs more than a few characters
+            int lastChanged = column;
+            for (int end = column + 1; end < width && end - lastChanged <= 4; end++) {
+                if (next[end] != shown[end]) {
+                    lastChanged = end;
+                }
+            }
+            int length = lastChanged - column + 1;
+            snprintf(position, sizeof(position), "\x1b[%d;%dH", row + 1, column + 1);
+            frame += position;
+            frame.append(next + column, length);
+            memcpy(shown + column, next + column, length);
+            column = lastChanged + 1;
+        }
+    }
+
+    if (!frame.empty()) {
+        // Park the cursor below the grid
+        snprintf(position, sizeof(position), "\x1b[%d;1H", height + 1);
+        frame += position;
+    }
+    return frame;
+}
+
+int ScreenBuffer::present() {
+    string frame = renderFrame();
+    if (!frame.empty()) {
+        fwrite(frame.data(), 1, frame.size(), stdout);
+        fflush(stdout);
+    }
+    return static_cast<int>(frame.size());
+}
+
+int ScreenBuffer::getWidth() const {
+    return width;
+}
+
+int ScreenBuffer::getHeight() const {
+    return height;
+}
+
+// -------------------------------
+// LatencyHistogram implementation
+// -------------------------------
+
+LatencyHistogram::LatencyHistogram()
+    : counts(BUCKETS, 0), total(0), maximum(0.0) {
+}
+
+void LatencyHistogram::record(double microseconds) {
+    int bucket = 0;
+    if (microseconds > 1.0) {
+        bucket = min(BUCKETS - 1, static_cast<int>(log(microseconds) / log(1.05)) + 1);
+    }
+    counts[bucket]++;
+    total++;
+    maximum = max(maximum, microseconds);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (int i = 0; i < BUCKETS; i++) {
+        counts[i] += other.counts[i];
+    }
+    total += other.total;
+    maximum = max(maximum, other.maximum);
+}
+
+long long LatencyHistogram::getCount() const {
+    return total;
+}
+
+double LatencyHistogram::getMaximum() const {
+    return maximum;
+}
+
+double LatencyHistogram::percentile(double fraction) const {
+    // Upper edge of the bucket holding the requested rank
+    long long rank = static_cast<long long>(fraction * total);
+    long long seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+            return i == 0 ? 1.0 : min(maximum, pow(1.05, i));
+        }
+    }
+    return maximum;
+}
+
+// -------------------------
+// GameServer implementation
+// -------------------------
+
+#ifdef __linux__
+
+static GameServer* activeServer = nullptr;
+
+static void stopActiveServer(int) {
+    if (activeServer) {
+        activeServer->stop();
+    }
+}
+
+// Thousands of clients need more descriptors than the default soft limit
+static void raiseDescriptorLimit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// Connects or binds to "unix:/path" or a localhost TCP port
+static int openSocket(const string& address, bool listening) {
+    int fd;
+    int result;
+
+    if (address.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un local;
+        memset(&local, 0, sizeof(local));
+        local.sun_family = AF_UNIX;
+        strncpy(local.sun_path, address.c_str() + 5, sizeof(local.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        if (listening) {
+            unlink(local.sun_path);
+            result = ::bind(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local));
+        }
+        else {
+            setNonBlocking(fd);
+            result = connect(fd, reinterpret_cast<struct sockaddr*>(&local), sizeof(local));
+        }
+    }
+    else {
+        struct sockaddr_in inet;
+        memset(&inet, 0, sizeof(inet));
+        inet.sin_family = AF_INET;
+        inet.sin_port = htons(static_cast<uint16_t>(atoi(address.c_str())));
+        inet.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+        int flag = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        if (listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+            result = ::bind(fd, reinterpret_cast<struct sockaddr*>(&inet), sizeof(inet));
+        }
+        else {
+            setNonBlocking(fd);
+            result = connect(fd, reinterpret_cast<struct sockaddr*>(&inet), sizeof(inet));
+        }
+    }
+
+    if (listening) {
+        if (result < 0 || listen(fd, SOMAXCONN) < 0) {
+            close(fd);
+            return -1;
+        }
+        setNonBlocking(fd);
+    }
+    else if (result < 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+GameServer::GameServer(const string& address, int workerCount, int maxKingdoms)
+    : address(address), workerCount(max(1, workerCount)), maxKingdoms(max(1, maxKingdoms)),
+    listenFd(-1), epollFd(-1), wakeFd(-1), nextClientId(1), running(false), workersStopping(false) {
+    // Reserved up front so workers never see the vector move
+    kingdoms.reserve(this->maxKingdoms);
+}
+
+GameServer::~GameServer() {
+    if (listenFd >= 0) close(listenFd);
+    if (epollFd >= 0) close(epollFd);
+    if (wakeFd >= 0) close(wakeFd);
+}
+
+bool GameServer::openListener() {
+    raiseDescriptorLimit();
+    listenFd = openSocket(address, true);
+    if (listenFd < 0) {
+        cerr << "Error: Could not listen on " << address << endl;
+        return false;
+    }
+
+    epollFd = epoll_create1(0);
+    wakeFd = eventfd(0, EFD_NONBLOCK);
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = listenFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.fd = wakeFd;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    return true;
+}
+
+void GameServer::stop() {
+    running = false;
+}
+
+int GameServer::getKingdomCount() const {
+    return static_cast<int>(kingdoms.size());
+}
+
+void GameServer::acceptClients() {
+    while (true) {
+        int fd = accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            return; // EAGAIN: backlog drained
+        }
+        setNonBlocking(fd);
+
+        Client client = { fd, nextClientId++, string(), string(), false, false, false, 0 };
+        clients[fd] = client;
+        clientFds[client.id] = fd;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+void GameServer::closeClient(int fd) {
+    unordered_map<int, Client>::iterator it = clients.find(fd);
+    if (it == clients.end()) {
+        return;
+    }
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    clientFds.erase(it->second.id);
+    clients.erase(it);
+    close(fd);
+}
+
+void GameServer::readClient(int fd) {
+    chrono::steady_clock::time_point received = chrono::steady_clock::now();
+    char buffer[4096];
+
+    while (true) {
+        ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+        if (bytes > 0) {
+            clients[fd].input.append(buffer, bytes);
+            continue;
+        }
+        if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            closeClient(fd);
+            return;
+        }
+        break;
+    }
+
+    // Handle every complete line; a partial line waits for more bytes
+    Client& client = clients[fd];
+    size_t start = 0;
+    size_t end;
+    while ((end = client.input.find('\n', start)) != string::npos) {
+        string line = client.input.substr(start, end - start);
+        if (!line.empty() && line[line.size() - 1] == '\r') {
+            line.erase(line.size() - 1);
+        }
+        // Whatever follows QUIT is ignored
+        if (!client.quitting) {
+            handleLine(client, line, received);
+        }
+        start = end + 1;
+    }
+    client.input.erase(0, start);
+
+    if (client.closing && client.output.empty()) {
+        closeClient(fd);
+    }
+}
+
+void GameServer::flushClient(int fd) {
+    Client& client = clients[fd];
+    while (!client.output.empty()) {
+        ssize_t bytes = send(fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if (bytes <= 0) {
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            closeClient(fd);
+            return;
+        }
+        client.output.erase(0, bytes);
+    }
+
+    // Only ask for EPOLLOUT while something is still waiting to be sent
+    bool wantsWrite = !client.output.empty();
+    if (wantsWrite != client.writing) {
+        struct epoll_event event;
+        event.events = wantsWrite ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+        client.writing = wantsWrite;
+    }
+    if (client.closing && client.output.empty()) {
+        closeClient(fd);
+    }
+}
+
+void GameServer::respond(Client& client, int type, const string& response,
+    chrono::steady_clock::time_point received) {
+    client.output += response;
+    client.output += '\n';
+    latencies[type].record(chrono::duration<double, micro>(chrono::steady_clock::now() - received).count());
+}
+
+void GameServer::handleLine(Client& client, const string& line, chrono::steady_clock::time_point received) {
+    istringstream words(line);
+    string command;
+    words >> command;
+
+    if (command == "NEW") {
+        if (getKingdomCount() >= maxKingdoms) {
+            respond(client, COMMAND_NEW, "ERR kingdom limit reached", received);
+            return;
+        }
+        string name;
+        getline(words >> ws, name);
+        // Unnamed kingdoms get their id so log tags tell them apart
+        kingdoms.push_back(make_unique<Kingdom>(name.empty() ? "Kingdom " + to_string(getKingdomCount()) : name));
+        respond(client, COMMAND_NEW, "OK " + to_string(getKingdomCount() - 1), received);
+    }
+    else if (command == "ADVANCE" || command == "STATUS") {
+        int kingdomId = -1;
+        if (!(words >> kingdomId) || kingdomId < 0 || kingdomId >= getKingdomCount()) {
+            respond(client, COMMAND_OTHER, "ERR unknown kingdom", received);
+            return;
+        }
+        Job job = { kingdomId, command == "ADVANCE" ? COMMAND_ADVANCE : COMMAND_STATUS, Command(), client.id, received };
+        client.inFlight++;
+        dispatch(job);
+    }
+    else if (command == "DO") {
+        // Any script command, e.g. "DO 3 tax 0.1 0.1 0.2"
+        int kingdomId = -1;
+        string rest;
+        if (!(words >> kingdomId) || kingdomId < 0 || kingdomId >= getKingdomCount()) {
+            respond(client, COMMAND_OTHER, "ERR unknown kingdom", received);
+            return;
+        }
+        getline(words >> ws, rest);
+        Job job = { kingdomId, COMMAND_ACTION, Command(), client.id, received };
+        string error;
+        if (!Command::parse(rest, job.command, error)) {
+            respond(client, COMMAND_OTHER, "ERR " + error, received);
+            return;
+        }
+        // Clients never name files on the server's disk
+        if (job.command.type == Command::SAVE_GAME || job.command.type == Command::LOAD_GAME) {
+            respond(client, COMMAND_OTHER, "ERR save and load are not available over the network", received);
+            return;
+        }
+        client.inFlight++;
+        dispatch(job);
+    }
+    else if (command == "STATS") {
+        respond(client, COMMAND_STATS, latencyReport() + "END", received);
+    }
+    else if (command == "QUIT") {
+        client.quitting = true;
+        if (client.inFlight == 0) {
+            client.closing = true;
+            respond(client, COMMAND_OTHER, "BYE", received);
+        }
+    }
+    else if (!command.empty()) {
+        respond(client, COMMAND_OTHER, "ERR unknown command", received);
+    }
+}
+
+void GameServer::dispatch(const Job& job) {
+    WorkerQueue& queue = *queues[job.kingdomId % workerCount];
+    {
+        lock_guard<mutex> lock(queue.mutex);
+        queue.jobs.push_back(job);
+    }
+    queue.ready.notify_one();
+}
+
+void GameServer::workerLoop(int worker) {
+    WorkerQueue& queue = *queues[worker];
+
+    while (true) {
+        Job job;
+        {
+            unique_lock<mutex> lock(queue.mutex);
+            while (queue.jobs.empty() && !workersStopping) {
+                queue.ready.wait(lock);
+            }
+            if (queue.jobs.empty()) {
+                return;
+            }
+            job = queue.jobs.front();
+            queue.jobs.pop_front();
+        }
+
+        Kingdom& kingdom = *kingdoms[job.kingdomId];
+        ostringstream response;
+        if (job.type == COMMAND_ACTION) {
+            CommandQueue::Result result = CommandQueue::apply(job.command, kingdom);
+            response << (result.success ? "OK " : "ERR ") << job.kingdomId << " " << result.message;
+        }
+        else if (job.type == COMMAND_ADVANCE) {
+            kingdom.advanceYear();
+            response << "OK " << job.kingdomId << " YEAR " << kingdom.getGameYear() << " SCORE " << kingdom.getScore();
+        }
+        else {
+            response << "OK " << job.kingdomId << " YEAR " << kingdom.getGameYear()
+                << " POPULATION " << kingdom.getPopulation()->getTotal()
+                << " ARMY " << kingdom.getArmy()->getTotal()
+                << " TREASURY " << kingdom.getEconomy()->getTreasuryGold()
+                << " DEBT " << kingdom.getEconomy()->getDebt()
+                << " HAPPINESS " << static_cast<int>(kingdom.getPopulation()->getHappiness() * 100)
+                << " SCORE " << kingdom.getScore();
+        }
+
+        Completion completion = { job.clientId, job.type, response.str(), job.received };
+        {
+            lock_guard<mutex> lock(completionMutex);
+            completions.push_back(completion);
+        }
+        uint64_t one = 1;
+        ssize_t written = write(wakeFd, &one, sizeof(one));
+        (void)written;
+    }
+}
+
+void GameServer::drainCompletions() {
+    uint64_t counter;
+    ssize_t bytes = read(wakeFd, &counter, sizeof(counter));
+    (void)bytes;
+
+    vector<Completion> ready;
+    {
+        lock_guard<mutex> lock(completionMutex);
+        ready.swap(completions);
+    }
+
+    // Clients that disconnected meanwhile are simply skipped
+    vector<int> touched;
+    for (size_t i = 0; i < ready.size(); i++) {
+        unordered_map<unsigned long long, int>::iterator it = clientFds.find(ready[i].clientId);
+        if (it == clientFds.end()) {
+            continue;
+        }
+        Client& client = clients[it->second];
+        respond(client, ready[i].type, ready[i].response, ready[i].received);
+        client.inFlight--;
+
+        // A client that quit gets BYE after its last answer, then is closed once flushed
+        if (client.quitting && client.inFlight == 0 && !client.closing) {
+            client.closing = true;
+            respond(client, COMMAND_OTHER, "BYE", ready[i].received);
+        }
+        touched.push_back(it->second);
+    }
+    for (size_t i = 0; i < touched.size(); i++) {
+        if (clients.count(touched[i])) {
+            flushClient(touched[i]);
+        }
+    }
+}
+
+bool GameServer::run() {
+    if (!openListener()) {
+        return false;
+    }
+
+    // Player narration is noise here; keep warnings, tagged by kingdom, on stderr
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_WARNING);
+    Logger::setDecorated(true);
+    Logger::setOutput(&cerr);
+    activeServer = this;
+    signal(SIGINT, stopActiveServer);
+    signal(SIGTERM, stopActiveServer);
+
+    running = true;
+    workersStopping = false;
+    for (int i = 0; i < workerCount; i++) {
+        queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue()));
+    }
+    for (int i = 0; i < workerCount; i++) {
+        workers.push_back(thread(&GameServer::workerLoop, this, i));
+    }
+    cerr << "Server listening on " << address << " with " << workerCount << " workers" << endl;
+
+    vector<struct epoll_event> events(1024);
+    while (running) {
+        int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 100);
+        for (int i = 0; i < ready; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd) {
+                acceptClients();
+            }
+            else if (fd == wakeFd) {
+                drainCompletions();
+            }
+            else {
+                if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    readClient(fd);
+                }
+                if (clients.count(fd)) {
+                    flushClient(fd);
+                }
+            }
+        }
+    }
+
+    // Let the workers finish what was queued, then shut down
+    for (int i = 0; i < workerCount; i++) {
+        lock_guard<mutex> lock(queues[i]->mutex);
+        workersStopping = true;
+    }
+    for (int i = 0; i < workerCount; i++) {
+        queues[i]->ready.notify_all();
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    workers.clear();
+    while (!clients.empty()) {
+        closeClient(clients.begin()->first);
+    }
+
+    activeServer = nullptr;
+    Logger::setOutput(&cout);
+    Logger::setDecorated(false);
+    Logger::setLevel(consoleLevel);
+    return true;
+}
+
+int runLoadGenerator(const string& address, int clientCount, int requestsPerClient) {
+    // Closed loop: each client creates a kingdom then alternates ADVANCE and STATUS
+    struct LoadClient {
+        int fd;
+        int kingdomId;
+        int sent;
+        string input;
+        chrono::steady_clock::time_point sentAt;
+    };
+
+    raiseDescriptorLimit();
+    int epollFd = epoll_create1(0);
+    vector<LoadClient> loadClients(clientCount);
+    unordered_map<int, int> clientOfFd;
+    for (int i = 0; i < clientCount; i++) {
+        loadClients[i].fd = openSocket(address, false);
+        loadClients[i].kingdomId = -1;
+        loadClients[i].sent = 0;
+        if (loadClients[i].fd < 0) {
+            cerr << "Error: Could not connect client " << i << " to " << address << endl;
+            close(epollFd);
+            return 1;
+        }
+        clientOfFd[loadClients[i].fd] = i;
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.fd = loadClients[i].fd;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, loadClients[i].fd, &event);
+    }
+
+    LatencyHistogram roundTrips;
+    int finished = 0;
+    long long requests = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    vector<struct epoll_event> events(1024);
+
+    while (finished < clientCount) {
+        int ready = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), 1000);
+        if (ready == 0) {
+            cerr << "Error: Server stopped responding" << endl;
+            break;
+        }
+        for (int e = 0; e < ready; e++) {
+            LoadClient& client = loadClients[clientOfFd[events[e].data.fd]];
+            string request;
+
+            if (events[e].events & EPOLLOUT) {
+                // Connected: send the first request and wait for replies
+                request = "NEW loadgen\n";
+                struct epoll_event event;
+                event.events = EPOLLIN;
+                event.data.fd = client.fd;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &event);
+            }
+            else {
+                char buffer[4096];
+                ssize_t bytes = recv(client.fd, buffer, sizeof(buffer), 0);
+                if (bytes <= 0) {
+                    if (bytes < 0 && errno == EAGAIN) {
+                        continue;
+                    }
+                    cerr << "Error: Server closed a connection" << endl;
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                    finished++;
+                    continue;
+                }
+                client.input.append(buffer, bytes);
+                size_t end = client.input.find('\n');
+                if (end == string::npos) {
+                    continue;
+                }
+                string reply = client.input.substr(0, end);
+                client.input.erase(0, end + 1);
+                roundTrips.record(chrono::duration<double, micro>(chrono::steady_clock::now() - client.sentAt).count());
+                requests++;
+
+                if (client.kingdomId < 0) {
+                    client.kingdomId = atoi(reply.c_str() + 3);
+                }
+                if (client.sent >= requestsPerClient) {
+                    epoll_ctl(epollFd, EPOLL_CTL_DEL, client.fd, nullptr);
+                    close(client.fd);
+                    finished++;
+                    continue;
+                }
+                request = (client.sent % 2 == 0 ? "ADVANCE " : "STATUS ") + to_string(client.kingdomId) + "\n";
+            }
+
+            client.sent++;
+            client.sentAt = chrono::steady_clock::now();
+            send(client.fd, request.data(), request.size(), MSG_NOSIGNAL);
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    close(epollFd);
+
+    cout << "===== Load Generator =====" << endl;
+    cout << "Clients: " << clientCount << ", requests: " << requests << " in " << seconds << " s" << endl;
+    cout << "Throughput: " << static_cast<long long>(requests / seconds) << " requests/sec" << endl;
+    cout << "Round trip p50: " << roundTrips.percentile(0.50) << " us" << endl;
+    cout << "Round trip p99: " << roundTrips.percentile(0.99) << " us" << endl;
+    cout << "Round trip p99.9: " << roundTrips.percentile(0.999) << " us" << endl;
+    cout << "Round trip max: " << roundTrips.getMaximum() << " us" << endl;
+    return finished == clientCount ? 0 : 1;
+}
+
+#else
+
+GameServer::GameServer(const string& address, int workerCount, int maxKingdoms)
+    : address(address), workerCount(workerCount), maxKingdoms(maxKingdoms),
+    listenFd(-1), epollFd(-1), wakeFd(-1), nextClientId(1), running(false), workersStopping(false) {
+}
+
+GameServer::~GameServer() {}
+
+bool GameServer::run() {
+    cout << "Error: Server mode needs Linux (epoll)." << endl;
+    return false;
+}
+
+void GameServer::stop() {
+    running = false;
+}
+
+int GameServer::getKingdomCount() const {
+    return static_cast<int>(kingdoms.size());
+}
+
+int runLoadGenerator(const string& address, int clientCount, int requestsPerClient) {
+    cout << "Error: The load generator needs Linux (epoll)." << endl;
+    return 1;
+}
+
+#endif
+
+string GameServer::latencyReport() const {
+    static const char* names[COMMAND_TYPE_COUNT] = { "NEW", "ADVANCE", "STATUS", "STATS", "DO", "OTHER" };
+    ostringstream report;
+    for (int i = 0; i < COMMAND_TYPE_COUNT; i++) {
+        if (latencies[i].getCount() == 0) {
+            continue;
+        }
+        report << "STAT " << names[i] << " count " << latencies[i].getCount()
+            << " p50 " << latencies[i].percentile(0.50) << "us"
+            << " p90 " << latencies[i].percentile(0.90) << "us"
+            << " p99 " << latencies[i].percentile(0.99) << "us"
+            << " p999 " << latencies[i].percentile(0.999) << "us"
+            << " max " << latencies[i].getMaximum() << "us\n";
+    }
+    return report.str();
+}
+
+bool runScriptFile(const string& filename, Kingdom& kingdom, bool quiet) {
+    ifstream file(filename);
+    if (!file.is_open()) {
+        cout << "Error: Could not open script file " << filename << "!" << endl;
+        return false;
+    }
+
+    // Parse everything first so a typo fails before the game is touched
+    CommandQueue queue;
+    string line;
+    int lineNumber = 0;
+    while (getline(file, line)) {
+        lineNumber++;
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+        Command command;
+        string error;
+        if (!Command::parse(line.substr(start), command, error)) {
+            cout << filename << ":" << lineNumber << ": " << error << endl;
+            return false;
+        }
+        queue.push(command);
+    }
+
+    int commandCount = queue.getCount();
+    vector<CommandQueue::Result> results;
+    results.reserve(commandCount);
+
+    Logger::Level consoleLevel = Logger::getLevel();
+    if (quiet) {
+        Logger::setLevel(Logger::LEVEL_OFF);
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int succeeded = queue.applyAll(kingdom, &results);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    Logger::setLevel(consoleLevel);
+    Logger::flush();
+
+    for (size_t i = 0; i < results.size(); i++) {
+        if (!quiet || !results[i].success) {
+            cout << (results[i].success ? "  ok: " : "  failed: ") << results[i].message << endl;
+        }
+    }
+    cout << "Script finished: " << succeeded << "/" << commandCount << " commands succeeded in "
+        << seconds * 1000.0 << " ms." << endl;
+    cout << "Year " << kingdom.getGameYear() << ", score " << kingdom.getScore()
+        << (kingdom.isGameOver() ? " (kingdom has fallen)" : "") << endl;
+    return succeeded == commandCount;
+}
+
+// -------------------------
+// Utility functions
+// -------------------------
+
+void displayMainMenu() {
+    cout << "\n===== Stronghold: Kingdom Management =====" << endl;
+    cout << "1. Advance Year" << endl;
+    cout << "2. Display Status" << endl;
+    cout << "3. Manage Resources" << endl;
+    cout << "4. Manage Army" << endl;
+    cout << "5. Manage Economy" << endl;
+    cout << "6. Manage Diplomacy" << endl;
+    cout << "7. Manage Bank" << endl;
+    cout << "8. Hold Elections" << endl;
+    cout << "9. Perform Ruler Action" << endl;
+    cout << "10. Trigger Random Event" << endl;
+    cout << "11. Save Game" << endl;
+    cout << "12. Load Game" << endl;
+    cout << "13. Exit" << endl;
+    cout << "Enter choice: ";
+}
+
+// Menus build commands so they share validation and messages with scripts
+static bool runCommand(const Command& command, Kingdom& kingdom) {
+    CommandQueue::Result result = CommandQueue::apply(command, kingdom);
+    Logger::flush();
+    cout << result.message << endl;
+    return result.success;
+}
+
+bool processMenuChoice(int choice, Kingdom& kingdom) {
+    string filename;
+    switch (choice) {
+    case 1:
+        kingdom.advanceYear();
+        pauseScreen();
+        break;
+    case 2:
+        kingdom.displayStatus();
+        pauseScreen();
+        break;
+    case 3:
+        displayResourceManagementMenu(kingdom);
+        break;
+    case 4:
+        displayArmyMenu(kingdom);
+        break;
+    case 5:
+        displayEconomyMenu(kingdom);
+        break;
+    case 6:
+        displayDiplomacyMenu(kingdom);
+        break;
+    case 7:
+        displayBankMenu(kingdom);
+        break;
+    case 8:
+        runCommand(Command::holdElections(), kingdom);
+        pauseScreen();
+        break;
+    case 9:
+        kingdom.getRuler()->specialAction(kingdom);
+        pauseScreen();
+        break;
+    case 10:
+        kingdom.handleEvent(kingdom.getEvents()->generateEvent(kingdom));
+        pauseScreen();
+        break;
+    case 11:
+        cout << "Enter save file name (e.g., savegame.txt): ";
+        getline(cin, filename);
+        if (filename.empty()) {
+            cout << "Error: Filename cannot be empty!" << endl;
+        }
+        else {
+            runCommand(Command::saveGame(filename), kingdom);
+        }
+        pauseScreen();
+        break;
+    case 12:
+        cout << "Enter load file name (e.g., savegame.txt): ";
+        getline(cin, filename);
+        if (filename.empty()) {
+            cout << "Error: Filename cannot be empty!" << endl;
+        }
+        else {
+            runCommand(Command::loadGame(filename), kingdom);
+        }
+        pauseScreen();
+        break;
+    case 13:
+        cout << "Exiting game..." << endl;
+        return false;
+    default:
+        cout << "Invalid choice!" << endl;
+        pauseScreen();
+    }
+    return true;
+}
+
+bool validateIntInput(int& value, const string& prompt, int min, int max) {
+    Logger::flush();
+    cout << prompt;
+    cin >> value;
+    if (cin.fail() || value < min || value > max) {
+        cin.clear();
+        cin.ignore(10000, '\n');
+        cout << "Invalid input! Must be between " << min << " and " << max << "." << endl;
+        return false;
+    }
+    cin.ignore();
+    return true;
+}
+
+bool validateDoubleInput(double& value, const string& prompt, double min, double max) {
+    Logger::flush();
+    cout << prompt;
+    cin >> value;
+    if (cin.fail() || value < min || value > max) {
+        cin.clear();
+        cin.ignore(10000, '\n');
+        cout << "Invalid input! Must be between " << min << " and " << max << "." << endl;
+        return false;
+    }
+    cin.ignore();
+    return true;
+}
+
+bool validateStringInput(string& value, const string& prompt, int minLength, int maxLength) {
+    Logger::flush();
+    cout << prompt;
+    getline(cin, value);
+    if (value.length() < minLength || value.length() > maxLength) {
+        cout << "Invalid input! Length must be between " << minLength << " and " << maxLength << "." << endl;
+        return false;
+    }
+    return true;
+}
+
+void displayResourceManagementMenu(Kingdom& kingdom) {
+    int choice;
+    int amount;
+    string resourceType;
+
+    do {
+        cout << "\n===== Resource Management =====" << endl;
+        cout << "1. Buy Resources" << endl;
+        cout << "2. Sell Resources" << endl;
+        cout << "3. View Market" << endl;
+        cout << "4. Price History" << endl;
+        cout << "5. Back" << endl;
+        cout << "Enter choice: ";
+
+        if (validateIntInput(choice, "", 1, 5)) {
+            switch (choice) {
+            case 1:
                 cout << "Enter resource type (Food/Wood/Stone/Iron): ";
                 getline(cin, resourceType);
                 if (validateIntInput(amount, "Enter amount to buy: ", 1, 1000)) {
-                    if (kingdom.getMarket()->buyResource(resourceType, amount, *kingdom.getEconomy())) {
-                        cout << "Purchased " << amount << " " << resourceType << "!" << endl;
+                    runCommand(Command::buyResource(resourceType, amount), kingdom);
+                }
+                break;
+            case 2:
+                cout << "Enter resource type (Food/Wood/Stone/Iron): ";
+                getline(cin, resourceType);
+                if (validateIntInput(amount, "Enter amount to sell: ", 1, 1000)) {
+                    runCommand(Command::sellResource(resourceType, amount), kingdom);
+                }
+                break;
+            case 3:
+                kingdom.displayStatus();
+                break;
+            case 4: {
+                // Ten-year window over each resource's recorded prices
+                const string resourceNames[4] = { "Food", "Wood", "Stone", "Iron" };
+                cout << "\nPrice History (last 10 years):" << endl;
+                for (int i = 0; i < 4; i++) {
+                    const PriceHistory* history = kingdom.getMarket()->getPriceHistory(resourceNames[i]);
+                    int lastYear = history->getLastYear();
+                    if (lastYear == 0) {
+                        cout << "  No prices recorded yet. Advance a year first." << endl;
+                        break;
                     }
-                    else {
-                        cout << "Failed to buy! Check funds or resource type." << endl;
+                    PriceHistory::Stats stats = history->getStats(lastYear - 9, lastYear);
+                    cout << "  " << resourceNames[i] << ": now " << history->getPrice(lastYear)
+                        << ", avg " << stats.mean << ", min " << stats.minimum << ", max " << stats.maximum
+                        << ", volatility " << static_cast<int>(stats.volatility * 100) << "%" << endl;
+                }
+                break;
+            }
+            case 5:
+                return;
+            }
+        }
+    } while (true);
+}
+
+void displayArmyMenu(Kingdom& kingdom) {
+    int choice;
+
+    do {
+        cout << "\n===== Army Management =====" << endl;
+        cout << "1. Train Army" << endl;
+        cout << "2. Recruit Infantry" << endl;
+        cout << "3. Recruit Cavalry" << endl;
+        cout << "4. Recruit Archers" << endl;
+        cout << "5. Back" << endl;
+        cout << "Enter choice: ";
+
+        if (validateIntInput(choice, "", 1, 5)) {
+            switch (choice) {
+            case 1:
+                // Training takes time
+                cout << "Training army units... ";
+                for (int i = 0; i < 3; i++) {
+                    cout << "." << flush;
+                    crossPlatformSleep(1);
+                }
+                cout << " Complete!" << endl;
+                runCommand(Command::trainArmy(), kingdom);
+                break;
+            case 2:
+                int infantry;
+                if (validateIntInput(infantry, "Enter number of infantry to recruit: ", 1, 100)) {
+                    runCommand(Command::recruit("infantry", infantry), kingdom);
+                }
+                break;
+            case 3:
+                int cavalry;
+                if (validateIntInput(cavalry, "Enter number of cavalry to recruit: ", 1, 50)) {
+                    runCommand(Command::recruit("cavalry", cavalry), kingdom);
+                }
+                break;
+            case 4:
+                int archers;
+                if (validateIntInput(archers, "Enter number of archers to recruit: ", 1, 50)) {
+                    runCommand(Command::recruit("archers", archers), kingdom);
+                }
+                break;
+            case 5:
+                return;
+            }
+        }
+    } while (true);
+}
+
+void displayEconomyMenu(Kingdom& kingdom) {
+    int choice;
+    double rate;
+    Economy& economy = *kingdom.getEconomy();
+
+    do {
+        cout << "\n===== Economy Management =====" << endl;
+        cout << "1. Adjust Peasant Tax Rate" << endl;
+        cout << "2. Adjust Merchant Tax Rate" << endl;
+        cout << "3. Adjust Noble Tax Rate" << endl;
+        cout << "4. Back" << endl;
+        cout << "Enter choice: ";
+
+        if (validateIntInput(choice, "", 1, 4)) {
+            switch (choice) {
+            case 1:
+                if (validateDoubleInput(rate, "Enter new peasant tax rate (0.0-0.5): ", 0.0, 0.5)) {
+                    runCommand(Command::setTaxRates(rate, economy.getMerchantTaxRate(), economy.getNobleTaxRate()), kingdom);
+                }
+                break;
+            case 2:
+                if (validateDoubleInput(rate, "Enter new merchant tax rate (0.0-0.5): ", 0.0, 0.5)) {
+                    runCommand(Command::setTaxRates(economy.getPeasantTaxRate(), rate, economy.getNobleTaxRate()), kingdom);
+                }
+                break;
+            case 3:
+                if (validateDoubleInput(rate, "Enter new noble tax rate (0.0-0.5): ", 0.0, 0.5)) {
+                    runCommand(Command::setTaxRates(economy.getPeasantTaxRate(), economy.getMerchantTaxRate(), rate), kingdom);
+                }
+                break;
+            case 4:
+                return;
+            }
+        }
+    } while (true);
+}
+
+void displayDiplomacyMenu(Kingdom& kingdom) {
+    int choice;
+    string kingdomName;
+
+    do {
+        cout << "\n===== Diplomacy Management =====" << endl;
+        cout << "1. List Foreign Kingdoms" << endl;
+        cout << "2. Improve Relations" << endl;
+        cout << "3. Declare War" << endl;
+        cout << "4. Sign Peace Treaty" << endl;
+        cout << "5. Form Alliance" << endl;
+        cout << "6. Establish Trade" << endl;
+        cout << "7. Engage in Battle" << endl;
+        cout << "8. Back" << endl;
+        cout << "Enter choice: ";
+
+        if (validateIntInput(choice, "", 1, 8)) {
+            switch (choice) {
+            case 1:
+                kingdom.getDiplomacy()->listKingdoms();
+                pauseScreen();
+                break;
+            case 2:
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name: ";
+                getline(cin, kingdomName);
+                runCommand(Command::improveRelations(kingdomName), kingdom);
+                pauseScreen();
+                break;
+            case 3:
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name to declare war on: ";
+                getline(cin, kingdomName);
+                runCommand(Command::declareWar(kingdomName), kingdom);
+                pauseScreen();
+                break;
+            case 4:
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name to sign peace with: ";
+                getline(cin, kingdomName);
+                runCommand(Command::signPeace(kingdomName), kingdom);
+                pauseScreen();
+                break;
+            case 5:
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name to form alliance with: ";
+                getline(cin, kingdomName);
+                runCommand(Command::formAlliance(kingdomName), kingdom);
+                pauseScreen();
+                break;
+            case 6:
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name to establish trade with: ";
+                getline(cin, kingdomName);
+                runCommand(Command::establishTrade(kingdomName), kingdom);
+                pauseScreen();
+                break;
+            case 7: {
+                kingdom.getDiplomacy()->listKingdoms();
+                cout << "Enter kingdom name to battle: ";
+                getline(cin, kingdomName);
+                bool atWar = false;
+                StringTable::Handle target = StringTable::find(kingdomName);
+                for (int i = 0; i < kingdom.getDiplomacy()->getKingdomCount(); i++) {
+                    if (kingdom.getDiplomacy()->getForeignKingdoms()[i].nameHandle == target &&
+                        kingdom.getDiplomacy()->getForeignKingdoms()[i].atWar) {
+                        atWar = true;
+                        int enemyStrength = kingdom.getDiplomacy()->getForeignKingdoms()[i].strength;
+                        cout << "\nBattle against " << kingdomName << " begins!" << endl;
+
+                        BattleEngine battle;
+                        BattleEngine::Force playerForce = forceFromArmy(*kingdom.getArmy(), 1);
+                        battle.addBattle(playerForce, BattleEngine::forceFromStrength(enemyStrength));
+                        battle.resolveAll();
+                        BattleEngine::Result result = battle.getResult(0);
+
+                        int casualties = kingdom.getArmy()->getTotal() -
+                            (result.attacker.infantry + result.attacker.cavalry + result.attacker.archers);
+                        kingdom.getArmy()->setInfantry(result.attacker.infantry);
+                        kingdom.getArmy()->setCavalry(result.attacker.cavalry);
+                        kingdom.getArmy()->setArchers(result.attacker.archers);
+                        kingdom.getDiplomacy()->getForeignKingdomsMutable()[i].strength =
+                            max(100, BattleEngine::calculateStrength(result.defender));
+
+                        if (result.attackerWon) {
+                            cout << "Victory! Your forces crush the enemy after " << result.rounds << " rounds!" << endl;
+                            kingdom.getArmy()->setMorale(result.attacker.morale + 0.1);
+                        }
+                        else {
+                            cout << "Defeat! Your army suffers heavy losses!" << endl;
+                            kingdom.getArmy()->setMorale(result.attacker.morale);
+                        }
+                        cout << "Casualties: " << casualties << " troops." << endl;
+                        break;
                     }
                 }
+                if (!atWar) {
+                    cout << "Cannot battle! Not at war with " << kingdomName << " or invalid kingdom." << endl;
+                }
+                pauseScreen();
+                break;
+            }
+            case 8:
+                return;
+            }
+        }
+    } while (true);
+}
+
+void displayBankMenu(Kingdom& kingdom) {
+    int choice;
+    int amount;
+
+    do {
+        cout << "\n===== Bank Management =====" << endl;
+        cout << "1. Take Loan" << endl;
+        cout << "2. Repay Loan" << endl;
+        cout << "3. View Bank Status" << endl;
+        cout << "4. Back" << endl;
+        cout << "Enter choice: ";
+
+        if (validateIntInput(choice, "", 1, 4)) {
+            switch (choice) {
+            case 1:
+                if (validateIntInput(amount, "Enter loan amount: ", 1, kingdom.getBank()->getMaxLoanAmount())) {
+                    runCommand(Command::takeLoan(amount), kingdom);
+                }
                 break;
             case 2:
-                cout << "Enter resource type (Food/Wood/Stone/Iron): ";
-                getline(cin, resourceType);
-                if (validateIntInput(amount, "Enter amount to sell: ", 1, 1000)) {
-                    if (kingdom.getMarket()->sellResource(resourceType, amount, *kingdom.getEconomy())) {
-                        cout << "Sold " << amount << " " << resourceType << "!" << endl;
-                    }
-                    else {
-                        cout << "Failed to sell! Check stock or resource type." << endl;
-                    }
+                if (validateIntInput(amount, "Enter amount to repay: ", 1, kingdom.getEconomy()->getDebt())) {
+                    runCommand(Command::repayLoan(amount), kingdom);
                 }
                 break;
             case 3:
-                kingdom.displayStatus();
+                cout << "\nBank Status:" << endl;
+                cout << "  Interest Rate: " << kingdom.getBank()->getInterestRate() * 100 << "%" << endl;
+                cout << "  Current Loans: " << kingdom.getBank()->getCurrentLoans() << " gold in "
+                    << kingdom.getBank()->getLedger().getLoanCount() << " loans" << endl;
+                cout << "  Yearly Installments: " << static_cast<int>(kingdom.getBank()->getLedger().getScheduledPayments())
+                    << " gold over " << kingdom.getBank()->getLoanTerm() << "-year terms" << endl;
+                cout << "  Corruption Level: " << kingdom.getBank()->getCorruptionLevel() << endl;
                 break;
             case 4:
                 return;
@@ -1926,268 +11008,1934 @@ void displayResourceManagementMenu(Kingdom& kingdom) {
     } while (true);
 }
 
-void displayArmyMenu(Kingdom& kingdom) {
-    int choice;
+void clearScreen() {
+    // Escape sequences instead of spawning a shell for cls
+    Logger::flush();
+    enableAnsiTerminal();
+    cout << "\x1b[2J\x1b[H" << flush;
+}
 
-    do {
-        cout << "\n===== Army Management =====" << endl;
-        cout << "1. Train Army" << endl;
-        cout << "2. Recruit Infantry" << endl;
-        cout << "3. Recruit Cavalry" << endl;
-        cout << "4. Recruit Archers" << endl;
-        cout << "5. Back" << endl;
-        cout << "Enter choice: ";
+void pauseScreen() {
+    Logger::flush();
+    cout << "\nPress Enter to continue...";
+    cin.ignore(10000, '\n');
+}
+
+void runDashboard(Kingdom& kingdom, int years, int yearsPerSecond) {
+    typedef chrono::steady_clock Clock;
+    const Clock::duration frameInterval = chrono::milliseconds(16);
+    const Clock::duration yearInterval = yearsPerSecond > 0 ?
+        Clock::duration(chrono::seconds(1)) / yearsPerSecond : Clock::duration::zero();
+
+    enableAnsiTerminal();
+    ScreenBuffer screen(80, 24);
+    // Year narration would scroll the dashboard away
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    fputs("\x1b[?25l", stdout);
+
+    int yearsRun = 0;
+    int frames = 0;
+    long long bytesWritten = 0;
+    double renderSeconds = 0.0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point nextYear = start;
+    Clock::time_point nextFrame = start;
+
+    while (true) {
+        bool finished = yearsRun >= years || kingdom.isGameOver();
+        Clock::time_point now = Clock::now();
+        if (!finished && now >= nextYear) {
+            kingdom.advanceYear();
+            yearsRun++;
+            nextYear += yearInterval;
+        }
+
+        if (finished || now >= nextFrame) {
+            Clock::time_point renderStart = Clock::now();
+            vector<string> lines = kingdom.getStatusLines();
+            screen.clear();
+            screen.writeText(0, 0, lines[0]);
+
+            // Two columns: the sections before the middle blank line, then the rest
+            size_t split = lines.size();
+            for (size_t i = lines.size() / 2; i < lines.size(); i++) {
+                if (lines[i].empty()) {
+                    split = i;
+                    break;
+                }
+            }
+            for (size_t i = 1; i < split; i++) {
+                screen.writeText(static_cast<int>(i) + 1, 0, lines[i]);
+            }
+            for (size_t i = split + 1; i < lines.size(); i++) {
+                screen.writeText(static_cast<int>(i - split) + 1, 40, lines[i]);
+            }
+
+            double elapsed = chrono::duration<double>(now - start).count();
+            ostringstream footer;
+            footer << "Years run: " << yearsRun << "/" << years << "  |  "
+                << static_cast<int>(elapsed > 0.1 ? yearsRun / elapsed : 0.0) << " years/s  |  frame " << frames;
+            screen.writeText(screen.getHeight() - 2, 0, footer.str());
+            if (kingdom.isGameOver()) {
+                screen.writeText(screen.getHeight() - 1, 0, "GAME OVER - your kingdom has fallen!");
+            }
+
+            bytesWritten += screen.present();
+            frames++;
+            renderSeconds += chrono::duration<double>(Clock::now() - renderStart).count();
+            nextFrame = now + frameInterval;
+        }
+
+        if (finished) {
+            break;
+        }
+        if (yearsPerSecond > 0) {
+            this_thread::sleep_until(nextYear < nextFrame ? nextYear : nextFrame);
+        }
+    }
+
+    fputs("\x1b[?25h", stdout);
+    fflush(stdout);
+    Logger::setLevel(consoleLevel);
+
+    double seconds = chrono::duration<double>(Clock::now() - start).count();
+    cout << "Dashboard ran " << yearsRun << " years in " << seconds << " s: " << frames << " frames ("
+        << static_cast<int>(frames / seconds) << " fps), " << (frames ? bytesWritten / frames : 0)
+        << " bytes per frame, rendering took " << renderSeconds * 100.0 / seconds << "% of the run." << endl;
+}
+
+// -------------------------
+// Benchmarks
+// -------------------------
+
+// Percentile of an already sorted sample
+static double percentile(const vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0.0;
+    }
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+    return sorted[index];
+}
+
+void runArchiveBenchmark(int kingdomCount, int years) {
+    cout << "===== Archive Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    vector<unique_ptr<Kingdom>> kingdoms;
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        kingdoms[i]->setRandomKey(12345, static_cast<uint32_t>(i));
+        // Elections found the houses and crown any kind of ruler; wars and loans fill the rest
+        if (i % 2 == 0) {
+            kingdoms[i]->holdElections();
+        }
+        if (i % 4 == 1) {
+            Diplomacy* diplomacy = kingdoms[i]->getDiplomacy();
+            diplomacy->declareWar(StringTable::lookup(diplomacy->getForeignKingdoms()[0].nameHandle), *kingdoms[i]->getArmy());
+        }
+        if (i % 3 == 0) {
+            kingdoms[i]->getBank()->takeLoan(300, *kingdoms[i]->getEconomy());
+        }
+    }
+
+    // Year-major order, as a batch run produces them
+    const string filename = "kingdoms.archive";
+    KingdomArchiveWriter writer;
+    if (!writer.open(filename)) {
+        Logger::setLevel(consoleLevel);
+        return;
+    }
+    // Every year of a few kingdoms is kept to check the whole state against
+    const int checkEvery = max(1, kingdomCount / 20);
+    vector<KingdomSnapshot> checked;
+    vector<uint32_t> checkedIds;
+    uint64_t textBytes = 0;
+    uint64_t packedBytes = 0;
+    uint64_t packedTailBytes = 0;
+    vector<unsigned char> tail;
+    double captureSeconds = 0.0;
+    for (int year = 0; year < years; year++) {
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms[i]->advanceYear();
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            KingdomSnapshot snapshot;
+            kingdoms[i]->captureSnapshot(snapshot);
+            writer.add(static_cast<uint32_t>(i), snapshot);
+            captureSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            textBytes += snapshot.serialize().size();
+            KingdomArchiveWriter::packTail(snapshot, tail);
+            packedBytes += KingdomArchiveWriter::RECORD_SIZE + tail.size();
+            packedTailBytes += tail.size();
+            if (i % checkEvery == 0) {
+                checked.push_back(snapshot);
+                checkedIds.push_back(static_cast<uint32_t>(i));
+            }
+        }
+    }
+    bool closed = writer.close();
+    Logger::setLevel(consoleLevel);
+    if (!closed) {
+        return;
+    }
+
+    int snapshots = writer.getSnapshotCount();
+    cout << "Write:" << endl;
+    cout << "  Snapshots: " << snapshots << " in " << captureSeconds * 1000.0 << " ms" << endl;
+    cout << "  Archive size: " << writer.getBytesWritten() << " bytes ("
+        << static_cast<double>(writer.getBytesWritten()) / snapshots << " bytes per snapshot)" << endl;
+    cout << "  Of which relations, loans and dynasties: " << writer.getTailBytesWritten() << " bytes ("
+        << static_cast<double>(writer.getTailBytesWritten()) / snapshots << " bytes per snapshot, "
+        << static_cast<double>(packedTailBytes) / snapshots << " packed)" << endl;
+    cout << "  Whole archive: " << static_cast<double>(packedBytes) / writer.getBytesWritten()
+        << "x smaller than the packed records and tails (" << packedBytes << " bytes)" << endl;
+    // Text saves drop the rulers, relations, loans and dynasties, so they are not like for like
+    cout << "  Text saves would take: " << textBytes << " bytes in " << snapshots << " files (fixed fields only)" << endl;
+
+    KingdomArchiveReader reader;
+    if (!reader.open(filename)) {
+        return;
+    }
+
+    // The kept years must come back whole, and restore into a kingdom that captures the same
+    Logger::setLevel(Logger::LEVEL_OFF);
+    Kingdom scratch("Scratch");
+    int mismatches = 0;
+    int restoreMismatches = 0;
+    for (size_t i = 0; i < checked.size(); i++) {
+        KingdomSnapshot loaded;
+        if (!reader.load(checkedIds[i], checked[i].gameYear, loaded) || !loaded.matches(checked[i])) {
+            mismatches++;
+            continue;
+        }
+        KingdomSnapshot restored;
+        scratch.restoreSnapshot(loaded);
+        scratch.captureSnapshot(restored);
+        restoreMismatches += restored.matches(checked[i]) ? 0 : 1;
+    }
+    Logger::setLevel(consoleLevel);
+    cout << "Whole-state check:" << endl;
+    cout << "  Snapshots: " << checked.size() << " from " << (kingdomCount + checkEvery - 1) / checkEvery
+        << " kingdoms, loaded differently: " << mismatches << ", restoring differently: " << restoreMismatches << endl;
+
+    const int lookups = 100000;
+    int failures = 0;
+    vector<double> latencies;
+    latencies.reserve(lookups);
+    for (int i = 0; i < lookups; i++) {
+        uint32_t kingdomId = static_cast<uint32_t>(rand() % kingdomCount);
+        int year = 2 + rand() % years;
+        KingdomSnapshot loaded;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        bool found = reader.load(kingdomId, year, loaded);
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+        if (!found) {
+            failures++;
+        }
+    }
+    sort(latencies.begin(), latencies.end());
+    cout << "Random loads:" << endl;
+    cout << "  Lookups: " << lookups << ", failures: " << failures << endl;
+    cout << "  Latency p50: " << percentile(latencies, 0.50) << " ns" << endl;
+    cout << "  Latency p99: " << percentile(latencies, 0.99) << " ns" << endl;
+    remove(filename.c_str());
+}
+
+void runHistoryBenchmark(int kingdomCount, int years) {
+    cout << "===== History Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    // Play the kingdoms with history on, keeping every year's state to check against
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    vector<unique_ptr<Kingdom>> kingdoms;
+    vector<vector<KingdomSnapshot>> timelines(kingdomCount);
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        kingdoms[i]->setRandomKey(12345, static_cast<uint32_t>(i));
+        // Elections found the houses and crown any kind of ruler; wars and loans fill the rest
+        if (i % 2 == 0) {
+            kingdoms[i]->holdElections();
+        }
+        if (i % 4 == 1) {
+            Diplomacy* diplomacy = kingdoms[i]->getDiplomacy();
+            diplomacy->declareWar(StringTable::lookup(diplomacy->getForeignKingdoms()[0].nameHandle), *kingdoms[i]->getArmy());
+        }
+        if (i % 3 == 0) {
+            kingdoms[i]->getBank()->takeLoan(300, *kingdoms[i]->getEconomy());
+        }
+        kingdoms[i]->enableHistory();
+        timelines[i].resize(years + 1);
+        kingdoms[i]->captureSnapshot(timelines[i][0]);
+    }
+    for (int year = 1; year <= years; year++) {
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms[i]->advanceYear();
+            kingdoms[i]->captureSnapshot(timelines[i][year]);
+        }
+    }
+    Logger::setLevel(consoleLevel);
+
+    // Recording cost, replaying the same timelines into fresh recorders
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < kingdomCount; i++) {
+        HistoryRecorder recorder;
+        for (int year = 0; year <= years; year++) {
+            recorder.record(timelines[i][year]);
+        }
+    }
+    double recordSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // What keeping every year whole would cost: the packed record and its tail
+    size_t fullBytes = 0;
+    size_t dynastyBytes = 0;
+    vector<unsigned char> tail;
+    for (int i = 0; i < kingdomCount; i++) {
+        for (int year = 0; year <= years; year++) {
+            KingdomArchiveWriter::packTail(timelines[i][year], tail);
+            fullBytes += KingdomArchiveWriter::RECORD_SIZE + tail.size();
+            dynastyBytes += timelines[i][year].dynasty.size();
+        }
+    }
+
+    size_t bytes = 0;
+    int recorded = 0;
+    int mismatches = 0;
+    KingdomSnapshot snapshot;
+    for (int i = 0; i < kingdomCount; i++) {
+        const HistoryRecorder* history = kingdoms[i]->getHistory();
+        bytes += history->getMemoryUsage();
+        recorded += history->getYearCount();
+        for (int year = 0; year <= years; year++) {
+            if (!history->seek(timelines[i][year].gameYear, snapshot) || !snapshot.matches(timelines[i][year])) {
+                mismatches++;
+            }
+        }
+    }
+
+    // A seeked year restored into another kingdom must capture the same, and play the
+    // next year the way the original did
+    Logger::setLevel(Logger::LEVEL_OFF);
+    Kingdom scratch("Scratch");
+    KingdomSnapshot restored;
+    int roundTripMismatches = 0;
+    int nextYearMismatches = 0;
+    int rulers[3] = { 0, 0, 0 };
+    int withHouses = 0;
+    for (int i = 0; i < kingdomCount; i++) {
+        for (int year = 0; year < years; year++) {
+            kingdoms[i]->getHistory()->seek(timelines[i][year].gameYear, snapshot);
+            scratch.restoreSnapshot(snapshot);
+            scratch.captureSnapshot(restored);
+            roundTripMismatches += restored.matches(snapshot) ? 0 : 1;
+            scratch.advanceYear();
+            scratch.captureSnapshot(restored);
+            nextYearMismatches += restored.matches(timelines[i][year + 1]) ? 0 : 1;
+        }
+        rulers[max(0, min(2, timelines[i][years].rulerType))]++;
+        withHouses += timelines[i][years].dynasty.empty() ? 0 : 1;
+    }
+    Logger::setLevel(consoleLevel);
+
+    const int seeks = 100000;
+    vector<double> latencies;
+    latencies.reserve(seeks);
+    for (int i = 0; i < seeks; i++) {
+        const HistoryRecorder* history = kingdoms[rand() % kingdomCount]->getHistory();
+        int year = 1 + rand() % (years + 1);
+        start = chrono::steady_clock::now();
+        history->seek(year, snapshot);
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+    }
+    sort(latencies.begin(), latencies.end());
+
+    cout << "  Kingdom-years recorded: " << recorded << ", mismatches: " << mismatches << endl;
+    cout << "  Restored years capturing differently: " << roundTripMismatches << ", playing the next year differently: "
+        << nextYearMismatches << endl;
+    cout << "  Final rulers: " << rulers[KingdomSnapshot::RULER_KING] << " kings, " << rulers[KingdomSnapshot::RULER_COMMANDER]
+        << " commanders, " << rulers[KingdomSnapshot::RULER_GUILD_LEADER] << " guild leaders; " << withHouses
+        << " kingdoms with noble houses" << endl;
+    cout << "  Memory: " << static_cast<double>(bytes) / recorded << " bytes per kingdom-year; a full snapshot is "
+        << static_cast<double>(fullBytes) / recorded << " (" << static_cast<double>(dynastyBytes) / recorded
+        << " of them the dynasty), a text save of the fixed fields alone " << timelines[0][years].serialize().size() << endl;
+    cout << "  Record: " << recordSeconds * 1e9 / recorded << " ns per year" << endl;
+    cout << "  Seek p50: " << percentile(latencies, 0.50) << " ns, p99: " << percentile(latencies, 0.99) << " ns" << endl;
+}
+
+// Brute-force range stats over the full series, to check PriceHistory against
+static PriceHistory::Stats exactPriceStats(const vector<double>& prices, int firstYear, int fromYear, int toYear) {
+    PriceHistory::Stats stats = { 0, 0.0, 0.0, 0.0, 0.0 };
+    double sum = 0.0;
+    double returnSum = 0.0;
+    double returnSquares = 0.0;
+    int returns = 0;
+    for (int year = max(fromYear, firstYear); year <= toYear && year - firstYear < static_cast<int>(prices.size()); year++) {
+        double price = prices[year - firstYear];
+        stats.minimum = stats.count == 0 ? price : min(stats.minimum, price);
+        stats.maximum = stats.count == 0 ? price : max(stats.maximum, price);
+        stats.count++;
+        sum += price;
+        if (year > firstYear) {
+            double r = log(price / prices[year - firstYear - 1]);
+            returnSum += r;
+            returnSquares += r * r;
+            returns++;
+        }
+    }
+    if (stats.count > 0) {
+        stats.mean = sum / stats.count;
+    }
+    if (returns > 1) {
+        double meanReturn = returnSum / returns;
+        stats.volatility = sqrt(max(0.0, returnSquares / returns - meanReturn * meanReturn));
+    }
+    return stats;
+}
+
+void runPriceHistoryBenchmark(int years, int queries) {
+    cout << "===== Price History Benchmark =====" << endl;
+    cout << "Years: " << years << ", queries: " << queries << endl;
+    years = max(1, years);
+    queries = max(1, queries);
+
+    // Swings of up to 10% around a base price, as updatePrices makes them, kept in full
+    // to check against
+    srand(12345);
+    const int firstYear = 1;
+    vector<double> prices(years);
+    for (int i = 0; i < years; i++) {
+        prices[i] = floor(10.0 * (0.9 + (rand() % 201) / 1000.0) * 100.0) / 100.0;
+    }
+
+    PriceHistory history;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < years; i++) {
+        history.record(firstYear + i, prices[i]);
+    }
+    double recordSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // Recent ranges lie in the detailed horizon and must be exact. Old ranges start and end
+    // inside coarsened blocks, and must still count only their own years
+    const int detailedHorizon = 2000;
+    int lastYear = firstYear + years - 1;
+    int recentMismatches = 0;
+    int countMismatches = 0;
+    double worstOldMeanError = 0.0;
+    double querySeconds = 0.0;
+    for (int q = 0; q < queries; q++) {
+        bool recent = q % 2 == 0 || years <= detailedHorizon;
+        int low = recent ? max(firstYear, lastYear - detailedHorizon + 1) : firstYear;
+        int high = recent ? lastYear : lastYear - detailedHorizon;
+        int from = low + rand() % (high - low + 1);
+        int to = min(high, from + rand() % 5000);
+
+        start = chrono::steady_clock::now();
+        PriceHistory::Stats stats = history.getStats(from, to);
+        querySeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        PriceHistory::Stats exact = exactPriceStats(prices, firstYear, from, to);
+
+        countMismatches += stats.count != exact.count ? 1 : 0;
+        if (recent) {
+            bool same = stats.count == exact.count && stats.minimum == exact.minimum && stats.maximum == exact.maximum &&
+                fabs(stats.mean - exact.mean) < 1e-9 * exact.mean && fabs(stats.volatility - exact.volatility) < 1e-9;
+            recentMismatches += same ? 0 : 1;
+        }
+        else {
+            worstOldMeanError = max(worstOldMeanError, fabs(stats.mean - exact.mean) / exact.mean);
+        }
+    }
+
+    cout << "  Record: " << recordSeconds * 1e9 / years << " ns per year" << endl;
+    cout << "  Memory: " << history.getMemoryUsage() << " bytes (" << years * sizeof(double) << " as raw doubles)" << endl;
+    cout << "  Query: " << querySeconds * 1e9 / queries << " ns per range" << endl;
+    cout << "  Ranges counting years outside them: " << countMismatches << endl;
+    cout << "  Recent ranges differing from the exact stats: " << recentMismatches << endl;
+    cout << "  Worst mean error on coarsened ranges: " << worstOldMeanError * 100.0 << "%" << endl;
+}
+
+void runEventBenchmark(int kingdomCount, int eventCount) {
+    cout << "===== Event Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", modded events: " << eventCount << endl;
+
+    // Generated events in the shape a mod would write: conditions, a weight and a few effects
+    ostringstream text;
+    for (int i = 0; i < eventCount; i++) {
+        text << "event MODDED " << i << "\n"
+            << "    when population > " << (i % 50) * 10 << " and happiness < " << 0.5 + (i % 5) * 0.1 << "\n"
+            << "    weight 1 + " << (i % 7) << " * (1 - happiness)\n"
+            << "    say Modded event " << i << " strikes!\n"
+            << "    let loss = int(population / " << 20 + i % 30 << ")\n"
+            << "    peasants -= loss\n"
+            << "    if food > " << 100 * (i % 9) << "\n"
+            << "        food -= int(food / 10)\n"
+            << "        happiness += 0.05\n"
+            << "    else\n"
+            << "        treasury -= min(treasury, " << 10 + i % 90 << ")\n"
+            << "    end\n"
+            << "    morale = max(0.1, morale - 0.01 * " << i % 4 << ")\n";
+    }
+    EventLibrary library;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (!library.loadText(text.str(), "generated events")) {
+        return;
+    }
+    double compileSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "  Compiled " << library.getEventCount() << " events in " << compileSeconds * 1000.0 << " ms ("
+        << library.getCodeSize() << " bytes of code)" << endl;
+
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    srand(12345);
+    vector<unique_ptr<Kingdom>> kingdoms;
+    vector<Kingdom*> pointers;
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        pointers.push_back(kingdoms[i].get());
+
+        // Spread the kingdoms over many states so the weights differ
+        kingdoms[i]->getPopulation()->setPeasants(rand() % 20000);
+        kingdoms[i]->getPopulation()->setHappiness(rand() / static_cast<double>(RAND_MAX));
+        kingdoms[i]->getArmy()->setInfantry(rand() % 2000);
+        kingdoms[i]->getArmy()->setMorale(rand() / static_cast<double>(RAND_MAX));
+        kingdoms[i]->getArmy()->setWarStatus(rand() % 4 == 0);
+        kingdoms[i]->getEconomy()->setTreasuryGold(rand() % 5000);
+        kingdoms[i]->getMarket()->getFood()->setAmount(rand() % 40000);
+        kingdoms[i]->getMarket()->getWood()->setAmount(rand() % 4000);
+    }
+
+    // Exact choice runs every event's weight program against the kingdom
+    start = chrono::steady_clock::now();
+    int chosen = 0;
+    for (int i = 0; i < kingdomCount; i++) {
+        chosen += library.chooseEvent(*kingdoms[i]) >= 0 ? 1 : 0;
+    }
+    double chooseSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The sampler pays for a bucket's table once, then draws in O(1)
+    EventSampler sampler(library);
+    vector<int> draws(kingdomCount);
+    double sampleSeconds[2];
+    for (int pass = 0; pass < 2; pass++) {
+        start = chrono::steady_clock::now();
+        sampler.sample(pointers.data(), kingdomCount, draws.data());
+        sampleSeconds[pass] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // How far the bucketed chances are from the exact ones (total variation distance)
+    int checked = min(kingdomCount, 200);
+    double distance = 0.0;
+    for (int i = 0; i < checked; i++) {
+        vector<double> weights(library.getEventCount());
+        double total = 0.0;
+        for (int event = 0; event < library.getEventCount(); event++) {
+            weights[event] = library.getWeight(event, *kingdoms[i]);
+            total += weights[event];
+        }
+        for (int event = 0; event < library.getEventCount(); event++) {
+            double exact = total > 0.0 ? weights[event] / total : 0.0;
+            distance += 0.5 * fabs(exact - sampler.getProbability(*kingdoms[i], event)) / checked;
+        }
+    }
+
+    // Applying runs one effect program over every kingdom, event by event
+    start = chrono::steady_clock::now();
+    for (int event = 0; event < library.getEventCount(); event++) {
+        library.apply(event, pointers.data(), kingdomCount);
+    }
+    double applySeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // World years at engine speed draw and sample events exactly as play does
+    const int worldYears = 5;
+    EventSampler& worldSampler = EventSampler::forThisThread();
+    uint64_t lookupsBefore = worldSampler.getHits() + worldSampler.getMisses();
+    long long fired = 0;
+    start = chrono::steady_clock::now();
+    for (int y = 0; y < worldYears; y++) {
+        int year = kingdoms[0]->getGameYear();
+        Kingdom::advanceYearTogether(pointers);
+        for (int i = 0; i < kingdomCount; i++) {
+            fired += kingdoms[i]->getEvents()->getLastEventYear() == year ? 1 : 0;
+        }
+    }
+    double worldSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    uint64_t worldLookups = worldSampler.getHits() + worldSampler.getMisses() - lookupsBefore;
+    Logger::setLevel(consoleLevel);
+
+    cout << "  Exact choice: " << chooseSeconds * 1e9 / kingdomCount << " ns per kingdom over "
+        << library.getEventCount() << " events (" << chosen << " kingdoms had one)" << endl;
+    cout << "  Alias sampling: " << sampleSeconds[0] * 1e9 / kingdomCount << " ns per draw cold, "
+        << sampleSeconds[1] * 1e9 / kingdomCount << " ns warm (" << sampler.getGroupCount()
+        << " hazard groups, " << sampler.getTableCount() << " tables)" << endl;
+    cout << "  Bucketed chances differ from exact by " << distance * 100.0 << "% on average" << endl;
+    cout << "  Apply: " << applySeconds * 1e9 / (static_cast<double>(kingdomCount) * library.getEventCount())
+        << " ns per event per kingdom" << endl;
+    cout << "  World years: " << fired << " events in " << static_cast<long long>(kingdomCount) * worldYears
+        << " kingdom-years (" << fired * 100.0 / (static_cast<double>(kingdomCount) * worldYears)
+        << "%), " << worldLookups << " alias table lookups, " << worldSeconds * 1000.0 / worldYears << " ms per year" << endl;
+}
+
+void runRngBenchmark(int kingdomCount, int years) {
+    cout << "===== Counter RNG Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    // Known answers from the Philox4x32-10 reference implementation
+    const uint32_t counters[3][4] = {
+        { 0u, 0u, 0u, 0u },
+        { 0xffffffffu, 0xffffffffu, 0xffffffffu, 0xffffffffu },
+        { 0x243f6a88u, 0x85a308d3u, 0x13198a2eu, 0x03707344u }
+    };
+    const uint32_t keys[3][2] = { { 0u, 0u }, { 0xffffffffu, 0xffffffffu }, { 0xa4093822u, 0x299f31d0u } };
+    const uint32_t expected[3][4] = {
+        { 0x6627e8d5u, 0xe169c58du, 0xbc57ac4cu, 0x9b00dbd8u },
+        { 0x408f276du, 0x41c83b0eu, 0xa20bc7c6u, 0x6d5451fdu },
+        { 0xd16cfe09u, 0x94fdccebu, 0x5001e420u, 0x24126ea1u }
+    };
+    bool known = true;
+    for (int i = 0; i < 3; i++) {
+        uint32_t output[4];
+        CounterRng::philox(counters[i], keys[i], output);
+        known = known && memcmp(output, expected[i], sizeof(output)) == 0;
+    }
+    cout << "  Reference vectors: " << (known ? "match" : "MISMATCH") << endl;
+
+    // One block of draws per kingdom per year, produced three ways
+    const uint64_t seed = 0x5eed5eed1234ull;
+    const size_t values = static_cast<size_t>(kingdomCount) * CounterRng::BLOCK_WORDS;
+    vector<double> scalar(values), batch(values), normals(values);
+    srand(12345);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int year = 0; year < years; year++) {
+        for (size_t i = 0; i < values; i++) {
+            scalar[i] = rand() / (RAND_MAX + 1.0);
+        }
+    }
+    double randSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int year = 0; year < years; year++) {
+        for (int k = 0; k < kingdomCount; k++) {
+            CounterRng rng(seed, static_cast<uint32_t>(k), static_cast<uint32_t>(year), CounterRng::STREAM_PRICES);
+            for (int lane = 0; lane < CounterRng::BLOCK_WORDS; lane++) {
+                scalar[lane * kingdomCount + k] = rng.uniform();
+            }
+        }
+    }
+    double scalarSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int year = 0; year < years; year++) {
+        CounterRng::uniformAcross(seed, 0, kingdomCount, static_cast<uint32_t>(year), CounterRng::STREAM_PRICES, 0,
+            batch.data());
+    }
+    double batchSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    start = chrono::steady_clock::now();
+    for (int year = 0; year < years; year++) {
+        CounterRng::normalAcross(seed, 0, kingdomCount, static_cast<uint32_t>(year), CounterRng::STREAM_PRICES, 0,
+            normals.data());
+    }
+    double normalSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The batched lanes are the scalar draws, just laid out for kernels over kingdoms
+    size_t mismatches = 0;
+    for (size_t i = 0; i < values; i++) {
+        mismatches += scalar[i] != batch[i] ? 1 : 0;
+    }
+    double mean = 0.0, variance = 0.0;
+    for (size_t i = 0; i < values; i++) {
+        mean += normals[i] / values;
+    }
+    for (size_t i = 0; i < values; i++) {
+        variance += (normals[i] - mean) * (normals[i] - mean) / values;
+    }
+
+    double total = static_cast<double>(values) * years;
+    cout << "  rand(): " << randSeconds * 1e9 / total << " ns per uniform" << endl;
+    cout << "  Keyed scalar: " << scalarSeconds * 1e9 / total << " ns per uniform" << endl;
+    cout << "  Keyed across kingdoms: " << batchSeconds * 1e9 / total << " ns per uniform, "
+        << normalSeconds * 1e9 / total << " ns per normal (mean " << mean << ", variance " << variance << ")" << endl;
+    cout << "  Batched values differing from scalar draws: " << mismatches << endl;
+
+    // Replay: restore the state before a year and step once; with the same key it lands
+    // where the full run did, in any order and without the years before it
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    Kingdom original("Replay");
+    original.setRandomKey(seed, 7);
+    vector<KingdomSnapshot> states(years + 1);
+    original.captureSnapshot(states[0]);
+    for (int year = 0; year < years; year++) {
+        original.advanceYear();
+        original.captureSnapshot(states[year + 1]);
+    }
+    int diverged = 0;
+    for (int year = years - 1; year >= 0; year--) {
+        Kingdom replay("Replay");
+        replay.setRandomKey(seed, 7);
+        replay.restoreSnapshot(states[year]);
+        replay.advanceYear();
+        KingdomSnapshot snapshot;
+        replay.captureSnapshot(snapshot);
+        diverged += snapshot.matches(states[year + 1]) ? 0 : 1;
+    }
+    Logger::setLevel(consoleLevel);
+    cout << "  Years replayed out of order: " << years << ", diverged: " << diverged << endl;
+}
+
+void runLoanBenchmark(int loanCount, int years) {
+    cout << "===== Loan Ledger Benchmark =====" << endl;
+    cout << "Loans: " << loanCount << ", years: " << years << endl;
+
+    // One loan on its own: the last installment clears it at maturity
+    LoanLedger single;
+    single.addLoan(1000.0, 0.05, 10);
+    double installment = single.getScheduledPayments();
+    double paid = 0.0;
+    int closedYear = 0;
+    for (int year = 1; year <= 12 && closedYear == 0; year++) {
+        LoanLedger::YearSummary summary = single.advanceYear(1e9);
+        paid += summary.paid;
+        closedYear = summary.matured > 0 ? year : 0;
+    }
+    cout << "  1000 gold at 5% over 10 years: installments of " << installment << ", "
+        << paid << " paid in total, closed in year " << closedYear << endl;
+
+    // A world's worth of loans with mixed rates, terms and schedules
+    srand(12345);
+    LoanLedger ledger;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < loanCount; i++) {
+        ledger.addLoan(100.0 + rand() % 10000, 0.01 + (rand() % 15) * 0.01, 1 + rand() % 30,
+            rand() % 4 == 0 ? LoanLedger::BULLET : LoanLedger::AMORTIZING);
+    }
+    double addSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // Matured loans are replaced so the ledger stays the same size; one year in ten is lean
+    double runSeconds = 0.0;
+    long long matured = 0;
+    long long defaulted = 0;
+    for (int year = 0; year < years; year++) {
+        double funds = year % 10 == 9 ? ledger.getScheduledPayments() * 0.5 : 1e18;
+        start = chrono::steady_clock::now();
+        LoanLedger::YearSummary summary = ledger.advanceYear(funds);
+        runSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        matured += summary.matured;
+        defaulted += summary.defaulted;
+        for (int i = 0; i < summary.matured; i++) {
+            ledger.addLoan(100.0 + rand() % 10000, 0.01 + (rand() % 15) * 0.01, 1 + rand() % 30);
+        }
+    }
+
+    cout << "  Booking: " << addSeconds * 1e9 / loanCount << " ns per loan" << endl;
+    cout << "  Yearly pass: " << runSeconds * 1000.0 / years << " ms per year, "
+        << runSeconds * 1e9 / (static_cast<double>(years) * ledger.getRowCount()) << " ns per loan-year" << endl;
+    cout << "  Matured: " << matured << ", rolled over unpaid: " << defaulted << ", open: " << ledger.getLoanCount()
+        << ", outstanding: " << ledger.getOutstanding() << " gold" << endl;
+    cout << "  Memory: " << static_cast<double>(ledger.memoryUsage()) / ledger.getRowCount() << " bytes per loan" << endl;
+}
+
+void runInterbankBenchmark(int bankCount, int years) {
+    cout << "===== Interbank Benchmark =====" << endl;
+    cout << "Banks: " << bankCount << ", years: " << years << endl;
+
+    InterbankNetwork network(0.05);
+    for (int i = 0; i < bankCount; i++) {
+        network.addBank();
+    }
+
+    // A few large core banks borrow from everyone; a handful of banks take an outside
+    // shock each year, and every fifth year the largest borrower is one of them
+    srand(12345);
+    const int core = max(1, bankCount / 100);
+    double totalSeconds = 0.0;
+    double worstResidual = 0.0;
+    double worstImbalance = 0.0;
+    cout << "  year  loans  defaults  contagion  rounds  iterations  unpaid%      ms" << endl;
+    for (int year = 0; year < years; year++) {
+        vector<double> assets(bankCount);
+        vector<double> owed(bankCount, 0.0);
+        for (int i = 0; i < bankCount; i++) {
+            assets[i] = i < core ? 2000.0 + rand() % 3000 : 20.0 + rand() % 200;
+        }
+        for (int lender = 0; lender < bankCount; lender++) {
+            int loans = 5 + rand() % 11;
+            for (int l = 0; l < loans; l++) {
+                int borrower = rand() % 2 == 0 ? rand() % core : rand() % bankCount;
+                double principal = 10.0 + rand() % 90;
+                if (network.bookLoan(lender, borrower, principal)) {
+                    // Lent money leaves the lender's outside assets and joins the borrower's
+                    assets[lender] -= principal;
+                    assets[borrower] += principal;
+                    owed[borrower] += principal * (1.0 + network.getInterestRate());
+                }
+            }
+        }
+        for (int s = 0; s < max(1, bankCount / 100); s++) {
+            int bank = year % 5 == 4 && s == 0 ? 0 : rand() % bankCount;
+            assets[bank] *= 0.1 + (rand() % 60) * 0.01;
+        }
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        InterbankNetwork::YearMetrics metrics = network.clear(assets);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        totalSeconds += seconds;
+
+        // The result must be a clearing vector: each bank pays all it owes or all it has
+        double paid = 0.0;
+        double received = 0.0;
+        for (int i = 0; i < bankCount; i++) {
+            double expected = min(owed[i], max(0.0, assets[i]) + network.getReceived(i));
+            worstResidual = max(worstResidual, fabs(network.getPayment(i) - expected));
+            paid += network.getPayment(i);
+            received += network.getReceived(i);
+        }
+        worstImbalance = max(worstImbalance, fabs(paid - received));
+
+        char row[128];
+        snprintf(row, sizeof(row), "  %4d %6d %9d %10d %7d %11d %8.3f %7.3f", metrics.year, metrics.loans,
+            metrics.defaults, metrics.contagionDefaults, metrics.cascadeRounds, metrics.iterations,
+            metrics.obligations > 0.0 ? metrics.shortfall / metrics.obligations * 100.0 : 0.0, seconds * 1000.0);
+        cout << row << endl;
+    }
+    cout << "  Clearing: " << totalSeconds * 1000.0 / years << " ms per year" << endl;
+    cout << "  Largest fixed-point residual: " << worstResidual << " gold, paid minus received: "
+        << worstImbalance << " gold" << endl;
+}
+
+void runDynastyBenchmark(int nobleCount, int successions) {
+    cout << "===== Dynasty Benchmark =====" << endl;
+    cout << "Nobles: " << nobleCount << ", successions: " << successions << endl;
+
+    srand(12345);
+    Dynasty dynasty;
+    const int perHouse = 100;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    dynasty.found(max(1, nobleCount / perHouse), perHouse, 1000);
+    double foundSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // A few decades of births and deaths so the trees and the heap are lived in
+    const int years = 50;
+    start = chrono::steady_clock::now();
+    for (int year = 1001; year <= 1000 + years; year++) {
+        dynasty.advanceYear(year);
+    }
+    double yearSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    // The heap's choice against a scan of every candidate; each crowning also reorders
+    // the new ruler's children
+    int candidates = dynasty.getCandidateCount();
+    double heapSeconds = 0.0;
+    double scanSeconds = 0.0;
+    int mismatches = 0;
+    for (int s = 0; s < successions && dynasty.getCandidateCount() > 0; s++) {
+        start = chrono::steady_clock::now();
+        double best = -1.0;
+        for (uint32_t row = 0; row < dynasty.getRowCount(); row++) {
+            if (dynasty.isCandidate(row)) {
+                best = max(best, dynasty.getScore(row));
+            }
+        }
+        scanSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        start = chrono::steady_clock::now();
+        uint32_t heir = dynasty.crownSuccessor();
+        heapSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        mismatches += dynasty.getScore(heir) < best - 1e-3 ? 1 : 0;
+    }
+
+    cout << "  Founding: " << foundSeconds * 1e9 / dynasty.getRowCount() << " ns per noble, "
+        << dynasty.getHouseCount() << " houses" << endl;
+    cout << "  Year: " << yearSeconds * 1e6 / years << " us (births, comings of age, deaths), "
+        << dynasty.getLivingCount() << " living" << endl;
+    cout << "  Succession among " << candidates << " candidates: " << heapSeconds * 1e6 / successions
+        << " us from the heap, " << scanSeconds * 1e6 / successions << " us scanning" << endl;
+    cout << "  Heirs below the best score: " << mismatches << endl;
+    cout << "  Memory: " << static_cast<double>(dynasty.memoryUsage()) / dynasty.getRowCount() << " bytes per noble ("
+        << dynasty.getRowCount() << " rows including ancestors)" << endl;
+}
+
+void runBattleBenchmark(int kingdomCount, int years) {
+    kingdomCount = max(1, kingdomCount);
+    years = max(1, years);
+    cout << "===== Battle Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    // Two identical worlds at war with every neighbour: one advanced kingdom by kingdom,
+    // the other with every front of the world in one batch
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    vector<unique_ptr<Kingdom>> worlds[2];
+    for (int w = 0; w < 2; w++) {
+        srand(12345);
+        for (int i = 0; i < kingdomCount; i++) {
+            worlds[w].push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+            Kingdom& kingdom = *worlds[w].back();
+            kingdom.setRandomKey(12345, static_cast<uint32_t>(i));
+            Diplomacy* diplomacy = kingdom.getDiplomacy();
+            for (int k = 0; k < diplomacy->getKingdomCount(); k++) {
+                diplomacy->declareWar(StringTable::lookup(diplomacy->getForeignKingdoms()[k].nameHandle),
+                    *kingdom.getArmy());
+            }
+        }
+    }
+    vector<Kingdom*> together;
+    for (int i = 0; i < kingdomCount; i++) {
+        together.push_back(worlds[1][i].get());
+    }
+
+    double seconds[2] = { 0.0, 0.0 };
+    long long battles = 0;
+    int largestBatch = 0;
+    int differing = 0;
+    KingdomSnapshot alone;
+    KingdomSnapshot batched;
+    for (int year = 0; year < years; year++) {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < kingdomCount; i++) {
+            worlds[0][i]->advanceYear();
+        }
+        chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+        int fought = Kingdom::advanceYearTogether(together);
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        seconds[0] += chrono::duration<double>(middle - start).count();
+        seconds[1] += chrono::duration<double>(end - middle).count();
+        battles += fought;
+        largestBatch = max(largestBatch, fought);
+
+        for (int i = 0; i < kingdomCount; i++) {
+            worlds[0][i]->captureSnapshot(alone);
+            worlds[1][i]->captureSnapshot(batched);
+            differing += alone.matches(batched) ? 0 : 1;
+        }
+    }
+
+    // The engine alone on the same number of battles: one batch, or one engine per battle
+    // as a kingdom with a single front gets
+    const int engineBattles = max(1, largestBatch);
+    vector<BattleEngine::Force> attackers(engineBattles);
+    vector<BattleEngine::Force> defenders(engineBattles);
+    for (int b = 0; b < engineBattles; b++) {
+        attackers[b] = BattleEngine::forceFromStrength(400 + rand() % 800);
+        defenders[b] = BattleEngine::forceFromStrength(400 + rand() % 800);
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    BattleEngine batch;
+    for (int b = 0; b < engineBattles; b++) {
+        batch.addBattle(attackers[b], defenders[b]);
+    }
+    batch.resolveAll();
+    chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+    int outcomesDiffering = 0;
+    for (int b = 0; b < engineBattles; b++) {
+        BattleEngine single;
+        single.addBattle(attackers[b], defenders[b]);
+        single.resolveAll();
+        outcomesDiffering += single.getResult(0).attackerWon == batch.getResult(b).attackerWon ? 0 : 1;
+    }
+    chrono::steady_clock::time_point end = chrono::steady_clock::now();
+    Logger::setLevel(consoleLevel);
+
+    double kingdomYears = static_cast<double>(kingdomCount) * years;
+    cout << "World at war:" << endl;
+    cout << "  Battles: " << battles << " (" << static_cast<double>(battles) / years << " a year, largest batch "
+        << largestBatch << ")" << endl;
+    cout << "  Kingdom by kingdom: " << seconds[0] * 1e6 / kingdomYears << " us per kingdom-year" << endl;
+    cout << "  All fronts together: " << seconds[1] * 1e6 / kingdomYears << " us per kingdom-year" << endl;
+    cout << "  Kingdom-years ending differently: " << differing << endl;
+    cout << "Engine alone, " << engineBattles << " battles:" << endl;
+    cout << "  One batch: " << chrono::duration<double>(middle - start).count() * 1e9 / engineBattles
+        << " ns per battle" << endl;
+    cout << "  One engine each: " << chrono::duration<double>(end - middle).count() * 1e9 / engineBattles
+        << " ns per battle (outcomes differing: " << outcomesDiffering << ")" << endl;
+}
+
+void runTradeBenchmark(int kingdomCount, int years) {
+    kingdomCount = max(2, kingdomCount);
+    years = max(1, years);
+    cout << "===== Trade Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    // Farms beside garrison towns: peasants and soldiers vary, so every good runs short in
+    // some kingdoms and over in others
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    srand(12345);
+    vector<unique_ptr<Kingdom>> kingdoms;
+    vector<Kingdom*> world;
+    TradeNetwork network;
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        kingdoms[i]->setRandomKey(12345, static_cast<uint32_t>(i));
+        kingdoms[i]->getPopulation()->setPeasants(40 + (i * 37) % 200);
+        kingdoms[i]->getArmy()->setInfantry(20 + (i * 53) % 300);
+        world.push_back(kingdoms[i].get());
+        network.addKingdom(kingdoms[i].get());
+    }
+
+    // Regions of 20 kingdoms along a road, with a shortcut across each
+    const int region = 20;
+    for (int i = 0; i < kingdomCount; i++) {
+        if (i % region != 0) {
+            network.addRoute(i - 1, i, 100 + rand() % 200, 1 + rand() % 3);
+        }
+        else if (i + region / 2 < kingdomCount) {
+            network.addRoute(i, i + region / 2, 50 + rand() % 100, 2 + rand() % 3);
+        }
+    }
+    const int routeCount = network.getRouteCount();
+
+    double incrementalSeconds = 0.0;
+    double fullSeconds = 0.0;
+    double worldSeconds = 0.0;
+    long long solvedComponents = 0;
+    long long solvedGoods = 0;
+    long long componentYears = 0;
+    long long resolvedDiffering = 0;
+    long long keptDiffering = 0;
+    long long keptUnits = 0;
+    long long planned = 0;
+    long long shipped = 0;
+    long long transportCost = 0;
+    for (int year = 0; year < years; year++) {
+        // A few routes close or reopen each year, as wars and seasons would
+        for (int t = 0; t < max(1, routeCount / 50); t++) {
+            network.setRouteActive(rand() % routeCount, rand() % 4 != 0);
+        }
+
+        // The same network solved from scratch, for comparison
+        TradeNetwork full = network;
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        full.solve(true);
+        chrono::steady_clock::time_point middle = chrono::steady_clock::now();
+        network.solve();
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        fullSeconds += chrono::duration<double>(middle - start).count();
+        incrementalSeconds += chrono::duration<double>(end - middle).count();
+        solvedComponents += network.getLastSolvedComponents();
+        solvedGoods += network.getLastSolvedGoods();
+        componentYears += network.getComponentCount();
+
+        // Re-solved and kept flows alike must match the full re-solve exactly
+        for (int route = 0; route < routeCount; route++) {
+            for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+                int difference = abs(network.getFlow(route, r) - full.getFlow(route, r));
+                if (difference == 0) {
+                    continue;
+                }
+                if (network.wasSolved(network.getRoute(route).from)) {
+                    resolvedDiffering++;
+                }
+                else {
+                    keptDiffering++;
+                    keptUnits += difference;
+                }
+            }
+        }
+
+        chrono::steady_clock::time_point worldStart = chrono::steady_clock::now();
+        Kingdom::advanceYearTogether(world, &network);
+        worldSeconds += chrono::duration<double>(chrono::steady_clock::now() - worldStart).count();
+        planned += network.getLastPlanned();
+        shipped += network.getLastShipped();
+        transportCost += network.getLastTransportCost();
+    }
+    Logger::setLevel(consoleLevel);
+
+    cout << "Network: " << routeCount << " routes in " << network.getComponentCount() << " components" << endl;
+    cout << "Solving:" << endl;
+    cout << "  Full re-solve: " << fullSeconds * 1e3 / years << " ms a year" << endl;
+    cout << "  Incremental: " << incrementalSeconds * 1e3 / years << " ms a year, "
+        << 100.0 * solvedComponents / max(1LL, componentYears) << "% of components and "
+        << 100.0 * solvedGoods / max(1LL, componentYears * Exchange::RESOURCE_COUNT) << "% of their goods re-solved" << endl;
+    cout << "  Flows differing from the full re-solve: " << resolvedDiffering << " in re-solved components, "
+        << keptDiffering << " kept from last year (" << keptUnits << " units)" << endl;
+    cout << "Shipping:" << endl;
+    cout << "  Units planned: " << planned << ", shipped: " << shipped << " (the rest lacked stock or gold)" << endl;
+    cout << "  Transport paid: " << transportCost << " gold" << endl;
+    cout << "  World year with trade: " << worldSeconds * 1e6 / (static_cast<double>(kingdomCount) * years)
+        << " us per kingdom-year" << endl;
+}
+
+void runAgentBenchmark(int agentCount, int years) {
+    agentCount = max(1, agentCount);
+    years = max(1, years);
+    cout << "===== Agent Benchmark =====" << endl;
+    cout << "Agents: " << agentCount << ", years: " << years << endl;
+
+    // One kingdom whose whole population is simulated citizen by citizen
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    srand(12345);
+    Kingdom kingdom("Agent Kingdom");
+    kingdom.setRandomKey(12345, 0);
+    Population* population = kingdom.getPopulation();
+    population->setPeasants(agentCount / 100 * 85 + agentCount % 100);
+    population->setMerchants(agentCount / 100 * 12);
+    population->setNobles(agentCount / 100 * 3);
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    kingdom.enableAgentMode();
+    double enableSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    CitizenAgents* agents = population->getAgents();
+
+    double totalSeconds = 0.0;
+    double slowestSeconds = 0.0;
+    int outOfStep = 0;
+    for (int y = 0; y < years; y++) {
+        start = chrono::steady_clock::now();
+        kingdom.advanceYear();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        totalSeconds += seconds;
+        slowestSeconds = max(slowestSeconds, seconds);
+        if (agents->getCount() != population->getTotal()) {
+            outOfStep++;
+        }
+    }
+    Logger::setLevel(consoleLevel);
+
+    cout << "Agent mode on: " << enableSeconds * 1000.0 << " ms for " << agentCount << " agents" << endl;
+    cout << "Year step:" << endl;
+    cout << "  Average: " << totalSeconds * 1000.0 / years << " ms, slowest: " << slowestSeconds * 1000.0
+        << " ms" << endl;
+    cout << "  Years per second: " << years / totalSeconds << " (target: 1 at 10M agents)" << endl;
+    cout << "  Agents at the end: " << agents->getCount() << ", columns " << agents->memoryUsage() / (1024 * 1024)
+        << " MB" << endl;
+    cout << "  Years with agents out of step with the population: " << outOfStep << endl;
+}
+
+// Resident memory of the process, or 0 where it cannot be read
+static size_t residentBytes() {
+#ifdef __linux__
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    unsigned long long pages = 0;
+    unsigned long long resident = 0;
+    int fields = fscanf(statm, "%llu %llu", &pages, &resident);
+    fclose(statm);
+    return fields == 2 ? static_cast<size_t>(resident * sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+void runFootprintBenchmark(int kingdomCount, int years) {
+    cout << "===== Footprint Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+    kingdomCount = max(1, kingdomCount);
+
+    // Compact records must stay small enough for ten million kingdoms in a few gigabytes
+    const size_t compactBudget = 512;
+    const double worldSize = 1e7;
+
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    srand(12345);
+    Kingdom scratch("Scratch");
+
+    // Live kingdoms that have lived a while, so histories, houses and loans have grown
+    size_t residentBefore = residentBytes();
+    vector<unique_ptr<Kingdom>> kingdoms;
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        kingdoms[i]->setRandomKey(12345, static_cast<uint32_t>(i));
+        if (i % 4 == 0) {
+            kingdoms[i]->getBank()->takeLoan(200 + i % 500, *kingdoms[i]->getEconomy());
+        }
+    }
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int year = 0; year < years; year++) {
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms[i]->advanceYear();
+        }
+    }
+    double liveSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    size_t residentLive = residentBytes();
+
+    MemoryFootprint total;
+    for (int i = 0; i < kingdomCount; i++) {
+        total.add(kingdoms[i]->getFootprint());
+    }
+
+    // Pack every kingdom, then check that a record expands and packs back to the same bytes
+    vector<CompactKingdom> world(kingdomCount);
+    int lossy = 0;
+    int droppedHistories = 0;
+    int droppedHouses = 0;
+    int roundTripMismatches = 0;
+    CompactKingdom repacked;
+    for (int i = 0; i < kingdomCount; i++) {
+        lossy += kingdoms[i]->compact(world[i]) ? 0 : 1;
+        droppedHistories += kingdoms[i]->getMarket()->hasPriceHistory() ? 1 : 0;
+        droppedHouses += kingdoms[i]->getDynasty()->getHouseCount() > 0 ? 1 : 0;
+        scratch.expand(world[i]);
+        scratch.compact(repacked);
+        roundTripMismatches += memcmp(&world[i], &repacked, sizeof(CompactKingdom)) != 0 ? 1 : 0;
+    }
+
+    // One more year both ways: the live kingdom, and its record expanded into the scratch kingdom
+    int yearMismatches = 0;
+    KingdomSnapshot liveState;
+    KingdomSnapshot expandedState;
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < kingdomCount; i++) {
+        scratch.expand(world[i]);
+        scratch.advanceYear();
+        scratch.compact(world[i]);
+    }
+    double compactSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (int i = 0; i < kingdomCount; i++) {
+        kingdoms[i]->advanceYear();
+        kingdoms[i]->captureSnapshot(liveState);
+        scratch.expand(world[i]);
+        scratch.captureSnapshot(expandedState);
+        yearMismatches += liveState.serialize() != expandedState.serialize() ? 1 : 0;
+    }
+    Logger::setLevel(consoleLevel);
+
+    char row[96];
+    snprintf(row, sizeof(row), "  %-12s %14s %7s", "Subsystem", "Bytes/kingdom", "Share");
+    cout << row << endl;
+    for (int i = 0; i < MemoryFootprint::SUBSYSTEM_COUNT; i++) {
+        snprintf(row, sizeof(row), "  %-12s %14.1f %6.1f%%",
+            MemoryFootprint::getSubsystemName(static_cast<MemoryFootprint::Subsystem>(i)),
+            static_cast<double>(total.bytes[i]) / kingdomCount, 100.0 * total.bytes[i] / total.getTotal());
+        cout << row << endl;
+    }
+    double liveBytes = static_cast<double>(total.getTotal()) / kingdomCount;
+    snprintf(row, sizeof(row), "  %-12s %14.1f %6.1f%%", "total", liveBytes, 100.0);
+    cout << row << endl;
+    cout << "  Name table: " << StringTable::getCount() << " names in " << StringTable::memoryUsage()
+        << " bytes, shared by every kingdom" << endl;
+    if (residentBefore > 0 && residentLive > residentBefore) {
+        cout << "  Resident growth: " << static_cast<double>(residentLive - residentBefore) / kingdomCount
+            << " bytes per live kingdom, allocator overhead included" << endl;
+    }
+
+    cout << "  Compact kingdom: " << sizeof(CompactKingdom) << " bytes (budget " << compactBudget << "): "
+        << (sizeof(CompactKingdom) <= compactBudget ? "within budget" : "OVER BUDGET") << endl;
+    cout << "  " << worldSize / 1e6 << "M kingdoms: " << liveBytes * worldSize / 1e9 << " GB live, "
+        << sizeof(CompactKingdom) * worldSize / 1e9 << " GB compact" << endl;
+    cout << "  Packed with loss (merged loans, agents): " << lossy << endl;
+    cout << "  Packed without their price history: " << droppedHistories << ", without their noble houses: "
+        << droppedHouses << " (never packed)" << endl;
+    cout << "  Records that do not pack back to the same bytes: " << roundTripMismatches
+        << " (the record round-trips; the dropped parts above do not)" << endl;
+    cout << "  Year from the compact form: " << compactSeconds * 1e6 / kingdomCount << " us per kingdom (expand, advance, "
+        << "pack), against " << liveSeconds * 1e6 / (static_cast<double>(kingdomCount) * max(1, years)) << " us live" << endl;
+    cout << "  Kingdoms whose next year differs from the live one: " << yearMismatches
+        << " (successions crown nobles from regrown houses)" << endl;
+}
+
+// One starting state for the scaling suite; a zero population or army keeps the default
+struct ScalingScenario {
+    const char* name;
+    double population;
+    double army;
+    int foreignKingdoms;
+    int warFronts;          // Foreign kingdoms at war from the first year
+    int debt;
+    int loans;
+    int yearsScale;         // Long wars run several times as long
+};
+
+static int clampToInt(double value) {
+    return static_cast<int>(max(0.0, min(static_cast<double>(INT_MAX), value)));
+}
+
+// Reals that stopped being finite; integers that would not fit are held at the limit
+// and counted by Headroom instead
+static int countNonFinite(const KingdomSnapshot& snapshot) {
+    const double reals[] = { snapshot.happiness, snapshot.growthRate, snapshot.morale, snapshot.inflation };
+    int found = 0;
+    for (size_t i = 0; i < sizeof(reals) / sizeof(reals[0]); i++) {
+        found += std::isfinite(reals[i]) ? 0 : 1;
+    }
+    return found;
+}
+
+void runScalingBenchmark(int kingdomCount, int years, const string& filename) {
+    cout << "===== Scaling Benchmark =====" << endl;
+    cout << "Kingdoms per scenario: " << kingdomCount << ", years: " << years << endl;
+    kingdomCount = max(1, kingdomCount);
+    years = max(1, years);
+
+    static const ScalingScenario scenarios[] = {
+        { "population-1e2", 1e2, 0, 3, 0, 0, 0, 1 },
+        { "population-1e4", 1e4, 0, 3, 0, 0, 0, 1 },
+        { "population-1e6", 1e6, 0, 3, 0, 0, 0, 1 },
+        { "population-1e8", 1e8, 0, 3, 0, 0, 0, 1 },
+        { "population-1e9", 1e9, 0, 3, 0, 0, 0, 1 },
+        { "army-1e1", 0, 1e1, 3, 0, 0, 0, 1 },
+        { "army-1e3", 0, 1e3, 3, 0, 0, 0, 1 },
+        { "army-1e5", 0, 1e5, 3, 0, 0, 0, 1 },
+        { "army-1e7", 0, 1e7, 3, 0, 0, 0, 1 },
+        { "long-war", 0, 0, 3, 3, 0, 0, 4 },
+        { "long-war-1e6", 1e6, 1e5, 3, 3, 0, 0, 4 },
+        { "heavy-debt", 0, 0, 3, 0, 1000000, 1000, 1 },
+        { "foreign-1e2", 0, 0, 100, 0, 0, 0, 1 },
+        { "foreign-1e3", 0, 0, 1000, 0, 0, 0, 1 },
+        { "foreign-1e4", 0, 0, 10000, 0, 0, 0, 1 },
+        { "foreign-1e4-war", 0, 1e5, 10000, 10000, 0, 0, 1 }
+    };
+
+    // One JSON object per scenario, for scripts that track the limits over time
+    ofstream out(filename);
+    if (!out) {
+        Logger::error("Error: Could not create {}!", filename);
+        return;
+    }
+
+    char row[160];
+    snprintf(row, sizeof(row), "  %-16s %11s %11s %11s %12s %9s %6s", "Scenario", "us/yr p50", "us/yr p99",
+        "us/yr max", "KB/kingdom", "Overflows", "First");
+    cout << row << endl;
+
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    for (const ScalingScenario& scenario : scenarios) {
+        srand(12345);
+        vector<unique_ptr<Kingdom>> kingdoms;
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+            Kingdom& kingdom = *kingdoms[i];
+            kingdom.setRandomKey(12345, static_cast<uint32_t>(i));
+
+            // Stocks and treasury grow with the people, so large kingdoms do not simply starve
+            if (scenario.population > 0) {
+                kingdom.getPopulation()->setPeasants(clampToInt(scenario.population * 0.80));
+                kingdom.getPopulation()->setMerchants(clampToInt(scenario.population * 0.15));
+                kingdom.getPopulation()->setNobles(clampToInt(scenario.population * 0.05));
+                kingdom.getMarket()->getFood()->setAmount(clampToInt(scenario.population * 2.0));
+                kingdom.getEconomy()->setTreasuryGold(clampToInt(scenario.population));
+            }
+            if (scenario.army > 0) {
+                kingdom.getArmy()->setInfantry(clampToInt(scenario.army * 0.6));
+                kingdom.getArmy()->setCavalry(clampToInt(scenario.army * 0.2));
+                kingdom.getArmy()->setArchers(clampToInt(scenario.army * 0.2));
+            }
 
-        if (validateIntInput(choice, "", 1, 5)) {
-            switch (choice) {
-            case 1:
-                kingdom.getArmy()->trainArmy();
-                break;
-            case 2:
-                int infantry;
-                if (validateIntInput(infantry, "Enter number of infantry to recruit: ", 1, 100)) {
-                    kingdom.getArmy()->setInfantry(kingdom.getArmy()->getInfantry() + infantry);
-                    kingdom.getEconomy()->setTreasuryGold(kingdom.getEconomy()->getTreasuryGold() - infantry * 10);
-                    cout << "Recruited " << infantry << " infantry!" << endl;
-                }
-                break;
-            case 3:
-                int cavalry;
-                if (validateIntInput(cavalry, "Enter number of cavalry to recruit: ", 1, 50)) {
-                    kingdom.getArmy()->setCavalry(kingdom.getArmy()->getCavalry() + cavalry);
-                    kingdom.getEconomy()->setTreasuryGold(kingdom.getEconomy()->getTreasuryGold() - cavalry * 20);
-                    cout << "Recruited " << cavalry << " cavalry!" << endl;
+            Diplomacy* diplomacy = kingdom.getDiplomacy();
+            if (scenario.foreignKingdoms > diplomacy->getKingdomCount()) {
+                diplomacy->setCapacity(scenario.foreignKingdoms);
+                for (int k = diplomacy->getKingdomCount(); k < scenario.foreignKingdoms; k++) {
+                    diplomacy->addKingdom("Realm " + to_string(k), 400 + rand() % 600);
                 }
-                break;
-            case 4:
-                int archers;
-                if (validateIntInput(archers, "Enter number of archers to recruit: ", 1, 50)) {
-                    kingdom.getArmy()->setArchers(kingdom.getArmy()->getArchers() + archers);
-                    kingdom.getEconomy()->setTreasuryGold(kingdom.getEconomy()->getTreasuryGold() - archers * 15);
-                    cout << "Recruited " << archers << " archers!" << endl;
+            }
+            int fronts = min(scenario.warFronts, diplomacy->getKingdomCount());
+            for (int k = 0; k < fronts; k++) {
+                diplomacy->getForeignKingdomsMutable()[k].atWar = true;
+            }
+            kingdom.getArmy()->setWarStatus(fronts > 0);
+
+            if (scenario.debt > 0) {
+                kingdom.getEconomy()->setDebt(scenario.debt);
+            }
+            for (int l = 0; l < scenario.loans; l++) {
+                kingdom.getBank()->getLedgerMutable().addLoan(500.0 + l % 500, 0.05 + (l % 10) * 0.01, 5 + l % 20);
+            }
+        }
+
+        // The state the kingdoms actually start from, defaults included
+        double population = 0.0;
+        double army = 0.0;
+        for (int i = 0; i < kingdomCount; i++) {
+            population += kingdoms[i]->getPopulation()->getTotal();
+            army += kingdoms[i]->getArmy()->getTotal();
+        }
+        population /= kingdomCount;
+        army /= kingdomCount;
+
+        // Each year is timed across the batch and charged evenly to its kingdoms. Values
+        // held at the int limit are charged to the kingdom whose year held them
+        int scenarioYears = years * scenario.yearsScale;
+        vector<double> yearMicros;
+        int overflows = 0;
+        int firstOverflowYear = 0;
+        vector<bool> overflowed(kingdomCount, false);
+        vector<int> found(kingdomCount);
+        KingdomSnapshot after;
+        for (int year = 1; year <= scenarioYears; year++) {
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (int i = 0; i < kingdomCount; i++) {
+                uint64_t saturations = Headroom::getSaturations();
+                kingdoms[i]->advanceYear();
+                found[i] = static_cast<int>(Headroom::getSaturations() - saturations);
+            }
+            yearMicros.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count() * 1e6 /
+                kingdomCount);
+
+            for (int i = 0; i < kingdomCount; i++) {
+                kingdoms[i]->captureSnapshot(after);
+                found[i] += countNonFinite(after);
+                if (found[i] > 0) {
+                    overflows += found[i];
+                    overflowed[i] = true;
+                    firstOverflowYear = firstOverflowYear == 0 ? year : firstOverflowYear;
                 }
-                break;
-            case 5:
-                return;
             }
         }
-    } while (true);
-}
 
-void displayEconomyMenu(Kingdom& kingdom) {
-    int choice;
-    double rate;
+        MemoryFootprint footprint;
+        for (int i = 0; i < kingdomCount; i++) {
+            footprint.add(kingdoms[i]->getFootprint());
+        }
+        double bytesPerKingdom = static_cast<double>(footprint.getTotal()) / kingdomCount;
+        int overflowedKingdoms = static_cast<int>(count(overflowed.begin(), overflowed.end(), true));
 
-    do {
-        cout << "\n===== Economy Management =====" << endl;
-        cout << "1. Adjust Peasant Tax Rate" << endl;
-        cout << "2. Adjust Merchant Tax Rate" << endl;
-        cout << "3. Adjust Noble Tax Rate" << endl;
-        cout << "4. Back" << endl;
-        cout << "Enter choice: ";
+        double meanMicros = 0.0;
+        for (double micros : yearMicros) {
+            meanMicros += micros;
+        }
+        meanMicros /= yearMicros.size();
+        sort(yearMicros.begin(), yearMicros.end());
+        double p50 = yearMicros[yearMicros.size() / 2];
+        double p99 = yearMicros[min(yearMicros.size() - 1, yearMicros.size() * 99 / 100)];
+        double worst = yearMicros.back();
+
+        snprintf(row, sizeof(row), "  %-16s %11.2f %11.2f %11.2f %12.1f %9d %6s", scenario.name, p50, p99, worst,
+            bytesPerKingdom / 1024.0, overflows, firstOverflowYear > 0 ? to_string(firstOverflowYear).c_str() : "-");
+        cout << row << endl;
+
+        char line[640];
+        snprintf(line, sizeof(line), "{\"scenario\":\"%s\",\"kingdoms\":%d,\"years\":%d,\"population\":%.0f,"
+            "\"army\":%.0f,\"foreign_kingdoms\":%d,\"war_fronts\":%d,\"debt\":%d,\"loans\":%d,"
+            "\"us_per_year_mean\":%.3f,\"us_per_year_p50\":%.3f,\"us_per_year_p99\":%.3f,\"us_per_year_max\":%.3f,"
+            "\"bytes_per_kingdom\":%.1f,\"overflow_incidents\":%d,"
+            "\"kingdoms_overflowed\":%d,\"first_overflow_year\":%d}",
+            scenario.name, kingdomCount, scenarioYears, population, army, scenario.foreignKingdoms,
+            scenario.warFronts, scenario.debt, scenario.loans, meanMicros, p50, p99, worst, bytesPerKingdom,
+            overflows, overflowedKingdoms, firstOverflowYear);
+        out << line << '\n';
+    }
+    Logger::setLevel(consoleLevel);
+
+    cout << "  Overflows count values held at the int limit instead of wrapping, and reals that stopped" << endl;
+    cout << "  being finite. First is the first year one appeared. One JSON line per scenario in " << filename << endl;
+}
+
+// An engine parameter the sensitivity sweep varies, and the range it is sampled over
+struct SensitivityParameter {
+    const char* name;
+    double low;
+    double high;
+};
+
+enum {
+    SENSITIVITY_PARAMETERS = 5,
+    SENSITIVITY_OUTPUTS = 3     // Score, survival, happiness
+};
+
+static const SensitivityParameter sensitivityParameters[SENSITIVITY_PARAMETERS] = {
+    { "bank interest", 0.01, 0.2 },
+    { "bank corruption", 0.0, 50.0 },
+    { "event chance", 0.0, 50.0 },
+    { "relation cost", 5.0, 100.0 },
+    { "peace cost", 50.0, 500.0 }
+};
+
+// Plays one kingdom from the packed start under the given parameters and a plain ruler's
+// policy, since diplomacy costs only matter to a ruler who pays them: march on the weakest
+// neighbour every tenth year and sue for peace two years later, calm the coldest of the
+// others, and borrow when the treasury runs low. Returns the years played before the game ended
+static int sensitivityRollout(Kingdom& kingdom, const CompactKingdom& start, const double* parameters,
+    uint32_t rollout, int years, double* outputs) {
+    kingdom.expand(start);
+    kingdom.setRandomKey(12345, rollout);
+    kingdom.getBank()->setInterestRate(parameters[0]);
+    kingdom.getBank()->setCorruptionLevel(static_cast<int>(lround(parameters[1])));
+    kingdom.getEvents()->setEventChance(static_cast<int>(lround(parameters[2])));
+    kingdom.getDiplomacy()->setRelationCost(static_cast<int>(lround(parameters[3])));
+    kingdom.getDiplomacy()->setPeaceCost(static_cast<int>(lround(parameters[4])));
+
+    Economy& economy = *kingdom.getEconomy();
+    Diplomacy& diplomacy = *kingdom.getDiplomacy();
+    int warStarted = -1;
+    int year = 0;
+    for (; year < years && !kingdom.isGameOver(); year++) {
+        int enemy = -1;
+        int coldest = -1;
+        int weakest = -1;
+        for (int k = 0; k < diplomacy.getKingdomCount(); k++) {
+            const auto& foreign = diplomacy.getForeignKingdoms()[k];
+            if (foreign.atWar) {
+                enemy = enemy < 0 ? k : enemy;
+                continue;
+            }
+            if (coldest < 0 || foreign.relationLevel < diplomacy.getForeignKingdoms()[coldest].relationLevel) {
+                coldest = k;
+            }
+            if (weakest < 0 || foreign.strength < diplomacy.getForeignKingdoms()[weakest].strength) {
+                weakest = k;
+            }
+        }
+        if (enemy >= 0) {
+            // Peace is sued for until the treasury can pay for it
+            if (year - warStarted >= 2) {
+                diplomacy.signPeace(StringTable::lookup(diplomacy.getForeignKingdoms()[enemy].nameHandle), economy);
+            }
+        }
+        else if (year % 10 == 0 && weakest >= 0) {
+            diplomacy.declareWar(StringTable::lookup(diplomacy.getForeignKingdoms()[weakest].nameHandle),
+                *kingdom.getArmy());
+            warStarted = year;
+        }
+        else if (coldest >= 0) {
+            const auto& foreign = diplomacy.getForeignKingdoms()[coldest];
+            if (foreign.relationLevel < 3 && economy.getTreasuryGold() > 500) {
+                diplomacy.improveRelations(StringTable::lookup(foreign.nameHandle), economy);
+            }
+        }
+        if (economy.getTreasuryGold() < 200 && economy.getDebt() < 3000) {
+            kingdom.getBank()->takeLoan(500, economy);
+        }
 
-        if (validateIntInput(choice, "", 1, 4)) {
-            switch (choice) {
-            case 1:
-                if (validateDoubleInput(rate, "Enter new peasant tax rate (0.0-0.5): ", 0.0, 0.5)) {
-                    kingdom.getEconomy()->setPeasantTaxRate(rate);
-                    cout << "Peasant tax rate set to " << rate << "!" << endl;
-                }
-                break;
-            case 2:
-                if (validateDoubleInput(rate, "Enter new merchant tax rate (0.0-0.5): ", 0.0, 0.5)) {
-                    kingdom.getEconomy()->setMerchantTaxRate(rate);
-                    cout << "Merchant tax rate set to " << rate << "!" << endl;
-                }
-                break;
-            case 3:
-                if (validateDoubleInput(rate, "Enter new noble tax rate (0.0-0.5): ", 0.0, 0.5)) {
-                    kingdom.getEconomy()->setNobleTaxRate(rate);
-                    cout << "Noble tax rate set to " << rate << "!" << endl;
+        kingdom.advanceYear();
+    }
+
+    outputs[0] = kingdom.getScore();
+    outputs[1] = kingdom.isGameOver() ? 0.0 : 1.0;
+    outputs[2] = kingdom.getPopulation()->getHappiness();
+    return year;
+}
+
+// Plays the first count parameter sets of the design on the given number of threads, each
+// with its own scratch kingdom, and stores the mean outputs of every set. Returns the
+// kingdom-years played
+static long long sensitivityEvaluate(const CompactKingdom& start, const vector<double>& design, int count,
+    int rollouts, int years, int threadCount, vector<double>& results) {
+    vector<unique_ptr<Kingdom>> scratch;
+    for (int t = 0; t < threadCount; t++) {
+        scratch.push_back(make_unique<Kingdom>("Sensitivity"));
+    }
+    vector<long long> yearsPlayed(threadCount, 0);
+    atomic<int> nextEvaluation(0);
+    auto work = [&](int t) {
+        double outputs[SENSITIVITY_OUTPUTS];
+        for (int e = nextEvaluation++; e < count; e = nextEvaluation++) {
+            double sums[SENSITIVITY_OUTPUTS] = { 0.0, 0.0, 0.0 };
+            for (int r = 0; r < rollouts; r++) {
+                yearsPlayed[t] += sensitivityRollout(*scratch[t], start,
+                    &design[static_cast<size_t>(e) * SENSITIVITY_PARAMETERS], static_cast<uint32_t>(r), years, outputs);
+                for (int o = 0; o < SENSITIVITY_OUTPUTS; o++) {
+                    sums[o] += outputs[o];
                 }
-                break;
-            case 4:
-                return;
+            }
+            for (int o = 0; o < SENSITIVITY_OUTPUTS; o++) {
+                results[static_cast<size_t>(e) * SENSITIVITY_OUTPUTS + o] = sums[o] / rollouts;
             }
         }
-    } while (true);
+    };
+    vector<thread> workers;
+    for (int t = 0; t < threadCount; t++) {
+        workers.push_back(thread(work, t));
+    }
+    for (size_t t = 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    long long total = 0;
+    for (int t = 0; t < threadCount; t++) {
+        total += yearsPlayed[t];
+    }
+    return total;
+}
+
+void runSensitivityAnalysis(int samples, int rollouts, int years) {
+    samples = max(2, samples);
+    rollouts = max(1, rollouts);
+    years = max(1, years);
+    // At least two threads, so the check against one below always compares something
+    int threadCount = max(2, static_cast<int>(thread::hardware_concurrency()));
+    cout << "===== Sensitivity Analysis =====" << endl;
+    cout << "Samples: " << samples << ", rollouts: " << rollouts << ", years: " << years
+        << ", threads: " << threadCount << endl;
+
+    // Saltelli's design: matrices A and B take the two halves of one Sobol sequence, and
+    // each AB_i is A with column i from B. Row s of the design holds A, B, then every AB_i
+    const int k = SENSITIVITY_PARAMETERS;
+    const int rowsPerSample = k + 2;
+    int evaluations = samples * rowsPerSample;
+    vector<double> design(static_cast<size_t>(evaluations) * k);
+    SobolSequence sobol(2 * k);
+    double point[2 * SENSITIVITY_PARAMETERS];
+    for (int s = 0; s < samples; s++) {
+        sobol.next(point);
+        for (int p = 0; p < k; p++) {
+            const SensitivityParameter& parameter = sensitivityParameters[p];
+            double a = parameter.low + point[p] * (parameter.high - parameter.low);
+            double b = parameter.low + point[k + p] * (parameter.high - parameter.low);
+            double* row = &design[static_cast<size_t>(s * rowsPerSample) * k];
+            row[p] = a;
+            row[k + p] = b;
+            for (int i = 0; i < k; i++) {
+                row[(2 + i) * k + p] = i == p ? b : a;
+            }
+        }
+    }
+
+    // Every parameter set plays the same rollout keys, so differences between them come
+    // from the parameters rather than the dice
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    srand(12345);
+    CompactKingdom start;
+    Kingdom("Sensitivity").compact(start);
+
+    vector<double> results(static_cast<size_t>(evaluations) * SENSITIVITY_OUTPUTS);
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    long long kingdomYears = sensitivityEvaluate(start, design, evaluations, rollouts, years, threadCount, results);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    // Which thread plays a set, and what its scratch kingdom played before, must not show
+    // in the results: the first sets are played again on one thread and compared bit for bit
+    int replayed = min(evaluations, 64 * rowsPerSample);
+    vector<double> replay(static_cast<size_t>(replayed) * SENSITIVITY_OUTPUTS);
+    sensitivityEvaluate(start, design, replayed, rollouts, years, 1, replay);
+    int differing = 0;
+    for (int e = 0; e < replayed; e++) {
+        if (memcmp(&replay[static_cast<size_t>(e) * SENSITIVITY_OUTPUTS],
+            &results[static_cast<size_t>(e) * SENSITIVITY_OUTPUTS], SENSITIVITY_OUTPUTS * sizeof(double)) != 0) {
+            differing++;
+        }
+    }
+    Logger::setLevel(consoleLevel);
+
+    // First-order indices by Saltelli (2010) and total effects by Jansen, against the
+    // variance of the A and B rows together
+    const char* outputNames[SENSITIVITY_OUTPUTS] = { "score", "survival", "happiness" };
+    double firstOrder[SENSITIVITY_OUTPUTS][SENSITIVITY_PARAMETERS];
+    double totalEffect[SENSITIVITY_OUTPUTS][SENSITIVITY_PARAMETERS];
+    double means[SENSITIVITY_OUTPUTS];
+    double variances[SENSITIVITY_OUTPUTS];
+    for (int o = 0; o < SENSITIVITY_OUTPUTS; o++) {
+        auto f = [&](int s, int row) {
+            return results[static_cast<size_t>(s * rowsPerSample + row) * SENSITIVITY_OUTPUTS + o];
+        };
+        double sum = 0.0;
+        double squares = 0.0;
+        for (int s = 0; s < samples; s++) {
+            sum += f(s, 0) + f(s, 1);
+            squares += f(s, 0) * f(s, 0) + f(s, 1) * f(s, 1);
+        }
+        means[o] = sum / (2.0 * samples);
+        variances[o] = max(0.0, squares / (2.0 * samples) - means[o] * means[o]);
+        for (int i = 0; i < k; i++) {
+            double first = 0.0;
+            double total = 0.0;
+            for (int s = 0; s < samples; s++) {
+                first += f(s, 1) * (f(s, 2 + i) - f(s, 0));
+                total += (f(s, 0) - f(s, 2 + i)) * (f(s, 0) - f(s, 2 + i));
+            }
+            firstOrder[o][i] = variances[o] > 0.0 ? first / samples / variances[o] : 0.0;
+            totalEffect[o][i] = variances[o] > 0.0 ? total / (2.0 * samples) / variances[o] : 0.0;
+        }
+    }
+
+    char row[160];
+    snprintf(row, sizeof(row), "  %-16s %9s %9s %11s %11s %12s %12s", "Parameter", "score S1", "score ST",
+        "survival S1", "survival ST", "happiness S1", "happiness ST");
+    cout << row << endl;
+    for (int i = 0; i < k; i++) {
+        snprintf(row, sizeof(row), "  %-16s %9.3f %9.3f %11.3f %11.3f %12.3f %12.3f", sensitivityParameters[i].name,
+            firstOrder[0][i], totalEffect[0][i], firstOrder[1][i], totalEffect[1][i], firstOrder[2][i],
+            totalEffect[2][i]);
+        cout << row << endl;
+    }
+    for (int o = 0; o < SENSITIVITY_OUTPUTS; o++) {
+        cout << "  " << outputNames[o] << ": mean " << means[o] << ", standard deviation " << sqrt(variances[o])
+            << (variances[o] > 0.0 ? "" : " (no spread, so no indices)") << endl;
+    }
+    cout << "  " << evaluations << " parameter sets, " << static_cast<double>(evaluations) * rollouts << " rollouts in "
+        << seconds << " s (" << kingdomYears / seconds / 1e6 << "M kingdom-years per second)" << endl;
+    cout << "  First " << replayed << " parameter sets again on 1 thread, differing from " << threadCount
+        << " threads: " << differing << endl;
+    cout << "  S1 is a parameter's effect alone, ST includes its interactions; ST well above S1" << endl;
+    cout << "  points to interactions, and both near 0 to a parameter that does not matter." << endl;
 }
 
-void displayDiplomacyMenu(Kingdom& kingdom) {
-    int choice;
-    string kingdomName;
+void runRulesetBenchmark(int kingdomCount, int years, const string& filename) {
+    cout << "===== Ruleset Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
 
-    do {
-        cout << "\n===== Diplomacy Management =====" << endl;
-        cout << "1. List Foreign Kingdoms" << endl;
-        cout << "2. Improve Relations" << endl;
-        cout << "3. Declare War" << endl;
-        cout << "4. Sign Peace Treaty" << endl;
-        cout << "5. Form Alliance" << endl;
-        cout << "6. Establish Trade" << endl;
-        cout << "7. Engage in Battle" << endl;
-        cout << "8. Back" << endl;
-        cout << "Enter choice: ";
+    // The designer path reads the shipped rules back from a file
+    if (!standardRuleset.save(filename) || !designerRuleset.load(filename)) {
+        return;
+    }
 
-        if (validateIntInput(choice, "", 1, 8)) {
-            switch (choice) {
-            case 1:
-                kingdom.getDiplomacy()->listKingdoms();
-                pauseScreen();
-                break;
-            case 2:
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name: ";
-                getline(cin, kingdomName);
-                if (kingdom.getDiplomacy()->improveRelations(kingdomName, *kingdom.getEconomy())) {
-                    cout << "Relations with " << kingdomName << " improved!" << endl;
-                }
-                else {
-                    cout << "Failed to improve relations! Check funds or kingdom name." << endl;
-                }
-                pauseScreen();
-                break;
-            case 3:
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name to declare war on: ";
-                getline(cin, kingdomName);
-                if (kingdom.getDiplomacy()->declareWar(kingdomName, *kingdom.getArmy())) {
-                    cout << "War declared on " << kingdomName << "!" << endl;
-                }
-                else {
-                    cout << "Failed to declare war! Already at war or invalid kingdom." << endl;
-                }
-                pauseScreen();
-                break;
-            case 4:
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name to sign peace with: ";
-                getline(cin, kingdomName);
-                if (kingdom.getDiplomacy()->signPeace(kingdomName, *kingdom.getEconomy())) {
-                    cout << "Peace signed with " << kingdomName << "!" << endl;
-                }
-                else {
-                    cout << "Failed to sign peace! Not at war or insufficient funds." << endl;
-                }
-                pauseScreen();
-                break;
-            case 5:
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name to form alliance with: ";
-                getline(cin, kingdomName);
-                if (kingdom.getDiplomacy()->formAlliance(kingdomName)) {
-                    cout << "Alliance formed with " << kingdomName << "!" << endl;
-                }
-                else {
-                    cout << "Failed to form alliance! Relations too low or at war." << endl;
-                }
-                pauseScreen();
-                break;
-            case 6:                   
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name to establish trade with: ";
-                getline(cin, kingdomName);
-                if (kingdom.getDiplomacy()->establishTrade(kingdomName, *kingdom.getMarket(), *kingdom.getEconomy())) {
-                    cout << "Trade established with " << kingdomName << "!" << endl;
-                }
-                else {
-                    cout << "Failed to establish trade! Relations too low or at war." << endl;
-                }
-                pauseScreen();
-                break;
-            case 7: {
-                kingdom.getDiplomacy()->listKingdoms();
-                cout << "Enter kingdom name to battle: ";
-                getline(cin, kingdomName);
-                bool atWar = false;
-                for (int i = 0; i < kingdom.getDiplomacy()->getKingdomCount(); i++) {
-                    if (kingdom.getDiplomacy()->getForeignKingdoms()[i].name == kingdomName &&
-                        kingdom.getDiplomacy()->getForeignKingdoms()[i].atWar) {
-                        atWar = true;
-                        int playerStrength = kingdom.getArmy()->calculateStrength();
-                        int enemyStrength = kingdom.getDiplomacy()->getForeignKingdoms()[i].strength;
-                        cout << "\nBattle against " << kingdomName << " begins!" << endl;
-                        if (playerStrength > enemyStrength) {
-                            cout << "Victory! Your forces crush the enemy!" << endl;
-                            kingdom.getDiplomacy()->getForeignKingdomsMutable()[i].strength = max(100, enemyStrength - (playerStrength / 10));
-                            kingdom.getArmy()->setMorale(kingdom.getArmy()->getMorale() + 0.1);
-                        }
-                        else {
-                            cout << "Defeat! Your army suffers heavy losses!" << endl;
-                            int armyLoss = kingdom.getArmy()->getTotal() / 10;
-                            kingdom.getArmy()->setInfantry(kingdom.getArmy()->getInfantry() - (armyLoss * 6 / 10));
-                            kingdom.getArmy()->setCavalry(kingdom.getArmy()->getCavalry() - (armyLoss * 2 / 10));
-                            kingdom.getArmy()->setArchers(kingdom.getArmy()->getArchers() - (armyLoss * 2 / 10));
-                            kingdom.getArmy()->setMorale(kingdom.getArmy()->getMorale() - 0.1);
-                        }
-                        break;
-                    }
-                }
-                if (!atWar) {
-                    cout << "Cannot battle! Not at war with " << kingdomName << " or invalid kingdom." << endl;
-                }
-                pauseScreen();
-                break;
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    double seconds[2] = { 0.0, 0.0 };
+    vector<string> finalStates[2];
+    for (int pass = 0; pass < 2; pass++) {
+        srand(12345);
+        vector<unique_ptr<Kingdom>> kingdoms;
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+            kingdoms[i]->useDesignerRules(pass == 1);
+        }
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int year = 0; year < years; year++) {
+            for (int i = 0; i < kingdomCount; i++) {
+                kingdoms[i]->advanceYear();
             }
-            case 8:
+        }
+        seconds[pass] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        KingdomSnapshot snapshot;
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms[i]->captureSnapshot(snapshot);
+            finalStates[pass].push_back(snapshot.serialize());
+        }
+    }
+    Logger::setLevel(consoleLevel);
+
+    int mismatches = 0;
+    for (int i = 0; i < kingdomCount; i++) {
+        mismatches += finalStates[0][i] != finalStates[1][i] ? 1 : 0;
+    }
+    cout << "  Shipped rules (folded): " << seconds[0] * 1000.0 << " ms" << endl;
+    cout << "  Designer rules from " << filename << ": " << seconds[1] * 1000.0 << " ms" << endl;
+    cout << "  Kingdoms ending in a different state: " << mismatches << endl;
+}
+
+void runMetricsBenchmark(int kingdomCount, int years, const string& filename) {
+    cout << "===== Metrics Benchmark =====" << endl;
+    cout << "Kingdoms: " << kingdomCount << ", years: " << years << endl;
+
+    // The same seeded batch four times, plain, exporting, exporting, plain, so a later
+    // pass running slower on its own does not count as export overhead
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    double seconds[2] = { 0.0, 0.0 };
+    double cpuSeconds[2] = { 0.0, 0.0 };
+    double writerSeconds = 0.0;
+    uint64_t droppedRows = 0;
+    MetricsExporter exporter;
+    for (int run = 0; run < 4; run++) {
+        int pass = run == 1 || run == 2 ? 1 : 0;
+        srand(12345);
+        vector<unique_ptr<Kingdom>> kingdoms;
+        for (int i = 0; i < kingdomCount; i++) {
+            kingdoms.push_back(make_unique<Kingdom>("Kingdom " + to_string(i)));
+        }
+        if (pass == 1) {
+            if (!exporter.open(filename)) {
+                Logger::setLevel(consoleLevel);
                 return;
             }
+            for (int i = 0; i < kingdomCount; i++) {
+                kingdoms[i]->setMetricsExporter(&exporter, static_cast<uint32_t>(i));
+            }
         }
-    } while (true);
-}
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        double cpuStart = threadCpuSeconds();
+        for (int year = 0; year < years; year++) {
+            for (int i = 0; i < kingdomCount; i++) {
+                kingdoms[i]->advanceYear();
+            }
+        }
+        if (pass == 1) {
+            exporter.close();
+            writerSeconds += exporter.getWriterSeconds();
+            droppedRows += exporter.getDroppedRows();
+        }
+        cpuSeconds[pass] += threadCpuSeconds() - cpuStart;
+        seconds[pass] += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    Logger::setLevel(consoleLevel);
+
+    uint64_t rows = exporter.getRowCount() - exporter.getDroppedRows();
+    cout << "  Rows: " << rows << " in " << exporter.getBytesWritten() << " bytes ("
+        << static_cast<double>(exporter.getBytesWritten()) / max<uint64_t>(1, rows) << " bytes per row, "
+        << MetricsExporter::getColumnCount() << " columns)" << endl;
+    cout << "  Rows dropped while the writer was busy: " << droppedRows << " of " << 2 * exporter.getRowCount() << endl;
+    // Per batch, averaged over the two runs of each. The wall clock also holds the
+    // writer's time whenever it has no core of its own
+    cout << "  Wall clock: " << seconds[0] * 500.0 << " ms plain, " << seconds[1] * 500.0
+        << " ms exporting (" << (seconds[1] / seconds[0] - 1.0) * 100.0 << "% overhead)" << endl;
+    if (cpuSeconds[0] > 0.0) {
+        cout << "  Game thread CPU: " << cpuSeconds[0] * 500.0 << " ms plain, " << cpuSeconds[1] * 500.0
+            << " ms exporting (" << (cpuSeconds[1] / cpuSeconds[0] - 1.0) * 100.0 << "% overhead)" << endl;
+    }
+    cout << "  Writer thread: " << writerSeconds * 500.0 << " ms encoding and writing, on "
+        << thread::hardware_concurrency() << " hardware threads" << endl;
+    cout << "  Read it back with --metrics-csv " << filename << endl;
+}
+
+void runExchangeBenchmark(int orderCount) {
+    cout << "===== Exchange Benchmark =====" << endl;
+    cout << "Orders: " << orderCount << endl;
+
+    // Pre-generate the order flow so only matching is timed
+    struct Op {
+        bool cancel;
+        OrderBook::Side side;
+        int price;
+        int quantity;
+        int pick;
+    };
+    vector<Op> ops(orderCount);
+    for (int i = 0; i < orderCount; i++) {
+        ops[i].cancel = rand() % 10 == 0;
+        ops[i].side = rand() % 2 == 0 ? OrderBook::BUY : OrderBook::SELL;
+        ops[i].price = 500 + (rand() % 41) - 20;
+        ops[i].quantity = 1 + rand() % 100;
+        ops[i].pick = rand();
+    }
 
-void displayBankMenu(Kingdom& kingdom) {
-    int choice;
-    int amount;
+    OrderBook book;
+    vector<OrderBook::Fill> fills;
+    fills.reserve(256);
+    vector<int> live;
+    vector<double> latencies;
+    latencies.reserve(orderCount);
+    long long fillCount = 0;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int i = 0; i < orderCount; i++) {
+        chrono::steady_clock::time_point opStart = chrono::steady_clock::now();
+        if (ops[i].cancel && !live.empty()) {
+            size_t slot = ops[i].pick % live.size();
+            book.cancel(live[slot]);
+            live[slot] = live.back();
+            live.pop_back();
+        }
+        else {
+            fills.clear();
+            int id = book.submit(ops[i].side, 0, ops[i].price, ops[i].quantity, fills);
+            fillCount += fills.size();
+            if (book.getOrder(id)->quantity > 0) {
+                live.push_back(id);
+            }
+        }
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - opStart).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    sort(latencies.begin(), latencies.end());
+    cout << "Continuous matching:" << endl;
+    cout << "  Fills: " << fillCount << endl;
+    cout << "  Throughput: " << static_cast<long long>(orderCount / seconds) << " orders/sec" << endl;
+    cout << "  Latency p50: " << percentile(latencies, 0.50) << " ns" << endl;
+    cout << "  Latency p99: " << percentile(latencies, 0.99) << " ns" << endl;
+    cout << "  Latency p99.9: " << percentile(latencies, 0.999) << " ns" << endl;
+    cout << "  Latency max: " << latencies.back() << " ns" << endl;
+    cout << "  Orders kept: " << book.getStoredOrderCount() << " of " << orderCount << " placed" << endl;
+
+    // Call auction over the same flow, cleared in one pass
+    OrderBook auctionBook;
+    auctionBook.setAuctionMode(true);
+    fills.clear();
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < orderCount; i++) {
+        auctionBook.submit(ops[i].side, 0, ops[i].price, ops[i].quantity, fills);
+    }
+    double submitSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    int clearingPrice = auctionBook.runAuction(fills);
+    double auctionSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << "Auction mode:" << endl;
+    cout << "  Submit throughput: " << static_cast<long long>(orderCount / submitSeconds) << " orders/sec" << endl;
+    cout << "  Clearing price: " << clearingPrice << " ticks, " << fills.size() << " fills" << endl;
+    cout << "  Auction time: " << auctionSeconds * 1000.0 << " ms" << endl;
+
+    // The same flow placed by kingdoms on an exchange: escrow, matching and settlement
+    const int traderCount = 64;
+    const char* const resourceNames[Exchange::RESOURCE_COUNT] = { "Food", "Wood", "Stone", "Iron" };
+    Logger::Level consoleLevel = Logger::getLevel();
+    Logger::setLevel(Logger::LEVEL_OFF);
+    Exchange exchange;
+    vector<unique_ptr<Kingdom>> traders;
+    for (int i = 0; i < traderCount; i++) {
+        traders.push_back(make_unique<Kingdom>("Trader " + to_string(i)));
+        traders.back()->getEconomy()->setTreasuryGold(100000000);
+        exchange.registerKingdom(traders.back().get());
+        for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+            resourceOf(traders[i].get(), r)->changeAmount(10000000);
+        }
+    }
 
-    do {
-        cout << "\n===== Bank Management =====" << endl;
-        cout << "1. Take Loan" << endl;
-        cout << "2. Repay Loan" << endl;
-        cout << "3. View Bank Status" << endl;
-        cout << "4. Back" << endl;
-        cout << "Enter choice: ";
+    // Gold in ticks and goods, wherever they are held
+    long long goldBefore = 0;
+    long long goodsBefore[Exchange::RESOURCE_COUNT] = { 0, 0, 0, 0 };
+    for (int i = 0; i < traderCount; i++) {
+        goldBefore += traders[i]->getEconomy()->getTreasuryGold() * 100LL + exchange.getPendingTicks(i);
+        for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+            goodsBefore[r] += resourceOf(traders[i].get(), r)->getAmount();
+        }
+    }
 
-        if (validateIntInput(choice, "", 1, 4)) {
-            switch (choice) {
-            case 1:
-                if (validateIntInput(amount, "Enter loan amount: ", 1, kingdom.getBank()->getMaxLoanAmount())) {
-                    if (kingdom.getBank()->takeLoan(amount, *kingdom.getEconomy())) {
-                        cout << "Loan of " << amount << " gold taken!" << endl;
-                    }
-                    else {
-                        cout << "Failed to take loan! Amount too high." << endl;
-                    }
-                }
-                break;
-            case 2:
-                if (validateIntInput(amount, "Enter amount to repay: ", 1, kingdom.getEconomy()->getDebt())) {
-                    if (kingdom.getBank()->repayLoan(amount, *kingdom.getEconomy())) {
-                        cout << "Repaid " << amount << " gold of loan!" << endl;
-                    }
-                    else {
-                        cout << "Failed to repay loan! Check funds or debt." << endl;
-                    }
-                }
-                break;
-            case 3:
-                cout << "\nBank Status:" << endl;
-                cout << "  Interest Rate: " << kingdom.getBank()->getInterestRate() * 100 << "%" << endl;
-                cout << "  Current Loans: " << kingdom.getBank()->getCurrentLoans() << " gold" << endl;
-                cout << "  Corruption Level: " << kingdom.getBank()->getCorruptionLevel() << endl;
-                break;
-            case 4:
-                return;
+    vector<pair<int, int>> resting;
+    long long rejected = 0;
+    latencies.clear();
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < orderCount; i++) {
+        int resource = ops[i].pick % Exchange::RESOURCE_COUNT;
+        int trader = (ops[i].pick / Exchange::RESOURCE_COUNT) % traderCount;
+        chrono::steady_clock::time_point opStart = chrono::steady_clock::now();
+        if (ops[i].cancel && !resting.empty()) {
+            size_t slot = ops[i].pick % resting.size();
+            exchange.cancelOrder(resourceNames[resting[slot].first], resting[slot].second);
+            resting[slot] = resting.back();
+            resting.pop_back();
+        }
+        else {
+            int id = exchange.placeOrder(trader, resourceNames[resource], ops[i].side, ops[i].price / 100.0,
+                ops[i].quantity);
+            if (id < 0) {
+                rejected++;
+            }
+            else if (exchange.getBook(resource).getOrder(id)->quantity > 0) {
+                resting.push_back(make_pair(resource, id));
             }
         }
-    } while (true);
-}
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - opStart).count());
+    }
+    seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-void clearScreen() {
-    system("cls");
-}
+    size_t storedOrders = 0;
+    for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+        storedOrders += exchange.getBook(r).getStoredOrderCount();
+    }
 
-void pauseScreen() {
-    cout << "\nPress Enter to continue...";
-    cin.ignore(10000, '\n');
+    // Cancelling what still rests hands every escrow back, so nothing may be missing after
+    for (size_t i = 0; i < resting.size(); i++) {
+        exchange.cancelOrder(resourceNames[resting[i].first], resting[i].second);
+    }
+    long long goldAfter = 0;
+    long long goodsDiffering = 0;
+    for (int i = 0; i < traderCount; i++) {
+        goldAfter += traders[i]->getEconomy()->getTreasuryGold() * 100LL + exchange.getPendingTicks(i);
+    }
+    for (int r = 0; r < Exchange::RESOURCE_COUNT; r++) {
+        long long goods = 0;
+        for (int i = 0; i < traderCount; i++) {
+            goods += resourceOf(traders[i].get(), r)->getAmount();
+        }
+        goodsDiffering += goods > goodsBefore[r] ? goods - goodsBefore[r] : goodsBefore[r] - goods;
+    }
+
+    // A kingdom's own market trades now go through the exchange too
+    int foodBefore = resourceOf(traders[1].get(), Exchange::FOOD)->getAmount();
+    traders[0]->getMarket()->sellResource<standardRuleset>("Food", 100, *traders[0]->getEconomy());
+    traders[1]->getMarket()->buyResource("Food", 100, *traders[1]->getEconomy());
+    int delivered = resourceOf(traders[1].get(), Exchange::FOOD)->getAmount() - foodBefore;
+    Logger::setLevel(consoleLevel);
+
+    sort(latencies.begin(), latencies.end());
+    cout << "Settlement between " << traderCount << " kingdoms:" << endl;
+    cout << "  Trades: " << exchange.getTradeCount() << ", volume " << exchange.getTradedVolume()
+        << ", rejected orders: " << rejected << endl;
+    cout << "  Throughput: " << static_cast<long long>(orderCount / seconds) << " orders/sec" << endl;
+    cout << "  Latency p50: " << percentile(latencies, 0.50) << " ns" << endl;
+    cout << "  Latency p99: " << percentile(latencies, 0.99) << " ns" << endl;
+    cout << "  Latency p99.9: " << percentile(latencies, 0.999) << " ns" << endl;
+    cout << "  Latency max: " << latencies.back() << " ns" << endl;
+    cout << "  Orders kept: " << storedOrders << " of " << orderCount << " placed" << endl;
+    cout << "  Gold created or lost (ticks): " << goldAfter - goldBefore << ", goods: " << goodsDiffering << endl;
+    cout << "  Market trades through the exchange: " << delivered << " of 100 food delivered" << endl;
 }
@@ -6,8 +6,18 @@
 #include <string>
 #include <ctime>
 #include <cstdlib>
+#include <cstdio>
 #include <memory>
 #include <cstring>
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
 
  // Forward declarations
 class Kingdom;
@@ -16,9 +26,425 @@ class Army;
 class Economy;
 class Resource;
 class Market;
+class Exchange;
 class Diplomacy;
 class Bank;
 class RandomEvents;
+struct Ruleset;
+
+// StringTable class - interns names for the life of the process. Equal names share one
+// handle, so comparing names is an integer compare and reading one never copies it
+class StringTable {
+public:
+    typedef uint32_t Handle;
+
+    enum : uint32_t {
+        NO_HANDLE = 0xFFFFFFFFu
+    };
+
+private:
+    enum {
+        CHUNK_BITS = 12,
+        CHUNK_SIZE = 1 << CHUNK_BITS,
+        MAX_CHUNKS = 1 << 12,           // Room for 16M names
+        INITIAL_SLOTS = 1 << 10
+    };
+
+    // Handles by name hash, open-addressed and at most half full. A full index is
+    // replaced by one twice the size; replaced ones stay allocated, since a reader may
+    // still be probing one
+    struct Index {
+        size_t mask;
+        std::unique_ptr<std::atomic<Handle>[]> slots;
+    };
+
+    // Names never move once stored, so the chunks point at them. Chunks, index slots and
+    // the index itself are published with release stores, so lookups and finds need no
+    // lock; only adding a name takes it
+    std::deque<std::string> names;
+    std::atomic<const std::string**> chunks[MAX_CHUNKS];
+    std::atomic<Index*> index;
+    std::vector<std::unique_ptr<Index>> indexes;
+    std::mutex mutex;
+
+    StringTable();
+    static StringTable& instance();
+    static std::unique_ptr<Index> makeIndex(size_t slotCount);
+    static Handle probe(const Index& index, const std::string& text, size_t& slot);
+    Index* growIndex();
+
+public:
+    static Handle intern(const std::string& text);
+    // NO_HANDLE for a name never interned; lookups of names from outside use this, so
+    // they cannot grow the table
+    static Handle find(const std::string& text);
+    static const std::string& lookup(Handle handle);
+    static size_t getCount();
+    static size_t memoryUsage();
+};
+
+// Logger class - leveled log; callers copy raw arguments into a per-thread ring
+// and a background writer formats and writes them in batches
+class Logger {
+public:
+    enum Level {
+        LEVEL_DEBUG,
+        LEVEL_INFO,
+        LEVEL_WARNING,
+        LEVEL_ERROR,
+        LEVEL_OFF
+    };
+
+    // Tags log calls made on this thread with a kingdom name while in scope
+    class KingdomScope {
+    private:
+        StringTable::Handle previousTag;
+
+    public:
+        KingdomScope(StringTable::Handle kingdomName);
+        ~KingdomScope();
+    };
+
+    // Formats use {} for each argument; the format must be a string literal
+    template <typename... Args>
+    static void debug(const char* format, const Args&... args) {
+        log(LEVEL_DEBUG, format, args...);
+    }
+
+    template <typename... Args>
+    static void info(const char* format, const Args&... args) {
+        log(LEVEL_INFO, format, args...);
+    }
+
+    template <typename... Args>
+    static void warning(const char* format, const Args&... args) {
+        log(LEVEL_WARNING, format, args...);
+    }
+
+    template <typename... Args>
+    static void error(const char* format, const Args&... args) {
+        log(LEVEL_ERROR, format, args...);
+    }
+
+    template <typename... Args>
+    static void log(Level level, const char* format, const Args&... args) {
+        // Disabled levels cost one relaxed load
+        if (level < activeLevel.load(std::memory_order_relaxed)) {
+            return;
+        }
+        Record& record = beginRecord(level, format);
+        capture(record, args...);
+        commitRecord();
+    }
+
+    static void setLevel(Level level);
+    static Level getLevel();
+    // Decorated output prefixes each line with time, level and kingdom
+    static void setDecorated(bool decorated);
+    static void setOutput(std::ostream* output);
+    // Blocks until everything logged so far has been written
+    static void flush();
+
+private:
+    enum {
+        MAX_ARGUMENTS = 6,
+        TEXT_CAPACITY = 96,
+        RING_SIZE = 1024
+    };
+
+    enum ArgumentType : uint8_t {
+        ARGUMENT_INTEGER,
+        ARGUMENT_UNSIGNED,
+        ARGUMENT_REAL,
+        ARGUMENT_BOOL,
+        ARGUMENT_CHAR,
+        ARGUMENT_TEXT
+    };
+
+    struct Argument {
+        ArgumentType type;
+        uint16_t textOffset;
+        uint16_t textLength;
+        union {
+            long long integer;
+            unsigned long long unsignedInteger;
+            double real;
+        };
+    };
+
+    // Unformatted log call; strings are copied into the inline text area
+    struct Record {
+        const char* format;
+        std::chrono::steady_clock::time_point time;
+        StringTable::Handle kingdomTag;
+        uint8_t level;
+        uint8_t argumentCount;
+        uint16_t textUsed;
+        Argument arguments[MAX_ARGUMENTS];
+        char text[TEXT_CAPACITY];
+    };
+
+    // Single-producer single-consumer ring owned by one logging thread
+    struct ThreadBuffer {
+        Record records[RING_SIZE];
+        std::atomic<uint32_t> head;
+        std::atomic<uint32_t> tail;
+    };
+
+    static std::atomic<int> activeLevel;
+
+    static Record& beginRecord(Level level, const char* format);
+    static void commitRecord();
+
+    static void capture(Record&) {}
+
+    template <typename First, typename... Rest>
+    static void capture(Record& record, const First& first, const Rest&... rest) {
+        addArgument(record, first);
+        capture(record, rest...);
+    }
+
+    static void addArgument(Record& record, int value);
+    static void addArgument(Record& record, long value);
+    static void addArgument(Record& record, long long value);
+    static void addArgument(Record& record, unsigned int value);
+    static void addArgument(Record& record, unsigned long value);
+    static void addArgument(Record& record, unsigned long long value);
+    static void addArgument(Record& record, double value);
+    static void addArgument(Record& record, bool value);
+    static void addArgument(Record& record, char value);
+    static void addArgument(Record& record, const char* value);
+    static void addArgument(Record& record, const std::string& value);
+    static Argument* nextArgument(Record& record, ArgumentType type);
+    static void addText(Record& record, const char* text, size_t length);
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::ostream* output;
+    bool decorated;
+    bool stopping;
+    bool flushRequested;
+    uint64_t startedPasses;
+    uint64_t completedPasses;
+    std::chrono::steady_clock::time_point startTime;
+    std::thread writer;
+
+    Logger();
+    ~Logger();
+    static Logger& instance();
+    ThreadBuffer& threadBuffer();
+    void writerLoop();
+    void formatRecord(const Record& record, bool decorate, std::string& batch) const;
+};
+
+// CounterRng class - Philox4x32-10 counter-based generator. Every number is a pure
+// function of (seed, kingdom, year, stream, draw index), so any kingdom-year can be
+// regenerated without replaying the years before it
+class CounterRng {
+public:
+    // Each subsystem draws from its own stream, so an extra draw in one leaves the rest unchanged
+    enum Stream : uint32_t {
+        STREAM_POPULATION,
+        STREAM_REBELLION,
+        STREAM_MUTINY,
+        STREAM_RIOTS,
+        STREAM_PRICES,
+        STREAM_DIPLOMACY,
+        STREAM_BANK,
+        STREAM_LEADER,
+        STREAM_EVENTS,
+        STREAM_DYNASTY,
+        STREAM_AGENTS,
+        STREAM_COUNT
+    };
+
+    enum {
+        BLOCK_WORDS = 4     // 32-bit words per Philox block
+    };
+
+    // Routes the year step's draws on this thread to the kingdom's keyed streams while in scope
+    class KingdomScope {
+    private:
+        uint64_t seed;
+        uint32_t kingdom;
+        uint32_t year;
+        uint32_t drawn[STREAM_COUNT];   // Next draw index per stream
+        KingdomScope* previous;
+
+        friend class CounterRng;
+
+    public:
+        KingdomScope(uint64_t seed, uint32_t kingdom, uint32_t year);
+        // Picks up the draw counts an ended scope of the same kingdom-year left off at, so a
+        // year step run in two halves draws what it would in one piece
+        KingdomScope(uint64_t seed, uint32_t kingdom, uint32_t year, const uint32_t resumeDrawn[STREAM_COUNT]);
+        ~KingdomScope();
+
+        const uint32_t* getDrawn() const;
+    };
+
+private:
+    uint32_t key[2];
+    uint32_t counter[4];    // Block index, kingdom, year, stream
+    uint32_t block[BLOCK_WORDS];
+    uint32_t used;          // Words of block already handed out
+
+    void refill();
+
+public:
+    CounterRng(uint64_t seed = 0, uint32_t kingdom = 0, uint32_t year = 0, uint32_t stream = 0);
+
+    static void philox(const uint32_t counter[4], const uint32_t key[2], uint32_t output[4]);
+
+    // Jumps straight to a draw; later draws continue from there
+    void seek(uint64_t index);
+    uint32_t next();
+    double uniform();           // [0, 1)
+    int below(int bound);       // [0, bound)
+    double normal();
+    // Whole vectors per call; normals come in Box-Muller pairs, so count should be even
+    void fillUniform(double* output, size_t count);
+    void fillNormal(double* output, size_t count);
+
+    // One block of a stream for kingdoms firstKingdom .. firstKingdom + count - 1, laid out
+    // lane by lane: output[lane * count + i] is draw block * 4 + lane of kingdom firstKingdom + i,
+    // the same number the scalar generator returns for it
+    static void uniformAcross(uint64_t seed, uint32_t firstKingdom, size_t count, uint32_t year,
+        uint32_t stream, uint32_t block, double* output);
+    static void normalAcross(uint64_t seed, uint32_t firstKingdom, size_t count, uint32_t year,
+        uint32_t stream, uint32_t block, double* output);
+
+    // Year-step draws: the keyed stream inside a KingdomScope, rand() outside one
+    static int draw(Stream stream, int bound);
+    static double drawUniform(Stream stream);
+    // A generator for the next count draws of a stream, so a loop drawing per agent seeks
+    // once; rand() seeds it outside a KingdomScope
+    static CounterRng drawMany(Stream stream, uint32_t count);
+};
+
+// SobolSequence class - quasi-random points in the unit cube from Joe-Kuo direction
+// numbers. They cover the cube more evenly than independent draws, so parameter sweeps
+// need fewer samples for the same accuracy
+class SobolSequence {
+public:
+    enum {
+        MAX_DIMENSIONS = 12,
+        BITS = 32
+    };
+
+private:
+    int dimensions;
+    uint32_t index;
+    uint32_t directions[MAX_DIMENSIONS][BITS];
+    uint32_t state[MAX_DIMENSIONS];
+
+public:
+    explicit SobolSequence(int dimensions);
+
+    int getDimensions() const;
+    // Fills one coordinate per dimension in [0, 1); the all-zero first point is skipped
+    void next(double* point);
+};
+
+// PhaseProfiler class - opt-in totals per phase of the year step: wall time plus hardware
+// counters read with perf_event_open on Linux, printed as one table at shutdown
+class PhaseProfiler {
+public:
+    enum Phase {
+        PHASE_POPULATION,
+        PHASE_HAPPINESS,
+        PHASE_MORALE,
+        PHASE_ECONOMY,
+        PHASE_PRICES,
+        PHASE_PRODUCTION,
+        PHASE_DIPLOMACY,
+        PHASE_BANK,
+        PHASE_LEADER,
+        PHASE_DYNASTY,
+        PHASE_RESOURCES,
+        PHASE_EVENTS,
+        PHASE_UNREST,
+        PHASE_TAXES,
+        PHASE_RECORDING,
+        PHASE_COUNT
+    };
+
+    enum Counter {
+        COUNTER_CYCLES,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_CACHE_MISSES,
+        COUNTER_BRANCH_MISSES,
+        COUNTER_COUNT
+    };
+
+private:
+    // Owned by one thread; the registry keeps it alive after the thread exits
+    struct ThreadCounters {
+        int groupFd;                    // Leader of the counter group, -1 without counters
+        int fds[COUNTER_COUNT];
+        int slots[COUNTER_COUNT];       // Position in a group read, -1 if the counter did not open
+        int openError;                  // errno of the last counter that failed to open
+        uint64_t calls[PHASE_COUNT];
+        uint64_t nanoseconds[PHASE_COUNT];
+        uint64_t counts[PHASE_COUNT][COUNTER_COUNT];
+    };
+
+    static std::atomic<bool> enabled;
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadCounters>> threads;
+
+    PhaseProfiler();
+
+    static PhaseProfiler& instance();
+    ThreadCounters& threadCounters();
+    static void readCounters(const ThreadCounters& counters, uint64_t values[COUNTER_COUNT]);
+
+public:
+    // Charges everything from one enter() to the next, or to the end of scope, to the
+    // entered phase. Costs one flag check per call while profiling is off
+    class Timeline {
+    private:
+        ThreadCounters* counters;
+        int phase;      // -1 before the first enter()
+        uint64_t start[COUNTER_COUNT];
+        std::chrono::steady_clock::time_point startTime;
+
+        void close();
+
+    public:
+        Timeline();
+        ~Timeline();
+
+        void enter(Phase phase);
+    };
+
+    ~PhaseProfiler();
+
+    static void enable();
+    static bool isEnabled();
+    static const char* getPhaseName(Phase phase);
+    // Sums every thread's totals; call once the simulation threads have gone quiet
+    static std::string report();
+    static void printReport();
+};
+
+// Headroom class - narrows wide or real results of the yearly update to an int. A value
+// that does not fit is held at the limit and counted, so a huge kingdom stops growing
+// instead of wrapping
+class Headroom {
+private:
+    static std::atomic<uint64_t> saturations;
+
+public:
+    static int narrow(long long value);
+    // Truncates toward zero like a cast; NaN counts and becomes zero
+    static int truncate(double value);
+    // Values held at a limit so far, by every thread
+    static uint64_t getSaturations();
+};
 
 // Template class for resource management
 template <typename T>
@@ -82,7 +508,7 @@ public:
 // Base Resource class
 class Resource {
 protected:
-    std::string name;
+    StringTable::Handle nameHandle;
     int amount;
     double value;
 
@@ -90,7 +516,8 @@ public:
     Resource(const std::string& name, int amount, double value);
     virtual ~Resource();
 
-    std::string getName() const;
+    const std::string& getName() const;
+    StringTable::Handle getNameHandle() const;
     int getAmount() const;
     double getValue() const;
 
@@ -137,7 +564,7 @@ public:
 // Base Leader class
 class Leader {
 protected:
-    std::string name;
+    StringTable::Handle nameHandle;
     int charisma;
     int intelligence;
     int strength;
@@ -146,7 +573,8 @@ public:
     Leader(const std::string& name, int charisma, int intelligence, int strength);
     virtual ~Leader();
 
-    std::string getName() const;
+    const std::string& getName() const;
+    StringTable::Handle getNameHandle() const;
     int getCharisma() const;
     int getIntelligence() const;
     int getStrength() const;
@@ -158,6 +586,9 @@ public:
 
     // Virtual method for leader-specific effects
     virtual void applyEffects(Kingdom& kingdom);
+
+    // Heap bytes the leader owns; names live in the StringTable
+    virtual size_t memoryUsage() const;
 };
 
 // Leader types
@@ -173,6 +604,7 @@ public:
     int getRoyalBloodline() const;
     int getYearsInPower() const;
     void incrementYearsInPower();
+    void setYearsInPower(int years);
 
     void specialAction(Kingdom& kingdom) override;
     void applyEffects(Kingdom& kingdom) override;
@@ -197,7 +629,7 @@ public:
 
 class GuildLeader : public Leader {
 private:
-    std::string guildType;
+    StringTable::Handle guildTypeHandle;
     int businessAcumen;
 
 public:
@@ -205,13 +637,248 @@ public:
         const std::string& guildType, int businessAcumen);
     ~GuildLeader();
 
-    std::string getGuildType() const;
+    const std::string& getGuildType() const;
+    StringTable::Handle getGuildTypeHandle() const;
     int getBusinessAcumen() const;
 
     void specialAction(Kingdom& kingdom) override;
     void applyEffects(Kingdom& kingdom) override;
 };
 
+// Dynasty class - a kingdom's noble houses as a compact family tree. Adult nobles
+// wait in an indexed max-heap by succession score, so crowning one is a heap pop
+class Dynasty {
+public:
+    enum : uint32_t {
+        NO_NOBLE = 0xFFFFFFFFu
+    };
+
+    enum {
+        AGE_OF_MAJORITY = 16
+    };
+
+private:
+    typedef std::pair<int32_t, uint32_t> YearEntry;
+
+    // One row per noble; a dead noble's row is reused once no child points to it
+    std::vector<uint32_t> parent;
+    std::vector<uint32_t> firstChild;
+    std::vector<uint32_t> nextSibling;
+    std::vector<int32_t> birthYear;
+    std::vector<uint16_t> house;
+    std::vector<uint8_t> lifespan;
+    std::vector<uint8_t> charisma;
+    std::vector<uint8_t> intelligence;
+    std::vector<uint8_t> strength;
+    std::vector<uint8_t> legitimacy;    // 40 for a ruler's child, halved each generation
+    std::vector<uint8_t> givenName;
+    std::vector<uint8_t> alive;
+    std::vector<float> score;
+    std::vector<uint32_t> heapPosition; // NO_NOBLE while not a candidate
+    std::vector<uint32_t> freeRows;
+
+    std::vector<uint32_t> candidates;   // Indexed max-heap of rows by score
+    std::vector<YearEntry> deaths;      // Min-heaps by year
+    std::vector<YearEntry> comingOfAge;
+    std::vector<StringTable::Handle> houseNames;
+    uint32_t ruler;
+    int livingCount;
+    int capacity;                       // Births stop at this many living nobles
+    int lastYear;                       // Of the founding or the last advance
+
+    uint32_t addNoble(uint32_t parentRow, int houseId, int born, int year);
+    void die(uint32_t row);
+    void release(uint32_t row);
+    void rescore(uint32_t row);
+    void siftUp(uint32_t position);
+    void siftDown(uint32_t position);
+    void pushCandidate(uint32_t row);
+    void removeCandidate(uint32_t row);
+
+public:
+    Dynasty();
+    ~Dynasty();
+
+    // Starts the houses with members of every age, each family a tree under its founder
+    void found(int houseCount, int noblesPerHouse, int year);
+    // Forgets every noble and house, keeping the allocations for the next found()
+    void clear();
+    // Every row and the candidate heap as little-endian bytes, so a loaded dynasty crowns and
+    // grows the same nobles; load returns false and leaves the houses cleared if the bytes are damaged
+    void save(std::vector<unsigned char>& out) const;
+    bool load(const unsigned char* in, size_t length);
+    // Births, comings of age and deaths; returns true if the ruler died
+    bool advanceYear(int year);
+    // Takes the best-scoring candidate off the heap and makes them ruler; NO_NOBLE if none
+    uint32_t crownSuccessor();
+    // The ruler came from outside the houses
+    void clearRuler();
+    // King, Commander or Guild Leader, whichever the noble's traits favour
+    std::unique_ptr<Leader> makeLeader(uint32_t noble) const;
+
+    std::string getNobleName(uint32_t noble) const;
+    uint32_t getParent(uint32_t noble) const;
+    int getBirthYear(uint32_t noble) const;
+    double getScore(uint32_t noble) const;
+    bool isCandidate(uint32_t noble) const;
+    uint32_t getBestCandidate() const;
+    uint32_t getRuler() const;
+    int getLivingCount() const;
+    int getCandidateCount() const;
+    int getHouseCount() const;
+    size_t getRowCount() const;
+    size_t memoryUsage() const;
+};
+
+// CitizenAgents class - opt-in per-citizen simulation stored as SoA columns
+class CitizenAgents {
+private:
+    std::vector<uint8_t> socialClass;
+    std::vector<float> wealth;
+    std::vector<float> loyalty;
+    std::vector<float> happiness;
+    int classCounts[3];
+    double averageHappiness;
+    double discontentShare;
+
+    void addAgents(int socialClassId, int count, double initialHappiness);
+    void removeAgents(const int excess[3]);
+
+public:
+    enum SocialClass {
+        PEASANT = 0,
+        MERCHANT = 1,
+        NOBLE = 2
+    };
+
+    CitizenAgents();
+    ~CitizenAgents();
+
+    int getCount() const;
+    int getClassCount(int socialClassId) const;
+    double getAverageHappiness() const;
+    double getDiscontentShare() const;
+    size_t memoryUsage() const;
+
+    // Grow or shrink the agent columns to match the population counts
+    void syncCounts(int peasants, int merchants, int nobles, double initialHappiness);
+
+    // Vectorizable kernels, each one pass over the columns
+    template <const Ruleset& rules> void applyTaxes(double peasantRate, double merchantRate, double nobleRate);
+    void applyFood(double foodPerPerson);
+    template <const Ruleset& rules> void applyArmy(double armyPresence, double inflation, bool atWar);
+    void shiftHappiness(double delta);
+    void summarize();
+};
+
+// Ruleset struct - balance constants for the yearly simulation
+// The defaults are the shipped rules; the engine takes a ruleset as a template
+// parameter so these fold into the code, while a designer copy loads from a file
+struct Ruleset {
+    // Population growth, as a yearly rate
+    double baseGrowth = 0.05;
+    double growthPerHappiness = 0.05;
+    double growthPerTaxBurden = 0.1;
+    double growthPerFoodSecurity = 0.02;
+    double minGrowth = 0.01;
+    double maxGrowth = 0.2;
+    double merchantGrowthShare = 0.8;
+    double nobleGrowthShare = 0.5;
+    int peasantRiseChance = 5;          // Percent per year
+    int merchantRiseChance = 2;         // Percent per year
+    double socialMobilityShare = 0.01;
+
+    // Happiness
+    double armyPresenceWeight = 0.5;
+    double peasantTaxWeight = 2;
+    double merchantTaxWeight = 1.5;
+    double nobleTaxWeight = 0.5;
+    double inflationUnhappiness = 2.0;
+    double happinessMemory = 0.7;
+    double happinessPerTax = 0.1;
+    double happinessPerArmy = 0.1;
+    double happinessPerInflation = 0.1;
+    double rebellionHappiness = 0.2;
+    double agentRebellionShare = 0.15;
+    double rebellionChanceScale = 2;
+
+    // Citizen agents; class incomes are the tax yields and the burdens the tax weights
+    double agentWealthMemory = 0.9;
+    double agentTaxBurden = 2.5;        // Scales an agent's felt tax rate
+    double loyaltyMemory = 0.9;
+    double loyaltyPerHappiness = 0.1;
+    double warLoyaltyLoss = 0.02;
+
+    // Army
+    int soldierPay = 5;                 // Gold per soldier for full morale
+    double moraleMemory = 0.7;
+    double moralePerPay = 0.1;
+    double moralePerSupport = 0.1;
+    double warMoraleLoss = 0.1;
+    double peaceMoraleGain = 0.05;
+    double minMorale = 0.1;
+    double mutinyMorale = 0.2;
+    double mutinyHappiness = 0.3;
+    double mutinyChanceScale = 3;
+
+    // Economy
+    int peasantTaxYield = 2;            // Gold per head at a 100% rate
+    int merchantTaxYield = 10;
+    int nobleTaxYield = 50;
+    int soldierUpkeep = 2;
+    int citizensPerBureaucrat = 10;
+    double activityScale = 1000.0;
+    double treasuryScale = 10000.0;
+    double inflationMemory = 0.8;
+    double inflationPerActivity = 0.05;
+    double inflationPerTreasury = 0.03;
+    double minInflation = 0.01;
+    double maxInflation = 0.2;
+    double unrestTaxWeight = 0.5;
+    double inflationImpact = 5.0;
+    double unrestInflationWeight = 0.3;
+    double unrestHappinessWeight = 0.5;
+    double riotUnrest = 0.6;
+
+    // Market
+    double foodBasePrice = 1.0;
+    double woodBasePrice = 2.0;
+    double stoneBasePrice = 3.0;
+    double ironBasePrice = 5.0;
+    int priceSwing = 10;                // Percent either way
+    double marketFee = 0.1;             // Share of a sale the market keeps
+    int peasantsPerWorker = 5;
+    int foodPerWorker = 2;
+    int workersPerWood = 1;
+    int workersPerStone = 2;
+    int workersPerIron = 4;
+    int merchantsPerTrade = 2;
+    int goldPerTrade = 2;
+    int foodPerCitizen = 1;
+    int foodPerSoldier = 2;
+    int citizensPerWood = 10;
+    int citizensPerIron = 50;
+    int soldiersPerIron = 20;
+
+    // Score
+    int scorePerCitizen = 10;
+    int scorePerSoldier = 20;
+    int goldPerPoint = 10;
+    int happinessScore = 1000;
+    int scorePerYear = 100;
+    int debtPerPoint = 5;
+    int inflationPenalty = 2000;
+
+    // Key = value lines; keys left out keep the shipped value
+    bool load(const std::string& filename);
+    bool save(const std::string& filename) const;
+};
+
+// The shipped rules, constant-folded into the engine
+extern const Ruleset standardRuleset;
+// Rules loaded at runtime for balance experiments
+extern Ruleset designerRuleset;
+
 // Population class - manages different population groups
 class Population {
 private:
@@ -220,6 +887,7 @@ private:
     int nobles;
     double growthRate;
     double happiness;
+    std::unique_ptr<CitizenAgents> agents;
 
 public:
     Population(int initialPeasants = 100, int initialMerchants = 20, int initialNobles = 5);
@@ -238,9 +906,15 @@ public:
     void setGrowthRate(double rate);
     void setHappiness(double value);
 
-    void updatePopulation(const Economy& economy, const Army& army);
-    void calculateHappiness(const Economy& economy, const Army& army);
-    bool checkRebellion() const;
+    // Agent mode: simulate every citizen individually
+    void enableAgentMode();
+    void disableAgentMode();
+    bool isAgentMode() const;
+    CitizenAgents* getAgents() const;
+
+    template <const Ruleset& rules> void updatePopulation(const Economy& economy, const Army& army);
+    template <const Ruleset& rules> void calculateHappiness(const Economy& economy, const Army& army, double foodPerPerson = 1.0);
+    template <const Ruleset& rules> bool checkRebellion() const;
 };
 
 // Army class - manages military forces
@@ -274,9 +948,9 @@ public:
 
     void trainArmy();
     int calculateStrength() const;
-    void updateMorale(const Economy& economy, const Population& population);
+    template <const Ruleset& rules> void updateMorale(const Economy& economy, const Population& population);
     int calculateDesertion();
-    bool checkRebellion(const Population& population) const;
+    template <const Ruleset& rules> bool checkRebellion(const Population& population) const;
 };
 
 // Economy class - manages taxes and finances
@@ -308,10 +982,95 @@ public:
     void setTreasuryGold(int amount);
     void setDebt(int amount);
 
-    int collectTaxes(const Population& population);
-    void updateEconomy(const Population& population, const Army& army);
-    double calculateUnrest(const Population& population) const;
-    bool checkRiots(const Population& population) const;
+    template <const Ruleset& rules> int collectTaxes(const Population& population);
+    template <const Ruleset& rules> void updateEconomy(const Population& population, const Army& army);
+    template <const Ruleset& rules> double calculateUnrest(const Population& population) const;
+    template <const Ruleset& rules> bool checkRiots(const Population& population) const;
+};
+
+// PriceHistory class - bounded yearly price series for one resource
+class PriceHistory {
+public:
+    static const int DEFAULT_RECENT_YEARS = 128;
+
+    struct Stats {
+        int count;
+        double minimum;
+        double maximum;
+        double mean;
+        double volatility; // Standard deviation of yearly log returns
+    };
+
+private:
+    static const int BLOCK_YEARS = 64;
+    static const int MAX_DETAILED_BLOCKS = 32;
+    static const int MAX_BLOCKS = 96;
+
+    // Range aggregates kept for every block so full blocks are never decoded
+    struct Summary {
+        int count;
+        double minimum;
+        double maximum;
+        double sum;
+        double sumSquares;
+        int returnCount;
+        double returnSum;
+        double returnSumSquares;
+    };
+
+    // Closed run of years; bits are dropped once the block is coarsened
+    struct Block {
+        int firstYear;
+        int yearCount;
+        bool hasEntryReturn;
+        double entryReturn;
+        Summary summary;
+        std::vector<uint8_t> bits;
+    };
+
+    // Ring of the newest years, grown as they arrive up to recentCapacity
+    std::vector<double> recent;
+    int recentCapacity;
+    int recentStart;
+    int recentCount;
+    int firstRecentYear;
+    bool hasLastBlockValue;
+    double lastBlockValue;
+    std::vector<Block> blocks;
+    int detailedBlocks;
+
+    static void clearSummary(Summary& summary);
+    static void addValue(Summary& summary, double value);
+    static void addReturn(Summary& summary, double previous, double value);
+    static void mergeSummary(Summary& into, const Summary& from);
+    static void encodeBlock(const double* values, int count, std::vector<uint8_t>& bits);
+    static void decodeBlock(const std::vector<uint8_t>& bits, int count, double* values);
+
+    double recentAt(int index) const;
+    void pushRecent(double price);
+    void sealOldestBlock();
+    void coarsen();
+    void accumulate(int fromYear, int toYear, Summary& result) const;
+
+public:
+    // Years kept exact in the ring before they are sealed into blocks; rounded up to
+    // whole blocks, two at least
+    explicit PriceHistory(int recentYears = DEFAULT_RECENT_YEARS);
+    ~PriceHistory();
+
+    // Years are expected in order; gaps repeat the previous price
+    void record(int year, double price);
+
+    bool isEmpty() const;
+    int getFirstYear() const;
+    int getLastYear() const;
+    size_t getMemoryUsage() const;
+
+    // Exact inside the detailed horizon, block average for coarsened years. A range that
+    // cuts a coarsened block takes that block's covered years at its average
+    double getPrice(int year) const;
+    double movingAverage(int endYear, int window) const;
+    Stats getStats(int fromYear, int toYear) const;
 };
 
 // Market class - manages trading and resources
@@ -323,29 +1082,320 @@ private:
     std::shared_ptr<Stone> stone;
     std::shared_ptr<Iron> iron;
     double priceFluctuation;
+    PriceHistory foodHistory;
+    PriceHistory woodHistory;
+    PriceHistory stoneHistory;
+    PriceHistory ironHistory;
+    Exchange* exchange;     // Shared, not owned
+    int exchangeId;
 
 public:
     Market();
     ~Market();
 
-    std::shared_ptr<Food> getFood() const;
-    std::shared_ptr<Gold> getGold() const;
-    std::shared_ptr<Wood> getWood() const;
-    std::shared_ptr<Stone> getStone() const;
-    std::shared_ptr<Iron> getIron() const;
-
-    void updatePrices(const Economy& economy);
+    // Once set, buying and selling place limit orders on the exchange at this market's prices
+    void setExchange(Exchange* shared, int kingdomId);
+    Exchange* getExchange() const;
+
+    const std::shared_ptr<Food>& getFood() const;
+    const std::shared_ptr<Gold>& getGold() const;
+    const std::shared_ptr<Wood>& getWood() const;
+    const std::shared_ptr<Stone>& getStone() const;
+    const std::shared_ptr<Iron>& getIron() const;
+
+    // Yearly amounts without touching stock, indexed by Exchange::ResourceType
+    template <const Ruleset& rules> void projectProduction(const Population& population, int amounts[4]) const;
+    template <const Ruleset& rules> void projectConsumption(const Population& population, const Army& army, int amounts[4]) const;
+
+    template <const Ruleset& rules> void updatePrices(const Economy& economy);
+    void recordPrices(int year);
+    void clearPriceHistory();
+    bool hasPriceHistory() const;
+    const PriceHistory* getPriceHistory(const std::string& resourceType) const;
+    // With an exchange these are true once the order is placed; it fills as sellers or buyers arrive
     bool buyResource(const std::string& resourceType, int amount, Economy& economy);
-    bool sellResource(const std::string& resourceType, int amount, Economy& economy);
-    void produceResources(const Population& population);
-    void consumeResources(const Population& population, const Army& army);
+    template <const Ruleset& rules> bool sellResource(const std::string& resourceType, int amount, Economy& economy);
+    template <const Ruleset& rules> void produceResources(const Population& population);
+    template <const Ruleset& rules> void consumeResources(const Population& population, const Army& army);
+
+    // Heap bytes of the resources and price histories
+    size_t memoryUsage() const;
+};
+
+// OrderBook class - limit order book for one resource with price-time priority
+class OrderBook {
+public:
+    enum Side {
+        BUY,
+        SELL
+    };
+
+    struct Order {
+        int id;
+        int kingdomId;
+        Side side;
+        int price;          // In ticks of 0.01 gold
+        int quantity;       // Remaining quantity, 0 once filled or cancelled
+        long long reserved; // Gold ticks or goods an exchange holds back for it; the book only carries it
+    };
+
+    struct Fill {
+        int buyOrderId;
+        int sellOrderId;
+        int buyerId;
+        int sellerId;
+        int price;
+        int quantity;
+    };
+
+private:
+    // Slots of the orders at one price in arrival order; filled orders are skipped via head
+    struct PriceLevel {
+        std::vector<int> queue;
+        size_t head;
+        int volume;
+    };
+
+    // Live orders and the dead ones since the last compaction, in id order. Orders from
+    // tailId on sit at tailSlot plus their distance from it; older ones are searched for
+    std::vector<Order> orders;
+    std::vector<PriceLevel> bidLevels;
+    std::vector<PriceLevel> askLevels;
+    int maxTick;
+    int bestBid;    // 0 when there are no bids
+    int bestAsk;    // maxTick + 1 when there are no asks
+    bool auctionMode;
+    int nextId;
+    int tailId;
+    size_t tailSlot;
+    size_t deadOrders;
+
+    int slotOf(int orderId) const;
+    void compact();
+    void rest(int slot);
+    void popFront(PriceLevel& level);
+    void refreshBestBid();
+    void refreshBestAsk();
+    void match(int executionPrice, bool useRestingPrice, std::vector<Fill>& fills);
+
+public:
+    OrderBook(int maxPriceTicks = 100000);
+    ~OrderBook();
+
+    int getBestBid() const;
+    int getBestAsk() const;
+    int getMaxTick() const;
+    int getDepth(Side side, int price) const;
+    // Null once the order has been filled or cancelled and compacted away
+    const Order* getOrder(int orderId) const;
+    Order* getOrder(int orderId);
+    // Orders held, live or not yet compacted
+    size_t getStoredOrderCount() const;
+    bool isAuctionMode() const;
+
+    // In auction mode orders only rest until runAuction() is called
+    void setAuctionMode(bool enabled);
+
+    // Returns the new order id, or -1 for an invalid order. Orders filled or cancelled
+    // before this call may be compacted away by it
+    int submit(Side side, int kingdomId, int price, int quantity, std::vector<Fill>& fills,
+        long long reserved = 0);
+    bool cancel(int orderId);
+
+    // Uniform-price call auction; returns the clearing price or 0 if nothing crosses
+    int runAuction(std::vector<Fill>& fills);
+};
+
+// Exchange class - order books between kingdoms with escrow and settlement. Each order
+// carries what it holds back from its owner until it fills or is cancelled
+class Exchange {
+public:
+    enum ResourceType {
+        FOOD,
+        WOOD,
+        STONE,
+        IRON,
+        RESOURCE_COUNT
+    };
+
+private:
+    OrderBook books[RESOURCE_COUNT];
+    std::vector<Kingdom*> kingdoms;
+    std::vector<long long> pendingTicks;
+    std::vector<OrderBook::Fill> fills;
+    long long tradeCount;
+    long long tradedVolume;
+
+    Resource* getResource(int kingdomId, int resource) const;
+    void creditTicks(int kingdomId, long long ticks);
+    void releaseEscrow(int resource, int orderId);
+    void settle(int resource);
+
+public:
+    Exchange();
+    ~Exchange();
+
+    static int resourceIndex(const std::string& resourceType);
+
+    // The kingdom's Market trades go through the exchange from then on; the exchange must
+    // outlive its trading
+    int registerKingdom(Kingdom* kingdom);
+    int getKingdomCount() const;
+    // Fractions of a coin owed to the kingdom, paid once they add up to one
+    long long getPendingTicks(int kingdomId) const;
+    OrderBook& getBook(int resource);
+    long long getTradeCount() const;
+    long long getTradedVolume() const;
+
+    void setAuctionMode(bool enabled);
+
+    // Prices are in gold per unit; returns the order id or -1
+    int placeOrder(int kingdomId, const std::string& resourceType, OrderBook::Side side,
+        double price, int quantity);
+    bool cancelOrder(const std::string& resourceType, int orderId);
+
+    // Clears every book in auction mode; call once per day or year
+    void runAuctions();
+};
+
+// TradeNetwork class - persistent trade routes with yearly min-cost resource flows
+class TradeNetwork {
+public:
+    struct Route {
+        int from;
+        int to;
+        int capacity;       // Units per year in each direction, shared by all goods
+        int costPerUnit;
+        bool active;
+    };
+
+private:
+    struct Arc {
+        int to;
+        int capacity;
+        int cost;
+        int flow;
+    };
+
+    std::vector<Kingdom*> kingdoms;
+    std::vector<Route> routes;
+    std::vector<int> routeFlows;        // Signed, route * RESOURCE_COUNT + resource
+    std::vector<int> routeUsed;         // Capacity each good took, (route * RESOURCE_COUNT + resource) * 2 + direction
+    std::vector<int> supply;            // Kingdom * RESOURCE_COUNT + resource
+    std::vector<int> demand;
+    std::vector<int> solvedSupply;
+    std::vector<int> solvedDemand;
+    std::vector<int> componentOf;
+    std::vector<std::vector<int> > componentMembers;
+    std::vector<std::vector<int> > componentRoutes;
+    std::vector<bool> componentDirty;
+    std::vector<int> componentFirstGood;    // The first good whose balance moved, or RESOURCE_COUNT
+    std::vector<bool> componentSolved;  // Re-solved by the last solve
+    std::vector<int> touchedKingdoms;   // Route endpoints changed since the last solve
+    std::vector<int> localIndex;
+    int componentCount;
+    bool topologyChanged;
+    int lastSolvedComponents;
+    int lastSolvedGoods;
+    long long lastPlanned;              // Units the flows called for last year
+    long long lastShipped;              // Units the exporters had and the importers could pay for
+    long long lastTransportCost;        // Gold importers paid the routes on top of the goods
+
+    void rebuildComponents();
+    void computeBalances();
+    bool balanceChanged(int kingdomIndex, int resource) const;
+    // Goods before firstResource keep their flows and the capacity they took
+    void solveComponent(int component, int firstResource);
+    void applyFlows();
+
+public:
+    TradeNetwork();
+    ~TradeNetwork();
+
+    int addKingdom(Kingdom* kingdom);
+    int addRoute(int from, int to, int capacity, int costPerUnit);
+    void setRouteActive(int routeId, bool active);
+
+    int getKingdomCount() const;
+    int getRouteCount() const;
+    const Route& getRoute(int routeId) const;
+    int getFlow(int routeId, int resource) const;
+    int getComponentCount() const;
+    int getLastSolvedComponents() const;
+    // Goods re-solved by the last solve, counted once per component
+    int getLastSolvedGoods() const;
+    long long getLastPlanned() const;
+    long long getLastShipped() const;
+    long long getLastTransportCost() const;
+    // Whether the last solve re-solved the kingdom's component rather than keeping its flows
+    bool wasSolved(int kingdomId) const;
+
+    // Re-solves the components whose routes moved, and in the others each good from the
+    // first one whose balance moved, since later goods use the capacity it leaves; or
+    // re-solves everything
+    void solve(bool everything = false);
+    // Solves, then ships goods. Importers pay the exporter's price plus the route's cost
+    // per unit, and only as many units as their treasury covers move
+    void advanceYear();
+};
+
+// BattleEngine class - batched Lanchester-style battles resolved in engagement rounds
+class BattleEngine {
+public:
+    struct Force {
+        int infantry;
+        int cavalry;
+        int archers;
+        double morale;
+        int trainingLevel;
+    };
+
+    struct Result {
+        Force attacker;
+        Force defender;
+        bool attackerWon;
+        int rounds;
+    };
+
+private:
+    // One entry per battle in each column so a round is a single pass
+    std::vector<float> attackerInfantry;
+    std::vector<float> attackerCavalry;
+    std::vector<float> attackerArchers;
+    std::vector<float> attackerMorale;
+    std::vector<float> attackerQuality;
+    std::vector<float> defenderInfantry;
+    std::vector<float> defenderCavalry;
+    std::vector<float> defenderArchers;
+    std::vector<float> defenderMorale;
+    std::vector<float> defenderQuality;
+    std::vector<float> active;
+    std::vector<float> roundsFought;
+    std::vector<int> attackerTraining;
+    std::vector<int> defenderTraining;
+
+public:
+    BattleEngine();
+    ~BattleEngine();
+
+    int addBattle(const Force& attacker, const Force& defender);
+    int getBattleCount() const;
+    void clear();
+
+    // Every battle advances together until it breaks or maxRounds is reached
+    void resolveAll(int maxRounds = 12);
+    Result getResult(int battle) const;
+
+    // Conversions between a force and a single strength figure
+    static int calculateStrength(const Force& force);
+    static Force forceFromStrength(int strength);
 };
 
 // Diplomacy class - manages relations with other kingdoms
 class Diplomacy {
 private:
     struct Kingdom {
-        std::string name;
+        StringTable::Handle nameHandle;
         int relationLevel;
         bool isAlly;
         bool atWar;
@@ -355,18 +1405,30 @@ private:
     Kingdom* foreignKingdoms;
     int kingdomCount;
     int maxKingdoms;
+    int relationCost;   // Gold to improve relations from neutral; each level above adds 5
+    int peaceCost;      // Reparations before the enemy's strength is added
+    std::vector<int> battleFronts;  // Foreign kingdoms fought this year, between queue and apply
+    int firstBattle;                // Engine index of the first of them
 
 public:
     Diplomacy(int maxForeignKingdoms = 5);
     ~Diplomacy();
 
     void addKingdom(const std::string& name, int strength);
+    void clearKingdoms();
+    // Room for more foreign kingdoms; the ones already known are kept
+    void setCapacity(int maxForeignKingdoms);
     bool improveRelations(const std::string& kingdomName, Economy& economy);
     bool declareWar(const std::string& kingdomName, Army& army);
     bool signPeace(const std::string& kingdomName, Economy& economy);
     bool formAlliance(const std::string& kingdomName);
     bool establishTrade(const std::string& kingdomName, Market& market, Economy& economy);
-    void updateDiplomacy(const Army& army, const Economy& economy);
+    void updateDiplomacy(Army& army, const Economy& economy);
+    // updateDiplomacy in two halves around an engine that may hold other kingdoms' battles
+    // too: queueBattles drifts relations and adds this year's battles, applyBattles takes
+    // the losses once the engine has resolved them
+    void queueBattles(const Army& army, BattleEngine& battles);
+    void applyBattles(Army& army, const BattleEngine& battles);
     void listKingdoms() const;
     int getRelationLevel(const std::string& kingdomName) const;
     int getKingdomCount() const {
@@ -378,6 +1440,83 @@ public:
     Kingdom* getForeignKingdomsMutable() {
         return foreignKingdoms;
     }
+    int getMaxKingdoms() const {
+        return maxKingdoms;
+    }
+    int getRelationCost() const;
+    int getPeaceCost() const;
+    void setRelationCost(int cost);
+    void setPeaceCost(int cost);
+    size_t memoryUsage() const;
+};
+
+// LoanLedger class - one row per loan in contiguous columns, so interest and
+// installments are one pass over the arrays; a maturity heap finds the loans that end
+class LoanLedger {
+public:
+    enum Schedule : uint8_t {
+        AMORTIZING,     // Equal yearly installments of interest and principal
+        BULLET          // Interest every year, principal at maturity
+    };
+
+    // What a year of the ledger did
+    struct YearSummary {
+        double interest;
+        double due;
+        double paid;
+        int matured;
+        int defaulted;  // Loans still owing at maturity, extended by a year
+    };
+
+    // One open loan as it stands, enough to book it again in another ledger
+    struct Loan {
+        double balance;
+        double rate;
+        double payment;
+        int32_t yearsLeft;
+        Schedule schedule;
+    };
+
+private:
+    // Columns; a closed row keeps zero balance and payment until reused
+    std::vector<double> balance;
+    std::vector<double> rate;
+    std::vector<double> payment;        // Scheduled yearly installment
+    std::vector<int32_t> maturity;      // Ledger year of the last installment
+    std::vector<uint8_t> schedule;
+    std::vector<uint8_t> open;
+    std::vector<uint32_t> freeRows;
+    // Min-heap of (maturity, row); entries whose row has moved on are skipped when popped
+    std::vector<std::pair<int32_t, uint32_t>> maturities;
+    double outstanding;
+    int loanCount;
+    int year;
+
+    void closeLoan(uint32_t row);
+
+public:
+    LoanLedger();
+    ~LoanLedger();
+
+    // Returns the loan's row
+    uint32_t addLoan(double principal, double yearlyRate, int termYears, Schedule loanSchedule = AMORTIZING);
+    // Books a loan part way through its life, keeping its installment
+    uint32_t restoreLoan(const Loan& loan);
+    // Pays down the loans that mature first; returns the amount applied
+    double prepay(double amount);
+    // Scales every balance down, e.g. when debt is forgiven outside the bank
+    void writeDown(double amount);
+    // Accrues interest, collects installments from funds, then settles matured loans
+    YearSummary advanceYear(double funds);
+
+    double getOutstanding() const;
+    double getScheduledPayments() const;
+    int getLoanCount() const;
+    int getYear() const;
+    size_t getRowCount() const;
+    // False for a closed row
+    bool getLoan(uint32_t row, Loan& loan) const;
+    size_t memoryUsage() const;
 };
 
 // Bank class - manages loans and financial services
@@ -385,8 +1524,9 @@ class Bank {
 private:
     double interestRate;
     int maxLoanAmount;
-    int currentLoans;
+    int loanTerm;
     int corruptionLevel;
+    LoanLedger ledger;
 
 public:
     Bank(double initialInterestRate = 0.05, int initialMaxLoan = 1000);
@@ -395,28 +1535,310 @@ public:
     double getInterestRate() const;
     int getMaxLoanAmount() const;
     int getCurrentLoans() const;
+    int getLoanTerm() const;
     int getCorruptionLevel() const;
+    const LoanLedger& getLedger() const;
+    LoanLedger& getLedgerMutable();
 
     void setInterestRate(double rate);
     void setMaxLoanAmount(int amount);
+    void setLoanTerm(int years);
     void setCorruptionLevel(int level);
 
     bool takeLoan(int amount, Economy& economy);
     bool repayLoan(int amount, Economy& economy);
+    // Books debt the ledger has not seen, then runs the ledger's year against the treasury
     void updateInterest(Economy& economy);
     void attemptCorruption(Economy& economy, Population& population);
 };
 
-// RandomEvents class - manages unpredictable game events
+// InterbankNetwork class - one-year loans between kingdoms' banks. Every year all of
+// them fall due at once and are cleared with the Eisenberg-Noe fixed point, so an
+// unpaid loan passes its loss on to the lender's own creditors
+class InterbankNetwork {
+public:
+    // Systemic-risk figures for one clearing
+    struct YearMetrics {
+        int year;
+        int banks;
+        int loans;
+        int defaults;
+        int contagionDefaults;  // Would have paid in full had their own debtors paid
+        int cascadeRounds;      // Iterations in which new banks defaulted
+        int iterations;
+        double obligations;     // Owed between banks this year
+        double shortfall;       // Left unpaid
+        double largestShortfall;
+    };
+
+private:
+    std::vector<Kingdom*> kingdoms;     // Null for banks with no kingdom behind them
+    std::vector<uint32_t> loanLender;
+    std::vector<uint32_t> loanBorrower;
+    std::vector<double> loanDue;        // Principal plus interest
+    // Claims grouped by lender (CSR): claimStart[i] .. claimStart[i + 1] are bank i's debtors
+    std::vector<uint32_t> claimStart;
+    std::vector<uint32_t> claimDebtor;
+    std::vector<double> claimAmount;
+    std::vector<double> obligations;
+    std::vector<double> payments;       // The clearing vector
+    std::vector<double> paidShare;      // payments / obligations
+    std::vector<double> received;
+    std::vector<uint8_t> defaulted;
+    std::vector<YearMetrics> history;
+    double interestRate;
+    int year;
+
+    void buildClaims();
+
+public:
+    InterbankNetwork(double interestRate = 0.05);
+    ~InterbankNetwork();
+
+    int addKingdom(Kingdom* kingdom);
+    // A bank with no kingdom behind it, for scenarios run through clear()
+    int addBank();
+    // Books a claim only; lend() also moves the gold between treasuries
+    bool bookLoan(int lender, int borrower, double principal);
+    bool lend(int lender, int borrower, int amount);
+
+    // Clears this year's loans against each bank's outside assets, then starts a new year
+    YearMetrics clear(const std::vector<double>& outsideAssets);
+    // clear() with treasuries as the outside assets; the results are paid into them
+    YearMetrics advanceYear();
+
+    int getBankCount() const;
+    int getLoanCount() const;
+    double getInterestRate() const;
+    void setInterestRate(double rate);
+    // Results of the last clearing
+    double getPayment(int bank) const;
+    double getReceived(int bank) const;
+    bool isDefaulted(int bank) const;
+    const std::vector<YearMetrics>& getHistory() const;
+};
+
+// EventLibrary class - events defined as text, compiled at load time into a
+// flat stack program that runs on a copy of the kingdom's numbers
+class EventLibrary {
+public:
+    // Kingdom numbers an event can read; totals and the year are read-only
+    enum Field {
+        FIELD_PEASANTS,
+        FIELD_MERCHANTS,
+        FIELD_NOBLES,
+        FIELD_POPULATION,
+        FIELD_HAPPINESS,
+        FIELD_INFANTRY,
+        FIELD_CAVALRY,
+        FIELD_ARCHERS,
+        FIELD_SOLDIERS,
+        FIELD_MORALE,
+        FIELD_AT_WAR,
+        FIELD_TREASURY,
+        FIELD_DEBT,
+        FIELD_INFLATION,
+        FIELD_FOOD,
+        FIELD_WOOD,
+        FIELD_STONE,
+        FIELD_IRON,
+        FIELD_YEAR,
+        FIELD_COUNT
+    };
+
+    enum OpCode : uint8_t {
+        OP_CONSTANT,        // Push constants[operand]
+        OP_LOAD,            // Push registers[operand]
+        OP_STORE,           // Pop into registers[operand]
+        OP_ADD,
+        OP_SUBTRACT,
+        OP_MULTIPLY,
+        OP_DIVIDE,
+        OP_NEGATE,
+        OP_LESS,
+        OP_LESS_EQUAL,
+        OP_GREATER,
+        OP_GREATER_EQUAL,
+        OP_EQUAL,
+        OP_NOT_EQUAL,
+        OP_AND,
+        OP_OR,
+        OP_NOT,
+        OP_TRUNCATE,        // int(x)
+        OP_RANDOM,          // random(n): 0 to n - 1
+        OP_MIN,
+        OP_MAX,
+        OP_JUMP,            // Go to operand
+        OP_JUMP_IF_FALSE,   // Pop, go to operand if zero
+        OP_SAY,             // Log messages[operand]
+        OP_NEW_RULER,       // Crown the dynasty's best candidate
+        OP_RETURN           // Pop the result and stop
+    };
+
+    struct Instruction {
+        OpCode op;
+        int32_t operand;
+    };
+
+    enum { MAX_LOCALS = 32, MAX_STACK = 32, REGISTER_COUNT = FIELD_COUNT + MAX_LOCALS };
+
+private:
+    // Text pieces with a register printed after each one but the last
+    struct Message {
+        std::vector<std::string> pieces;
+        std::vector<int> registers;
+    };
+
+    struct Event {
+        std::string name;
+        int32_t weight;     // Program entry points into code
+        int32_t effect;
+        uint32_t inputs;    // Bit per Field the weight program reads
+    };
+
+    std::vector<Event> events;
+    std::vector<Instruction> code;
+    std::vector<double> constants;
+    std::vector<Message> messages;
+    int revision;
+
+    bool compile(std::istream& in, const std::string& source);
+    double run(int32_t entry, double* registers, uint32_t& written, Kingdom* kingdom) const;
+    static void scatter(const double* registers, uint32_t written, Kingdom& kingdom);
+
+public:
+    EventLibrary();
+
+    // Copies the kingdom's numbers into registers indexed by Field
+    static void gather(const Kingdom& kingdom, double* registers);
+
+    // Adds the events in a file; an event with a known name replaces the old one
+    bool load(const std::string& filename);
+    bool loadText(const std::string& text, const std::string& source);
+
+    int getEventCount() const;
+    const std::string& getEventName(int event) const;
+    int findEvent(const std::string& name) const;
+    size_t getCodeSize() const;
+
+    // Weight of an event for a kingdom; zero when its conditions fail
+    double getWeight(int event, const Kingdom& kingdom) const;
+    double getWeight(int event, double* registers) const;
+    // Bit per Field the event's weight program reads
+    uint32_t getWeightInputs(int event) const;
+    // Changes whenever events are loaded
+    int getRevision() const;
+    // Picks an event by weight, or -1 if none applies
+    int chooseEvent(const Kingdom& kingdom) const;
+    void apply(int event, Kingdom& kingdom) const;
+    // Runs one event over many kingdoms, reusing one register file
+    void apply(int event, Kingdom* const* kingdoms, int count) const;
+
+    // The library every kingdom draws from, starting with the built-in events
+    static EventLibrary& shared();
+};
+
+// AliasTable class - Vose's alias method: O(n) to build, O(1) per weighted draw
+class AliasTable {
+private:
+    std::vector<float> threshold;
+    std::vector<uint32_t> alias;
+    double total;
+
+public:
+    AliasTable();
+
+    void build(const double* weights, int count);
+    int size() const;
+    double getTotal() const;
+    // u is uniform in [0, 1); -1 when every weight was zero
+    int sample(double u) const;
+    // Chance of drawing an index, for checking the table
+    double getProbability(int index) const;
+};
+
+// EventSampler class - draws events by state-dependent weight without running
+// every weight program; events whose weights read the same fields form a hazard
+// group, and each group caches an alias table per bucket of those fields
+class EventSampler {
+public:
+    enum {
+        BUCKET_BITS = 5,
+        BUCKET_COUNT = 1 << BUCKET_BITS,
+        MAX_DENSE_FIELDS = 2,           // Groups this small index their tables directly
+        MAX_CACHED_ENTRIES = 1 << 21    // Events summed over cached tables
+    };
+
+private:
+    struct HazardKey {
+        uint64_t low;
+        uint64_t high;
+        bool operator==(const HazardKey& other) const;
+    };
+
+    struct HazardKeyHash {
+        size_t operator()(const HazardKey& key) const;
+    };
+
+    struct HazardGroup {
+        uint32_t inputs;
+        std::vector<int> fields;        // The set bits of inputs
+        std::vector<int> events;
+        std::unordered_map<HazardKey, AliasTable, HazardKeyHash> tables;
+        std::vector<AliasTable> dense;  // Every bucket combination, when there are few fields
+        std::vector<char> built;
+    };
+
+    const EventLibrary& library;
+    int revision;
+    std::vector<HazardGroup> groups;
+    std::vector<int> groupOf;           // Per event
+    std::vector<int> slotOf;            // Per event, its index inside the group
+    uint32_t inputs;                    // Every field any group reads
+    std::vector<const AliasTable*> found;
+    size_t cachedEntries;
+    uint64_t hits;
+    uint64_t misses;
+
+    void refresh();
+    // Fills found with each group's table for the kingdom
+    void findTables(const Kingdom& kingdom);
+    const AliasTable& lookup(HazardGroup& group, const int* buckets);
+
+public:
+    explicit EventSampler(const EventLibrary& eventLibrary);
+
+    // Event index, or -1 if none applies
+    int sample(const Kingdom& kingdom);
+    void sample(const Kingdom* const* kingdoms, int count, int* chosen);
+    // Chance the sampler gives an event for this kingdom
+    double getProbability(const Kingdom& kingdom, int event);
+
+    int getGroupCount() const;
+    size_t getTableCount() const;
+    uint64_t getHits() const;
+    uint64_t getMisses() const;
+
+    // One sampler per thread over EventLibrary::shared()
+    static EventSampler& forThisThread();
+};
+
+// RandomEvents class - decides when events happen; what they do lives in the EventLibrary
 class RandomEvents {
 private:
     int eventChance;
-    time_t lastEventTime;
+    int lastEventYear;      // Game year of the last event, 0 before the first
 
 public:
     RandomEvents(int chance = 15);
     ~RandomEvents();
 
+    int getEventChance() const;
+    int getLastEventYear() const;
+    void setEventChance(int chance);
+    void setLastEventYear(int year);
+
+    // Built-in events, in the order the shared library defines them
     enum EventType {
         PLAGUE,
         GOOD_HARVEST,
@@ -430,25 +1852,486 @@ public:
         EARTHQUAKE
     };
 
-    bool checkForEvent();
-    EventType generateEvent() const;
-    void applyEvent(EventType event, Kingdom& kingdom);
-    void describePlagueEvent(Kingdom& kingdom);
-    void describeGoodHarvestEvent(Kingdom& kingdom);
-    void describeDroughtEvent(Kingdom& kingdom);
-    void describeForeignInvasionEvent(Kingdom& kingdom);
-    void describeRebellionEvent(Kingdom& kingdom);
-    void describeAssassinationEvent(Kingdom& kingdom);
-    void describeDiscoveryEvent(Kingdom& kingdom);
-    void describeFestivalEvent(Kingdom& kingdom);
-    void describeFireEvent(Kingdom& kingdom);
-    void describeEarthquakeEvent(Kingdom& kingdom);
+    // Draws whether an event strikes in the given game year
+    bool checkForEvent(int year);
+    // Index into EventLibrary::shared(), or -1 if no event applies
+    int generateEvent(const Kingdom& kingdom) const;
+    void applyEvent(int event, Kingdom& kingdom);
+};
+
+// KingdomSnapshot struct - copy of a kingdom's whole state, cheap to take on the game
+// thread and safe to hand to another thread. The save file holds the first part; the
+// rest is what the year step reads besides. Citizen agents and price histories are not kept
+struct KingdomSnapshot {
+    enum { NAME_LENGTH = 64 };
+
+    enum RulerType {
+        RULER_KING,
+        RULER_COMMANDER,
+        RULER_GUILD_LEADER
+    };
+
+    struct Foreign {
+        char name[NAME_LENGTH];
+        int strength;
+        int relationLevel;
+        bool isAlly;
+        bool atWar;
+    };
+
+    char name[NAME_LENGTH];
+    int gameYear;
+    int score;
+
+    int peasants;
+    int merchants;
+    int nobles;
+    double happiness;
+    double growthRate;
+
+    int infantry;
+    int cavalry;
+    int archers;
+    double morale;
+    int trainingLevel;
+    bool atWar;
+
+    int treasuryGold;
+    int debt;
+    double peasantTaxRate;
+    double merchantTaxRate;
+    double nobleTaxRate;
+    double inflation;
+
+    int food;
+    int wood;
+    int stone;
+    int iron;
+
+    char rulerName[NAME_LENGTH];
+    int rulerTrait;         // Royal bloodline, tactical skill or business acumen
+    int rulerStanding;      // A king's years in power or a commander's loyalty
+
+    // Not in the save file
+    uint64_t randomSeed;
+    uint32_t randomId;
+    bool designerRules;
+
+    int rulerType;
+    int rulerCharisma;
+    int rulerIntelligence;
+    int rulerStrength;
+    char guildType[NAME_LENGTH];
+
+    int gold;
+    double values[5];       // Food, gold, wood, stone, iron
+
+    double interestRate;
+    int maxLoanAmount;
+    int loanTerm;
+    int corruptionLevel;
+    int relationCost;
+    int peaceCost;
+    int eventChance;
+    int64_t lastEventYear;
+
+    std::vector<Foreign> foreign;
+    std::vector<LoanLedger::Loan> loans;
+    std::vector<unsigned char> dynasty;     // Dynasty::save bytes, empty before the houses are founded
+
+    // Save file text for this snapshot
+    std::string serialize() const;
+    // Every field equal, the parts the save file leaves out included
+    bool matches(const KingdomSnapshot& other) const;
+};
+
+// MemoryFootprint struct - bytes one kingdom holds, by subsystem: each object's own
+// size plus the heap blocks it owns, before allocator overhead
+struct MemoryFootprint {
+    enum Subsystem {
+        SUBSYSTEM_KINGDOM,      // The Kingdom object and its name
+        SUBSYSTEM_POPULATION,   // Including citizen agents
+        SUBSYSTEM_ARMY,
+        SUBSYSTEM_ECONOMY,
+        SUBSYSTEM_MARKET,       // Resources and price histories
+        SUBSYSTEM_DIPLOMACY,
+        SUBSYSTEM_BANK,         // Including the loan ledger
+        SUBSYSTEM_EVENTS,
+        SUBSYSTEM_RULER,
+        SUBSYSTEM_DYNASTY,
+        SUBSYSTEM_RECORDING,    // Autosave worker and history recorder
+        SUBSYSTEM_COUNT
+    };
+
+    size_t bytes[SUBSYSTEM_COUNT];
+
+    MemoryFootprint();
+
+    void add(const MemoryFootprint& other);
+    size_t getTotal() const;
+    static const char* getSubsystemName(Subsystem subsystem);
+};
+
+// CompactKingdom struct - a kingdom at rest in 408 bytes, for worlds too big to keep a
+// Kingdom object per realm. It holds every number the year step reads. Packing is lossy:
+// price histories and the noble houses are dropped and start afresh once expanded, so a
+// record packs back to the same bytes but the expanded kingdom is not the one packed.
+// Names are StringTable handles, so a record only means something in the process that packed it
+struct CompactKingdom {
+    enum {
+        FOREIGN_SLOTS = 5,      // Diplomacy's default capacity
+        LOAN_SLOTS = 3,
+        RESOURCE_COUNT = 5      // Food, gold, wood, stone, iron
+    };
+
+    enum RulerType : uint8_t {
+        RULER_KING,
+        RULER_COMMANDER,
+        RULER_GUILD_LEADER
+    };
+
+    struct Foreign {
+        StringTable::Handle name;
+        int32_t strength;
+        int16_t relationLevel;  // -10 to 10
+        uint8_t isAlly;
+        uint8_t atWar;
+    };
+
+    StringTable::Handle name;
+    StringTable::Handle rulerName;
+    StringTable::Handle guildType;
+    uint64_t randomSeed;
+    int64_t lastEventYear;
+    uint32_t randomId;
+    int32_t gameYear;
+    int32_t score;
+
+    int32_t peasants;
+    int32_t merchants;
+    int32_t nobles;
+    double happiness;
+    double growthRate;
+
+    int32_t infantry;
+    int32_t cavalry;
+    int32_t archers;
+    int32_t trainingLevel;
+    double morale;
+
+    double peasantTaxRate;
+    double merchantTaxRate;
+    double nobleTaxRate;
+    double inflation;
+    int32_t treasuryGold;
+    int32_t debt;
+
+    int32_t amounts[RESOURCE_COUNT];
+    double values[RESOURCE_COUNT];
+
+    double interestRate;
+    int32_t maxLoanAmount;
+    int32_t loanTerm;
+    int32_t corruptionLevel;
+    int32_t relationCost;
+    int32_t peaceCost;
+    LoanLedger::Loan loans[LOAN_SLOTS];
+
+    int32_t rulerTrait;     // Royal bloodline, tactical skill or business acumen
+    int32_t rulerStanding;  // A king's years in power or a commander's loyalty
+    int16_t rulerCharisma;
+    int16_t rulerIntelligence;
+    int16_t rulerStrength;
+    uint8_t rulerType;
+    uint8_t eventChance;
+    uint8_t loanCount;
+    uint8_t foreignCount;
+    uint8_t atWar;
+    uint8_t designerRules;
+    Foreign foreign[FOREIGN_SLOTS];
+};
+
+static_assert(sizeof(CompactKingdom) <= 512, "CompactKingdom must stay within 512 bytes for ten million kingdoms");
+
+// AutosaveWorker class - writes kingdom snapshots on a background thread. A newer
+// snapshot replaces one still waiting, so the game thread never waits on the disk
+class AutosaveWorker {
+private:
+    std::string filename;
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    KingdomSnapshot pending;
+    bool hasPending;
+    bool writing;
+    bool stopping;
+    int savesWritten;
+    int savesReplaced;
+    int failures;
+    int lastSavedYear;
+    std::thread writer;
+
+    void writerLoop();
+
+public:
+    AutosaveWorker(const std::string& filename);
+    ~AutosaveWorker();
+
+    void submit(const KingdomSnapshot& snapshot);
+    // Blocks until the latest submitted snapshot is on disk
+    void flush();
+
+    std::string getFilename() const;
+    int getSavesWritten() const;
+    int getSavesReplaced() const;
+    int getFailures() const;
+    int getLastSavedYear() const;
+};
+
+// KingdomArchiveWriter class - packs many kingdom snapshots into one file of
+// compressed chunks followed by an index sorted by kingdom id and year. A chunk holds
+// the fixed records first, then the tails of the same snapshots, each stored against
+// the tail of its kingdom's snapshot before
+class KingdomArchiveWriter {
+public:
+    enum {
+        RECORD_SIZE = 448,    // Packed fixed fields of a snapshot, in bytes
+        CHUNK_RECORDS = 128,
+        TAIL_KEYFRAME_INTERVAL = 16     // A kingdom's tail is stored whole this often
+    };
+
+private:
+    struct IndexEntry {
+        uint32_t kingdomId;
+        int32_t year;
+        uint32_t chunk;
+        uint32_t slot;
+    };
+
+    struct ChunkInfo {
+        uint64_t offset;
+        uint32_t compressedSize;    // Of the records; the tails follow them
+        uint32_t recordCount;
+        uint32_t tailSize;
+    };
+
+    // The last tail added for a kingdom, which its next one is stored against
+    struct KingdomTail {
+        int year;
+        int newestYear;     // The last tail is the one before in the index only if it is the newest
+        int sinceKeyframe;
+        std::vector<unsigned char> tail;        // Relations and loans
+        std::vector<unsigned char> dynasty;
+    };
+
+    FILE* file;
+    uint64_t offset;
+    uint64_t tailBytes;
+    std::vector<unsigned char> records;   // Packed records of the open chunk
+    std::vector<unsigned char> tails;     // Encoded tails of the open chunk
+    std::vector<unsigned char> encodedTail;
+    std::vector<unsigned char> tail;
+    std::vector<unsigned char> compressed;
+    std::vector<IndexEntry> index;
+    std::vector<ChunkInfo> chunks;
+    std::unordered_map<uint32_t, KingdomTail> lastTails;
+
+    bool write(const void* data, size_t length);
+    bool flushChunk();
+
+public:
+    KingdomArchiveWriter();
+    ~KingdomArchiveWriter();
+
+    bool open(const std::string& filename);
+    bool add(uint32_t kingdomId, const KingdomSnapshot& snapshot);
+    // Writes the last chunk, the chunk table, the index and the footer
+    bool close();
+
+    int getSnapshotCount() const;
+    uint64_t getBytesWritten() const;
+    // Of those, the bytes spent on relations, loans and dynasties
+    uint64_t getTailBytesWritten() const;
+
+    // Fixed little-endian layout shared with the reader
+    static void pack(const KingdomSnapshot& snapshot, unsigned char* record);
+    static void unpack(const unsigned char* record, KingdomSnapshot& snapshot);
+    // The variable part that follows a record: relations, loans and the dynasty, unless
+    // the caller stores the dynasty on its own
+    static void packTail(const KingdomSnapshot& snapshot, std::vector<unsigned char>& tail, bool withDynasty = true);
+    static bool unpackTail(const unsigned char* tail, size_t length, KingdomSnapshot& snapshot);
+};
+
+// KingdomArchiveReader class - memory-maps an archive and loads one snapshot by
+// binary searching the index, decoding its record from a single chunk and its tail
+// from the kingdom's last whole one
+class KingdomArchiveReader {
+private:
+    const unsigned char* data;
+    size_t size;
+    const unsigned char* chunkTable;
+    const unsigned char* index;
+    uint32_t chunkCount;
+    uint64_t entryCount;
+#ifdef _WIN32
+    void* fileHandle;
+    void* mappingHandle;
+#else
+    int descriptor;
+#endif
+
+    // Position of the first index entry not less than (kingdomId, year)
+    uint64_t lowerBound(uint32_t kingdomId, int year) const;
+    // The encoded tail of an entry and the length it decodes to
+    bool findTail(uint64_t entry, const unsigned char*& in, const unsigned char*& end, uint64_t& length) const;
+    bool loadEntry(uint64_t entry, KingdomSnapshot& snapshot) const;
+
+public:
+    KingdomArchiveReader();
+    ~KingdomArchiveReader();
+
+    bool open(const std::string& filename);
+    void close();
+
+    bool load(uint32_t kingdomId, int year, KingdomSnapshot& snapshot) const;
+    bool loadLatest(uint32_t kingdomId, KingdomSnapshot& snapshot) const;
+    uint64_t getSnapshotCount() const;
+};
+
+// HistoryRecorder class - keeps a kingdom's state for every year as field deltas
+// against the year before, with a full keyframe every few years
+class HistoryRecorder {
+public:
+    enum { DEFAULT_KEYFRAME_INTERVAL = 32, DYNASTY_KEYFRAME_SEGMENTS = 4 };
+
+private:
+    // A keyframe followed by the deltas of consecutive years. The dynasty is large and
+    // changes little, so only every DYNASTY_KEYFRAME_SEGMENTS-th keyframe holds all of
+    // it; the others carry on from the segment before
+    struct Segment {
+        int firstYear;
+        int yearCount;
+        size_t offset;
+        bool dynastyKeyframe;
+    };
+
+    int keyframeInterval;
+    std::vector<unsigned char> stream;
+    std::vector<Segment> segments;
+    unsigned char previous[KingdomArchiveWriter::RECORD_SIZE];
+    unsigned char beforePrevious[KingdomArchiveWriter::RECORD_SIZE];
+    std::vector<unsigned char> previousTail;
+    std::vector<unsigned char> tail;            // Relations and loans
+    std::vector<unsigned char> previousDynasty;
+
+    // Integers are predicted to keep last year's trend, reals to stay the same; changed
+    // relations and loans are stored as their XOR with last year's, a changed dynasty as
+    // the fields that moved
+    static void encodeDelta(const unsigned char* older, const unsigned char* base, const unsigned char* record,
+        const std::vector<unsigned char>& baseTail, const std::vector<unsigned char>& recordTail,
+        const std::vector<unsigned char>& baseDynasty, const std::vector<unsigned char>& recordDynasty,
+        std::vector<unsigned char>& out);
+    // The tail holds last year's on the way in. A changed dynasty is left for the caller
+    // to read from where this returns
+    static const unsigned char* decodeDelta(const unsigned char* in, const unsigned char* end,
+        const unsigned char* older, unsigned char* record, std::vector<unsigned char>& recordTail,
+        bool& dynastyChanged);
+    static void startSegment(int year, unsigned char* older, unsigned char* base);
+
+public:
+    HistoryRecorder(int keyframeInterval = DEFAULT_KEYFRAME_INTERVAL);
+    ~HistoryRecorder();
+
+    void record(const KingdomSnapshot& snapshot);
+    // Rebuilds the state at the end of a year from its keyframe and at most
+    // keyframeInterval - 1 deltas, and the dynasty from its own keyframe on
+    bool seek(int year, KingdomSnapshot& snapshot) const;
+    void clear();
+
+    int getYearCount() const;
+    bool isEmpty() const;
+    int getFirstYear() const;
+    int getLastYear() const;
+    size_t getMemoryUsage() const;
+};
+
+// MetricsExporter class - appends one row per kingdom-year to a columnar file.
+// Full row groups are compressed column by column on a background thread; a group
+// that fills while the last one is still being written is dropped, not waited for
+class MetricsExporter {
+public:
+    enum ColumnType : uint8_t {
+        COLUMN_INTEGER,
+        COLUMN_REAL
+    };
+
+    enum Encoding : uint8_t {
+        ENCODING_VARINT,        // Zigzag varint of each value
+        ENCODING_DELTA_VARINT,  // Zigzag varint of the change from the row before
+        ENCODING_XOR            // Bytes that differ from the row before
+    };
+
+    enum { ROW_GROUP_SIZE = 16384 };
+
+    struct Column {
+        const char* name;
+        ColumnType type;
+    };
+
+private:
+    // Row-major values: row * column count + column; reals stored as their bits
+    typedef std::vector<uint64_t> RowGroup;
+
+    FILE* file;
+    RowGroup filling;
+    RowGroup pending;
+    RowGroup transposed;    // The writer's column-major copy of pending
+    int fillingRows;
+    int pendingRows;
+    bool hasPending;
+    bool stopping;
+    bool failed;
+    uint64_t rowCount;
+    uint64_t droppedRows;
+    uint64_t bytesWritten;
+    double writerSeconds;
+    std::vector<uint64_t> groupOffsets;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::thread writer;
+
+    // Drops the group instead of waiting for the writer, unless told to wait
+    void handOff(bool wait);
+    void writerLoop();
+    bool writeGroup(const RowGroup& group, int rows, std::vector<unsigned char>& buffer);
+
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    bool open(const std::string& filename);
+    void append(uint32_t kingdomId, const Kingdom& kingdom);
+    // Writes the last row group and the footer
+    bool close();
+
+    uint64_t getRowCount() const;
+    // Rows appended but dropped because the writer was still busy
+    uint64_t getDroppedRows() const;
+    uint64_t getBytesWritten();
+    // CPU time the writer thread spent encoding and writing row groups
+    double getWriterSeconds();
+
+    static int getColumnCount();
+    static const Column& getColumn(int index);
+    // Decodes a metrics file back into CSV, one row per line
+    static bool exportCsv(const std::string& filename, std::ostream& out);
 };
 
 // Kingdom class - the main game class that combines all other systems
 class Kingdom {
 private:
-    std::string name;
+    StringTable::Handle nameHandle;
     std::unique_ptr<Population> population;
     std::unique_ptr<Army> army;
     std::unique_ptr<Economy> economy;
@@ -457,15 +2340,29 @@ private:
     std::unique_ptr<Bank> bank;
     std::unique_ptr<RandomEvents> events;
     std::unique_ptr<Leader> ruler;
+    std::unique_ptr<Dynasty> dynasty;
+    std::unique_ptr<AutosaveWorker> autosave;
+    std::unique_ptr<HistoryRecorder> history;
+    MetricsExporter* metrics;
+    uint32_t metricsId;
+    bool designerRules;
+    uint64_t randomSeed;
+    uint32_t randomId;
     int gameYear;
     int score;
 
+    template <const Ruleset& rules> void simulateYear();
+    // The year step up to its battles and from them on; callers hold the kingdom's scopes
+    template <const Ruleset& rules> void openYear(BattleEngine& battles, PhaseProfiler::Timeline& phases);
+    template <const Ruleset& rules> void closeYear(const BattleEngine& battles, PhaseProfiler::Timeline& phases);
+
 public:
     Kingdom(const std::string& kingdomName);
     ~Kingdom();
 
     // Getters for component access
-    std::string getName() const;
+    const std::string& getName() const;
+    StringTable::Handle getNameHandle() const;
     Population* getPopulation() const;
     Army* getArmy() const;
     Economy* getEconomy() const;
@@ -474,6 +2371,7 @@ public:
     Bank* getBank() const;
     RandomEvents* getEvents() const;
     Leader* getRuler() const;
+    Dynasty* getDynasty() const;
     int getGameYear() const;
     int getScore() const;
 
@@ -485,19 +2383,267 @@ public:
 
     // Game mechanics
     void advanceYear();
-    void calculateScore();
+    // Advances distinct kingdoms one year each, fighting every war front of all of them as
+    // one battle batch. Each ends the year exactly as its own advanceYear would leave it.
+    // Goods move along the trade network's routes first, if one is given. Returns the
+    // number of battles fought
+    static int advanceYearTogether(const std::vector<Kingdom*>& kingdoms, TradeNetwork* trade = nullptr);
+    template <const Ruleset& rules> void calculateScore();
+    // Switches between the shipped rules and designerRuleset
+    void useDesignerRules(bool enabled);
+    bool usesDesignerRules() const;
+    // Every draw of a year comes from (seed, id, year), so the same key replays the same years
+    void setRandomKey(uint64_t seed, uint32_t kingdomId);
+    uint64_t getRandomSeed() const;
+    uint32_t getRandomId() const;
     bool isGameOver() const;
     void displayStatus() const;
+    std::vector<std::string> getStatusLines() const;
 
     // Save/Load game
     bool saveGame(const std::string& filename) const;
     bool loadGame(const std::string& filename);
+    void captureSnapshot(KingdomSnapshot& snapshot) const;
+    void restoreSnapshot(const KingdomSnapshot& snapshot);
+
+    // Packs the kingdom for storage; false if loans were merged or agents dropped. Price
+    // histories and noble houses are always dropped, see CompactKingdom
+    bool compact(CompactKingdom& packed) const;
+    // Replaces this kingdom's state with a packed one; autosave, history and metrics stay attached
+    void expand(const CompactKingdom& packed);
+    MemoryFootprint getFootprint() const;
+
+    // Autosave writes a snapshot after every year without blocking the turn
+    void enableAutosave(const std::string& filename);
+    void disableAutosave();
+    AutosaveWorker* getAutosave() const;
+
+    // Agent mode simulates every citizen; their starting wealth and loyalty come from the kingdom's key
+    void enableAgentMode();
+
+    // History records the state after every year for later seeking
+    void enableHistory();
+    void disableHistory();
+    HistoryRecorder* getHistory() const;
+
+    // Appends a metrics row after every year; the exporter is shared, not owned
+    void setMetricsExporter(MetricsExporter* exporter, uint32_t kingdomId);
 
     // Event handling
-    void handleEvent(RandomEvents::EventType event);
+    void handleEvent(int event);
 
-    // Elections
+    // Elections and succession
     void holdElections();
+    // Crowns the dynasty's best candidate, or a default King if no noble is of age
+    void succeedRuler();
+};
+
+// Command class - one typed game action, decoupled from the console menus
+class Command {
+public:
+    enum Type {
+        SET_TAX_RATES,
+        BUY_RESOURCE,
+        SELL_RESOURCE,
+        RECRUIT,
+        TRAIN_ARMY,
+        IMPROVE_RELATIONS,
+        DECLARE_WAR,
+        SIGN_PEACE,
+        FORM_ALLIANCE,
+        ESTABLISH_TRADE,
+        TAKE_LOAN,
+        REPAY_LOAN,
+        HOLD_ELECTIONS,
+        ADVANCE_YEAR,
+        SAVE_GAME,
+        LOAD_GAME,
+        SHOW_HISTORY
+    };
+
+    Type type;
+    std::string target;     // Resource, unit type, foreign kingdom or file name
+    int amount;             // Units, gold or years
+    double rates[3];        // Peasant, merchant and noble tax rates
+
+    Command(Type type = ADVANCE_YEAR, const std::string& target = "", int amount = 1);
+
+    static Command setTaxRates(double peasantRate, double merchantRate, double nobleRate);
+    static Command buyResource(const std::string& resourceType, int amount);
+    static Command sellResource(const std::string& resourceType, int amount);
+    static Command recruit(const std::string& unitType, int count);
+    static Command trainArmy();
+    static Command improveRelations(const std::string& kingdomName);
+    static Command declareWar(const std::string& kingdomName);
+    static Command signPeace(const std::string& kingdomName);
+    static Command formAlliance(const std::string& kingdomName);
+    static Command establishTrade(const std::string& kingdomName);
+    static Command takeLoan(int amount);
+    static Command repayLoan(int amount);
+    static Command holdElections();
+    static Command advanceYear(int years = 1);
+    static Command saveGame(const std::string& filename);
+    static Command loadGame(const std::string& filename);
+    static Command showHistory(int year);
+
+    // Script syntax, e.g. "tax 0.1 0.15 0.2", "buy Food 100", "advance 10"
+    static bool parse(const std::string& line, Command& command, std::string& error);
+};
+
+// CommandQueue class - batches commands and applies them to a kingdom
+class CommandQueue {
+public:
+    struct Result {
+        bool success;
+        std::string message;
+    };
+
+private:
+    std::vector<Command> commands;
+
+public:
+    CommandQueue();
+    ~CommandQueue();
+
+    void push(const Command& command);
+    int getCount() const;
+    void clear();
+
+    // Applies in order and empties the queue; returns the number that succeeded
+    int applyAll(Kingdom& kingdom, std::vector<Result>* results = nullptr);
+
+    static Result apply(const Command& command, Kingdom& kingdom);
+};
+
+// ScreenBuffer class - character grid that sends only changed cells to the terminal
+class ScreenBuffer {
+private:
+    int width;
+    int height;
+    std::vector<char> back;   // Frame being drawn
+    std::vector<char> front;  // What the terminal currently shows
+    bool fullRedraw;
+
+public:
+    ScreenBuffer(int width = 80, int height = 24);
+    ~ScreenBuffer();
+
+    void clear();
+    void writeText(int row, int column, const std::string& text);
+    void invalidate();
+
+    // Escape sequences that turn the front frame into the back frame
+    std::string renderFrame();
+    int present();
+
+    int getWidth() const;
+    int getHeight() const;
+};
+
+// LatencyHistogram class - bounded log-scale histogram of latencies in microseconds
+class LatencyHistogram {
+private:
+    static const int BUCKETS = 480; // 5% wide buckets from 1us to beyond an hour
+
+    std::vector<long long> counts;
+    long long total;
+    double maximum;
+
+public:
+    LatencyHistogram();
+
+    void record(double microseconds);
+    void merge(const LatencyHistogram& other);
+    long long getCount() const;
+    double getMaximum() const;
+    double percentile(double fraction) const;
+};
+
+// GameServer class - hosts many kingdoms behind a non-blocking epoll socket loop (Linux only)
+class GameServer {
+public:
+    enum CommandType {
+        COMMAND_NEW,
+        COMMAND_ADVANCE,
+        COMMAND_STATUS,
+        COMMAND_STATS,
+        COMMAND_ACTION,
+        COMMAND_OTHER,
+        COMMAND_TYPE_COUNT
+    };
+
+private:
+    struct Job {
+        int kingdomId;
+        int type;
+        Command command;
+        unsigned long long clientId;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    struct Completion {
+        unsigned long long clientId;
+        int type;
+        std::string response;
+        std::chrono::steady_clock::time_point received;
+    };
+
+    struct Client {
+        int fd;
+        unsigned long long id;
+        std::string input;
+        std::string output;
+        bool writing;
+        bool closing;
+        bool quitting;      // QUIT seen; BYE waits for the answers still with the workers
+        int inFlight;       // Jobs dispatched and not yet answered
+    };
+
+    // Each kingdom always goes to the same worker, so its years never overlap
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<Job> jobs;
+    };
+
+    std::string address;
+    int workerCount;
+    int maxKingdoms;
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    std::vector<std::unique_ptr<Kingdom> > kingdoms;
+    std::unordered_map<int, Client> clients;
+    std::unordered_map<unsigned long long, int> clientFds;
+    unsigned long long nextClientId;
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<WorkerQueue> > queues;
+    std::mutex completionMutex;
+    std::vector<Completion> completions;
+    std::atomic<bool> running;
+    bool workersStopping;
+    LatencyHistogram latencies[COMMAND_TYPE_COUNT];
+
+    bool openListener();
+    void acceptClients();
+    void readClient(int fd);
+    void flushClient(int fd);
+    void closeClient(int fd);
+    void handleLine(Client& client, const std::string& line, std::chrono::steady_clock::time_point received);
+    void respond(Client& client, int type, const std::string& response, std::chrono::steady_clock::time_point received);
+    void dispatch(const Job& job);
+    void workerLoop(int worker);
+    void drainCompletions();
+
+public:
+    // Address is a TCP port on localhost or "unix:/path/to/socket"
+    GameServer(const std::string& address, int workerCount = 4, int maxKingdoms = 100000);
+    ~GameServer();
+
+    bool run();
+    void stop();
+    int getKingdomCount() const;
+    std::string latencyReport() const;
 };
 
 // Function prototypes for main.cpp
@@ -513,5 +2659,29 @@ void displayDiplomacyMenu(Kingdom& kingdom);
 void displayBankMenu(Kingdom& kingdom);
 void clearScreen();
 void pauseScreen();
+void runDashboard(Kingdom& kingdom, int years, int yearsPerSecond);
+
+// Benchmarks and load testing
+void runExchangeBenchmark(int orderCount);
+void runArchiveBenchmark(int kingdomCount, int years);
+void runHistoryBenchmark(int kingdomCount, int years);
+void runPriceHistoryBenchmark(int years, int queries);
+void runMetricsBenchmark(int kingdomCount, int years, const std::string& filename);
+void runRulesetBenchmark(int kingdomCount, int years, const std::string& filename);
+void runEventBenchmark(int kingdomCount, int eventCount);
+void runRngBenchmark(int kingdomCount, int years);
+void runLoanBenchmark(int loanCount, int years);
+void runInterbankBenchmark(int bankCount, int years);
+void runDynastyBenchmark(int nobleCount, int successions);
+void runBattleBenchmark(int kingdomCount, int years);
+void runTradeBenchmark(int kingdomCount, int years);
+void runAgentBenchmark(int agentCount, int years);
+void runFootprintBenchmark(int kingdomCount, int years);
+void runScalingBenchmark(int kingdomCount, int years, const std::string& filename);
+void runSensitivityAnalysis(int samples, int rollouts, int years);
+int runLoadGenerator(const std::string& address, int clientCount, int requestsPerClient);
+
+// Headless play: applies a command script to a kingdom as one batch
+bool runScriptFile(const std::string& filename, Kingdom& kingdom, bool quiet);
 
 #endif // STRONGHOLD_H
\ No newline at end of file
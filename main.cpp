@@ -3,10 +3,145 @@
 #include <limits>
 using namespace std;
 
-int main() {
+int main(int argc, char* argv[]) {
+    // --profile works with every mode, so it is taken out before the modes read their arguments
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--profile") {
+            if (!PhaseProfiler::isEnabled()) {
+                PhaseProfiler::enable();
+                atexit(PhaseProfiler::printReport);
+            }
+        }
+        else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+
+    // Benchmark modes run without the interactive game
+    if (argc > 1 && string(argv[1]) == "--bench-exchange") {
+        runExchangeBenchmark(argc > 2 ? atoi(argv[2]) : 1000000);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench-archive") {
+        runArchiveBenchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 50);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench-history") {
+        runHistoryBenchmark(argc > 2 ? atoi(argv[2]) : 100, argc > 3 ? atoi(argv[3]) : 200);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench-prices") {
+        runPriceHistoryBenchmark(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+
+    if (argc > 1 && string(argv[1]) == "--bench-metrics") {
+        runMetricsBenchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 100,
+            argc > 4 ? argv[4] : "metrics.skmx");
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-events") {
+        runEventBenchmark(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 500);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-rng") {
+        runRngBenchmark(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 100);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-loans") {
+        runLoanBenchmark(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 50);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-interbank") {
+        runInterbankBenchmark(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 20);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-dynasty") {
+        runDynastyBenchmark(argc > 2 ? atoi(argv[2]) : 100000, argc > 3 ? atoi(argv[3]) : 1000);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-battles") {
+        runBattleBenchmark(argc > 2 ? atoi(argv[2]) : 10000, argc > 3 ? atoi(argv[3]) : 20);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-trade") {
+        runTradeBenchmark(argc > 2 ? atoi(argv[2]) : 2000, argc > 3 ? atoi(argv[3]) : 50);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-agents") {
+        runAgentBenchmark(argc > 2 ? atoi(argv[2]) : 10000000, argc > 3 ? atoi(argv[3]) : 10);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-footprint") {
+        runFootprintBenchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 50);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-scaling") {
+        runScalingBenchmark(argc > 2 ? atoi(argv[2]) : 20, argc > 3 ? atoi(argv[3]) : 50,
+            argc > 4 ? argv[4] : "scaling.jsonl");
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-rules") {
+        runRulesetBenchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 100,
+            argc > 4 ? argv[4] : "rules.txt");
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--sensitivity") {
+        runSensitivityAnalysis(argc > 2 ? atoi(argv[2]) : 1024, argc > 3 ? atoi(argv[3]) : 100,
+            argc > 4 ? atoi(argv[4]) : 50);
+        return 0;
+    }
+    if (argc > 2 && string(argv[1]) == "--metrics-csv") {
+        return MetricsExporter::exportCsv(argv[2], cout) ? 0 : 1;
+    }
+
+    // Server mode hosts many kingdoms over a socket instead of the console
+    if (argc > 1 && string(argv[1]) == "--server") {
+        GameServer server(argc > 2 ? argv[2] : "7777", argc > 3 ? atoi(argv[3]) : 4);
+        if (!server.run()) {
+            return 1;
+        }
+        cout << "Server stopped with " << server.getKingdomCount() << " kingdoms." << endl;
+        cout << server.latencyReport();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--loadgen") {
+        return runLoadGenerator(argc > 2 ? argv[2] : "7777", argc > 3 ? atoi(argv[3]) : 100,
+            argc > 4 ? atoi(argv[4]) : 100);
+    }
+
     // Seed random number generator
     srand(static_cast<unsigned int>(time(0)));
 
+    // Dashboard mode runs the kingdom unattended with a live status screen
+    if (argc > 1 && string(argv[1]) == "--dashboard") {
+        Kingdom kingdom("Default Kingdom");
+        kingdom.setRuler(make_unique<King>("King Ali", 70, 60, 50, 80));
+        runDashboard(kingdom, argc > 2 ? atoi(argv[2]) : 200, argc > 3 ? atoi(argv[3]) : 20);
+        return 0;
+    }
+
+    // Script mode plays a command file against a fresh kingdom, no prompts
+    if (argc > 2 && string(argv[1]) == "--script") {
+        bool quiet = false;
+        Kingdom kingdom("Default Kingdom");
+        kingdom.setRuler(make_unique<King>("King Ali", 70, 60, 50, 80));
+        for (int i = 3; i < argc; i++) {
+            if (string(argv[i]) == "--quiet") {
+                quiet = true;
+            }
+            else if (string(argv[i]) == "--history") {
+                kingdom.enableHistory();
+            }
+        }
+        return runScriptFile(argv[2], kingdom, quiet) ? 0 : 1;
+    }
+
     // Welcome message
     cout << "Welcome to Stronghold: Rule Your Medieval Kingdom!" << endl;
 
@@ -25,9 +160,46 @@ int main() {
         kingName = "King Ali";
     }
 
+    MetricsExporter metrics;
     Kingdom kingdom(kingdomName);
     kingdom.setRuler(make_unique<King>(kingName, 70, 60, 50, 80));
 
+    // Optional command-line switches
+    for (int i = 1; i < argc; i++) {
+        if (string(argv[i]) == "--agents") {
+            kingdom.enableAgentMode();
+            cout << "Agent mode enabled: every citizen is simulated individually." << endl;
+        }
+        else if (string(argv[i]) == "--history") {
+            kingdom.enableHistory();
+            cout << "History enabled: every year is recorded for later review." << endl;
+        }
+        else if (string(argv[i]) == "--autosave") {
+            string filename = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "autosave.txt";
+            kingdom.enableAutosave(filename);
+            cout << "Autosave enabled: the kingdom is saved to " << filename << " every year." << endl;
+        }
+        else if (string(argv[i]) == "--events" && i + 1 < argc) {
+            if (EventLibrary::shared().load(argv[++i])) {
+                cout << "Events loaded from " << argv[i] << ": " << EventLibrary::shared().getEventCount()
+                    << " events in play." << endl;
+            }
+        }
+        else if (string(argv[i]) == "--rules" && i + 1 < argc) {
+            if (designerRuleset.load(argv[++i])) {
+                kingdom.useDesignerRules(true);
+                cout << "Designer rules loaded from " << argv[i] << "." << endl;
+            }
+        }
+        else if (string(argv[i]) == "--metrics") {
+            string filename = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "metrics.skmx";
+            if (metrics.open(filename)) {
+                kingdom.setMetricsExporter(&metrics, 0);
+                cout << "Metrics enabled: every year is exported to " << filename << "." << endl;
+            }
+        }
+    }
+
     // Main game loop
     bool running = true;
     int choice;